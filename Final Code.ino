@@ -1,25 +1,26 @@
 # define LED_PIN 13  // Pin to activate the orange LED
 # define BUZZER_PIN 6 // Pin to activate the buzzer
-// Define our states 
-# define STATE_INITIAL 0
-# define STATE_JOIN_LINE 1
-# define STATE_ON_LINE 2        
-# define STATE_LOST_LINE 3
-# define STATE_RETURN_TO_START 4 
-# define STATE_HOME 5     
+// Our states are defined in fsm.h alongside the FSM's state and transition tables.
+
+# define FORCE_CALIBRATION 0 // set to 1 to re-learn the line sensor calibration even if one is stored in EEPROM.
+# define FORCE_MOTOR_CHARACTERISATION 0 // set to 1 to re-learn the motor feedforward map even if one is stored.
+# define FORCE_PATH_MAPPING 0 // set to 1 to record the path again (at the normal speed) even if one is stored.
+# define LOOP_LATENCY_LIMIT_US 5000 // no loop() should take longer than this, longer ones are counted.
 
 // Our FSM and Kinematics classes call the remaining classes so don't need to be called again here.
 # include "fsm.h"
 FSM_c fsm;
 
-int state; // global state int to set under differing conditions.
-int previous_state; // used to check if state has changed for PID reset
+// loop latency watchdog: state handlers must never block, so check it.
+unsigned long loop_previous_ts = 0;
+unsigned long loop_max_us = 0; // longest loop() seen
+unsigned long loop_late_count = 0; // loops longer than LOOP_LATENCY_LIMIT_US
 
 
 void setup() {
   // put your setup code here, to run once
   // Start Serial, send debug text
-  Serial.begin(9600);
+  Serial.begin(SERIAL_BAUD);
   delay(5000);
   Serial.println("***RESET***");
 
@@ -37,55 +38,137 @@ void setup() {
   // Initialise motor GPIO
   motors.initialise();
 
-  state = 0; // set state to join line.
+  // Use the stored sensor calibration, or sweep over the line to learn one (robot must start over the line).
+  if(FORCE_CALIBRATION || !linesensors.load_calibration()){
+    fsm.calibrate_line_sensors();
+  }
+
+  #if FEEDFORWARD_ENABLED
+  // Use the stored motor feedforward map, or spin on the spot to learn one.
+  if(FORCE_MOTOR_CHARACTERISATION || !feedforward.load()){
+    fsm.characterise_motors();
+  }
+  #endif
+
+  #if PATH_ENABLED
+  // With a stored path, follow it at its speed profile. Otherwise this run records it.
+  if(FORCE_PATH_MAPPING || !path.load()){
+    path.start_mapping();
+  }
+  #endif
 
   // pid set up
   // setup k_proportional, k_integral , k_differential - these are the system gains used to manipulate the error signal e_line.
   speed_pid_left.initialise(100, 0.5, -100);
   speed_pid_right.initialise(100, 0.5, -100);
+  // micros() timing, derivative on measurement, output saturated to the motor limit with anti-windup.
+  speed_pid_left.enable_engine(MAX_PWM, SPEED_PID_INT_LIMIT, SPEED_PID_BACKCALC, SPEED_PID_D_ALPHA);
+  speed_pid_right.enable_engine(MAX_PWM, SPEED_PID_INT_LIMIT, SPEED_PID_BACKCALC, SPEED_PID_D_ALPHA);
+  // outer line position PID, output is a turn rate demand for the speed PIDs.
+  line_pid.initialise(LINE_PID_KP, LINE_PID_KI, LINE_PID_KD);
+  line_pid.enable_engine(LINE_PID_TURN_LIMIT, LINE_PID_TURN_LIMIT, 0, LINE_PID_D_ALPHA);
 
   // reset PID before you use it.
   speed_pid_left.reset();
   speed_pid_right.reset();
+
+  // enter the initial state, register the fixed rate tasks and start the scheduler clock last, so setup time doesn't count as overruns.
+  fsm.initialise();
+  loop_previous_ts = micros();
 }
 
 void loop(){ 
   
-  // Get our state value from the finite state machine.
-  state = fsm.update_state(state);
-  // If the state has changed to "on line", reset the PID instances. State only resets after coming back from lost line or search for line.
-  if(state != previous_state && state !=2){
-    speed_pid_left.reset(); // reset the pid controllers
-    speed_pid_right.reset();
-    previous_state = state; // update previous state
+  // time from the start of the last loop to the start of this one.
+  unsigned long loop_ts = micros();
+  unsigned long loop_time = loop_ts - loop_previous_ts;
+  loop_previous_ts = loop_ts;
+  if(loop_time > loop_max_us){
+    loop_max_us = loop_time;
   }
-
-
-  // Choose behaviour based on current state.
-  if(state == STATE_INITIAL){
-    fsm.search_for_line();
+  if(loop_time > LOOP_LATENCY_LIMIT_US){
+    loop_late_count = loop_late_count + 1;
   }
 
-  else if(state == STATE_JOIN_LINE){
-    state = fsm.join_line();
+  // Serial commands: 's' for the scheduler's per task timing report, the state machine report and the loop latency,
+  // 'p' to dump the profiler's timers (they're reset after each dump), 't' to start/stop binary telemetry,
+  // 'd' to download the last run recording, 'm' to time the motor driver (robot stopped), 'f' for the motor
+  // feedforward map, 'r' for the stored path and its speed profile, 'e' for the pose estimate and its uncertainty,
+  // 'c' to time the fixed/float hot paths in cycles (robot stopped).
+  if(Serial.available()){
+    char command = Serial.read();
+    if(command == 's'){
+      fsm.scheduler.report();
+      fsm.machine.report();
+      Serial.print("loop max us: ");
+      Serial.print(loop_max_us);
+      Serial.print(", late loops: ");
+      Serial.println(loop_late_count);
+    }
+    #if TELEMETRY_ENABLED
+    else if(command == 't'){
+      telemetry.set_streaming(!telemetry.streaming);
+    }
+    #endif
+    #if RECORDER_ENABLED
+    else if(command == 'd'){
+      recorder.dump();
+    }
+    #endif
+    else if(command == 'm'){
+      motors.measure_cycles();
+    }
+    else if(command == 'c'){
+      fsm.measure_cycles();
+    }
+    #if FEEDFORWARD_ENABLED
+    else if(command == 'f'){
+      feedforward.report();
+    }
+    #endif
+    #if PATH_ENABLED
+    else if(command == 'r'){
+      path.report();
+    }
+    #endif
+    #if ESTIMATOR_ENABLED
+    else if(command == 'e'){
+      estimator.report();
+    }
+    #endif
+    #if PROFILER_ENABLED
+    else if(command == 'p'){
+      profiler.report();
+      profiler.reset();
+    }
+    #endif
+    loop_previous_ts = micros(); // don't count the time spent printing.
   }
 
-  else if(state == STATE_ON_LINE){
-    fsm.on_line();
-  }
+  // everything from here on counts towards the loop timer.
+  PROFILE_SCOPE(PROFILE_LOOP);
 
-  else if(state == STATE_LOST_LINE){
-    fsm.lost_line();
-  }
+  // Run whichever of the sensor, odometry, PID and state tasks are due. The state task takes the FSM's transitions,
+  // and the entry actions do the PID resets a state needs.
+  fsm.update();
 
-  else if(state == STATE_RETURN_TO_START){
-    state = fsm.return_to_start();
-  }
-  else if(state == STATE_HOME){
-    fsm.home();
-  }
+  // Run the current state's behaviour.
+  fsm.step();
+
+  #if TELEMETRY_ENABLED
+  // stream out whatever telemetry the serial port has room for.
+  telemetry.drain();
+  #endif
 
+  #if RECORDER_ENABLED
+  // write the next queued byte of the run recording if the EEPROM is free.
+  recorder.service();
+  #endif
 
+  #if PATH_ENABLED
+  // and the next byte of a path being saved.
+  path.service();
+  #endif
 }
 
 
@@ -1,308 +1,266 @@
-#ifndef _ENCODERS_H
-#define _ENCODERS_H
-
-#define ENCODER_0_A_PIN  7
-#define ENCODER_0_B_PIN  23
-#define ENCODER_1_A_PIN  26
-//#define ENCODER_1_B_PIN Non-standard pin!
-
-
-// Volatile Global variables used by Encoder ISR.
-volatile long count_wheel_right; // used by encoder to count the rotation
-volatile byte state_wheel_right; // used to store the prior and current state
-
-volatile long count_wheel_left; // used by encoder to count the rotation
-volatile byte state_wheel_left; // used to store the prior and current state.
-
-
-
-
-
-// This ISR handles just Encoder 0
-// ISR to read the Encoder0 Channel A and B pins
-// and then look up based on  transition what kind of
-// rotation must have occured.
-ISR( INT6_vect ) {
-  // We know that the ISR is only called when a pin changes.
-  // We also know only 1 pin can change at a time.
-  // The XOR(AB) signal change from "Channel A" triggers ISR.
- 
-  // First, Read in the new state of the encoder pins.
-  // Standard pins, so standard read functions.
-  boolean e0_B = digitalRead( ENCODER_0_B_PIN ); // normal B state
-  boolean e0_A = digitalRead( ENCODER_0_A_PIN ); // XOR(AB)
- 
-  // Software XOR (^) logically infers
-  // the true value of A given the state of B
-  e0_A = e0_A ^ e0_B;
-
-  // Shift our (new) current readings into bit positions
-  // 2 and 3 in the state variable (current state)
-  // State: (bit3)  (bit2)  (bit1)   (bit0)
-  // State:  new B   new A   old B   old A
-    state_wheel_right = state_wheel_right | ( e0_B  << 3 );
-    state_wheel_right = state_wheel_right | ( e0_A  << 2 );
-
-    // Handle which transition we have registered.
-    // Complete this if statement as necessary.
-    // Refer to the labsheet. 
-
-
-    // **************************************************************************
-    // MY STUFF HERE! 
-    // I think I can just do statements for 1,2,4,7,8,11,13,14 as these are the ones that effect the state values -> check table and whether this logic is valid
-    // if( state_wheel_right == 0 ) { // e.g is zero necessary??
-    // } .// STATE E0 UPDATES COUNT E0!! DO NOT MIX UP!
-    // FORWARD MOTION DECREMENTS VALUES AT THE MOMENT IN OPPOSITION TO COMMENTS BELOW. ASK ABOUT THIS.
-    if( state_wheel_right == 1 ) {
-        count_wheel_right = count_wheel_right -1;  // forwards 
-    } else if( state_wheel_right == 2 ) {
-        count_wheel_right = count_wheel_right +1;   // backwards
-    } else if( state_wheel_right == 4 ) { 
-        count_wheel_right = count_wheel_right +1;   // backwards
-    } else if( state_wheel_right == 7 ) { 
-        count_wheel_right = count_wheel_right -1;   // forwards
-    } else if( state_wheel_right == 8 ) { 
-        count_wheel_right = count_wheel_right -1;   // forwards
-    } else if( state_wheel_right == 11) { 
-        count_wheel_right = count_wheel_right +1;   // backwards
-    } else if( state_wheel_right == 13) { 
-        count_wheel_right = count_wheel_right +1;   // backwards
-    } else if( state_wheel_right == 14) { 
-        count_wheel_right = count_wheel_right -1;   // forwards
-    }
-   // other numbers produce invalid response so no count change.
-   // 360 Counts per rotation as expected. one count per degree.
-   // Wheel diameter is 32mm, circumference = 32pi, therefore one
-   // count length is 32pi/360 = 0.28mm roughly.
-
-
-    // ***************************************************************************
-
-
-
-    // Shift the current readings (bits 3 and 2) down
-    // into position 1 and 0 (to become prior readings)
-    // This bumps bits 1 and 0 off to the right, "deleting"
-    // them for the next ISR call. 
-    state_wheel_right = state_wheel_right >> 2;
-
-}
-
-
-// This ISR handles just Encoder 1
-// ISR to read the Encoder0 Channel A and B pins
-// and then look up based on  transition what kind of
-// rotation must have occured.
-ISR( PCINT0_vect ){
- 
-    // First, Read in the new state of the encoder pins.
-
-    // Mask for a specific pin from the port.
-    // Non-standard pin, so we access the register
-    // directly.  
-    // Reading just PINE would give us a number
-    // composed of all 8 bits.  We want only bit 2.
-    // B00000100 masks out all but bit 2
-    // It is more portable to use the PINE2 keyword.
-    boolean e1_B = PINE & (1<<PINE2);
-    //boolean e1_B = PINE & B00000100;  // Does same as above.
-
-    // Standard read from the other pin.
-    boolean e1_A = digitalRead( ENCODER_1_A_PIN ); // 26 the same as A8
-
-
-    e1_A = e1_A ^ e1_B;
-
-    // Create a bitwise representation of our states
-    // We do this by shifting the boolean value up by
-    // the appropriate number of bits, as per our table
-    // header:
-    //
-    // State :  (bit3)  (bit2)  (bit1)  (bit0)
-    // State :  New A,  New B,  Old A,  Old B.
-    state_wheel_left = state_wheel_left | ( e1_B  << 3 );
-    state_wheel_left = state_wheel_left | ( e1_A  << 2 );
-
-
-    // Handle which transition we have registered.
-    // Complete this if statement as necessary.
-    // Refer to the labsheet. 
-
-
-    // **************************************************************************
-    // MY STUFF HERE! 
-    // I think I can just do statements for 1,2,4,7,8,11,13,14 as these are the ones that effect the state values -> check table and whether this logic is valid
-    // if( state_wheel_left == 0 ) { // e.g is zero necessary??
-    // } .// STATE E1 UPDATES COUNT E1!! DO NOT MIX UP!
-    // FORWARD MOTION DECREMENTS VALUES AT THE MOMENT IN OPPOSITION TO COMMENTS BELOW. ASK ABOUT THIS.
-    if( state_wheel_left == 1 ) {
-        count_wheel_left = count_wheel_left -1;  // forwards
-    } else if( state_wheel_left == 2 ) {
-        count_wheel_left = count_wheel_left +1;   // backwards
-    } else if( state_wheel_left == 4 ) { 
-        count_wheel_left = count_wheel_left +1;   // backwards
-    } else if( state_wheel_left == 7 ) { 
-        count_wheel_left = count_wheel_left -1;   // forwards
-    } else if( state_wheel_left == 8 ) { 
-        count_wheel_left = count_wheel_left -1;   // forwards
-    } else if( state_wheel_left == 11) { 
-        count_wheel_left = count_wheel_left +1;   // backwards
-    } else if( state_wheel_left == 13) { 
-        count_wheel_left = count_wheel_left +1;   // backwards
-    } else if( state_wheel_left == 14) { 
-        count_wheel_left = count_wheel_left -1;   // forwards
-    }
-   // other numbers produce invalid response so no count change.
-   // roughly 360 Counts per rotation as expected. one count per degree.
-   // Wheel diameter is 32mm, circumference = 32pi, therefore one
-   // count length is 32pi/360 = 0.28mm roughly.
-
-    // ***************************************************************************
-
-
-
-
-    // Shift the current readings (bits 3 and 2) down
-    // into position 1 and 0 (to become prior readings)
-    // This bumps bits 1 and 0 off to the right, "deleting"
-    // them for the next ISR call. 
-    state_wheel_left = state_wheel_left >> 2;
-}
-
-
-/*
-   This setup routine enables interrupts for
-   encoder1.  The interrupt is automatically
-   triggered when one of the encoder pin changes.
-   This is really convenient!  It means we don't
-   have to check the encoder manually.
-*/
-void setupEncoder0() 
-{
-    count_wheel_right = 0;
-
-    // Setup pins for right encoder 
-    pinMode( ENCODER_0_A_PIN, INPUT );
-    pinMode( ENCODER_0_B_PIN, INPUT );
-
-    // initialise the recorded state of e0 encoder.
-    state_wheel_right = 0;
-
-    // Get initial state of encoder pins A + B
-    boolean e0_A = digitalRead( ENCODER_0_A_PIN );
-    boolean e0_B = digitalRead( ENCODER_0_B_PIN );
-    e0_A = e0_A ^ e0_B;
-
-    // Shift values into correct place in state.
-    // Bits 1 and 0  are prior states.
-    state_wheel_right = state_wheel_right | ( e0_B << 1 );
-    state_wheel_right = state_wheel_right | ( e0_A << 0 );
-
-
-    // Now to set up PE6 as an external interupt (INT6), which means it can
-    // have its own dedicated ISR vector INT6_vector
-
-    // Page 90, 11.1.3 External Interrupt Mask Register – EIMSK
-    // Disable external interrupts for INT6 first
-    // Set INT6 bit low, preserve other bits
-    EIMSK = EIMSK & ~(1<<INT6);
-    //EIMSK = EIMSK & B1011111; // Same as above.
-  
-    // Page 89, 11.1.2 External Interrupt Control Register B – EICRB
-    // Used to set up INT6 interrupt
-    EICRB |= ( 1 << ISC60 );  // using header file names, push 1 to bit ISC60
-    //EICRB |= B00010000; // does same as above
-
-    // Page 90, 11.1.4 External Interrupt Flag Register – EIFR
-    // Setting a 1 in bit 6 (INTF6) clears the interrupt flag.
-    EIFR |= ( 1 << INTF6 );
-    //EIFR |= B01000000;  // same as above
-
-    // Now that we have set INT6 interrupt up, we can enable
-    // the interrupt to happen
-    // Page 90, 11.1.3 External Interrupt Mask Register – EIMSK
-    // Disable external interrupts for INT6 first
-    // Set INT6 bit high, preserve other bits
-    EIMSK |= ( 1 << INT6 );
-    //EIMSK |= B01000000; // Same as above
-
-}
-
-void setupEncoder1() 
-{
-
-    count_wheel_left = 0;
-
-    // Setting up left encoder:
-    // The Romi board uses the pin PE2 (port E, pin 2) which is
-    // very unconventional.  It doesn't have a standard
-    // arduino alias (like d6, or a5, for example).
-    // We set it up here with direct register access
-    // Writing a 0 to a DDR sets as input
-    // DDRE = Data Direction Register (Port)E
-    // We want pin PE2, which means bit 2 (counting from 0)
-    // PE Register bits [ 7  6  5  4  3  2  1  0 ]
-    // Binary mask      [ 1  1  1  1  1  0  1  1 ]
-    //    
-    // By performing an & here, the 0 sets low, all 1's preserve
-    // any previous state.
-    DDRE = DDRE & ~(1<<DDE6);
-    //DDRE = DDRE & B11111011; // Same as above. 
-
-    // We need to enable the pull up resistor for the pin
-    // To do this, once a pin is set to input (as above)
-    // You write a 1 to the bit in the output register
-    PORTE = PORTE | (1 << PORTE2 );
-    //PORTE = PORTE | 0B00000100;
-
-    // Encoder0 uses conventional pin 26
-    pinMode( ENCODER_1_A_PIN, INPUT );
-    digitalWrite( ENCODER_1_A_PIN, HIGH ); // Encoder 1 xor
-
-    // initialise the recorded state of e1 encoder.
-    state_wheel_left = 0;
-    
-    // Get initial state of encoder.
-    boolean e1_B = PINE & (1<<PINE2);
-    //boolean e1_B = PINE & B00000100;  // Does same as above.
-
-    // Standard read from the other pin.
-    boolean e1_A = digitalRead( ENCODER_1_A_PIN ); // 26 the same as A8
-
-    // Some clever electronics combines the
-    // signals and this XOR restores the 
-    // true value.
-    e1_A = e1_A ^ e1_B;
-
-    // Shift values into correct place in state.
-    // Bits 1 and 0  are prior states.
-    state_wheel_left = state_wheel_left | ( e1_B << 1 );
-    state_wheel_left = state_wheel_left | ( e1_A << 0 );
-
-    // Enable pin-change interrupt on A8 (PB4) for encoder0, and disable other
-    // pin-change interrupts.
-    // Note, this register will normally create an interrupt a change to any pins
-    // on the port, but we use PCMSK0 to set it only for PCINT4 which is A8 (PB4)
-    // When we set these registers, the compiler will now look for a routine called
-    // ISR( PCINT0_vect ) when it detects a change on the pin.  PCINT0 seems like a
-    // mismatch to PCINT4, however there is only the one vector servicing a change
-    // to all PCINT0->7 pins.
-    // See Manual 11.1.5 Pin Change Interrupt Control Register - PCICR
-    
-    // Page 91, 11.1.5, Pin Change Interrupt Control Register 
-    // Disable interrupt first
-    PCICR = PCICR & ~( 1 << PCIE0 );
-    // PCICR &= B11111110;  // Same as above
-    
-    // 11.1.7 Pin Change Mask Register 0 – PCMSK0
-    PCMSK0 |= (1 << PCINT4);
-    
-    // Page 91, 11.1.6 Pin Change Interrupt Flag Register – PCIFR
-    PCIFR |= (1 << PCIF0);  // Clear its interrupt flag by writing a 1.
-
-    // Enable
-    PCICR |= (1 << PCIE0);
-}
-
-#endif
+#ifndef _ENCODERS_H
+#define _ENCODERS_H
+
+#include <util/atomic.h>
+
+#define ENCODER_0_A_PIN  7
+#define ENCODER_0_B_PIN  23
+#define ENCODER_1_A_PIN  26
+//#define ENCODER_1_B_PIN Non-standard pin!
+
+
+// Volatile Global variables used by Encoder ISR.
+volatile long count_wheel_right; // used by encoder to count the rotation
+volatile byte state_wheel_right; // used to store the prior and current state
+
+volatile long count_wheel_left; // used by encoder to count the rotation
+volatile byte state_wheel_left; // used to store the prior and current state.
+
+
+// Edge timing, stamped by the ISRs on every counted edge, for the period based speed estimate (velocity.h).
+struct EncoderEdge_s {
+  unsigned long ts_us; // micros() of the latest counted edge.
+  unsigned long period_us; // time since the edge before it, 0 if the direction changed (no valid period).
+  int8_t dir; // direction of the latest edge, +1/-1 (0 before the first edge).
+};
+
+volatile EncoderEdge_s edge_wheel_right;
+volatile EncoderEdge_s edge_wheel_left;
+
+
+// Both counts and the time they were taken, captured together.
+// A long is 4 bytes on this 8-bit MCU, so reading count_wheel_left/right directly can tear if the ISR fires half way
+// through the read. Everything outside the ISRs should go through encoder_snapshot() instead of the globals.
+struct EncoderSnapshot_s {
+  long left;
+  long right;
+  unsigned long ts_us; // micros() when the counts were read.
+  EncoderEdge_s left_edge; // latest edge timing of each wheel, consistent with the counts.
+  EncoderEdge_s right_edge;
+};
+
+// Read both encoder counts and a timestamp atomically (interrupts held off for a few cycles).
+inline EncoderSnapshot_s encoder_snapshot(){
+  EncoderSnapshot_s snapshot;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    snapshot.left = count_wheel_left;
+    snapshot.right = count_wheel_right;
+    snapshot.ts_us = micros();
+    snapshot.left_edge.ts_us = edge_wheel_left.ts_us;
+    snapshot.left_edge.period_us = edge_wheel_left.period_us;
+    snapshot.left_edge.dir = edge_wheel_left.dir;
+    snapshot.right_edge.ts_us = edge_wheel_right.ts_us;
+    snapshot.right_edge.period_us = edge_wheel_right.period_us;
+    snapshot.right_edge.dir = edge_wheel_right.dir;
+  }
+  return(snapshot);
+}
+
+
+
+
+
+// Quadrature transition table, indexed by the 4 bit state built in the ISRs:
+// State: (bit3)  (bit2)  (bit1)   (bit0)
+// State:  new B   new A   old B   old A
+// States 1,2,4,7,8,11,13,14 are valid single steps, anything else is no move (or an invalid double step) so no count change.
+// FORWARD MOTION DECREMENTS VALUES, same as the original if/else decoder.
+// 360 Counts per rotation as expected. one count per degree.
+// Wheel diameter is 32mm, circumference = 32pi, therefore one
+// count length is 32pi/360 = 0.28mm roughly.
+// Kept in RAM rather than PROGMEM, a 16 byte table is worth the faster read inside the ISR.
+const int8_t encoder_transition_table[16] = {
+   0, -1, +1,  0,
+  +1,  0,  0, -1,
+  -1,  0,  0, +1,
+   0, +1, -1,  0
+};
+
+// Port bits read directly in the ISRs, digitalRead() goes through pin lookup tables on every call.
+// Encoder 0 (right): A = pin 7 = PE6 (XOR of A and B), B = pin 23 = PF0.
+// Encoder 1 (left): A = pin 26 = PB4 (XOR of A and B), B = PE2 (non-standard pin).
+# define ENCODER_0_A_READ() ((PINE >> 6) & 1)
+# define ENCODER_0_B_READ() ((PINF >> 0) & 1)
+# define ENCODER_1_A_READ() ((PINB >> 4) & 1)
+# define ENCODER_1_B_READ() ((PINE >> PINE2) & 1)
+
+
+// Shared decoder for both wheels. a_xor is the raw A pin (XOR(AB) on this board), b the raw B pin.
+// Works on a local copy of the state so the volatile is only read and written once, with no branches on the transition.
+// Budget: at the top speed (~1.5 counts per ms a wheel) both ISRs together run 3000 times a second, so keep the
+// body under ~200 cycles (under 4% of the CPU, and under one 16us Timer3 sensor tick of delay). The 'c' serial
+// command measures it on the robot: a counted edge costs the table read plus the micros() call for its timestamp.
+static inline void encoder_decode(volatile byte & state, volatile long & count, volatile EncoderEdge_s & edge, byte a_xor, byte b){
+  // Software XOR (^) logically infers the true value of A given the state of B
+  byte a = a_xor ^ b;
+  // Shift our (new) current readings into bit positions 2 and 3 in the state variable (current state)
+  byte s = state | (b << 3) | (a << 2);
+  // one table read handles which transition we have registered.
+  int8_t step = encoder_transition_table[s];
+  count = count + step;
+
+  // timestamp the edge. The period is only meaningful between two edges in the same direction.
+  if(step != 0){
+    unsigned long now = micros();
+    edge.period_us = (step == edge.dir) ? now - edge.ts_us : 0;
+    edge.ts_us = now;
+    edge.dir = step;
+  }
+  // Shift the current readings (bits 3 and 2) down into position 1 and 0 (to become prior readings)
+  // This bumps bits 1 and 0 off to the right, "deleting" them for the next ISR call.
+  state = s >> 2;
+}
+
+
+// This ISR handles just Encoder 0
+// We know that the ISR is only called when a pin changes.
+// We also know only 1 pin can change at a time.
+// The XOR(AB) signal change from "Channel A" triggers ISR.
+// STATE E0 UPDATES COUNT E0!! DO NOT MIX UP!
+ISR( INT6_vect ) {
+  encoder_decode(state_wheel_right, count_wheel_right, edge_wheel_right, ENCODER_0_A_READ(), ENCODER_0_B_READ());
+}
+
+
+// This ISR handles just Encoder 1
+// STATE E1 UPDATES COUNT E1!! DO NOT MIX UP!
+ISR( PCINT0_vect ){
+  encoder_decode(state_wheel_left, count_wheel_left, edge_wheel_left, ENCODER_1_A_READ(), ENCODER_1_B_READ());
+}
+
+
+/*
+   This setup routine enables interrupts for
+   encoder1.  The interrupt is automatically
+   triggered when one of the encoder pin changes.
+   This is really convenient!  It means we don't
+   have to check the encoder manually.
+*/
+void setupEncoder0() 
+{
+    count_wheel_right = 0;
+
+    // Setup pins for right encoder 
+    pinMode( ENCODER_0_A_PIN, INPUT );
+    pinMode( ENCODER_0_B_PIN, INPUT );
+
+    // initialise the recorded state of e0 encoder.
+    state_wheel_right = 0;
+
+    // Get initial state of encoder pins A + B
+    boolean e0_A = digitalRead( ENCODER_0_A_PIN );
+    boolean e0_B = digitalRead( ENCODER_0_B_PIN );
+    e0_A = e0_A ^ e0_B;
+
+    // Shift values into correct place in state.
+    // Bits 1 and 0  are prior states.
+    state_wheel_right = state_wheel_right | ( e0_B << 1 );
+    state_wheel_right = state_wheel_right | ( e0_A << 0 );
+
+
+    // Now to set up PE6 as an external interupt (INT6), which means it can
+    // have its own dedicated ISR vector INT6_vector
+
+    // Page 90, 11.1.3 External Interrupt Mask Register – EIMSK
+    // Disable external interrupts for INT6 first
+    // Set INT6 bit low, preserve other bits
+    EIMSK = EIMSK & ~(1<<INT6);
+    //EIMSK = EIMSK & B1011111; // Same as above.
+  
+    // Page 89, 11.1.2 External Interrupt Control Register B – EICRB
+    // Used to set up INT6 interrupt
+    EICRB |= ( 1 << ISC60 );  // using header file names, push 1 to bit ISC60
+    //EICRB |= B00010000; // does same as above
+
+    // Page 90, 11.1.4 External Interrupt Flag Register – EIFR
+    // Setting a 1 in bit 6 (INTF6) clears the interrupt flag.
+    EIFR |= ( 1 << INTF6 );
+    //EIFR |= B01000000;  // same as above
+
+    // Now that we have set INT6 interrupt up, we can enable
+    // the interrupt to happen
+    // Page 90, 11.1.3 External Interrupt Mask Register – EIMSK
+    // Disable external interrupts for INT6 first
+    // Set INT6 bit high, preserve other bits
+    EIMSK |= ( 1 << INT6 );
+    //EIMSK |= B01000000; // Same as above
+
+}
+
+void setupEncoder1() 
+{
+
+    count_wheel_left = 0;
+
+    // Setting up left encoder:
+    // The Romi board uses the pin PE2 (port E, pin 2) which is
+    // very unconventional.  It doesn't have a standard
+    // arduino alias (like d6, or a5, for example).
+    // We set it up here with direct register access
+    // Writing a 0 to a DDR sets as input
+    // DDRE = Data Direction Register (Port)E
+    // We want pin PE2, which means bit 2 (counting from 0)
+    // PE Register bits [ 7  6  5  4  3  2  1  0 ]
+    // Binary mask      [ 1  1  1  1  1  0  1  1 ]
+    //    
+    // By performing an & here, the 0 sets low, all 1's preserve
+    // any previous state.
+    DDRE = DDRE & ~(1<<DDE6);
+    //DDRE = DDRE & B11111011; // Same as above. 
+
+    // We need to enable the pull up resistor for the pin
+    // To do this, once a pin is set to input (as above)
+    // You write a 1 to the bit in the output register
+    PORTE = PORTE | (1 << PORTE2 );
+    //PORTE = PORTE | 0B00000100;
+
+    // Encoder0 uses conventional pin 26
+    pinMode( ENCODER_1_A_PIN, INPUT );
+    digitalWrite( ENCODER_1_A_PIN, HIGH ); // Encoder 1 xor
+
+    // initialise the recorded state of e1 encoder.
+    state_wheel_left = 0;
+    
+    // Get initial state of encoder.
+    boolean e1_B = PINE & (1<<PINE2);
+    //boolean e1_B = PINE & B00000100;  // Does same as above.
+
+    // Standard read from the other pin.
+    boolean e1_A = digitalRead( ENCODER_1_A_PIN ); // 26 the same as A8
+
+    // Some clever electronics combines the
+    // signals and this XOR restores the 
+    // true value.
+    e1_A = e1_A ^ e1_B;
+
+    // Shift values into correct place in state.
+    // Bits 1 and 0  are prior states.
+    state_wheel_left = state_wheel_left | ( e1_B << 1 );
+    state_wheel_left = state_wheel_left | ( e1_A << 0 );
+
+    // Enable pin-change interrupt on A8 (PB4) for encoder0, and disable other
+    // pin-change interrupts.
+    // Note, this register will normally create an interrupt a change to any pins
+    // on the port, but we use PCMSK0 to set it only for PCINT4 which is A8 (PB4)
+    // When we set these registers, the compiler will now look for a routine called
+    // ISR( PCINT0_vect ) when it detects a change on the pin.  PCINT0 seems like a
+    // mismatch to PCINT4, however there is only the one vector servicing a change
+    // to all PCINT0->7 pins.
+    // See Manual 11.1.5 Pin Change Interrupt Control Register - PCICR
+    
+    // Page 91, 11.1.5, Pin Change Interrupt Control Register 
+    // Disable interrupt first
+    PCICR = PCICR & ~( 1 << PCIE0 );
+    // PCICR &= B11111110;  // Same as above
+    
+    // 11.1.7 Pin Change Mask Register 0 – PCMSK0
+    PCMSK0 |= (1 << PCINT4);
+    
+    // Page 91, 11.1.6 Pin Change Interrupt Flag Register – PCIFR
+    PCIFR |= (1 << PCIF0);  // Clear its interrupt flag by writing a 1.
+
+    // Enable
+    PCICR |= (1 << PCIE0);
+}
+
+#endif
@@ -0,0 +1,373 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _ESTIMATOR_H
+#define _ESTIMATOR_H
+
+# include "kinematics.h"
+# include "trig.h"
+
+// Pose estimator: a small extended Kalman filter that takes the odometry's motion (Kinematics_c::take_motion()) and
+// corrects it with the line. Dead reckoning alone drifts, mostly because the two wheels are never quite the same
+// size. A straight piece of line is a landmark: while the robot follows one centred, the point under the sensor bar
+// stays on the line it first saw. The filter holds the pose to that, and learns the wheel size error from how far
+// the odometry wanders off it, so the drift is smaller on the corners and the drive home too. It publishes the pose
+// and its covariance.
+# define ESTIMATOR_ENABLED 1
+// 1 = fuse the line, 0 = the estimate is the odometry's pose (sim_bench --fusion 0|1 compares the two, test_estimator
+// checks the line beats odometry alone). With a 2% big right wheel it gets home within ~120mm instead of ~255mm on the
+// straight track, and the others' straights are too short to learn the scale from.
+# define ESTIMATOR_FUSION 1
+
+// State: pose, the right wheel's scale error relative to the left, and the straight line being followed.
+# define ESTIMATOR_STATES 6
+# define EST_X 0 // mm
+# define EST_Y 1 // mm
+# define EST_THETA 2 // rad
+# define EST_SCALE 3 // right wheel travel = (1 + scale) x what the counts say.
+# define EST_LINE_HEADING 4 // rad, heading of the straight line.
+# define EST_LINE_OFFSET 5 // mm, sideways shift of the line from where it was first seen (left +ve).
+
+// Geometry, as Kinematics_c.
+# define ESTIMATOR_HALF_TRACK_MM 44.6
+# define ESTIMATOR_SENSOR_AHEAD_MM 40.0 // sensor bar ahead of the axle.
+
+// Noise.
+# define ESTIMATOR_WHEEL_NOISE 0.02 // mm^2 of wheel travel variance per mm travelled (slip, count quantisation).
+# define ESTIMATOR_SCALE_SD 0.03 // prior on the wheel scale error, ~3%.
+# define ESTIMATOR_SCALE_DRIFT 1e-9 // scale variance added per mm travelled, lets it keep learning.
+# define ESTIMATOR_LINE_HEADING_SD 0.15 // rad: a new straight's heading about the robot's, still straightening up.
+# define ESTIMATOR_LATERAL_SD 5.0 // mm: line position from the sensors, and how straight the line really is.
+
+// Line landmarks.
+# define ESTIMATOR_FUSE_MM 40 // fuse the line every 40mm of travel, closer samples only repeat the same wiggle.
+# define ESTIMATOR_CENTRED_MM 10.0 // only trust the line while it's this close to the middle of the sensor bar.
+# define ESTIMATOR_GATE 3.0 // a sighting more than 3 sd off the landmark isn't the same straight line (a corner).
+// A landmark only starts once the robot has followed the straight centred this far, so it has settled onto the line
+// after the corner. Straight away, the robot is still turned from the line by up to ~0.1 rad.
+# define ESTIMATOR_SETTLE_MM 150
+// The wheel scale is only learnt once a landmark has been followed this far. Over a shorter straight a 2% scale error
+// moves the line by less than its noise, and what's left is the robot still settling after the corner, which taught
+// the filter a scale of the wrong sign. Until then the scale is held (a consider state): the rest of the state is
+// corrected as usual, allowing for its uncertainty.
+# define ESTIMATOR_SCALE_MIN_MM 300
+
+
+// Class for the pose estimate and its covariance.
+class Estimator_c {
+  public:
+    bool fusion = ESTIMATOR_FUSION;
+
+    float state[ESTIMATOR_STATES];
+    float P[ESTIMATOR_STATES][ESTIMATOR_STATES]; // covariance
+
+    // the pose, published after every update like Kinematics_c.
+    float X_pos = 0.0;
+    float Y_pos = 0.0;
+    float Theta = 0.0;
+
+    // the straight line being followed, if any.
+    bool on_landmark = false;
+    float anchor_x = 0; // point on the line where it was first seen, mm.
+    float anchor_y = 0;
+    float fuse_mm = 0; // travelled since the line was last fused.
+    float landmark_mm = 0; // followed along the current landmark.
+    float settled_mm = 0; // followed a straight centred, before the landmark starts.
+    unsigned int landmarks = 0; // straights used this run.
+    unsigned int observations = 0; // times the line was fused.
+
+    // Constructor, must exist.
+    Estimator_c() {
+      reset();
+    }
+
+    // Start at the origin facing +x, knowing the pose exactly but not the wheel sizes.
+    void reset(){
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        state[i] = 0;
+        for(byte j = 0; j < ESTIMATOR_STATES; j++){
+          P[i][j] = 0;
+        }
+      }
+      P[EST_SCALE][EST_SCALE] = ESTIMATOR_SCALE_SD * ESTIMATOR_SCALE_SD;
+      on_landmark = false;
+      fuse_mm = 0;
+      settled_mm = 0;
+      landmarks = 0;
+      observations = 0;
+      publish();
+    }
+
+    // **** Odometry ****
+    // Move the pose on by the odometry's motion since the last call (every control tick), and grow the covariance to
+    // match.
+    void predict(const KinematicsMotion_s & motion){
+      if(motion.left_mm == 0 && motion.right_mm == 0){
+        return;
+      }
+
+      // the odometry's step, turned from its frame into the estimate's: the headings differ by what the line
+      // corrected.
+      float rotation = angle_wrap(state[EST_THETA] - motion.theta_start);
+      float rc = trig_cos(rotation);
+      float rs = trig_sin(rotation);
+      float dx = motion.dx * rc - motion.dy * rs;
+      float dy = motion.dx * rs + motion.dy * rc;
+
+      // then the right wheel's scale error: extra travel the counts don't show, half of it forward and the rest a turn.
+      float extra = motion.right_mm * state[EST_SCALE];
+      float heading = state[EST_THETA] + 0.5 * motion.dtheta;
+      float c = trig_cos(heading);
+      float s = trig_sin(heading);
+      dx = dx + 0.5 * extra * c;
+      dy = dy + 0.5 * extra * s;
+      state[EST_X] = state[EST_X] + dx;
+      state[EST_Y] = state[EST_Y] + dy;
+      state[EST_THETA] = angle_wrap(state[EST_THETA] + motion.dtheta + extra / (2 * ESTIMATOR_HALF_TRACK_MM));
+      fuse_mm = fuse_mm + abs(0.5 * (motion.left_mm + motion.right_mm));
+
+      // P = F P F', F is the identity bar these five terms, so do it as row then column operations.
+      float f_x_theta = -dy;
+      float f_y_theta = dx;
+      float f_x_scale = 0.5 * motion.right_mm * c;
+      float f_y_scale = 0.5 * motion.right_mm * s;
+      float f_theta_scale = motion.right_mm / (2 * ESTIMATOR_HALF_TRACK_MM);
+      for(byte j = 0; j < ESTIMATOR_STATES; j++){
+        P[EST_X][j] = P[EST_X][j] + f_x_theta * P[EST_THETA][j] + f_x_scale * P[EST_SCALE][j];
+        P[EST_Y][j] = P[EST_Y][j] + f_y_theta * P[EST_THETA][j] + f_y_scale * P[EST_SCALE][j];
+        P[EST_THETA][j] = P[EST_THETA][j] + f_theta_scale * P[EST_SCALE][j];
+      }
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        P[i][EST_X] = P[i][EST_X] + f_x_theta * P[i][EST_THETA] + f_x_scale * P[i][EST_SCALE];
+        P[i][EST_Y] = P[i][EST_Y] + f_y_theta * P[i][EST_THETA] + f_y_scale * P[i][EST_SCALE];
+        P[i][EST_THETA] = P[i][EST_THETA] + f_theta_scale * P[i][EST_SCALE];
+      }
+
+      // + Q: each wheel's travel is off by noise growing with the distance it turned.
+      float var_left = ESTIMATOR_WHEEL_NOISE * abs(motion.left_mm);
+      float var_right = ESTIMATOR_WHEEL_NOISE * abs(motion.right_mm);
+      float var_ds = 0.25 * (var_left + var_right);
+      float var_theta = var_ds / (ESTIMATOR_HALF_TRACK_MM * ESTIMATOR_HALF_TRACK_MM);
+      float cov_ds_theta = 0.25 * (var_right - var_left) / ESTIMATOR_HALF_TRACK_MM;
+      P[EST_X][EST_X] = P[EST_X][EST_X] + var_ds * c * c;
+      P[EST_Y][EST_Y] = P[EST_Y][EST_Y] + var_ds * s * s;
+      P[EST_X][EST_Y] = P[EST_X][EST_Y] + var_ds * c * s;
+      P[EST_Y][EST_X] = P[EST_X][EST_Y];
+      P[EST_THETA][EST_THETA] = P[EST_THETA][EST_THETA] + var_theta;
+      P[EST_X][EST_THETA] = P[EST_X][EST_THETA] + cov_ds_theta * c;
+      P[EST_THETA][EST_X] = P[EST_X][EST_THETA];
+      P[EST_Y][EST_THETA] = P[EST_Y][EST_THETA] + cov_ds_theta * s;
+      P[EST_THETA][EST_Y] = P[EST_Y][EST_THETA];
+      float travelled = abs(motion.left_mm) + abs(motion.right_mm);
+      P[EST_SCALE][EST_SCALE] = P[EST_SCALE][EST_SCALE] + ESTIMATOR_SCALE_DRIFT * travelled;
+
+      publish();
+    }
+    //*********************
+
+    // **** Line landmarks ****
+    // Every control tick after predict(). From the path (Path_c::on_straight(), in_corner()): landmarks start on a
+    // straight and end in a corner. centred: following the line with it near the middle of the sensor bar. Line
+    // position from the sensors, left +ve. A landmark also ends when the line leaves the middle of the bar or a
+    // sighting doesn't fit it, but not when the path's short noisy segments stop calling it a straight.
+    void observe(bool straight, bool corner, bool centred, float line_position_mm){
+      if(corner){
+        on_landmark = false;
+        settled_mm = 0;
+      }
+      if(!fusion || fuse_mm < ESTIMATOR_FUSE_MM){
+        return;
+      }
+      float travelled = fuse_mm;
+      landmark_mm = landmark_mm + travelled;
+      fuse_mm = 0;
+      if(!centred){
+        on_landmark = false; // whatever line comes next is a new one.
+        settled_mm = 0;
+        return;
+      }
+
+      // the point on the line under the sensors.
+      float c = trig_cos(state[EST_THETA]);
+      float s = trig_sin(state[EST_THETA]);
+      float line_x = state[EST_X] + ESTIMATOR_SENSOR_AHEAD_MM * c - line_position_mm * s;
+      float line_y = state[EST_Y] + ESTIMATOR_SENSOR_AHEAD_MM * s + line_position_mm * c;
+
+      if(!on_landmark){
+        settled_mm = straight ? settled_mm + travelled : 0;
+        if(settled_mm >= ESTIMATOR_SETTLE_MM){
+          start_landmark(line_x, line_y);
+        }
+        return;
+      }
+
+      // it's on the line, zero distance from it. The sensor bar is ahead of the axle, so this pins the heading as
+      // well as the sideways position. There's no separate heading measurement: the robot's heading about the line
+      // wanders while it straightens up after a corner, and treating it as the line's teaches the filter a wrong
+      // wheel scale.
+      float line_c = trig_cos(state[EST_LINE_HEADING]);
+      float line_s = trig_sin(state[EST_LINE_HEADING]);
+      float along = (line_x - anchor_x) * line_c + (line_y - anchor_y) * line_s;
+      float across = -(line_x - anchor_x) * line_s + (line_y - anchor_y) * line_c - state[EST_LINE_OFFSET];
+      float relative = state[EST_THETA] - state[EST_LINE_HEADING];
+      float H[ESTIMATOR_STATES];
+      H[EST_X] = -line_s;
+      H[EST_Y] = line_c;
+      H[EST_THETA] = ESTIMATOR_SENSOR_AHEAD_MM * trig_cos(relative) - line_position_mm * trig_sin(relative);
+      H[EST_SCALE] = 0;
+      H[EST_LINE_HEADING] = -along;
+      H[EST_LINE_OFFSET] = -1;
+      bool learn_scale = landmark_mm >= ESTIMATOR_SCALE_MIN_MM;
+      if(!fuse(H, -across, ESTIMATOR_LATERAL_SD * ESTIMATOR_LATERAL_SD, learn_scale)){
+        on_landmark = false;
+        return;
+      }
+
+      observations = observations + 1;
+      publish();
+    }
+
+    // A new straight: its heading is the robot's and it passes through the point under the sensors. Both go in the
+    // state, correlated with the pose they were taken from, so later sightings pin down the pose's drift since.
+    void start_landmark(float line_x, float line_y){
+      anchor_x = line_x;
+      anchor_y = line_y;
+      state[EST_LINE_HEADING] = state[EST_THETA];
+      state[EST_LINE_OFFSET] = 0;
+
+      // heading = theta, give or take how far the robot is still turned from the line.
+      for(byte j = 0; j < ESTIMATOR_STATES; j++){
+        P[EST_LINE_HEADING][j] = P[EST_THETA][j];
+        P[j][EST_LINE_HEADING] = P[EST_THETA][j];
+      }
+      float heading_var = ESTIMATOR_LINE_HEADING_SD * ESTIMATOR_LINE_HEADING_SD;
+      P[EST_LINE_HEADING][EST_LINE_HEADING] = P[EST_THETA][EST_THETA] + heading_var;
+
+      // offset = G x: where the line really is depends on where the robot really was when it saw it.
+      float G[ESTIMATOR_STATES] = {0};
+      G[EST_X] = -trig_sin(state[EST_THETA]);
+      G[EST_Y] = trig_cos(state[EST_THETA]);
+      G[EST_THETA] = ESTIMATOR_SENSOR_AHEAD_MM;
+      float GP[ESTIMATOR_STATES];
+      multiply(G, GP);
+      float GPG = 0;
+      for(byte j = 0; j < ESTIMATOR_STATES; j++){
+        GPG = GPG + GP[j] * G[j];
+      }
+      for(byte j = 0; j < ESTIMATOR_STATES; j++){
+        P[EST_LINE_OFFSET][j] = GP[j];
+        P[j][EST_LINE_OFFSET] = GP[j];
+      }
+      P[EST_LINE_OFFSET][EST_LINE_OFFSET] = GPG + ESTIMATOR_LATERAL_SD * ESTIMATOR_LATERAL_SD;
+
+      on_landmark = true;
+      landmark_mm = 0;
+      landmarks = landmarks + 1;
+    }
+    //*********************
+
+    // **** Kalman update ****
+    // One scalar measurement: h(x) with Jacobian H, innovation (measured - h(x)) and its noise variance. Returns false,
+    // changing nothing, if the innovation is too big to believe (past ESTIMATOR_GATE sd). learn_scale false holds the
+    // wheel scale and its variance where they are (Schmidt's consider filter): its gain is zero, and the rest of the
+    // covariance updates the same as it would otherwise.
+    bool fuse(const float * H, float innovation, float variance, bool learn_scale){
+      float PH[ESTIMATOR_STATES];
+      multiply(H, PH);
+      float S = variance;
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        S = S + H[i] * PH[i];
+      }
+      if(innovation * innovation > ESTIMATOR_GATE * ESTIMATOR_GATE * S){
+        return(false);
+      }
+      float scale_variance = P[EST_SCALE][EST_SCALE];
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        if(i != EST_SCALE || learn_scale){
+          state[i] = state[i] + PH[i] * innovation / S;
+        }
+      }
+      // P = P - K H P, K = P H / S. Symmetric, so K H P = PH PH' / S.
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        for(byte j = 0; j < ESTIMATOR_STATES; j++){
+          P[i][j] = P[i][j] - PH[i] * PH[j] / S;
+        }
+      }
+      if(!learn_scale){
+        P[EST_SCALE][EST_SCALE] = scale_variance;
+      }
+      state[EST_THETA] = angle_wrap(state[EST_THETA]);
+      state[EST_LINE_HEADING] = angle_wrap(state[EST_LINE_HEADING]);
+      return(true);
+    }
+
+    // out = P v
+    void multiply(const float * v, float * out){
+      for(byte i = 0; i < ESTIMATOR_STATES; i++){
+        out[i] = 0;
+        for(byte j = 0; j < ESTIMATOR_STATES; j++){
+          out[i] = out[i] + P[i][j] * v[j];
+        }
+      }
+    }
+    //*********************
+
+    // **** Uncertainty ****
+    // Standard deviations of the position (mm, the larger axis bound), heading (rad) and wheel scale error.
+    float position_sd(){
+      return(sqrt(P[EST_X][EST_X] + P[EST_Y][EST_Y]));
+    }
+    float heading_sd(){
+      return(sqrt(P[EST_THETA][EST_THETA]));
+    }
+    float scale_sd(){
+      return(sqrt(P[EST_SCALE][EST_SCALE]));
+    }
+    //*********************
+
+    void publish(){
+      X_pos = state[EST_X];
+      Y_pos = state[EST_Y];
+      Theta = state[EST_THETA];
+    }
+
+    // Print the estimate: pose, its standard deviations, the learnt wheel scale error and how much line was used.
+    void report(){
+      Serial.print("estimator,");
+      Serial.println(fusion ? "fused" : "odometry");
+      Serial.print("pose,");
+      Serial.print(X_pos, 1);
+      Serial.print(",");
+      Serial.print(Y_pos, 1);
+      Serial.print(",");
+      Serial.println(Theta, 3);
+      Serial.print("sd,");
+      Serial.print(position_sd(), 1);
+      Serial.print(",");
+      Serial.println(heading_sd(), 3);
+      Serial.print("wheel_scale,");
+      Serial.print(state[EST_SCALE], 4);
+      Serial.print(",");
+      Serial.println(scale_sd(), 4);
+      Serial.print("landmarks,");
+      Serial.print(landmarks);
+      Serial.print(",");
+      Serial.println(observations);
+    }
+
+    // Wrap an angle difference to +-pi.
+    static float angle_wrap(float angle){
+      while(angle > 3.14159){
+        angle = angle - 2*3.14159;
+      }
+      while(angle < -3.14159){
+        angle = angle + 2*3.14159;
+      }
+      return(angle);
+    }
+};
+
+Estimator_c estimator;
+
+#endif
@@ -0,0 +1,190 @@
+#include "Arduino.h"
+#include <EEPROM.h>
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _FEEDFORWARD_H
+#define _FEEDFORWARD_H
+
+// Motor feedforward: a measured pwm -> wheel speed map per motor and direction, and its inverse, so a wheel can be
+// asked for a speed (encoder counts per ms) instead of a hand tuned pwm. The speed PIDs then only correct what the
+// map gets wrong. The map is learnt by FSM_c::characterise_motors() and kept in EEPROM.
+# define FEEDFORWARD_ENABLED 1
+
+// Map points: the speed at pwm = MAX_PWM * (i + 1) / FF_POINTS, plus the deadband (pwm where the wheel starts to move).
+# define FF_POINTS 8
+# define FF_SPEED_SCALE 128 // speeds stored as counts per ms x 128 in a byte, up to ~2 counts per ms.
+
+// Curves, one per motor and direction.
+# define FF_LEFT 0
+# define FF_RIGHT 1
+# define FF_CURVES 4 // left forward, left reverse, right forward, right reverse
+
+// Until a map has been learnt, every curve is this nominal straight line.
+# define FF_DEFAULT_DEADBAND 8 // pwm
+# define FF_DEFAULT_GAIN 0.02 // counts per ms per pwm above the deadband
+
+// A map is only accepted if the fastest point of every curve reaches this speed (the wheels really turned).
+# define FF_MIN_TOP_SPEED 0.2
+
+// EEPROM layout: after the line sensor calibration, before the run recorder. Magic byte then the curves.
+# define FF_EEPROM_ADDR 32
+# define FF_EEPROM_MAGIC 0xF5
+
+
+// One motor in one direction. Speeds are magnitudes, and must not fall as the pwm rises.
+struct FeedforwardCurve_s {
+  byte deadband;
+  byte speed[FF_POINTS];
+};
+
+
+// Class for the feedforward map and its lookups.
+class Feedforward_c {
+  public:
+    FeedforwardCurve_s curves[FF_CURVES];
+    bool learnt = false; // true once a measured map is in use, otherwise the nominal one.
+
+    // Constructor, must exist.
+    Feedforward_c() {
+      set_nominal();
+    }
+
+    // pwm of map point i.
+    static float point_pwm(byte i){
+      return((float)MAX_PWM * (i + 1) / FF_POINTS);
+    }
+
+    // The nominal map: FF_DEFAULT_DEADBAND and FF_DEFAULT_GAIN for every curve.
+    void set_nominal(){
+      for(byte c = 0; c < FF_CURVES; c++){
+        curves[c].deadband = FF_DEFAULT_DEADBAND;
+        for(byte i = 0; i < FF_POINTS; i++){
+          float speed = (point_pwm(i) - FF_DEFAULT_DEADBAND) * FF_DEFAULT_GAIN;
+          curves[c].speed[i] = constrain(speed * FF_SPEED_SCALE + 0.5, 0, 255);
+        }
+      }
+      learnt = false;
+    }
+
+    // **** Learning ****
+    // Store the measured steady state speed (counts per ms, either sign) of one motor at map point i.
+    void record(byte motor, bool reverse, byte i, float speed){
+      curves[motor*2 + reverse].speed[i] = constrain(abs(speed) * FF_SPEED_SCALE + 0.5, 0, 255);
+    }
+
+    // After every point has been recorded: work out the deadbands and check the map. Returns false (and goes back
+    // to the nominal map) if any curve is unusable.
+    bool finish(){
+      for(byte c = 0; c < FF_CURVES; c++){
+        FeedforwardCurve_s & curve = curves[c];
+        // no going backwards, friction noise can make a point read a touch slower than the one before.
+        for(byte i = 1; i < FF_POINTS; i++){
+          if(curve.speed[i] < curve.speed[i - 1]){
+            curve.speed[i] = curve.speed[i - 1];
+          }
+        }
+        if(curve.speed[FF_POINTS - 1] < FF_MIN_TOP_SPEED * FF_SPEED_SCALE){
+          set_nominal();
+          return(false);
+        }
+        // deadband: extend the line through the first two moving points back to zero speed.
+        byte first = 0;
+        while(first < FF_POINTS - 2 && curve.speed[first] == 0){
+          first = first + 1;
+        }
+        float slope = (curve.speed[first + 1] - curve.speed[first]) / (point_pwm(first + 1) - point_pwm(first));
+        float deadband = (slope > 0) ? point_pwm(first) - curve.speed[first] / slope : point_pwm(first);
+        curve.deadband = constrain(deadband, 0, point_pwm(first));
+      }
+      learnt = true;
+      return(true);
+    }
+
+    void save(){
+      EEPROM.update(FF_EEPROM_ADDR, FF_EEPROM_MAGIC);
+      EEPROM.put(FF_EEPROM_ADDR + 1, curves);
+    }
+
+    // Load the map saved by save(). Returns false (keeping the nominal map) if there isn't one.
+    bool load(){
+      if(EEPROM.read(FF_EEPROM_ADDR) != FF_EEPROM_MAGIC){
+        return(false);
+      }
+      EEPROM.get(FF_EEPROM_ADDR + 1, curves);
+      learnt = true;
+      return(true);
+    }
+    //*********************
+
+    // Inverse feedforward: pwm (signed, +ve = forward) for a motor to run at speed (counts per ms, signed).
+    // Linear between map points, the deadband is jumped straight over, and speeds past the last point carry on along
+    // the last segment (Motors_c clamps the result).
+    float pwm_for_speed(byte motor, float speed){
+      if(speed == 0){
+        return(0);
+      }
+      const FeedforwardCurve_s & curve = curves[motor*2 + (speed < 0)];
+      float target = abs(speed) * FF_SPEED_SCALE;
+      float pwm_before = curve.deadband;
+      float speed_before = 0;
+      for(byte i = 0; i < FF_POINTS; i++){
+        float pwm_after = point_pwm(i);
+        float speed_after = curve.speed[i];
+        if(target <= speed_after || i == FF_POINTS - 1){
+          float pwm = pwm_after;
+          if(speed_after > speed_before){
+            pwm = pwm_before + (target - speed_before) * (pwm_after - pwm_before) / (speed_after - speed_before);
+          }
+          return((speed < 0) ? -pwm : pwm);
+        }
+        if(speed_after > speed_before){
+          pwm_before = pwm_after;
+          speed_before = speed_after;
+        }
+      }
+      return(0);
+    }
+
+    // Forward map: expected steady speed (counts per ms, signed) of a motor at a pwm.
+    float speed_for_pwm(byte motor, float pwm){
+      const FeedforwardCurve_s & curve = curves[motor*2 + (pwm < 0)];
+      float p = abs(pwm);
+      if(p <= curve.deadband){
+        return(0);
+      }
+      float pwm_before = curve.deadband;
+      float speed_before = 0;
+      float speed = curve.speed[FF_POINTS - 1];
+      for(byte i = 0; i < FF_POINTS; i++){
+        if(p <= point_pwm(i)){
+          speed = speed_before + (p - pwm_before) * (curve.speed[i] - speed_before) / (point_pwm(i) - pwm_before);
+          break;
+        }
+        pwm_before = point_pwm(i);
+        speed_before = curve.speed[i];
+      }
+      speed = speed / FF_SPEED_SCALE;
+      return((pwm < 0) ? -speed : speed);
+    }
+
+    // Print the map: one line per curve, deadband then the speed (counts per ms) at each point.
+    void report(){
+      Serial.print("feedforward,");
+      Serial.println(learnt ? "learnt" : "nominal");
+      for(byte c = 0; c < FF_CURVES; c++){
+        Serial.print((c < 2) ? "left" : "right");
+        Serial.print((c & 1) ? "_rev," : "_fwd,");
+        Serial.print(curves[c].deadband);
+        for(byte i = 0; i < FF_POINTS; i++){
+          Serial.print(",");
+          Serial.print((float)curves[c].speed[i] / FF_SPEED_SCALE, 3);
+        }
+        Serial.println();
+      }
+    }
+};
+
+Feedforward_c feedforward;
+
+#endif
@@ -0,0 +1,130 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _FIXED_H
+#define _FIXED_H
+
+// The 32U4 has no FPU, so every float operation is done in software and costs 100s of cycles (divisions ~500).
+// Setting USE_FIXED_POINT to 1 switches the line sensor, PID and kinematics maths over to a Q-format fixed point
+// type instead, which only needs the hardware 8x8 multiplier and integer adds.
+#ifndef USE_FIXED_POINT
+# define USE_FIXED_POINT 1
+#endif
+# define FIXED_FRAC_BITS 16 // Q15.16: range +-32767, resolution 0.000015. Plenty for mm, radians and PWM.
+
+
+// Signed fixed point number held in a 32 bit integer with FRAC_BITS fractional bits.
+// Converting from float literals is constexpr so constants cost nothing at run time, converting a float variable
+// does cost a float multiply so keep values in fixed point through a calculation and only convert at the ends.
+template<uint8_t FRAC_BITS>
+class Fixed_c {
+  // mul_raw() shifts its partial products left by (16 - FRAC_BITS), so it is only right up to 16 fractional bits.
+  static_assert(FRAC_BITS >= 1 && FRAC_BITS <= 16, "Fixed_c supports 1 to 16 fractional bits");
+
+  public:
+    int32_t raw; // the value times 2^FRAC_BITS
+
+    constexpr Fixed_c() : raw(0) {}
+    constexpr Fixed_c(int v) : raw((int32_t)v * ((int32_t)1 << FRAC_BITS)) {}
+    constexpr Fixed_c(long v) : raw((int32_t)v * ((int32_t)1 << FRAC_BITS)) {}
+    constexpr Fixed_c(unsigned int v) : raw((int32_t)v * ((int32_t)1 << FRAC_BITS)) {}
+    constexpr Fixed_c(unsigned long v) : raw((int32_t)v * ((int32_t)1 << FRAC_BITS)) {}
+    constexpr Fixed_c(float v) : raw((int32_t)(v * (float)((int32_t)1 << FRAC_BITS) + (v >= 0 ? 0.5f : -0.5f))) {}
+    constexpr Fixed_c(double v) : raw((int32_t)(v * (double)((int32_t)1 << FRAC_BITS) + (v >= 0 ? 0.5 : -0.5))) {}
+
+    static constexpr Fixed_c from_raw(int32_t r){
+      return(Fixed_c(r, true));
+    }
+
+    float to_float() const {
+      return((float)raw * (1.0f / (float)((int32_t)1 << FRAC_BITS)));
+    }
+
+    // whole part, rounded towards -infinity.
+    long to_long() const {
+      return(raw >> FRAC_BITS);
+    }
+
+    Fixed_c operator+(Fixed_c o) const { return(from_raw(raw + o.raw)); }
+    Fixed_c operator-(Fixed_c o) const { return(from_raw(raw - o.raw)); }
+    Fixed_c operator-() const { return(from_raw(-raw)); }
+    Fixed_c operator*(Fixed_c o) const { return(from_raw(mul_raw(raw, o.raw))); }
+    // Full division needs a 64 bit divide, slow on the AVR. Prefer multiplying by a constant reciprocal,
+    // or real_div_int()/real_ratio() below when the divisor is a whole number.
+    Fixed_c operator/(Fixed_c o) const { return(from_raw((int32_t)(((int64_t)raw * ((int32_t)1 << FRAC_BITS)) / o.raw))); }
+
+    Fixed_c & operator+=(Fixed_c o) { raw += o.raw; return(*this); }
+    Fixed_c & operator-=(Fixed_c o) { raw -= o.raw; return(*this); }
+    Fixed_c & operator*=(Fixed_c o) { raw = mul_raw(raw, o.raw); return(*this); }
+
+    bool operator<(Fixed_c o) const { return(raw < o.raw); }
+    bool operator>(Fixed_c o) const { return(raw > o.raw); }
+    bool operator<=(Fixed_c o) const { return(raw <= o.raw); }
+    bool operator>=(Fixed_c o) const { return(raw >= o.raw); }
+    bool operator==(Fixed_c o) const { return(raw == o.raw); }
+    bool operator!=(Fixed_c o) const { return(raw != o.raw); }
+
+    // 32x32 -> 32 multiply keeping the middle bits, built from four 16x16 -> 32 multiplies (each a few hardware
+    // MULs on the AVR) rather than a 64 bit multiply from libgcc. Result is only valid if it fits in 32 bits,
+    // which is the caller's job, same as any integer overflow.
+    static int32_t mul_raw(int32_t a, int32_t b){
+      bool negative = (a < 0) != (b < 0);
+      uint32_t ua = (a < 0) ? -(uint32_t)a : (uint32_t)a;
+      uint32_t ub = (b < 0) ? -(uint32_t)b : (uint32_t)b;
+      uint16_t ah = ua >> 16;
+      uint16_t al = ua & 0xFFFF;
+      uint16_t bh = ub >> 16;
+      uint16_t bl = ub & 0xFFFF;
+      // (ah.2^16 + al)(bh.2^16 + bl) >> FRAC_BITS, every term except the last is exact for FRAC_BITS <= 16.
+      uint32_t result = (((uint32_t)ah * bh) << (32 - FRAC_BITS))
+                      + (((uint32_t)ah * bl) << (16 - FRAC_BITS))
+                      + (((uint32_t)al * bh) << (16 - FRAC_BITS))
+                      + (((uint32_t)al * bl) >> FRAC_BITS);
+      return(negative ? -(int32_t)result : (int32_t)result);
+    }
+
+  private:
+    constexpr Fixed_c(int32_t r, bool) : raw(r) {}
+};
+
+typedef Fixed_c<FIXED_FRAC_BITS> fixed_t;
+
+
+// real_t is the number type used by the hot paths. The helpers below let the same code compile with either.
+#if USE_FIXED_POINT
+typedef fixed_t real_t;
+#else
+typedef float real_t;
+#endif
+
+inline float real_to_float(float x){
+  return(x);
+}
+
+template<uint8_t FRAC_BITS>
+inline float real_to_float(Fixed_c<FRAC_BITS> x){
+  return(x.to_float());
+}
+
+// Divide by a whole number: a plain 32 bit integer division in fixed point.
+inline float real_div_int(float x, long n){
+  return(x / n);
+}
+
+template<uint8_t FRAC_BITS>
+inline Fixed_c<FRAC_BITS> real_div_int(Fixed_c<FRAC_BITS> x, long n){
+  return(Fixed_c<FRAC_BITS>::from_raw(x.raw / n));
+}
+
+// num/den as a real_t. In fixed point num must fit in (31 - FRAC_BITS) bits (+-32767 for Q15.16) so the
+// division stays 32 bit.
+inline real_t real_ratio(long num, long den){
+  #if USE_FIXED_POINT
+  return(real_t::from_raw((num * ((int32_t)1 << FIXED_FRAC_BITS)) / den));
+  #else
+  return((float)num / (float)den);
+  #endif
+}
+
+#endif
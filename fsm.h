@@ -1,327 +1,755 @@
-# include "Arduino.h"
-// this #ifndef stops this file
-// from being included mored than
-// once by the compiler. 
-# ifndef _FSM_H
-# define _FSM_H
-# define LED_PIN 13 
-# define BUZZER_PIN 6
-
-// Define frequency of updates for our linesensors, PID and motors.
-# define LINE_SENSOR_UPDATE 10 // absolute minimum is 8 milliseconds here as that is about the max time the line sensor update function can take
-# define PID_UPDATE         20
-# define MOTOR_UPDATE       30
-# define LOST_LIMIT  1500// Initiate return to start after 1.5 seconds of lost line.
-
-
-
-# include "linesensor.h"
-# include "kinematics.h"
-# include "pid.h"
-
-LineSensor_c linesensors;
-Kinematics_c kinematics;
-
-// two instances of PID class, one for each wheel
-PID_c speed_pid_left; 
-PID_c speed_pid_right;
-
-
-// Class for our Finite State Machine
-class FSM_c {
-  public:
-
-    // need these bad boys as whole class variables.
-    unsigned long linesensors_ts = 0; 
-    unsigned long motor_ts = 0;
-    float e_line = 0.0; // initial value for or error from line variable
-    int lost_line_count = 0; // we want to know how long the robot has been off line force trigger of return to start.
-
-    //**** PID variables ****
-    // I use PID only for straight line control.
-    unsigned long pid_ts = 0; // timestamp
-    float average_left_speed; // low pass filter of speed, left
-    float average_right_speed; // low pass filter of speed, right
-
-    long count_left_last = count_wheel_left; // for difference in encoder counts, set initial values.
-    long count_right_last = count_wheel_right;
-    float demand = 0.3; // global demand speed variable, encoder counts per ms
-    float pwm_left; // our fixed speed values.
-    float pwm_right;
-    //***********************
-    
-
-    // Constructor, must exist.
-    FSM_c() {
-    }
-
-    // This function calls updates for: Linesensors, PID, and Robot State
-    int update_state(int state){
-
-      // Update kinematics (has timing built in, we should refactor the motors and line sensors to contain their own timing too.)
-      kinematics.update();
-
-      // Record the time of this execution of loop for coming calucations ( _ts = "time-stamp" )
-      unsigned long current_ts;
-      current_ts = millis();
-
-      // Run our line sensor update every 100ms (10hz). Tracking time for the line sensor (ls)
-      unsigned long elapsed_t;
-      elapsed_t = current_ts - linesensors_ts;
-
-
-      // Linesensore Update
-      if( elapsed_t > LINE_SENSOR_UPDATE ) {
-
-        // run our line sensor read function
-        e_line = linesensors.activate_LS();
-        // record when the line sensors were run
-        linesensors_ts = millis();
-      }
-
-
-
-      // PID Update: calculating speed estimate
-      elapsed_t = current_ts - pid_ts; // current time minus prevour time.
-      if ( elapsed_t > PID_UPDATE ) { // run every 20 ms
-
-        long diff_left_count;
-        long diff_right_count;
-        float left_speed;
-        float right_speed;
-
-        diff_left_count = count_wheel_left - count_left_last; // get the difference in counts
-        count_left_last = count_wheel_left; // update the previous count to current.
-
-        diff_right_count = count_wheel_right - count_right_last; // ditto
-        count_right_last = count_wheel_right;
-
-        left_speed = (float)diff_left_count/(float)elapsed_t; // difference in counts devided by elapsed time (counts per ms).
-        right_speed = (float)diff_right_count/(float)elapsed_t; 
-
-        // we find an average speed which we weight 70% compared to the current of 30%.
-        average_left_speed = (0.7*average_left_speed) + (0.3*left_speed);
-        average_right_speed = (0.7*average_right_speed) + (0.3*right_speed);
-
-        pwm_left = speed_pid_left.update(demand, average_left_speed); 
-        pwm_right = speed_pid_right.update(demand, average_right_speed);
-
-        pid_ts = millis(); // update the timestamp
-
-        // Serial.print("average left speed: ");
-        // Serial.println(average_left_speed);
-        // Serial.print("average right speed: ");
-        // Serial.println(average_right_speed);
-        // Serial.print("demand: ");
-        // Serial.println(demand);
-      }
-
-
-      // Robot State Update: Update what the motors are doing.
-      elapsed_t = current_ts - motor_ts;
-      if( elapsed_t > MOTOR_UPDATE ) {
-
-        // STATE 5: ROBOT REACHED HOME
-        if (state == 5){ // if you've reached home, stay home.
-          state = 5;
-        }
-
-        // STATE 4: CONTINUE RETURN TO START
-        else if (state == 4){ // for MVP, we do not attempt return to start.
-          state = 4;
-        }
-
-        // STATE 3 OR 4: DISCERN WHETHER LINE LOST OR AT TRACK END
-        // e.g 50 counts of 30 millis = 1500 so this should trigger on 51st count.
-        else if(lost_line_count*MOTOR_UPDATE > LOST_LIMIT){ // check return to start first. If lost line has run consecutively for more than LOST LIMIT then you assume we have lost the line.
-          Serial.print(lost_line_count);
-
-          // If travelled less than 300mm in x direction, you haven't yet reached end of track -> turn around.
-          if(abs(kinematics.X_pos) < 300){ // if robot has moved less than 30cm along the track.
-            float desired_angle = kinematics.Theta + 3.14159; //  as the robot always goes right at the start (turning angle -ve), desired angle will be opp direction so add pi
-            speed_pid_left.reset();
-            speed_pid_right.reset();
-            while(kinematics.Theta < (desired_angle - 0.2)){ // rotate until you reach desired angle, minus constant added to correct error. remove when you can.
-              kinematics.update(); // update theta
-              motors.setMotorPower(-pwm_left, pwm_right); // rotate toward desired angle - only works as pwm doesn't update in while loop.
-            }
-            motors.setMotorPower(0, 0); // stop the robot
-            lost_line_count = 0; // reset the lost line count
-            state = 3; // return to lost line state
-          }
- 
-          else{ // if you've gone far enough then you must be at track end.
-          motors.setMotorPower(0, 0); // stop the robot
-          delay(2000); // stop for two seconds to show you recognise you are at track end.
-          state = 4; //lost line count is reset only when line found so return to start should remain the state indefinitely.
-          }
-        }
-
-        // STATE 0: INITIAL STATE, JOINING LINE.
-        else if(abs(e_line) < 0.07 && state == 0){ // CHANGE ME FOR DIFFERENT SURFACES using a higher threshold than before to see the line to prevent it thinking it finds the line before it does and thus getting in a spin about being lost or finding.
-          state = 0; // still joining line
-        }
-        
-        // STATE 1: ERROR HIGH ENOUGH TO INITIATE JOIN LINE
-        else if(state == 0){
-          state = 1; // join line turn initialise
-        }
-
-        // STATE 3: LINE LOST
-        else if(abs(e_line) < 0.06) { // if error drops low enough, you've lost the line 
-          state = 3; // line lost
-          lost_line_count = lost_line_count + 1; // increment by one for each time you run lost line consecutively.
-        }
-
-        // STATE 2: ON LINE
-        else{ // Assume you are on line
-          state = 2;
-          lost_line_count = 0; // robot found line up so reset lost line count.
-        }
-      
-        // print the current state
-        // Serial.print("CURRENT STATE: ");
-        // Serial.print(state);
-        // Serial.print("\n");
-    
-        // Update the time stamp.
-        motor_ts = millis();
-
-      }
-
-      return(state);
-    }
-
-    // STATE 0: INITIAL STATE.
-    void search_for_line(){
-      // if state = initial, run this
-      // go forward (error is low)
-      motors.setMotorPower(pwm_left,pwm_right);
-      digitalWrite(LED_PIN, false); // light off means not on the line.
-    }
-
-    // STATE 1: JOINING LINE
-    int join_line(){
-      digitalWrite(LED_PIN, true);
-      // line found, turn on the spot to line up.
-      while (abs(kinematics.Theta) < 40*(3.14/180)){ // TURN ON THE SPOT TILL at 40 degrees, Allows our robot to get lined up enough for on line arc to take over.
-          kinematics.update(); // need updated theta values.
-          motors.setMotorPower(25, -20); // turn right for left sensor sees first
-      }
-      return(2); // once out of while loop, assume on line.
-    }
-
-    // STATE 2: ON THE LINE
-    void on_line(){
-      // if state = on line, run this
-      digitalWrite(LED_PIN, true); // error is small enough that we regard motor as "on line" but not so small that it cannot see line at all. Light on indicates this.
-
-      // turn if not lined up, else go straight.
-      if ( abs(e_line) >0.20){ // SHARP TURNS - HIGHER ERROR!
-        if(e_line > 0){ //+ve = turn left
-          motors.setMotorPower( 0 , e_line*(105) ); // MAX ERROR ABOUT 0.5 IN PRACTICE, 0.5 X 100 = 50, MAX TURN SPEED
-        }  
-        else{
-          motors.setMotorPower( e_line*(-105), 0 ); // MAX ERROR ABOUT 0.5 IN PRACTICE, 0.5 X 100 = 50, MAX TURN SPEED
-        }
-      }
-      // GENTLE TURNS - LOWER ERROR! CHANGED TO ARCING RATHER THAN TURNING FOR SMOOTHNESS.
-      if ( abs(e_line) >0.1){ // regarding +- 0.1 as seeing the line but not lined up. uneven motor values used to allow for weaker right motor I have noticed.
-        if(e_line > 0){ // +ve error, arc left
-          motors.setMotorPower( 22 , e_line*(250) ); // arc right proportionally to error. // difference to offset more powerful Left motor while calibration not in.
-      }   // above, proportional wheel speed range will be 25 - 75 pwm
-        else{ // -ve error, arc right
-          motors.setMotorPower(e_line*(-250) , 23 ); // arc right proportionally to error. // difference to offset more powerful Left motor while calibration not in.
-      }   // above, proportional wheel speed range will be 25 - 75 pwm
-      
-      }
-      
-
-
-      else{ // straight on line
-      motors.setMotorPower(22,22); // Not using straight line pid as resetting the pid every time the line is lost/found creates jerky line following.
-      }
-    }
-    
-
-    // STATE 3: LINE HAS BEEN LOST
-    void lost_line(){
-      // if state = lost line, run this
-      // go straight until you trigger return to start.
-      motors.setMotorPower(pwm_left,pwm_right); // go forward slowly
-      digitalWrite(LED_PIN, false); // light off means not on the line.
-      bool buzz = false;
-      for(int i = 0; i < 2 ; i++){ // buzz if you lose the line!
-        if (buzz == false) {
-        digitalWrite(BUZZER_PIN, HIGH);
-        buzz = true;
-        }
-        else{
-        digitalWrite(BUZZER_PIN, LOW); 
-        }       
-      }      
-    }
-
-
-    // STATE 4: RETURN TO START
-    int return_to_start(){ 
-      digitalWrite(LED_PIN, true); 
-      kinematics.update(); // need to keep updating position each loop!
-
-      // calculate theta home -> angle to return to start in a straight line.
-      if(kinematics.Theta_Home == 0){
-
-        kinematics.Theta_Home = 3.14159 + atan(kinematics.Y_pos/kinematics.X_pos);
-        Serial.println(kinematics.Theta_Home);
-
-        if(kinematics.Theta_Home > 3.14){ // Conditions to keep theta home -180 < theta_home < 180
-          kinematics.Theta_Home = kinematics.Theta_Home - (2*3.14159);
-        }
-        if(kinematics.Theta_Home < -3.14){
-          kinematics.Theta_Home = kinematics.Theta_Home + (2*3.14159);
-        }
-      }
-
-      // if theta does not equal theta home (within some error), slowly rotate.
-      if (kinematics.Theta > kinematics.Theta_Home + 0.20){ // rotate until theta within about degrees of theta home (0.2 rads) - 12 degree leighway combats the overshoot.
-        motors.setMotorPower(21,-21); // slowly rotate in -ve direction
-        return(4); // keep spinnin'
-      }
-
-      if (kinematics.Theta < kinematics.Theta_Home - 0.20){ // rotate until theta within about degrees of theta home (0.2 rads) - 12 degree leighway combats the overshoot.
-      motors.setMotorPower(-21,22); // slowly rotate in +ve direction
-      return(4); // keep spinnin'
-      }
-
-      else{ // Robot lined up, now head home
-        speed_pid_left.reset();
-        speed_pid_right.reset();
-        unsigned long time_to_home = millis() + 15000; // takes about 15 seconds to get home
-        unsigned long current_time = millis();
-        while(current_time < time_to_home){
-          current_time = millis(); // update current time
-          update_state(4); // need to keep updating average speeds!
-          kinematics.update(); // need to keep updating position each loop!
-          motors.setMotorPower(pwm_left,pwm_right); // go in a straight line.
-        }
-        Serial.println("HOME!");
-        // Once you're home, stop.
-        motors.setMotorPower(0, 0);
-        return(5); // our home state
-      }
-
-
-      
-       
-    }
-
-    void home(){
-      digitalWrite(LED_PIN, false); 
-      motors.setMotorPower(0, 0);
-    }
-
-};
-
-
-
+# include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler. 
+# ifndef _FSM_H
+# define _FSM_H
+# define LED_PIN 13 
+# define BUZZER_PIN 6
+
+// Define our states, numbered as they sit in FSM_c's state table.
+# define STATE_INITIAL 0
+# define STATE_JOIN_LINE 1
+# define STATE_ON_LINE 2
+# define STATE_LOST_LINE 3
+# define STATE_RETURN_TO_START 4
+# define STATE_HOME 5
+# define STATE_TURN_AROUND 6 // lost the line before the track end, turning back onto it.
+# define NUMBER_OF_STATES 7
+
+// Define frequency of updates for our linesensors, PID and motors.
+# define LINE_SENSOR_UPDATE 10 // absolute minimum is 8 milliseconds here as that is about the max time the line sensor update function can take
+# define PID_UPDATE         10 // engine mode PIDs (micros() timing, anti-windup) are happy at this rate.
+# define MOTOR_UPDATE       30
+# define LOST_LIMIT  1500// Initiate return to start after 1.5 seconds of lost line.
+# define TRACK_END_DISTANCE 300 // mm along the track (x) before a lost line counts as the track end.
+# define TRACK_END_PAUSE 2000 // ms to stop at the track end to show we recognise it.
+# define JOIN_LINE_ANGLE (40*(3.14/180)) // turn on the spot to 40 degrees when joining the line.
+# define TURN_AROUND_SLACK 0.2 // stop the 180 degree turn this early (rad) to combat the overshoot.
+
+// Return to start sub-states, each step of return_to_start() resumes from whichever it is in.
+# define RETURN_PAUSE 0 // stopped at the track end for TRACK_END_PAUSE
+# define RETURN_DRIVE 1 // driving home under the go-to-goal controller (homing.h)
+// Speed PID engine settings, see PID_c::enable_engine().
+# define SPEED_PID_INT_LIMIT 50 // pwm
+# define SPEED_PID_BACKCALC 0.5
+# define SPEED_PID_D_ALPHA 0.3
+
+// Cascaded line following: an outer PID on the line position (mm) gives a turn rate demand (counts per ms, +ve = turn
+// left), the inner speed PIDs then track forward speed -/+ turn on each wheel.
+# define LINE_FORWARD_SPEED 0.6 // counts per ms on the line, twice the old fixed demand.
+# define LINE_CORNER_SLOWDOWN 0.5 // fraction of the forward speed shed with the line under an outer sensor.
+# define LINE_PID_KP 0.025 // turn demand per mm of line offset.
+# define LINE_PID_KI 0.0
+# define LINE_PID_KD 0.3 // per mm/ms of line movement.
+# define LINE_PID_TURN_LIMIT 0.6 // maximum turn demand, counts per ms.
+# define LINE_PID_D_ALPHA 0.5
+#ifndef LINE_FOLLOW_CASCADE
+# define LINE_FOLLOW_CASCADE 1 // 0 = the original three band steering on the line, kept for the lap time comparison.
+#endif
+
+# define CALIBRATION_SWEEP_TIME 4000 // ms spent turning left/right over the line to learn the sensor ranges.
+# define CALIBRATION_TURN_PWM 20 // no feedforward map yet when the line sensors are first calibrated, so a plain pwm.
+
+// Motor characterisation, see characterise_motors(). Each map point spins on the spot both ways.
+# define CHARACTERISE_SETTLE_TIME 250 // ms at a new pwm before measuring.
+# define CHARACTERISE_MEASURE_TIME 250 // ms of counts per measurement.
+
+// Open loop speeds (counts per ms, through the feedforward map) for the turn on the spot.
+# define JOIN_LINE_LEFT_SPEED 0.34 // joining the line: turn right for the left sensor sees first.
+# define JOIN_LINE_RIGHT_SPEED -0.24
+
+# define MEASURE_CYCLES_CALLS 200 // calls of each hot path timed by measure_cycles().
+
+
+
+# include "linesensor.h"
+# include "kinematics.h"
+# include "pid.h"
+# include "velocity.h"
+# include "scheduler.h"
+# include "statemachine.h"
+# include "telemetry.h"
+# include "recorder.h"
+# include "feedforward.h"
+# include "path.h"
+# include "homing.h"
+# include "estimator.h"
+
+LineSensor_c linesensors;
+Kinematics_c kinematics;
+
+// two instances of PID class, one for each wheel
+PID_c speed_pid_left; 
+PID_c speed_pid_right;
+// and the outer line position PID feeding them on the line.
+PID_c line_pid;
+
+
+// Class for our Finite State Machine
+class FSM_c {
+  public:
+
+    // need these bad boys as whole class variables.
+    Scheduler_c scheduler; // runs the sensor, odometry, PID and state tasks at fixed rates.
+    StateMachine_c machine; // runs the state and transition tables below.
+    float e_line = 0.0; // initial value for or error from line variable
+
+    // Resumable sub-states. No state handler waits in a loop: each call does one step and returns.
+    float turn_around_target = 0.0; // heading to turn to.
+    byte return_phase = RETURN_PAUSE; // which part of the return to start we're in.
+    unsigned long return_phase_ts = 0; // millis() when the current return phase started.
+    bool home_reached = false; // return_to_start() is done.
+
+    //**** PID variables ****
+    float measured_left_speed; // wheel speed estimate, left (counts per ms)
+    float measured_right_speed; // wheel speed estimate, right
+
+    VelocityEstimator_c velocity_left; // blends edge period and count difference speeds, see velocity.h
+    VelocityEstimator_c velocity_right;
+    float demand = 0.3; // global demand speed variable, encoder counts per ms
+    float turn_demand = 0.0; // line PID output, counts per ms, +ve = turn left.
+    float demand_left = 0.3; // per wheel speed demands fed to the speed PIDs.
+    float demand_right = 0.3;
+    float pwm_left; // our fixed speed values.
+    float pwm_right;
+    //***********************
+    
+
+    // Constructor, must exist.
+    FSM_c() {
+    }
+
+    // Sweep the robot left and right on the spot over the line so every sensor sees both the line and the
+    // background, then store the learnt table. Blocking - call it from setup() only. Returns true if calibrated.
+    bool calibrate_line_sensors(){
+      unsigned int frame[NUMBER_OF_LS_PINS];
+      linesensors.reset_calibration();
+      unsigned long start_ts = millis();
+      unsigned long elapsed_t = 0;
+      while(elapsed_t < CALIBRATION_SWEEP_TIME){
+        // quarter of the time turning left, half right, then back to the middle.
+        if(elapsed_t < CALIBRATION_SWEEP_TIME/4 || elapsed_t >= 3*CALIBRATION_SWEEP_TIME/4){
+          motors.setMotorPower(-CALIBRATION_TURN_PWM, CALIBRATION_TURN_PWM);
+        }
+        else{
+          motors.setMotorPower(CALIBRATION_TURN_PWM, -CALIBRATION_TURN_PWM);
+        }
+        if(linesensors.next_frame(frame)){
+          linesensors.update_calibration(frame);
+        }
+        elapsed_t = millis() - start_ts;
+      }
+      motors.stop();
+
+      if(linesensors.finish_calibration()){
+        linesensors.save_calibration();
+        return(true);
+      }
+      return(false); // keep using the uncalibrated thresholds.
+    }
+
+    // Learn the feedforward map: at each map point, spin on the spot one way then the other so every motor runs in
+    // both directions without the robot going anywhere, and measure each wheel's steady speed. Blocking - call it
+    // from setup() only. Returns true if a usable map was learnt and saved.
+    bool characterise_motors(){
+      for(byte i = 0; i < FF_POINTS; i++){
+        float pwm = Feedforward_c::point_pwm(i);
+        for(byte reverse_left = 0; reverse_left < 2; reverse_left++){
+          float sign = reverse_left ? -1 : 1;
+          motors.setMotorPower(sign*pwm, -sign*pwm);
+          delay(CHARACTERISE_SETTLE_TIME);
+          EncoderSnapshot_s start = encoder_snapshot();
+          delay(CHARACTERISE_MEASURE_TIME);
+          EncoderSnapshot_s end = encoder_snapshot();
+          float ms = (end.ts_us - start.ts_us) * 0.001;
+          feedforward.record(FF_LEFT, reverse_left, i, (end.left - start.left) / ms);
+          feedforward.record(FF_RIGHT, !reverse_left, i, (end.right - start.right) / ms);
+        }
+      }
+      motors.stop();
+
+      if(feedforward.finish()){
+        feedforward.save();
+        return(true);
+      }
+      return(false); // keep using the nominal map.
+    }
+
+    // Run both wheels open loop at these speeds (counts per ms) through the feedforward map.
+    void drive_speeds(float left_speed, float right_speed){
+      motors.setMotorPower(feedforward.pwm_for_speed(FF_LEFT, left_speed), feedforward.pwm_for_speed(FF_RIGHT, right_speed));
+    }
+
+    // Time the real_t hot paths on the robot (stopped): the line position maths, a speed PID update and an odometry
+    // update, in cycles per call, on scratch copies so the robot's own state is left alone. Flash once with
+    // USE_FIXED_POINT 1 and once with 0 to compare (the profiler's two micros() reads per call are included too).
+    // Then the trig tables against libm, the encoder ISR body, and the share of the CPU the odometry takes at its rate.
+    void measure_cycles(){
+      LineSensor_c scratch_sensors;
+      const unsigned int frame[NUMBER_OF_LS_PINS] = {620, 1450, 2780, 1130, 540};
+      PID_c scratch_pid;
+      scratch_pid.initialise(100, 0.5, -100);
+      scratch_pid.enable_engine(MAX_PWM, SPEED_PID_INT_LIMIT, SPEED_PID_BACKCALC, SPEED_PID_D_ALPHA);
+      Kinematics_c scratch_kinematics;
+      EncoderSnapshot_s encoders = encoder_snapshot();
+
+      unsigned long start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        scratch_sensors.process_LS(frame);
+      }
+      unsigned long line_us = micros() - start_us;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        scratch_pid.update(0.5, 0.4 + (i & 7) * 0.01);
+      }
+      unsigned long pid_us = micros() - start_us;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        encoders.left = encoders.left + 3;
+        encoders.right = encoders.right + 2 + (i & 1);
+        scratch_kinematics.update(encoders);
+      }
+      unsigned long kinematics_us = micros() - start_us;
+
+      // sin + cos from the tables (trig.h) against libm, summed into volatiles so the calls can't be dropped.
+      volatile int32_t table_sum = 0;
+      volatile float libm_sum = 0;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        fixed_t angle = fixed_t::from_raw((int32_t)i * 1031);
+        table_sum = table_sum + trig_sin(angle).raw + trig_cos(angle).raw;
+      }
+      unsigned long table_us = micros() - start_us;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        float angle = i * 0.0157;
+        libm_sum = libm_sum + sin(angle) + cos(angle);
+      }
+      unsigned long libm_us = micros() - start_us;
+
+      // the encoder ISR body (encoders.h) on scratch state: pins that step every call, then pins that never move.
+      volatile byte scratch_state = 0;
+      volatile long scratch_count = 0;
+      volatile EncoderEdge_s scratch_edge;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        // XOR pin i & 1 and B pin ((i + 1) >> 1) & 1 walk round the quadrature cycle, one edge per call.
+        encoder_decode(scratch_state, scratch_count, scratch_edge, i & 1, ((i + 1) >> 1) & 1);
+      }
+      unsigned long edge_us = micros() - start_us;
+      start_us = micros();
+      for(int i = 0; i < MEASURE_CYCLES_CALLS; i++){
+        encoder_decode(scratch_state, scratch_count, scratch_edge, 0, 0);
+      }
+      unsigned long still_us = micros() - start_us;
+
+      float cycles_per_us = F_CPU / 1000000UL;
+      Serial.print(USE_FIXED_POINT ? "fixed point" : "float");
+      Serial.print(" cycles/call, line sensor: ");
+      Serial.print((float)line_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print(", pid: ");
+      Serial.print((float)pid_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print(", kinematics: ");
+      Serial.println((float)kinematics_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print("sin+cos cycles, tables: ");
+      Serial.print((float)table_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print(", libm: ");
+      Serial.println((float)libm_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print("encoder ISR body cycles, counted edge: ");
+      Serial.print((float)edge_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      Serial.print(", no edge: ");
+      Serial.println((float)still_us * cycles_per_us / MEASURE_CYCLES_CALLS, 0);
+      // what the odometry task costs at the rate it runs, and what it would cost at 10ms.
+      Serial.print("odometry CPU every ");
+      Serial.print(ODOMETRY_PERIOD_US);
+      Serial.print("us: ");
+      Serial.print(100.0 * kinematics_us / MEASURE_CYCLES_CALLS / ODOMETRY_PERIOD_US, 2);
+      Serial.print("%, every 10000us: ");
+      Serial.print(100.0 * kinematics_us / MEASURE_CYCLES_CALLS / 10000, 2);
+      Serial.println("%");
+    }
+
+    // Is the line under the sensors? Decided by the line position estimator's confidence.
+    bool line_seen(){
+      return(linesensors.line_confidence >= LS_MIN_CONFIDENCE);
+    }
+
+    // This function calls updates for: Linesensors, PID, and Robot State
+    void update(){
+      // the scheduler runs whichever of the sensor, odometry, PID and state tasks are due.
+      scheduler.run();
+    }
+
+    // Run the current state's behaviour, call every loop().
+    void step(){
+      machine.step();
+    }
+
+    // Enter the initial state, register the periodic tasks and start their clocks. Call at the end of setup().
+    void initialise(){
+      // whatever the wheels did during calibration isn't part of the run: start odometry and speeds from here.
+      EncoderSnapshot_s encoders = encoder_snapshot();
+      kinematics.previous_count_wheel_left = encoders.left;
+      kinematics.previous_count_wheel_right = encoders.right;
+      velocity_left.count_last = encoders.left;
+      velocity_left.ts_last = encoders.ts_us;
+      velocity_right.count_last = encoders.right;
+      velocity_right.ts_last = encoders.ts_us;
+      kinematics.take_motion(); // nothing moved yet as far as the estimator is concerned.
+      estimator.reset();
+      homing.reset(); // the trail home starts here.
+
+      machine.initialise(state_table, NUMBER_OF_STATES, transition_table, NUMBER_OF_TRANSITIONS, this, STATE_INITIAL);
+
+      // priority: odometry first so everything else sees the latest pose, then sensing, control, and state.
+      scheduler.add_task("odometry", run_odometry_task, this, ODOMETRY_PERIOD_US, 4);
+      scheduler.add_task("sensors", run_sensor_task, this, LINE_SENSOR_UPDATE*1000UL, 3);
+      scheduler.add_task("pid", run_pid_task, this, PID_UPDATE*1000UL, 2);
+      scheduler.add_task("state", run_state_task, this, MOTOR_UPDATE*1000UL, 1);
+      #if TELEMETRY_ENABLED
+      scheduler.add_task("telemetry", run_telemetry_task, this, TELEMETRY_PERIOD_US, 0);
+      #endif
+      #if RECORDER_ENABLED
+      scheduler.add_task("recorder", run_recorder_task, this, RECORDER_PERIOD_MS*1000UL, 0, 5000); // offset from the 10ms tasks.
+      #endif
+      scheduler.start();
+    }
+
+    // Scheduler entry points, the context is the FSM.
+    static void run_odometry_task(void * fsm){ ((FSM_c *)fsm)->odometry_task(); }
+    static void run_sensor_task(void * fsm){ ((FSM_c *)fsm)->sensor_task(); }
+    static void run_pid_task(void * fsm){ ((FSM_c *)fsm)->pid_task(); }
+    static void run_state_task(void * fsm){ ((FSM_c *)fsm)->state_task(); }
+    #if TELEMETRY_ENABLED
+    static void run_telemetry_task(void * fsm){ ((FSM_c *)fsm)->telemetry_task(); }
+    #endif
+    #if RECORDER_ENABLED
+    static void run_recorder_task(void * fsm){ ((FSM_c *)fsm)->recorder_task(); }
+    #endif
+
+    // Odometry task: integrate the latest encoder counts.
+    void odometry_task(){
+      kinematics.update();
+    }
+
+    // Linesensor task.
+    void sensor_task(){
+      // run our line sensor read function
+      #if LS_ACQUISITION_ASYNC
+      // never wait on the sensors - if the background frame isn't finished yet, keep the last e_line.
+      if(linesensors.reading_ready){
+        e_line = linesensors.read_async();
+      }
+      #else
+      e_line = linesensors.activate_LS();
+      #endif
+    }
+
+    // PID task: calculating speed estimate and updating the speed controllers.
+    void pid_task(){
+      // read the encoders once for this tick, everything below works from the same snapshot.
+      EncoderSnapshot_s encoders = encoder_snapshot();
+
+      // fresh speed per wheel from the snapshot, no low pass filter needed (and no lag from one).
+      measured_left_speed = velocity_left.update(encoders.left, encoders.left_edge, encoders.ts_us);
+      measured_right_speed = velocity_right.update(encoders.right, encoders.right_edge, encoders.ts_us);
+
+      // the pose the path and the way home work from: odometry corrected by the line when the estimator is in.
+      #if ESTIMATOR_ENABLED
+      estimator.predict(kinematics.take_motion());
+      bool straight = false;
+      bool corner = false;
+      #if PATH_ENABLED
+      straight = path.on_straight();
+      corner = path.in_corner();
+      #endif
+      bool centred = machine.current == STATE_ON_LINE && line_seen() && abs(linesensors.line_position_mm) < ESTIMATOR_CENTRED_MM;
+      estimator.observe(straight, corner, centred, linesensors.line_position_mm);
+      float x = estimator.X_pos;
+      float y = estimator.Y_pos;
+      float theta = estimator.Theta;
+      #else
+      float x = kinematics.X_pos;
+      float y = kinematics.Y_pos;
+      float theta = kinematics.Theta;
+      #endif
+
+      #if PATH_ENABLED
+      // where we are along the path, and the next sample of it on the mapping run.
+      path.update(encoders, x, y, theta, linesensors.line_position_mm, line_seen());
+      #endif
+      if(machine.current != STATE_RETURN_TO_START && machine.current != STATE_HOME){
+        homing.record(x, y); // the way out, for retracing it home.
+      }
+
+      // On the line the speed demands come from the line PID, otherwise both wheels drive at the demand speed.
+      if(machine.current == STATE_ON_LINE){
+        line_following_demands();
+      }
+      else if(machine.current == STATE_RETURN_TO_START){
+        // on the way home the go-to-goal controller steers, both demands are 0 until it starts and once it's there.
+        homing.update(x, y, theta);
+        demand_left = homing.forward_demand - homing.turn_demand;
+        demand_right = homing.forward_demand + homing.turn_demand;
+      }
+      else if(machine.current == STATE_TURN_AROUND){
+        // spinning on the spot to the left: the left wheel's speed PID has to see a backwards demand, so its
+        // feedback still has the right sign.
+        demand_left = -demand;
+        demand_right = demand;
+      }
+      else{
+        demand_left = demand;
+        demand_right = demand;
+      }
+
+      // feedforward gets each wheel close to its demand, the speed PIDs trim out the rest. It goes in as the PIDs'
+      // offset so the output clamp and the anti-windup see the whole pwm.
+      #if FEEDFORWARD_ENABLED
+      float ff_left = feedforward.pwm_for_speed(FF_LEFT, demand_left);
+      float ff_right = feedforward.pwm_for_speed(FF_RIGHT, demand_right);
+      pwm_left = speed_pid_left.update(demand_left, measured_left_speed, ff_left);
+      pwm_right = speed_pid_right.update(demand_right, measured_right_speed, ff_right);
+      #else
+      pwm_left = speed_pid_left.update(demand_left, measured_left_speed);
+      pwm_right = speed_pid_right.update(demand_right, measured_right_speed);
+      #endif
+
+      // Serial.print("measured left speed: ");
+      // Serial.println(measured_left_speed);
+      // Serial.print("measured right speed: ");
+      // Serial.println(measured_right_speed);
+      // Serial.print("demand: ");
+      // Serial.println(demand);
+    }
+
+    #if TELEMETRY_ENABLED
+    // Telemetry task: snapshot everything worth logging into the telemetry buffer, loop() streams it out.
+    void telemetry_task(){
+      if(!telemetry.streaming){
+        return;
+      }
+      TelemetrySample_s * sample = telemetry.claim();
+      if(!sample){
+        return; // buffer full, counted as dropped.
+      }
+      EncoderSnapshot_s encoders = encoder_snapshot();
+      sample->ts_us = encoders.ts_us;
+      for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+        sample->sensor_us[i] = linesensors.last_raw_read[i];
+      }
+      sample->e_line = e_line * TELEMETRY_E_LINE_SCALE;
+      sample->count_left = encoders.left;
+      sample->count_right = encoders.right;
+      sample->x = kinematics.X_pos * TELEMETRY_POSITION_SCALE;
+      sample->y = kinematics.Y_pos * TELEMETRY_POSITION_SCALE;
+      sample->theta = kinematics.Theta * TELEMETRY_THETA_SCALE;
+      sample->pwm_left = constrain(pwm_left, -MAX_PWM, MAX_PWM);
+      sample->pwm_right = constrain(pwm_right, -MAX_PWM, MAX_PWM);
+      sample->state = machine.current;
+      telemetry.commit();
+    }
+    #endif
+
+    #if RECORDER_ENABLED
+    // Recorder task: add the pose, e_line and state to the run recording (only queued, loop() writes the EEPROM).
+    void recorder_task(){
+      recorder.sample(kinematics.X_pos, kinematics.Y_pos, kinematics.Theta, e_line, machine.current);
+    }
+    #endif
+
+    // Robot State task: take whichever transition out of the current state is due.
+    void state_task(){
+      machine.evaluate();
+    }
+
+    // **** Transition guards, see transition_table ****
+    bool line_found(){
+      return(line_seen());
+    }
+
+    bool line_missing(){
+      return(!line_seen());
+    }
+
+    // e.g 1.5 seconds off the line before we assume it's really gone.
+    bool lost_too_long(){
+      return(machine.time_in_state() > LOST_LIMIT);
+    }
+
+    // If travelled less than 300mm in x direction, you haven't yet reached end of track -> turn around.
+    bool lost_before_track_end(){
+      return(lost_too_long() && abs(kinematics.X_pos) < TRACK_END_DISTANCE);
+    }
+
+    bool lined_up(){
+      return(abs(kinematics.Theta) >= JOIN_LINE_ANGLE);
+    }
+
+    bool turned_around(){
+      return(angle_difference(turn_around_target, kinematics.Theta) <= 0);
+    }
+
+    bool at_home(){
+      return(home_reached);
+    }
+    //***********************
+
+    // STATE 0: INITIAL STATE.
+    void search_for_line(){
+      // if state = initial, run this
+      // go forward (error is low)
+      motors.setMotorPower(pwm_left,pwm_right);
+      digitalWrite(LED_PIN, false); // light off means not on the line.
+    }
+
+    // STATE 1: JOINING LINE
+    void start_joining(){
+      #if RECORDER_ENABLED
+      recorder.start(); // the run starts when we find the line, so powering up on the bench doesn't overwrite the last run.
+      #endif
+    }
+
+    void join_line(){
+      digitalWrite(LED_PIN, true);
+      // line found, turn on the spot to line up.
+      if (!lined_up()){ // TURN ON THE SPOT TILL at 40 degrees, Allows our robot to get lined up enough for on line arc to take over.
+          drive_speeds(JOIN_LINE_LEFT_SPEED, JOIN_LINE_RIGHT_SPEED); // turn right for left sensor sees first
+          return;
+      }
+      motors.setMotorPower(pwm_left, pwm_right); // once lined up, head off until the state task moves us on line.
+    }
+
+    // Smallest signed angle from -> to, wrapped to +-pi.
+    float angle_difference(float to, float from){
+      float difference = to - from;
+      while(difference > 3.14159){
+        difference = difference - 2*3.14159;
+      }
+      while(difference < -3.14159){
+        difference = difference + 2*3.14159;
+      }
+      return(difference);
+    }
+
+    // Outer loop of the line following cascade: line position -> turn demand -> per wheel speed demands.
+    void line_following_demands(){
+      // demand 0, measurement -position: error is the position and the derivative acts on the line's movement.
+      turn_demand = line_pid.update(0, -linesensors.line_position_mm);
+
+      // ease off in corners, the further the line is from the centre the slower we go.
+      float offset = abs(linesensors.line_position_mm) / (2*LS_PITCH_MM);
+      if(offset > 1){
+        offset = 1;
+      }
+      float forward = LINE_FORWARD_SPEED;
+      #if PATH_ENABLED
+      if(path.replaying){
+        forward = path.speed(); // sprint on the straights, brake for the corners.
+      }
+      #endif
+      forward = forward * (1 - LINE_CORNER_SLOWDOWN*offset);
+
+      demand_left = forward - turn_demand;
+      demand_right = forward + turn_demand;
+    }
+
+    // STATE 2: ON THE LINE
+    void start_line_following(){
+      line_pid.reset(); // don't carry the line PID's history over from the last time on the line.
+      #if PATH_ENABLED
+      path.start(encoder_snapshot(), kinematics.Theta); // the path starts the first time we're on the line.
+      #endif
+    }
+
+    void on_line(){
+      // if state = on line, run this
+      digitalWrite(LED_PIN, true); // error is small enough that we regard motor as "on line" but not so small that it cannot see line at all. Light on indicates this.
+
+      #if LINE_FOLLOW_CASCADE
+      // steering comes from the line PID / speed PID cascade, worked out in pid_task().
+      motors.setMotorPower(pwm_left, pwm_right);
+      #else
+      // the original steering, fixed pwms in three bands of e_line. The pivot is overwritten by the arc just
+      // below it (no else), as it always was.
+      if ( abs(e_line) >0.20){ // SHARP TURNS - HIGHER ERROR!
+        if(e_line > 0){ //+ve = turn left
+          motors.setMotorPower( 0 , e_line*(105) );
+        }
+        else{
+          motors.setMotorPower( e_line*(-105), 0 );
+        }
+      }
+      if ( abs(e_line) >0.1){ // GENTLE TURNS - LOWER ERROR, arcing rather than turning for smoothness.
+        if(e_line > 0){ // +ve error, arc left
+          motors.setMotorPower( 22 , e_line*(250) );
+        }
+        else{ // -ve error, arc right
+          motors.setMotorPower(e_line*(-250) , 23 );
+        }
+      }
+      else{ // straight on line
+        motors.setMotorPower(22,22);
+      }
+      #endif
+    }
+    
+
+    // STATE 3: LINE HAS BEEN LOST
+    void lost_line(){
+      // if state = lost line, run this
+      // go straight until you trigger return to start.
+      motors.setMotorPower(pwm_left,pwm_right); // go forward slowly
+      digitalWrite(LED_PIN, false); // light off means not on the line.
+      bool buzz = false;
+      for(int i = 0; i < 2 ; i++){ // buzz if you lose the line!
+        if (buzz == false) {
+        digitalWrite(BUZZER_PIN, HIGH);
+        buzz = true;
+        }
+        else{
+        digitalWrite(BUZZER_PIN, LOW); 
+        }       
+      }      
+    }
+
+
+    // STATE 6: TURNING AROUND
+    void start_turn_around(){
+      // as the robot always goes right at the start (turning angle -ve), desired angle will be opp direction so add pi,
+      // minus constant added to correct error.
+      turn_around_target = kinematics.Theta + 3.14159 - TURN_AROUND_SLACK;
+      #if PATH_ENABLED
+      path.abandon(); // heading back the way we came, this run doesn't follow the path any more.
+      #endif
+      speed_pid_left.reset();
+      speed_pid_right.reset();
+    }
+
+    void turn_around(){
+      // rotate until you reach the desired angle, see turned_around(). The demands in pid_task() spin the wheels
+      // opposite ways.
+      motors.setMotorPower(pwm_left, pwm_right); // rotate toward desired angle
+    }
+
+    void stop(){
+      motors.setMotorPower(0, 0); // stop the robot
+    }
+
+
+    // STATE 4: RETURN TO START
+    void start_return_to_start(){
+      motors.setMotorPower(0, 0); // stop the robot
+      #if PATH_ENABLED
+      path.finish(); // the end of the track: on the mapping run, store the path for the next runs.
+      #endif
+      return_phase = RETURN_PAUSE; // stop for two seconds first to show you recognise you are at track end.
+      return_phase_ts = millis();
+      home_reached = false;
+    }
+
+    void return_to_start(){ 
+      if(home_reached){
+        return;
+      }
+      digitalWrite(LED_PIN, true); 
+
+      // stop for two seconds at the track end first.
+      if(return_phase == RETURN_PAUSE){
+        motors.setMotorPower(0, 0);
+        if(millis() - return_phase_ts < TRACK_END_PAUSE){
+          return;
+        }
+        speed_pid_left.reset();
+        speed_pid_right.reset();
+        homing.start();
+        return_phase = RETURN_DRIVE;
+      }
+
+      // the go-to-goal controller sets the speed demands in pid_task() until we're home (or it gives up).
+      if(homing.active){
+        motors.setMotorPower(pwm_left, pwm_right);
+        return;
+      }
+      motors.setMotorPower(0, 0);
+      home_reached = true; // the state task takes us home.
+    }
+
+    // STATE 5: HOME
+    void arrive_home(){
+      Serial.println("HOME!");
+      homing.report();
+      #if ESTIMATOR_ENABLED
+      estimator.report();
+      #endif
+      // Once you're home, stop.
+      motors.setMotorPower(0, 0);
+      #if RECORDER_ENABLED
+      recorder.stop();
+      #endif
+    }
+
+    void home(){
+      digitalWrite(LED_PIN, false); 
+      motors.setMotorPower(0, 0);
+    }
+
+
+    // **** State machine tables ****
+    // Entry points for the state machine, the context is the FSM.
+    static void run_search_for_line(void * fsm){ ((FSM_c *)fsm)->search_for_line(); }
+    static void run_start_joining(void * fsm){ ((FSM_c *)fsm)->start_joining(); }
+    static void run_join_line(void * fsm){ ((FSM_c *)fsm)->join_line(); }
+    static void run_start_line_following(void * fsm){ ((FSM_c *)fsm)->start_line_following(); }
+    static void run_on_line(void * fsm){ ((FSM_c *)fsm)->on_line(); }
+    static void run_lost_line(void * fsm){ ((FSM_c *)fsm)->lost_line(); }
+    static void run_start_return_to_start(void * fsm){ ((FSM_c *)fsm)->start_return_to_start(); }
+    static void run_return_to_start(void * fsm){ ((FSM_c *)fsm)->return_to_start(); }
+    static void run_arrive_home(void * fsm){ ((FSM_c *)fsm)->arrive_home(); }
+    static void run_home(void * fsm){ ((FSM_c *)fsm)->home(); }
+    static void run_start_turn_around(void * fsm){ ((FSM_c *)fsm)->start_turn_around(); }
+    static void run_turn_around(void * fsm){ ((FSM_c *)fsm)->turn_around(); }
+    static void run_stop(void * fsm){ ((FSM_c *)fsm)->stop(); }
+
+    static bool guard_line_found(void * fsm){ return(((FSM_c *)fsm)->line_found()); }
+    static bool guard_line_missing(void * fsm){ return(((FSM_c *)fsm)->line_missing()); }
+    static bool guard_lost_before_track_end(void * fsm){ return(((FSM_c *)fsm)->lost_before_track_end()); }
+    static bool guard_lost_too_long(void * fsm){ return(((FSM_c *)fsm)->lost_too_long()); }
+    static bool guard_lined_up(void * fsm){ return(((FSM_c *)fsm)->lined_up()); }
+    static bool guard_turned_around(void * fsm){ return(((FSM_c *)fsm)->turned_around()); }
+    static bool guard_at_home(void * fsm){ return(((FSM_c *)fsm)->at_home()); }
+
+    // in STATE_ number order: name, entry, step, exit.
+    static constexpr State_s state_table[NUMBER_OF_STATES] = {
+      {"initial", 0, run_search_for_line, 0},
+      {"join_line", run_start_joining, run_join_line, 0},
+      {"on_line", run_start_line_following, run_on_line, 0},
+      {"lost_line", 0, run_lost_line, 0},
+      {"return_to_start", run_start_return_to_start, run_return_to_start, 0},
+      {"home", run_arrive_home, run_home, 0},
+      {"turn_around", run_start_turn_around, run_turn_around, run_stop}
+    };
+
+    // from, to, guard. Grouped by the state they leave, the first passing guard wins.
+    static constexpr Transition_s transition_table[] = {
+      {STATE_INITIAL, STATE_JOIN_LINE, guard_line_found}, // keep searching until the estimator is confident it sees the line.
+      {STATE_JOIN_LINE, STATE_ON_LINE, guard_lined_up},
+      {STATE_ON_LINE, STATE_LOST_LINE, guard_line_missing}, // if confidence drops low enough, you've lost the line
+      {STATE_LOST_LINE, STATE_TURN_AROUND, guard_lost_before_track_end}, // check turn around / return to start first.
+      {STATE_LOST_LINE, STATE_RETURN_TO_START, guard_lost_too_long}, // if you've gone far enough then you must be at track end.
+      {STATE_LOST_LINE, STATE_ON_LINE, guard_line_found}, // robot found line again.
+      {STATE_TURN_AROUND, STATE_LOST_LINE, guard_turned_around}, // then carry on looking for the line.
+      {STATE_RETURN_TO_START, STATE_HOME, guard_at_home} // and once home, stay home.
+    };
+    static constexpr byte NUMBER_OF_TRANSITIONS = sizeof(transition_table) / sizeof(transition_table[0]);
+    //***********************
+};
+
+// the tables need a definition outside the class as well (they're used by address).
+constexpr State_s FSM_c::state_table[];
+constexpr Transition_s FSM_c::transition_table[];
+
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,176 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _HOMING_H
+#define _HOMING_H
+
+# include "trig.h"
+
+// Return to start: a closed loop go-to-goal controller on the odometry pose. It steers for the goal (turning on the
+// spot first if it's facing away), slows down on the approach and stops when the robot is within HOMING_ARRIVE_MM of
+// the start. With HOMING_RETRACE set it goes back the way it came: through the outbound trail of waypoints in reverse,
+// then to the start.
+# define HOMING_RETRACE 0 // 1 = retrace the outbound path, 0 = straight to the start.
+
+// Controller, speeds in counts per ms like the speed PIDs' demands.
+# define HOMING_SPEED 0.8 // forward speed on the way home.
+# define HOMING_TURN_GAIN 1.0 // turn demand per radian of heading error.
+# define HOMING_TURN_LIMIT 0.5 // largest turn demand.
+# define HOMING_TURN_IN_PLACE 1.0 // rad: with a heading error this big or more, turn on the spot.
+# define HOMING_APPROACH_GAIN 0.01 // forward speed per mm from the start, so it slows down for the last ~80mm.
+# define HOMING_MIN_SPEED 0.1 // never slower than this while driving, the wheels would stall short of the start.
+# define HOMING_ARRIVE_MM 10.0 // home when this close to the start.
+# define HOMING_TIMEOUT 30000 // ms, give up and stop wherever we are.
+
+// Outbound trail.
+# define HOMING_WAYPOINTS 32
+# define HOMING_WAYPOINT_SPACING_MM 50.0 // a waypoint every 50mm to start with, doubling each time the trail is full.
+# define HOMING_WAYPOINT_RADIUS_MM 40.0 // head for the next waypoint once this close to the current one.
+
+
+// Class for the outbound trail and the go-to-goal controller.
+class Homing_c {
+  public:
+    bool retrace = HOMING_RETRACE;
+
+    // outbound trail, mm. Waypoint 0 is the start.
+    int waypoint_x[HOMING_WAYPOINTS];
+    int waypoint_y[HOMING_WAYPOINTS];
+    byte waypoint_count = 0;
+    float spacing_mm = HOMING_WAYPOINT_SPACING_MM;
+
+    // the way home
+    bool active = false;
+    bool arrived = false; // within HOMING_ARRIVE_MM of the start.
+    bool timed_out = false;
+    int goal = 0; // trail index of the waypoint we're heading for, -1 = the start itself.
+    unsigned long start_ts = 0; // millis() when we set off home.
+    unsigned long time_ms = 0; // how long it took.
+    float distance_mm = 0; // from the start, latest.
+    float forward_demand = 0; // latest demands for the speed PIDs.
+    float turn_demand = 0;
+
+    // Constructor, must exist.
+    Homing_c() {
+
+    }
+
+    // **** Outbound trail ****
+    // Start the trail at the start pose. Call at the start of the run.
+    void reset(){
+      waypoint_x[0] = 0;
+      waypoint_y[0] = 0;
+      waypoint_count = 1;
+      spacing_mm = HOMING_WAYPOINT_SPACING_MM;
+      active = false;
+      arrived = false;
+      timed_out = false;
+    }
+
+    // Add the pose to the trail if we've moved far enough from the last waypoint. Call every control tick on the way
+    // out. A full trail keeps every other waypoint and doubles the spacing, so the whole way out always fits.
+    void record(float x, float y){
+      float dx = x - waypoint_x[waypoint_count - 1];
+      float dy = y - waypoint_y[waypoint_count - 1];
+      if(dx * dx + dy * dy < spacing_mm * spacing_mm){
+        return;
+      }
+      if(waypoint_count == HOMING_WAYPOINTS){
+        for(byte i = 1; i < HOMING_WAYPOINTS / 2; i++){
+          waypoint_x[i] = waypoint_x[2 * i];
+          waypoint_y[i] = waypoint_y[2 * i];
+        }
+        waypoint_count = HOMING_WAYPOINTS / 2;
+        spacing_mm = spacing_mm * 2;
+      }
+      waypoint_x[waypoint_count] = x;
+      waypoint_y[waypoint_count] = y;
+      waypoint_count = waypoint_count + 1;
+    }
+    //*********************
+
+    // **** Going home ****
+    void start(){
+      active = true;
+      arrived = false;
+      timed_out = false;
+      start_ts = millis();
+      // retracing starts from the newest waypoint, otherwise straight for the start.
+      goal = retrace ? waypoint_count - 1 : -1;
+    }
+
+    // Work out the speed demands from the pose. Call every control tick on the way home.
+    void update(float x, float y, float theta){
+      if(!active){
+        return;
+      }
+      distance_mm = sqrt(x * x + y * y);
+      if(distance_mm < HOMING_ARRIVE_MM || millis() - start_ts > HOMING_TIMEOUT){
+        arrived = distance_mm < HOMING_ARRIVE_MM;
+        timed_out = !arrived;
+        time_ms = millis() - start_ts;
+        active = false;
+        forward_demand = 0;
+        turn_demand = 0;
+        return;
+      }
+
+      // next waypoint once we're close enough to this one. Waypoint 0 is the start, which is the final goal anyway.
+      float goal_x = 0;
+      float goal_y = 0;
+      while(goal > 0){
+        goal_x = waypoint_x[goal];
+        goal_y = waypoint_y[goal];
+        float dx = goal_x - x;
+        float dy = goal_y - y;
+        if(dx * dx + dy * dy > HOMING_WAYPOINT_RADIUS_MM * HOMING_WAYPOINT_RADIUS_MM){
+          break;
+        }
+        goal = goal - 1;
+      }
+      if(goal <= 0){
+        goal_x = 0;
+        goal_y = 0;
+      }
+
+      // heading error to the goal, then turn towards it and drive when roughly facing it.
+      float error = trig_atan2(goal_y - y, goal_x - x) - theta;
+      while(error > 3.14159){
+        error = error - 2*3.14159;
+      }
+      while(error < -3.14159){
+        error = error + 2*3.14159;
+      }
+      turn_demand = constrain(HOMING_TURN_GAIN * error, -HOMING_TURN_LIMIT, HOMING_TURN_LIMIT);
+      float facing = 1 - abs(error) / HOMING_TURN_IN_PLACE;
+      if(facing <= 0){
+        forward_demand = 0;
+        return;
+      }
+      float speed = HOMING_SPEED;
+      if(goal <= 0){
+        speed = constrain(HOMING_APPROACH_GAIN * distance_mm, HOMING_MIN_SPEED, HOMING_SPEED);
+      }
+      forward_demand = speed * facing;
+    }
+
+    // Print how the last return went.
+    void report(){
+      Serial.print("home: ");
+      Serial.print(arrived ? "arrived" : "timed out");
+      Serial.print(retrace ? ", retraced " : ", direct, ");
+      if(retrace){
+        Serial.print(waypoint_count);
+        Serial.print(" waypoints, ");
+      }
+      Serial.print(time_ms);
+      Serial.print(" ms, end error ");
+      Serial.print(distance_mm, 1);
+      Serial.println(" mm");
+    }
+};
+
+Homing_c homing;
+
+#endif
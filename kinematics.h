@@ -1,150 +1,262 @@
-#include "Arduino.h"
-// this #ifndef stops this file
-// from being included mored than
-// once by the compiler. 
-
-// ALL MEASUREMENTS IN mm AT THE MOMENT!!!
-
-
-#ifndef _KINEMATICS_H
-#define _KINEMATICS_H
-
-# define POSITION_UPDATE 100 // how often we will update the position, testing will show if 100 milliseconds (0.1 seconds) is a sensible frequency.
-# include "encoders.h"
-# include "motors.h"
-Motors_c motors;
-
-// Class to track robot position.
-class Kinematics_c {
-  public:
-    unsigned long kinematics_ts = 0; // for time stamping!
-    
-    // We need some global class variables to refer to, specifically, X_pos, Y_pos and theta (angle rotation)
-    // all three must start at zero each time the class is initialised as we always want robot starting at origin of reference frame.
-    // all three must be floats as they will not necessarily be whole numbers. max value of float is 3 x 10^38, should be big enough I think...
-    float X_pos = 0.0;  // updated by calculating delta_X
-    float Y_pos = 0.0;  // updated by calculating delta_Y
-    float Theta = 0.0;  // updated by calculating delta_Theta
-    float Theta_Home = 0.0; // angle robot must turn to in order to return to start in a straight line.
-    volatile long previous_count_wheel_left = 0; // we require this for our change in count value, it starts at zero and is updated in updated function
-    volatile long previous_count_wheel_right = 0; // we require this for our change in count value, it starts at zero and is updated in updated function
-
-
-
-
-
-    // Constructor, must exist.
-    Kinematics_c() {
-
-    } 
-
-    // Use this function to update
-    // your kinematics
-    void update() {
-
-      // Record the time of this execution for coming calucations ( _ts = "time-stamp" )
-      unsigned long current_ts;
-      current_ts = millis();
-
-      // Calculate elapsed time.
-      unsigned long elapsed_t;
-      elapsed_t = current_ts - kinematics_ts;
-
-
-
-      if( elapsed_t > POSITION_UPDATE ) {
-        // declaring my change in x, y, theta variables. this is in reference frame
-        float delta_X;
-        float delta_Y;
-        float delta_Theta;
-        
-        // declaring my dimensional variables, fixed.
-        float r = 16.0; // wheel radius mm.
-        float l = 44.6; // dist from centre of robot to centre of wheel mm. Calculated in book.
-        float counts_per_rev =  358.3; // counts per revolution of each wheel.
-        float circumference = 100.5309649; // wheel circumference is 32pi mm.
-        float dist_per_count =  circumference/counts_per_rev; // distance travelled per count.
-
-        // now get change in counts since last update:
-        long left_change = count_wheel_left - previous_count_wheel_left;
-        long right_change = count_wheel_right - previous_count_wheel_right;     
-        
-        // now calculate the change in x position and theta in local frame (change in y local is always zero)
-        // this is essentially the average of the change in counts times by distance per count.
-        float delta_X_local = (0.5)*(left_change + right_change)*dist_per_count; // note, didn't like fraction co-efficient for float. Decimal better.// THIS MINUS MAKES FORWARD X AND Y POSITIVE.
-        delta_Theta = (0.5)*(1/l)*(right_change - left_change)*dist_per_count; // local delta theta is same as reference delta theta as bot starts lined up with x ref as well as x local.
-
-        // calculte our delta values -> eqns are in lab 6, kinematics section.
-        delta_X = delta_X_local*cos(Theta);
-        delta_Y = delta_X_local*sin(Theta);
-        // we have delta theta already.
-
-        // Update our refernce frame kinematics.
-        X_pos = X_pos + delta_X;
-        Y_pos = Y_pos + delta_Y;
-        Theta = Theta + delta_Theta;
-        
-        // THIS WORKS!!
-        // condition to prevent theta from exceeding +-180. WILL ONLY WORK IF ROBOT DOES NOT COMPLETE MORE THAN ONE FULL CIRCLE IN TIME OF POSITION UPDATE.
-        if(abs(Theta*180/3.14159) >= 180){  // we want theta in this range for our full circle. see angles A4 page
-          
-          if(Theta > 0){
-            Theta = Theta - 2*(3.14159); // left is 2pi -> degree equivalent: If theta reads 185, it should be 185 - 365 = -175           
-          }
-          else{
-            Theta = Theta + 2*(3.14159); // left is 2pi -> degree equivalent: If theta reads -185, it should be (-185) + 360 = 175
-          }
-        }
-
-
-
-
-
-
-        // printing our counts out - WORKING!!
-        // Serial.println("Right Wheel stats: current, prev, difference ");
-        // Serial.print(count_wheel_right);
-        // Serial.print(", ");
-        // Serial.print(previous_count_wheel_right);
-        // Serial.print(", ");
-        //  Serial.print(right_change);
-        // Serial.print("\n");
-
-        // Serial.println("Left Wheel stats: current, prev, difference ");
-        // Serial.print(count_wheel_left);
-        // Serial.print(", ");
-        // Serial.print(previous_count_wheel_left);
-        // Serial.print(", ");
-        // Serial.print(left_change);
-        // Serial.print("\n");
-
-
-
-        // Serial.print("\n");
-        // Serial.println("x position is: ");
-        // Serial.print(X_pos);
-
-
-        // Serial.print("\n");
-        // Serial.println("y position is: ");
-        // Serial.print(Y_pos);
-
-
-        // Serial.print("\n");
-        // Serial.println("angle from start is: ");
-        // Serial.print(Theta); //
-
-
-        // At the end of the update, set the previous counts for when the next update runs.
-        previous_count_wheel_left = count_wheel_left;
-        previous_count_wheel_right = count_wheel_right;
-        // also update our timestamp at the end.
-        kinematics_ts = millis();
-    }
-    }
-
-};
-
-
-
-#endif
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler. 
+
+// ALL MEASUREMENTS IN mm AT THE MOMENT!!!
+
+
+#ifndef _KINEMATICS_H
+#define _KINEMATICS_H
+
+// Trig backend for the heading integration: 1 = PROGMEM lookup tables (trig.h), 0 = libm sin/cos.
+#ifndef KINEMATICS_TRIG_LUT
+# define KINEMATICS_TRIG_LUT 1
+#endif
+
+// how often we will update the position (when not in high rate mode). With libm trig an update is slow enough that
+// 100 milliseconds (0.1 seconds) was the sensible frequency, the lookup tables make an update cheap enough to run every 10ms.
+#if KINEMATICS_TRIG_LUT
+# define POSITION_UPDATE 10
+#else
+# define POSITION_UPDATE 100
+#endif
+
+// Odometry integrator. EULER is the original: move along the heading from before the update.
+// MIDPOINT moves along the average heading over the update, EXACT_ARC moves along the chord of the arc the wheels
+// actually drove (midpoint scaled by sin(dTheta/2)/(dTheta/2)), so corners no longer add a drift each update.
+# define ODOM_EULER 0
+# define ODOM_MIDPOINT 1
+# define ODOM_EXACT_ARC 2
+#ifndef ODOMETRY_INTEGRATOR
+# define ODOMETRY_INTEGRATOR ODOM_EXACT_ARC
+#endif
+
+// High rate odometry: integrate every millisecond rather than every POSITION_UPDATE ms.
+// The FSM's scheduler runs the odometry task at ODOMETRY_PERIOD_US, update() itself integrates whenever it's called.
+#ifndef ODOMETRY_HIGH_RATE
+# define ODOMETRY_HIGH_RATE 1
+#endif
+#if ODOMETRY_HIGH_RATE
+# define ODOMETRY_PERIOD_US 1000UL
+#else
+# define ODOMETRY_PERIOD_US (POSITION_UPDATE*1000UL)
+#endif
+
+# include "encoders.h"
+# include "motors.h"
+# include "fixed.h"
+# include "trig.h"
+# include "profiler.h"
+Motors_c motors;
+
+// The motion since Kinematics_c::take_motion() was last called, for the pose estimator (estimator.h): the pose change
+// in the odometry frame, the odometry heading it started from, and how far each wheel turned.
+struct KinematicsMotion_s {
+  float dx = 0; // mm
+  float dy = 0; // mm
+  float dtheta = 0; // rad
+  float theta_start = 0; // rad
+  float left_mm = 0;
+  float right_mm = 0;
+};
+
+// Class to track robot position.
+class Kinematics_c {
+  public:
+    // We need some global class variables to refer to, specifically, X_pos, Y_pos and theta (angle rotation)
+    // all three must start at zero each time the class is initialised as we always want robot starting at origin of reference frame.
+    // all three must be floats as they will not necessarily be whole numbers. max value of float is 3 x 10^38, should be big enough I think...
+    float X_pos = 0.0;  // updated by calculating delta_X
+    float Y_pos = 0.0;  // updated by calculating delta_Y
+    float Theta = 0.0;  // updated by calculating delta_Theta
+    long previous_count_wheel_left = 0; // we require this for our change in count value, it starts at zero and is updated in updated function
+    long previous_count_wheel_right = 0; // we require this for our change in count value, it starts at zero and is updated in updated function
+
+    // The pose is integrated in real_t (fixed point when USE_FIXED_POINT is set), X_pos, Y_pos and Theta above are
+    // float copies published at the end of every update for the rest of the code to read.
+    real_t x_state = 0;
+    real_t y_state = 0;
+    real_t theta_state = 0;
+
+    // Motion summed up since take_motion(), see KinematicsMotion_s.
+    real_t motion_x = 0;
+    real_t motion_y = 0;
+    real_t motion_theta = 0;
+    long motion_left = 0; // counts
+    long motion_right = 0;
+    float motion_theta_start = 0;
+
+
+
+
+
+    // Constructor, must exist.
+    Kinematics_c() {
+
+    } 
+
+    // Use this function to update
+    // your kinematics
+    void update() {
+      update(encoder_snapshot());
+    }
+
+    // Same, using counts the caller has already taken (so one control tick reads the encoders once).
+    void update(const EncoderSnapshot_s & encoders) {
+      PROFILE_SCOPE(PROFILE_KINEMATICS);
+
+      // the caller sets the rate, so just integrate whatever new counts there are.
+      bool update_due = (encoders.left != previous_count_wheel_left) || (encoders.right != previous_count_wheel_right);
+
+      if( update_due ) {
+        // declaring my change in x, y, theta variables. this is in reference frame
+        real_t delta_X;
+        real_t delta_Y;
+        real_t delta_Theta;
+        
+        // declaring my dimensional variables, fixed. constexpr so all of this is worked out by the compiler.
+        // wheel radius is 16mm.
+        constexpr float l = 44.6; // dist from centre of robot to centre of wheel mm. Calculated in book.
+        constexpr float counts_per_rev =  358.3; // counts per revolution of each wheel.
+        constexpr float circumference = 100.5309649; // wheel circumference is 32pi mm.
+        constexpr float dist_per_count =  circumference/counts_per_rev; // distance travelled per count.
+        constexpr real_t half_dist_per_count = 0.5f*dist_per_count; // mm of forward travel per count of (left + right)
+        constexpr real_t theta_per_count = 0.5f*dist_per_count/l; // radians of turn per count of (right - left)
+        constexpr real_t pi = 3.14159f;
+        constexpr real_t two_pi = 2*3.14159f;
+
+        // now get change in counts since last update:
+        long left_change = encoders.left - previous_count_wheel_left;
+        long right_change = encoders.right - previous_count_wheel_right;     
+        
+        // now calculate the change in x position and theta in local frame (change in y local is always zero)
+        // this is essentially the average of the change in counts times by distance per count.
+        real_t delta_X_local = real_t(left_change + right_change)*half_dist_per_count; // THIS MINUS MAKES FORWARD X AND Y POSITIVE.
+        delta_Theta = real_t(right_change - left_change)*theta_per_count; // local delta theta is same as reference delta theta as bot starts lined up with x ref as well as x local.
+
+        // heading to move along for this update.
+        #if ODOMETRY_INTEGRATOR == ODOM_EULER
+        real_t heading = theta_state;
+        #else
+        real_t half_delta_Theta = delta_Theta*real_t(0.5);
+        real_t heading = theta_state + half_delta_Theta;
+        #endif
+
+        #if ODOMETRY_INTEGRATOR == ODOM_EXACT_ARC
+        // chord of the arc = arc length * sin(h)/h, h = dTheta/2. Taylor series so there's no division,
+        // h is tiny at high rate and the h^6 term is under 1e-7 even for a 0.3 rad update.
+        constexpr real_t sixth = 1.0/6.0;
+        constexpr real_t one_hundred_twentieth = 1.0/120.0;
+        real_t h_squared = half_delta_Theta*half_delta_Theta;
+        delta_X_local = delta_X_local*(real_t(1) - h_squared*sixth + h_squared*h_squared*one_hundred_twentieth);
+        #endif
+
+        // calculte our delta values -> eqns are in lab 6, kinematics section.
+        #if KINEMATICS_TRIG_LUT
+        delta_X = delta_X_local*trig_cos(heading);
+        delta_Y = delta_X_local*trig_sin(heading);
+        #else
+        float heading_float = real_to_float(heading);
+        delta_X = delta_X_local*real_t(cos(heading_float));
+        delta_Y = delta_X_local*real_t(sin(heading_float));
+        #endif
+        // we have delta theta already.
+
+        // Update our refernce frame kinematics.
+        x_state = x_state + delta_X;
+        y_state = y_state + delta_Y;
+        theta_state = theta_state + delta_Theta;
+
+        // and the motion for the next take_motion().
+        motion_x = motion_x + delta_X;
+        motion_y = motion_y + delta_Y;
+        motion_theta = motion_theta + delta_Theta;
+        motion_left = motion_left + left_change;
+        motion_right = motion_right + right_change;
+        
+        // THIS WORKS!!
+        // condition to prevent theta from exceeding +-180. WILL ONLY WORK IF ROBOT DOES NOT COMPLETE MORE THAN ONE FULL CIRCLE IN TIME OF POSITION UPDATE.
+        // we want theta in this range for our full circle. see angles A4 page
+        if(theta_state >= pi){
+          theta_state = theta_state - two_pi; // If theta reads 185, it should be 185 - 360 = -175
+        }
+        else if(theta_state <= -pi){
+          theta_state = theta_state + two_pi; // If theta reads -185, it should be (-185) + 360 = 175
+        }
+
+        // publish the float copies.
+        X_pos = real_to_float(x_state);
+        Y_pos = real_to_float(y_state);
+        Theta = real_to_float(theta_state);
+
+
+
+
+
+
+        // printing our counts out - WORKING!!
+        // Serial.println("Right Wheel stats: current, prev, difference ");
+        // Serial.print(encoders.right);
+        // Serial.print(", ");
+        // Serial.print(previous_count_wheel_right);
+        // Serial.print(", ");
+        //  Serial.print(right_change);
+        // Serial.print("\n");
+
+        // Serial.println("Left Wheel stats: current, prev, difference ");
+        // Serial.print(encoders.left);
+        // Serial.print(", ");
+        // Serial.print(previous_count_wheel_left);
+        // Serial.print(", ");
+        // Serial.print(left_change);
+        // Serial.print("\n");
+
+
+
+        // Serial.print("\n");
+        // Serial.println("x position is: ");
+        // Serial.print(X_pos);
+
+
+        // Serial.print("\n");
+        // Serial.println("y position is: ");
+        // Serial.print(Y_pos);
+
+
+        // Serial.print("\n");
+        // Serial.println("angle from start is: ");
+        // Serial.print(Theta); //
+
+
+        // At the end of the update, set the previous counts for when the next update runs.
+        previous_count_wheel_left = encoders.left;
+        previous_count_wheel_right = encoders.right;
+    }
+    }
+
+    // The motion integrated since the last call (or since the start), and start summing it again from here. The
+    // estimator moves its own pose on by this rather than integrating the encoder counts a second time.
+    KinematicsMotion_s take_motion(){
+      constexpr float dist_per_count = 100.5309649/358.3; // wheel circumference / counts per revolution, as update().
+      KinematicsMotion_s motion;
+      motion.dx = real_to_float(motion_x);
+      motion.dy = real_to_float(motion_y);
+      motion.dtheta = real_to_float(motion_theta);
+      motion.theta_start = motion_theta_start;
+      motion.left_mm = motion_left * dist_per_count;
+      motion.right_mm = motion_right * dist_per_count;
+      motion_x = 0;
+      motion_y = 0;
+      motion_theta = 0;
+      motion_left = 0;
+      motion_right = 0;
+      motion_theta_start = Theta;
+      return(motion);
+    }
+
+};
+
+
+
+#endif
@@ -1,240 +1,586 @@
-#include "Arduino.h"
-// this #ifndef stops this file
-// from being included mored than
-// once by the compiler. 
-#ifndef _LINESENSOR_H
-#define _LINESENSOR_H
-
-
-// define our 5 sensor pins and our IR emittor pin
-#define LS_LEFTEST_PIN A11
-#define LS_LEFT_PIN A0
-#define LS_CENTRE_PIN A2
-#define LS_RIGHT_PIN A3
-#define LS_RIGHTEST_PIN A4
-#define EMIT_IR_PIN 11
-// define the total number of sensors - basically a placeholder for int 5
-# define NUMBER_OF_LS_PINS 5
-
-
-
-
-// Class to operate the linesensor(s).
-class LineSensor_c {
-  public:
-  
-  // Constructor, must exist.
-  LineSensor_c() {
-    
-  } 
-
-
-  // define our array of 3 pins, number of entries (3) must match number of sensors we are readng (3). pin_list[3] tells the compiler we will access an integer stored in 3 
-  // consecutive locations in memory. index from 0 - 2 for range of 3 ofc.
-  int light_sensor_list[NUMBER_OF_LS_PINS] = {LS_LEFTEST_PIN ,LS_LEFT_PIN, LS_CENTRE_PIN, LS_RIGHT_PIN, LS_RIGHTEST_PIN}; 
-  int light_sensor; // integer for indexing our light sensor lists. e.g for light sensor in light sensor list.
-
-
-
-  // put your setup code here, to run once in void setup.
-  void initialise() {
-
-    // Set the five IR sensor pins as inputs
-    pinMode(LS_LEFT_PIN, INPUT);
-    pinMode(LS_CENTRE_PIN, INPUT);
-    pinMode(LS_RIGHT_PIN, INPUT);
-    pinMode(LS_LEFTEST_PIN, INPUT);
-    pinMode(LS_RIGHTEST_PIN, INPUT);
-    enable_IR_LED();
-  }
-
-
-
-  // function to enable the IR LED.
-  void enable_IR_LED(){
-    // Set emit pin as an output with HIGH - this is the setting to use it for the line sensors rather than bump detectors
-    pinMode(EMIT_IR_PIN, OUTPUT); // OUTPUT means IR emittor pin is ON. INPUT means it is off.
-    digitalWrite(EMIT_IR_PIN, HIGH); // HIGH for line sensors, LOW for bumpers. 
-  }
-
-
-  // function to disable the IR LED
-  void disable_IR_LED(){
-    // Set emit pin as an output with HIGH - this is the setting to use it for the line sensors rather than bump detectors
-    pinMode(EMIT_IR_PIN, INPUT); // OUTPUT means IR emittor pin is ON. INPUT means it is off.
-    digitalWrite(EMIT_IR_PIN, HIGH); // HIGH for line sensors, LOW for bumpers. 
-  }
-
-
-
-  // Function to charge the capacitor in each light sensor.
-  void charge_Capacitor( int light_sensor_list[], int light_sensor ){
-    // temporarily to output and HIGH
-    pinMode( light_sensor_list[light_sensor], OUTPUT );
-    digitalWrite( light_sensor_list[light_sensor], HIGH );
-    // Tiny delay for capacitor to charge.
-    delayMicroseconds(10);
-    //  Turn input pin back to an input
-    pinMode( light_sensor_list[light_sensor], INPUT );
-  }
-
-
-
-  // Function to activate our light sensors, this contains all the overall timing measures.
-  float activate_LS(){
-
-    // start the timer for hte process
-    unsigned long whole_process_time_start; 
-    whole_process_time_start = micros();
-
-    // run the function to read the sensors
-    float e_line_to_main = readLineSensor();
-
-    // mark the end time
-    unsigned long whole_process_time_end;
-    whole_process_time_end = micros();
-
-    // print elapsed time for whole process
-    // Serial.print(", whole process took: ");
-    // Serial.print(whole_process_time_end - whole_process_time_start); // whole process time calculation
-    // Serial.print("uS");
-    // Serial.print("\n");
-    // Serial.print("\n");
-
-    return(e_line_to_main);
-  }
-
-
-
-  // Function to read the line sensors and discern how long they take to discharge.
-  float readLineSensor() {
-
-
-
-    // for loop to charge all our pins. need to charge 'em up before we look at discharge time.
-    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
-    
-      // charge current capacitor.
-      charge_Capacitor(light_sensor_list, light_sensor); 
-    }
-
-
-    // DEFINE OUR VARIABLES
-    // Places to store microsecond count
-    unsigned long start_time; // start time
-    // currently seeing approx 500us on white surface, 2800us on black surface, >3000us suspended in air.
-    unsigned long timeout = 3000; // if it takes longer than 3000 microseconds to read all three sensors, time out the while loop (don't get stuck in loop).
-
-
-    float sensor_read[NUMBER_OF_LS_PINS] = {0, 0, 0, 0, 0}; // list to store our 5 sensor times, one from each sensor. Give initial values of 0 for to allow us to only record earliest discharge value. must be a float as later we want decimals in normalised values.
-    int remaining = NUMBER_OF_LS_PINS; // variable to track the number of sensors you have yet to check on.
-
-    start_time = micros(); // Get your start time! Outside while loop as we want the same start time for each sensor!
-
-    while( remaining > 0 ){
-
-      unsigned long current_time = micros(); // get current time
-
-      unsigned long elapsed_time = current_time - start_time; // get elapsed time
-
-      // now we read each of our sensors in a "for loop", increasing by one each time, going through our light sensors list.
-      for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
-
-        // check if current pin has gone to low
-        if( digitalRead( light_sensor_list[light_sensor]) == LOW){
-          // Check if this sensor has had a previous value of elapsed time stored before. We only want to store the EARLIEST i.e, value hasn't yet been changed from 0.
-          if(sensor_read[light_sensor] == 0){
-            // set the discharge time to elapsed time!
-            sensor_read[light_sensor] = elapsed_time;
-            // let 'em know one less remaining!
-            remaining = remaining - 1;
-          }
-        }
-      }
-
-      // check if elapsed time has reached your timeout
-      if( elapsed_time >= timeout){
-        // if so, set remaining to zero to force end of looping
-        remaining = 0;
-        // lets us clearly see if timeout has occured. This is defined as a timeout to read all five sensors.
-        // Serial.print("THAT'S A TIMEOUT BUDDY! -> (> ");
-        // Serial.print(timeout);
-        // Serial.print(" )");
-
-      }
-    }
-
-
-
-    // Print output.
-    // Serial.print("line sensors (L to R): " );
-    // Serial.print( sensor_read[0] ); // lets us see time for leftest sensor to reach LOW.
-    // Serial.print(", ");
-    // Serial.print( sensor_read[1] ); // lets us see time for left sensor to reach LOW.
-    // Serial.print(", ");
-    // Serial.print( sensor_read[2] ); // lets us see time for centre sensor to reach LOW.
-    // Serial.print(", ");
-    // Serial.print( sensor_read[3] ); // lets us see time for right sensor to reach LOW.
-    // Serial.print(", ");
-    // Serial.print( sensor_read[4] ); // lets us see time for rightest sensor to reach LOW.
-    //Serial.print("\n");
-
-    // Condition to prevent robot thinking line is lost if error is very low from being perfectly lined up on line
-    // This is the case if middle sensor discharge time is high but those either side are are low.
-    if(sensor_read[2] > 1500 && sensor_read[1] < 1000 && sensor_read[3] < 1000){ 
-      // Serial.print("\n");
-      // Serial.println(0.09);
-      return 0.09; //correct value to identify it as on line plus override the join line function.
-    }
-
-    // ************************************************  
-    //  Add weighted line following!
-    float Sensor_Summation = 0;
-    //Serial.println(Sensor_Summation);
-    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
-      Sensor_Summation += sensor_read[light_sensor];
-    }
-    //Serial.println(Sensor_Summation);
-
-    // summation is about 2600uS on all white, up to 9000uS on all black.
-
-    // now to normalise,
-    // Equation to normalise each part is individual value)/ original summation = percentage value from that sensor.
-
-    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
-      sensor_read[light_sensor] = sensor_read[light_sensor]/Sensor_Summation;
-    }
-    
-      // Print output.
-      // Serial.print("\n");
-      // Serial.print("Normalised line sensors (L to R): " );
-      // Serial.print( sensor_read[0] ); // lets us see time for leftest sensor to reach LOW.
-      // Serial.print(", ");
-      // Serial.print( sensor_read[1] ); // lets us see time for left sensor to reach LOW.
-      // Serial.print(", ");
-      // Serial.print( sensor_read[2] ); // lets us see time for centre sensor to reach LOW.
-      // Serial.print(", ");
-      // Serial.print( sensor_read[3] ); // lets us see time for right sensor to reach LOW.
-      // Serial.print(", ");
-      // Serial.print( sensor_read[4] ); // lets us see time for rightest sensor to reach LOW.
-      // Serial.print("\n");
-
-
-
-    // Now we have normalised dischage times, where the highest ones indicate the darkest surface a.k.a maximum line. 
-    // we update paul's eqn to account for 5 sensors: for left: w_left = L_leftest + L_Left. the 0.5L_Centre always cancels so I'm going to ignore that.
-
-    // error from line = e_line = weighting_left - weighting_right = L_leftest + L_Left - L_rightest - L_right. IN MY CODE WE TAKE LEFT ERROR AS +VE, RIGHT AS -VE.
-    float e_line = (sensor_read[0] + sensor_read[1] - sensor_read[3] -sensor_read[4]); // sensor_read[2] is centre, we can ignore that. 
-    // Serial.print("\n");
-    // Serial.print("e line: ");
-    // Serial.println(e_line);
-
-
-    return(e_line); // return the e_line value when we run our function.
-  } 
-  };
-
-
-
-#endif
+#include "Arduino.h"
+#include <EEPROM.h>
+#include "fixed.h"
+#include "profiler.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler. 
+#ifndef _LINESENSOR_H
+#define _LINESENSOR_H
+
+
+// define our 5 sensor pins and our IR emittor pin
+#define LS_LEFTEST_PIN A11
+#define LS_LEFT_PIN A0
+#define LS_CENTRE_PIN A2
+#define LS_RIGHT_PIN A3
+#define LS_RIGHTEST_PIN A4
+#define EMIT_IR_PIN 11
+// define the total number of sensors - basically a placeholder for int 5
+# define NUMBER_OF_LS_PINS 5
+
+// currently seeing approx 500us on white surface, 2800us on black surface, >3000us suspended in air.
+# define LS_TIMEOUT_US 3000
+# define LS_UNCALIBRATED_WHITE_US 500 // without a calibration, the background is never taken as darker than this, so a
+                                     // frame with all five over the line (crossing it square on) still counts as a line.
+
+// Asynchronous acquisition: set to 1 to let Timer3 sample the sensors in the background so loop() never waits
+// on the capacitors. Set to 0 to go back to the blocking readLineSensor().
+#ifndef LS_ACQUISITION_ASYNC
+# define LS_ACQUISITION_ASYNC 1
+#endif
+
+// Sensor I/O backend: 1 = direct port registers (all five charged in one batched write, sampled with one read of
+// PINF and PIND per iteration), 0 = portable pinMode/digitalWrite/digitalRead per pin. make -C sim bench-linesensor
+// compares the two.
+#ifndef LS_IO_PORT
+# define LS_IO_PORT 1
+#endif
+
+// How often (microseconds) the Timer3 compare interrupt samples the sensor pins. This is also the resolution
+// of each discharge time in async mode. 5 digitalRead() calls take roughly 20us, so keep this comfortably above that.
+// A port read takes well under 1us so the port backend can sample much finer.
+#if LS_IO_PORT
+# define LS_ASYNC_SAMPLE_US 16
+#else
+# define LS_ASYNC_SAMPLE_US 40
+#endif
+
+// Calibration: normalised readings run 0 (white) - 1000 (black) per sensor.
+# define LS_MIN_CALIBRATION_RANGE 200 // us, a sensor must see at least this much white/black difference in the sweep.
+// EEPROM layout: calibration table lives at the start of EEPROM, the motor feedforward map (feedforward.h) at 32,
+// the stored path (path.h) at 96, the run recorder (recorder.h) is at the end.
+# define LS_CALIBRATION_EEPROM_ADDR 0
+# define LS_CALIBRATION_MAGIC 0xC5
+
+// Line position estimate.
+# define LS_PITCH_MM 12.0 // approximate spacing between neighbouring sensors.
+# define LS_E_LINE_PER_MM (0.5/(2*LS_PITCH_MM)) // e_line is +-0.5 with the line under an outer sensor, as before.
+# define LS_MIN_CONFIDENCE 0.4 // below this the line is regarded as not seen (lost).
+
+// Port bits of the sensor pins on the 32U4 (https://www.pololu.com/docs/0J83/5.9)
+// A11 = PD6, A0 = PF7, A2 = PF5, A3 = PF4, A4 = PF1.
+# define LS_PORTF_MASK ((1 << 7) | (1 << 5) | (1 << 4) | (1 << 1))
+# define LS_PORTD_MASK (1 << 6)
+
+
+
+
+// The sensor instance the Timer3 ISR samples, set in initialise().
+class LineSensor_c;
+LineSensor_c * ls_async_sensor = 0;
+
+
+// Class to operate the linesensor(s).
+class LineSensor_c {
+  public:
+  
+  // Constructor, must exist.
+  LineSensor_c() {
+    
+  } 
+
+
+  // define our array of 3 pins, number of entries (3) must match number of sensors we are readng (3). pin_list[3] tells the compiler we will access an integer stored in 3 
+  // consecutive locations in memory. index from 0 - 2 for range of 3 ofc.
+  int light_sensor_list[NUMBER_OF_LS_PINS] = {LS_LEFTEST_PIN ,LS_LEFT_PIN, LS_CENTRE_PIN, LS_RIGHT_PIN, LS_RIGHTEST_PIN}; 
+  int light_sensor; // integer for indexing our light sensor lists. e.g for light sensor in light sensor list.
+
+  // **** Asynchronous acquisition variables ****
+  // Written by the Timer3 ISR, so they must be volatile.
+  volatile bool reading_ready = false; // true once a full 5 sensor frame has been captured and not yet consumed.
+  volatile bool acquiring = false; // true while a charge/discharge cycle is being timed.
+  volatile byte pending_mask = 0; // bit per sensor still waiting to discharge (bit 0 = leftest).
+  volatile unsigned int async_ticks = 0; // number of sample ticks since the cycle started.
+  volatile unsigned int pending_times[NUMBER_OF_LS_PINS]; // discharge times of the cycle in progress (us).
+  volatile unsigned int frame_times[NUMBER_OF_LS_PINS]; // latest completed frame (us). Stable until start_reading() is called again.
+  //*********************************************
+
+  // **** Calibration variables ****
+  bool calibrated = false; // true once a valid table has been learnt or loaded.
+  unsigned int calibration_min[NUMBER_OF_LS_PINS]; // white discharge time per sensor (us).
+  unsigned int calibration_max[NUMBER_OF_LS_PINS]; // black discharge time per sensor (us).
+  unsigned long calibration_scale[NUMBER_OF_LS_PINS]; // 1000/(max - min) in 16.16 fixed point.
+  unsigned int calibrated_read[NUMBER_OF_LS_PINS]; // latest normalised reading, 0 (white) - 1000 (black).
+  unsigned int last_raw_read[NUMBER_OF_LS_PINS]; // latest raw discharge times (us), kept for telemetry.
+  //********************************
+
+  // **** Line position estimate ****
+  float line_position_mm = 0.0; // line position relative to the robot centre line, left +ve.
+  float line_confidence = 0.0; // 0 (no line) - 1 (strong line under a sensor).
+  //*********************************
+
+
+
+  // put your setup code here, to run once in void setup.
+  void initialise() {
+
+    // Set the five IR sensor pins as inputs
+    pinMode(LS_LEFT_PIN, INPUT);
+    pinMode(LS_CENTRE_PIN, INPUT);
+    pinMode(LS_RIGHT_PIN, INPUT);
+    pinMode(LS_LEFTEST_PIN, INPUT);
+    pinMode(LS_RIGHTEST_PIN, INPUT);
+    enable_IR_LED();
+
+    #if LS_ACQUISITION_ASYNC
+    ls_async_sensor = this;
+    setup_async_timer();
+    start_reading(); // kick off the first frame so one is ready by the first sensor update.
+    #endif
+  }
+
+
+
+  // Timer3 drives the asynchronous sampling. CTC mode, prescaler 8 -> 0.5us per timer tick at 16MHz.
+  // The compare interrupt itself is only enabled while a cycle is in progress.
+  void setup_async_timer(){
+    cli();
+    TCCR3A = 0;
+    TCCR3B = (1 << WGM32) | (1 << CS31); // CTC on OCR3A, clk/8
+    OCR3A = (LS_ASYNC_SAMPLE_US * 2) - 1;
+    TIMSK3 = TIMSK3 & ~(1 << OCIE3A); // interrupt off until start_reading()
+    sei();
+  }
+
+
+
+  // Start a non-blocking charge/discharge cycle. Returns straight after the capacitors are charged,
+  // the Timer3 ISR then stamps each sensor as it discharges and raises reading_ready when done.
+  void start_reading(){
+    charge_all();
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      pending_times[light_sensor] = 0;
+    }
+
+    cli();
+    reading_ready = false;
+    async_ticks = 0;
+    pending_mask = (1 << NUMBER_OF_LS_PINS) - 1; // all five still charged.
+    acquiring = true;
+    TCNT3 = 0;
+    TIFR3 = (1 << OCF3A); // clear any stale compare flag.
+    TIMSK3 = TIMSK3 | (1 << OCIE3A);
+    sei();
+  }
+
+
+
+  // One sample of the discharge cycle. Called from the Timer3 compare ISR every LS_ASYNC_SAMPLE_US,
+  // kept as a plain member function so it can equally be driven by a simulated timer.
+  void sample_tick(){
+    if(!acquiring){
+      return;
+    }
+    async_ticks = async_ticks + 1;
+    unsigned int elapsed_time = async_ticks * LS_ASYNC_SAMPLE_US;
+
+    // only look at sensors which haven't discharged yet, we want the EARLIEST time only.
+    byte discharged = read_discharged() & pending_mask;
+    if(discharged){
+      for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+        if(discharged & (1 << i)){
+          pending_times[i] = elapsed_time;
+        }
+      }
+      pending_mask = pending_mask & ~discharged;
+    }
+
+    // finished when every sensor has discharged or we hit the timeout. Sensors that timed out keep 0,
+    // the same as the blocking read.
+    if(pending_mask == 0 || elapsed_time >= LS_TIMEOUT_US){
+      TIMSK3 = TIMSK3 & ~(1 << OCIE3A);
+      for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+        frame_times[i] = pending_times[i];
+      }
+      acquiring = false;
+      reading_ready = true;
+    }
+  }
+
+
+
+  // Consume the latest completed frame: work out e_line from it and immediately start the next cycle.
+  // Only call when reading_ready is true.
+  float read_async(){
+    PROFILE_SCOPE(PROFILE_LINE_SENSOR);
+    unsigned int sensor_read[NUMBER_OF_LS_PINS];
+    next_frame(sensor_read);
+    return(process_LS(sensor_read));
+  }
+
+
+
+  // **** Calibration ****
+  // Start a fresh min/max sweep.
+  void reset_calibration(){
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      calibration_min[light_sensor] = LS_TIMEOUT_US;
+      calibration_max[light_sensor] = 0;
+    }
+    calibrated = false;
+  }
+
+
+
+  // Learn from one raw frame: widen each sensor's white (min) / black (max) discharge range.
+  void update_calibration(const unsigned int raw_read[]){
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      unsigned int t = raw_read[light_sensor];
+      if(t == 0){
+        t = LS_TIMEOUT_US; // timed out means very dark, not instant.
+      }
+      if(t < calibration_min[light_sensor]){
+        calibration_min[light_sensor] = t;
+      }
+      if(t > calibration_max[light_sensor]){
+        calibration_max[light_sensor] = t;
+      }
+    }
+  }
+
+
+
+  // Check the learnt ranges and build the lookup scales. Returns false (and stays uncalibrated) if any sensor
+  // didn't see both the line and the background during the sweep.
+  bool finish_calibration(){
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      if(calibration_max[light_sensor] < calibration_min[light_sensor] + LS_MIN_CALIBRATION_RANGE){
+        calibrated = false;
+        return(false);
+      }
+      // 1000 in 16.16 fixed point over the range, so read time is one multiply and a shift per sensor.
+      calibration_scale[light_sensor] = (1000UL << 16) / (calibration_max[light_sensor] - calibration_min[light_sensor]);
+    }
+    calibrated = true;
+    return(true);
+  }
+
+
+
+  // Map a raw frame onto 0 (white) - 1000 (black) per sensor using the calibration table.
+  void calibrate_frame(const unsigned int raw_read[], unsigned int out[]){
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      unsigned int t = raw_read[light_sensor];
+      if(t == 0 || t > calibration_max[light_sensor]){
+        t = calibration_max[light_sensor];
+      }
+      if(t < calibration_min[light_sensor]){
+        t = calibration_min[light_sensor];
+      }
+      // (t - min) <= range so this can't overflow 32 bits.
+      out[light_sensor] = ((unsigned long)(t - calibration_min[light_sensor]) * calibration_scale[light_sensor]) >> 16;
+    }
+  }
+
+
+
+  // Store the min/max table in EEPROM so we don't need to sweep on every power up.
+  void save_calibration(){
+    EEPROM.update(LS_CALIBRATION_EEPROM_ADDR, LS_CALIBRATION_MAGIC);
+    EEPROM.put(LS_CALIBRATION_EEPROM_ADDR + 1, calibration_min);
+    EEPROM.put(LS_CALIBRATION_EEPROM_ADDR + 1 + sizeof(calibration_min), calibration_max);
+  }
+
+
+
+  // Load the table saved by save_calibration(). Returns false if nothing valid has been stored.
+  bool load_calibration(){
+    if(EEPROM.read(LS_CALIBRATION_EEPROM_ADDR) != LS_CALIBRATION_MAGIC){
+      return(false);
+    }
+    EEPROM.get(LS_CALIBRATION_EEPROM_ADDR + 1, calibration_min);
+    EEPROM.get(LS_CALIBRATION_EEPROM_ADDR + 1 + sizeof(calibration_min), calibration_max);
+    return(finish_calibration());
+  }
+  //*********************
+
+
+
+  // function to enable the IR LED.
+  void enable_IR_LED(){
+    // Set emit pin as an output with HIGH - this is the setting to use it for the line sensors rather than bump detectors
+    pinMode(EMIT_IR_PIN, OUTPUT); // OUTPUT means IR emittor pin is ON. INPUT means it is off.
+    digitalWrite(EMIT_IR_PIN, HIGH); // HIGH for line sensors, LOW for bumpers. 
+  }
+
+
+  // function to disable the IR LED
+  void disable_IR_LED(){
+    // Set emit pin as an output with HIGH - this is the setting to use it for the line sensors rather than bump detectors
+    pinMode(EMIT_IR_PIN, INPUT); // OUTPUT means IR emittor pin is ON. INPUT means it is off.
+    digitalWrite(EMIT_IR_PIN, HIGH); // HIGH for line sensors, LOW for bumpers. 
+  }
+
+
+
+  // Function to charge the capacitor in each light sensor.
+  void charge_Capacitor( int light_sensor_list[], int light_sensor ){
+    // temporarily to output and HIGH
+    pinMode( light_sensor_list[light_sensor], OUTPUT );
+    digitalWrite( light_sensor_list[light_sensor], HIGH );
+    // Tiny delay for capacitor to charge.
+    delayMicroseconds(10);
+    //  Turn input pin back to an input
+    pinMode( light_sensor_list[light_sensor], INPUT );
+  }
+
+
+
+  // Function to charge the capacitors of all five sensors.
+  void charge_all(){
+    #if LS_IO_PORT
+    // drive every sensor pin HIGH together, one write per port, then a single 10us charge delay.
+    PORTF = PORTF | LS_PORTF_MASK;
+    PORTD = PORTD | LS_PORTD_MASK;
+    DDRF = DDRF | LS_PORTF_MASK;
+    DDRD = DDRD | LS_PORTD_MASK;
+    delayMicroseconds(10);
+    // back to inputs, clearing the PORT bits too so the pull-ups don't hold the capacitors up.
+    DDRF = DDRF & ~LS_PORTF_MASK;
+    DDRD = DDRD & ~LS_PORTD_MASK;
+    PORTF = PORTF & ~LS_PORTF_MASK;
+    PORTD = PORTD & ~LS_PORTD_MASK;
+    #else
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      charge_Capacitor(light_sensor_list, light_sensor);
+    }
+    #endif
+  }
+
+
+
+  // Function to sample every sensor at once. Returns a bit per sensor (bit 0 = leftest) set when that sensor has discharged (LOW).
+  byte read_discharged(){
+    #if LS_IO_PORT
+    byte f = PINF;
+    byte d = PIND;
+    // gather the pin bits into sensor order: PD6, PF7, PF5, PF4, PF1.
+    byte high = ((d >> 6) & 0x01) | ((f >> 6) & 0x02) | ((f >> 3) & 0x04) | ((f >> 1) & 0x08) | ((f << 3) & 0x10);
+    return(~high & 0x1F);
+    #else
+    byte low = 0;
+    for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+      if(digitalRead(light_sensor_list[i]) == LOW){
+        low = low | (1 << i);
+      }
+    }
+    return(low);
+    #endif
+  }
+
+
+
+  // Function to activate our light sensors. The whole process time is kept by the profiler (see profiler.h).
+  float activate_LS(){
+
+    // run the function to read the sensors
+    float e_line_to_main = readLineSensor();
+
+    return(e_line_to_main);
+  }
+
+
+
+  // Function to read the line sensors and discern how long they take to discharge.
+  float readLineSensor() {
+    PROFILE_SCOPE(PROFILE_LINE_SENSOR);
+    unsigned int sensor_read[NUMBER_OF_LS_PINS];
+    capture_frame(sensor_read);
+    return(process_LS(sensor_read));
+  }
+
+
+
+  // Blocking charge/discharge cycle, fills sensor_read with the 5 discharge times (us). Timed out sensors read 0.
+  void capture_frame(unsigned int sensor_read[]) {
+
+    // charge all our pins. need to charge 'em up before we look at discharge time.
+    charge_all();
+
+
+    // DEFINE OUR VARIABLES
+    // Places to store microsecond count
+    unsigned long start_time; // start time
+    unsigned long timeout = LS_TIMEOUT_US; // if it takes longer than 3000 microseconds to read all three sensors, time out the while loop (don't get stuck in loop).
+
+
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      sensor_read[light_sensor] = 0; // initial values of 0 for to allow us to only record earliest discharge value.
+    }
+    byte remaining = (1 << NUMBER_OF_LS_PINS) - 1; // bit per sensor you have yet to check on.
+
+    start_time = micros(); // Get your start time! Outside while loop as we want the same start time for each sensor!
+
+    while( remaining > 0 ){
+
+      unsigned long current_time = micros(); // get current time
+
+      unsigned long elapsed_time = current_time - start_time; // get elapsed time
+
+      // sample all five sensors at once, keeping only those we haven't already got a time for (we only want the EARLIEST).
+      byte discharged = read_discharged() & remaining;
+      if(discharged){
+        for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+          if(discharged & (1 << light_sensor)){
+            // set the discharge time to elapsed time!
+            sensor_read[light_sensor] = elapsed_time;
+          }
+        }
+        // let 'em know which are no longer remaining!
+        remaining = remaining & ~discharged;
+      }
+
+      // check if elapsed time has reached your timeout
+      if( elapsed_time >= timeout){
+        // if so, set remaining to zero to force end of looping
+        remaining = 0;
+        // lets us clearly see if timeout has occured. This is defined as a timeout to read all five sensors.
+        // Serial.print("THAT'S A TIMEOUT BUDDY! -> (> ");
+        // Serial.print(timeout);
+        // Serial.print(" )");
+
+      }
+    }
+
+
+
+    // Print output.
+    // Serial.print("line sensors (L to R): " );
+    // Serial.print( sensor_read[0] ); // lets us see time for leftest sensor to reach LOW.
+    // Serial.print(", ");
+    // Serial.print( sensor_read[1] ); // lets us see time for left sensor to reach LOW.
+    // Serial.print(", ");
+    // Serial.print( sensor_read[2] ); // lets us see time for centre sensor to reach LOW.
+    // Serial.print(", ");
+    // Serial.print( sensor_read[3] ); // lets us see time for right sensor to reach LOW.
+    // Serial.print(", ");
+    // Serial.print( sensor_read[4] ); // lets us see time for rightest sensor to reach LOW.
+    //Serial.print("\n");
+  }
+
+
+
+  // Fetch the next raw frame of discharge times (us). In async mode this only succeeds once the background frame
+  // is complete (and starts the next one), in blocking mode it always reads the sensors.
+  bool next_frame(unsigned int sensor_read[]){
+    #if LS_ACQUISITION_ASYNC
+    if(!reading_ready){
+      return(false);
+    }
+    // acquisition is stopped while reading_ready is set, so frame_times can't change under us.
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      sensor_read[light_sensor] = frame_times[light_sensor];
+    }
+    start_reading();
+    #else
+    capture_frame(sensor_read);
+    #endif
+    return(true);
+  }
+
+
+
+  // Function to turn a frame of 5 discharge times (us) into our e_line value. Shared by the blocking and async reads.
+  // Also updates line_position_mm and line_confidence.
+  float process_LS(const unsigned int raw_read[]) {
+    for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+      last_raw_read[light_sensor] = raw_read[light_sensor];
+    }
+
+    // weights: how "black" each sensor is. Calibrated sensors are already on a 0 - 1000 scale, otherwise use the
+    // discharge time above the lightest sensor in this frame (removes the background surface).
+    long weight[NUMBER_OF_LS_PINS];
+    if(calibrated){
+      calibrate_frame(raw_read, calibrated_read);
+      for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+        weight[light_sensor] = calibrated_read[light_sensor];
+      }
+    }
+    else{
+      for(light_sensor = 0; light_sensor < NUMBER_OF_LS_PINS; light_sensor++){
+        weight[light_sensor] = raw_read[light_sensor] ? raw_read[light_sensor] : LS_TIMEOUT_US; // timed out = very dark.
+      }
+    }
+
+    estimate_position(weight);
+
+    // e_line keeps its old meaning (left +ve, about +-0.5 with the line under an outer sensor) for the controllers.
+    return(line_position_mm * LS_E_LINE_PER_MM);
+  }
+
+
+
+  // Line position estimator. Fits a parabola through the darkest sensor and its neighbours to get a sub-sensor
+  // position, falling back to the weighted centroid of all five when the peak is on an outer sensor. Position is in mm
+  // from the robot centre line (left +ve). Confidence is 0 - 1: how much darker the peak is than the background.
+  // If we aren't confident, the last position is held.
+  void estimate_position(long weight[]){
+    // find background (lightest) and peak (darkest) sensor.
+    byte peak = 0;
+    long lightest = weight[0];
+    for(byte i = 1; i < NUMBER_OF_LS_PINS; i++){
+      if(weight[i] > weight[peak]){
+        peak = i;
+      }
+      if(weight[i] < lightest){
+        lightest = weight[i];
+      }
+    }
+    if(!calibrated && lightest > LS_UNCALIBRATED_WHITE_US){
+      lightest = LS_UNCALIBRATED_WHITE_US;
+    }
+
+    // all the ratios below are of values <= LS_TIMEOUT_US * 6, small enough for real_ratio() in fixed point.
+    real_t confidence;
+    if(calibrated){
+      confidence = real_ratio(weight[peak], 1000);
+    }
+    else{
+      confidence = (weight[peak] > 0) ? real_ratio(weight[peak] - lightest, weight[peak]) : real_t(0);
+      // remove the background so white sensors don't pull the centroid towards the middle.
+      for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+        weight[i] = weight[i] - lightest;
+      }
+    }
+    line_confidence = real_to_float(confidence);
+
+    if(confidence < real_t(LS_MIN_CONFIDENCE)){
+      return;
+    }
+
+    // sensor positions in pitches, leftest = +2 ... rightest = -2.
+    real_t position;
+    long a = (peak > 0) ? weight[peak - 1] : 0;
+    long c = (peak < NUMBER_OF_LS_PINS - 1) ? weight[peak + 1] : 0;
+    long curvature = a - 2*weight[peak] + c;
+    if(peak > 0 && peak < NUMBER_OF_LS_PINS - 1 && curvature < 0){
+      // vertex of the parabola through (-1, a), (0, peak), (+1, c), offset in sensor indexes (+ve = towards the right).
+      real_t offset = real_ratio(a - c, 2*curvature);
+      position = real_t(2 - peak) - offset;
+    }
+    else{
+      long sum = 0;
+      long moment = 0;
+      for(byte i = 0; i < NUMBER_OF_LS_PINS; i++){
+        sum = sum + weight[i];
+        moment = moment + weight[i] * (2 - i);
+      }
+      position = real_ratio(moment, sum); // sum > 0 as the peak is above the background.
+    }
+    line_position_mm = real_to_float(position * real_t(LS_PITCH_MM));
+  }
+  };
+
+
+
+#if LS_ACQUISITION_ASYNC
+// Timer3 compare match, fires every LS_ASYNC_SAMPLE_US while a cycle is in progress.
+ISR( TIMER3_COMPA_vect ){
+  if(ls_async_sensor){
+    ls_async_sensor->sample_tick();
+  }
+}
+#endif
+
+#endif
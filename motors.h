@@ -1,78 +1,195 @@
-// this #ifndef stops this file
-// from being included mored than
-// once by the compiler. 
-#ifndef _MOTORS_H
-#define _MOTORS_H
-// Replace the ? with correct pin numbers
-// https://www.pololu.com/docs/0J83/5.9
-# define L_PWM_PIN 10
-# define L_DIR_PIN 16
-# define R_PWM_PIN 9
-# define R_DIR_PIN 15
-
-# define FWD LOW
-# define REV HIGH
-
-
-// Class to operate the motor(s).
-class Motors_c {
-  public:
-
-    // Constructor, must exist.
-    Motors_c() {
-
-    } 
-
-    // Use this function to 
-    // initialise the pins and 
-    // state of your motor(s).
-    void initialise() {
-      // Set all the motor pins as outputs.
-      // There are 4 pins in total to set.
-      pinMode(L_PWM_PIN,OUTPUT);
-      pinMode(L_DIR_PIN,OUTPUT);
-      pinMode(R_PWM_PIN,OUTPUT);
-      pinMode(R_DIR_PIN,OUTPUT);
-      // Set initial direction
-      // set speed to 0
-      digitalWrite(L_DIR_PIN, FWD);
-      digitalWrite(R_DIR_PIN, FWD);
-      analogWrite(L_PWM_PIN, 0);
-      analogWrite(R_PWM_PIN, 0);
-
-    }
-
-    // Function to set motor power and direction.
-    void setMotorPower( float left_pwm, float right_pwm) {
-      // allowed value range, maximum absolute pwm of 75.
-      if(abs(left_pwm) <= 75 && abs(right_pwm) <= 75){
-        //Serial.println("PWM in allowed range");
-        // Set initial Dir
-        bool L_DIR = FWD;
-        bool R_DIR = FWD;
-
-        // Condition to correct direction as required.
-        if(0 > left_pwm){
-          L_DIR = REV;
-        }
-        if(0 > right_pwm){
-          R_DIR = REV;
-        }    
-        // Use analogWrite() to set the power of the motors.
-        analogWrite(L_PWM_PIN, abs(left_pwm));
-        analogWrite(R_PWM_PIN, abs(right_pwm));
-
-        // Use digitalwrite() to set the direction of the motors.
-        digitalWrite(L_DIR_PIN, L_DIR);
-        digitalWrite(R_DIR_PIN, R_DIR);
-
-        
-      }
-      else {
-        // If requested value outside allowed range, do not change motor values.
-      }
-    }
-
-    
-};
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler. 
+#ifndef _MOTORS_H
+#define _MOTORS_H
+
+# include "profiler.h"
+
+// Replace the ? with correct pin numbers
+// https://www.pololu.com/docs/0J83/5.9
+# define L_PWM_PIN 10
+# define L_DIR_PIN 16
+# define R_PWM_PIN 9
+# define R_DIR_PIN 15
+
+# define FWD LOW
+# define REV HIGH
+
+# define MAX_PWM 75 // maximum absolute pwm we allow.
+
+// Motor driver mode. 1 = clamp over-range commands (keeping the left/right ratio, so the robot still turns the way
+// it was asked), slew-rate limit them, and write the Timer1 compare registers and direction bits directly, only
+// when they change. 0 = the original analogWrite()/digitalWrite() driver, which ignores over-range commands.
+# define MOTORS_DIRECT 1
+# define MOTORS_SLEW_PWM_PER_MS 1.5 // fastest change in pwm per millisecond, 0 = no limit. 0 -> 75 takes 50ms.
+
+// Port bits of the motor pins (https://www.pololu.com/docs/0J83/5.9): L_PWM = OC1B (PB6), R_PWM = OC1A (PB5),
+// L_DIR = PB2, R_DIR = PB1.
+# define MOTORS_L_DIR_BIT 2
+# define MOTORS_R_DIR_BIT 1
+
+# define MOTORS_MEASURE_CALLS 1000 // setMotorPower() calls timed by measure_cycles().
+
+
+// Class to operate the motor(s).
+class Motors_c {
+  public:
+
+    // Latest pwm actually applied to each wheel, after clamping and slew limiting (+ve = forward).
+    float applied_left = 0;
+    float applied_right = 0;
+    float slew_pwm_per_ms = MOTORS_SLEW_PWM_PER_MS;
+
+    // What's in the registers now, so unchanged values aren't written again.
+    byte ocr_left = 0;
+    byte ocr_right = 0;
+    byte dir_bits = 0;
+    unsigned long slew_ts = 0; // micros() of the last slew step.
+
+    // Constructor, must exist.
+    Motors_c() {
+
+    } 
+
+    // Use this function to 
+    // initialise the pins and 
+    // state of your motor(s).
+    void initialise() {
+      // Set all the motor pins as outputs.
+      // There are 4 pins in total to set.
+      pinMode(L_PWM_PIN,OUTPUT);
+      pinMode(L_DIR_PIN,OUTPUT);
+      pinMode(R_PWM_PIN,OUTPUT);
+      pinMode(R_DIR_PIN,OUTPUT);
+      // Set initial direction
+      // set speed to 0
+      digitalWrite(L_DIR_PIN, FWD);
+      digitalWrite(R_DIR_PIN, FWD);
+      analogWrite(L_PWM_PIN, 0);
+      analogWrite(R_PWM_PIN, 0);
+
+      #if MOTORS_DIRECT
+      // Timer1 stays as the Arduino core set it up (8 bit phase correct PWM, ~490Hz). Connect both compare outputs
+      // permanently, a compare value of 0 holds the pin low.
+      OCR1A = 0;
+      OCR1B = 0;
+      TCCR1A = TCCR1A | (1 << COM1A1) | (1 << COM1B1);
+      ocr_left = 0;
+      ocr_right = 0;
+      dir_bits = 0; // both FWD (LOW).
+      applied_left = 0;
+      applied_right = 0;
+      slew_ts = micros();
+      #endif
+    }
+
+    // Function to set motor power and direction.
+    void setMotorPower( float left_pwm, float right_pwm) {
+      PROFILE_SCOPE(PROFILE_MOTORS);
+      #if MOTORS_DIRECT
+      // clamp: scale both down together so the bigger one sits on the limit.
+      float biggest = abs(left_pwm);
+      if(abs(right_pwm) > biggest){
+        biggest = abs(right_pwm);
+      }
+      if(biggest > MAX_PWM){
+        float scale = MAX_PWM / biggest;
+        left_pwm = left_pwm * scale;
+        right_pwm = right_pwm * scale;
+      }
+
+      // slew limit: move each wheel at most slew_pwm_per_ms * elapsed time towards its command. A reversal ramps
+      // down through zero rather than switching direction at full power.
+      unsigned long now = micros();
+      if(slew_pwm_per_ms > 0){
+        float step = slew_pwm_per_ms * (now - slew_ts) * 0.001;
+        left_pwm = constrain(left_pwm, applied_left - step, applied_left + step);
+        right_pwm = constrain(right_pwm, applied_right - step, applied_right + step);
+      }
+      slew_ts = now;
+      applied_left = left_pwm;
+      applied_right = right_pwm;
+
+      // registers, only when they change. Truncated to whole pwm steps like analogWrite().
+      byte left = abs(left_pwm);
+      byte right = abs(right_pwm);
+      byte dir = ((left_pwm < 0) ? (1 << MOTORS_L_DIR_BIT) : 0) | ((right_pwm < 0) ? (1 << MOTORS_R_DIR_BIT) : 0);
+      if(dir != dir_bits){
+        PORTB = (PORTB & ~((1 << MOTORS_L_DIR_BIT) | (1 << MOTORS_R_DIR_BIT))) | dir; // REV is HIGH.
+        dir_bits = dir;
+      }
+      if(left != ocr_left){
+        OCR1B = left;
+        ocr_left = left;
+      }
+      if(right != ocr_right){
+        OCR1A = right;
+        ocr_right = right;
+      }
+      #else
+      // allowed value range, maximum absolute pwm of 75.
+      if(abs(left_pwm) <= MAX_PWM && abs(right_pwm) <= MAX_PWM){
+        //Serial.println("PWM in allowed range");
+        // Set initial Dir
+        bool L_DIR = FWD;
+        bool R_DIR = FWD;
+
+        // Condition to correct direction as required.
+        if(0 > left_pwm){
+          L_DIR = REV;
+        }
+        if(0 > right_pwm){
+          R_DIR = REV;
+        }    
+        // Use analogWrite() to set the power of the motors.
+        analogWrite(L_PWM_PIN, abs(left_pwm));
+        analogWrite(R_PWM_PIN, abs(right_pwm));
+
+        // Use digitalwrite() to set the direction of the motors.
+        digitalWrite(L_DIR_PIN, L_DIR);
+        digitalWrite(R_DIR_PIN, R_DIR);
+
+        
+      }
+      else {
+        // If requested value outside allowed range, do not change motor values.
+      }
+      #endif
+    }
+
+    // Stop both wheels now, without slew limiting. For the end of blocking routines, where there's no next call
+    // to carry on ramping down.
+    void stop(){
+      float slew = slew_pwm_per_ms;
+      slew_pwm_per_ms = 0;
+      setMotorPower(0, 0);
+      slew_pwm_per_ms = slew;
+    }
+
+    // Time setMotorPower() and print the average CPU cycles per call, for an unchanged command (nothing written)
+    // and for a changing one (registers written every call). Briefly drives pwm 0/1, under the motors' deadband,
+    // so run it with the robot stopped.
+    void measure_cycles(){
+      float slew = slew_pwm_per_ms;
+      slew_pwm_per_ms = 0; // every call has to reach its command for the changing case.
+      unsigned long start_us = micros();
+      for(int i = 0; i < MOTORS_MEASURE_CALLS; i++){
+        setMotorPower(0, 0);
+      }
+      unsigned long same_us = micros() - start_us;
+      start_us = micros();
+      for(int i = 0; i < MOTORS_MEASURE_CALLS; i++){
+        setMotorPower(i & 1, -(i & 1));
+      }
+      unsigned long changed_us = micros() - start_us;
+      setMotorPower(0, 0);
+      slew_pwm_per_ms = slew;
+
+      Serial.print("motors cycles/call, unchanged: ");
+      Serial.print((float)same_us * (F_CPU / 1000000UL) / MOTORS_MEASURE_CALLS, 1);
+      Serial.print(", changed: ");
+      Serial.println((float)changed_us * (F_CPU / 1000000UL) / MOTORS_MEASURE_CALLS, 1);
+    }
+};
 #endif
\ No newline at end of file
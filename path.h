@@ -0,0 +1,411 @@
+#include "Arduino.h"
+#include <EEPROM.h>
+#include <avr/eeprom.h>
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _PATH_H
+#define _PATH_H
+
+# include "encoders.h"
+# include "trig.h"
+
+// Path memory: the first run along the line is recorded as a short list of straights and arcs (odometry pose plus
+// where the line was under the sensors, so the robot weaving about the line doesn't show up as curves). It's kept in
+// EEPROM, and later runs follow the line at a speed profile worked out from it: flat out on the straights, braking in
+// time for each corner, limited by the corner's curvature. Send 'r' over serial for the stored path and its profile.
+# define PATH_ENABLED 1
+
+// Recording.
+# define PATH_MAX_SEGMENTS 32
+# define PATH_SAMPLE_MM 20.0 // line heading is sampled every 20mm of travel.
+# define PATH_MIN_SEGMENT_MM 40.0 // a segment must be this long before a change of curvature can end it.
+# define PATH_CURVATURE_TOLERANCE 0.006 // 1/mm off the segment's mean curvature: a sample this far starts a new one.
+# define PATH_STRAIGHT_CURVATURE 0.002 // 1/mm (500mm radius): gentler than this is stored as a straight.
+# define PATH_CURVATURE_SCALE 10000.0 // curvature stored as 1/10000 mm.
+# define PATH_SENSOR_AHEAD_MM 40.0 // how far the sensor bar is ahead of the axle.
+# define PATH_STRAIGHT_MARGIN_MM 40.0 // on_straight() keeps this far inside a straight, the robot is still
+                                      // straightening up after a corner.
+# define PATH_CORNER_CURVATURE 0.007 // 1/mm (~140mm radius): in_corner() from here, well clear of a straight's noise.
+
+// Speed profile, speeds in encoder counts per ms like the speed PIDs' demands.
+# define PATH_MAX_SPEED 1.25 // on the straights, leaves the speed PIDs some pwm headroom.
+# define PATH_END_SPEED 0.6 // at the start and end of the path: the mapping run's speed, so the line is found
+                            // and lost at the end exactly as before.
+# define PATH_LATERAL_ACCEL 1200.0 // mm/s^2, sets the corner speeds: v = sqrt(a / curvature).
+# define PATH_ACCEL 800.0 // mm/s^2, speeding up.
+# define PATH_BRAKE 800.0 // mm/s^2, slowing down for a corner.
+# define PATH_LOOKAHEAD_MM 40.0 // slow down this far before the profile says, covers the odometry's error in distance.
+# define PATH_SPEED_SCALE 128 // profile speeds stored as counts per ms x 128 in a byte.
+
+// Distance per encoder count (32pi mm wheel circumference over 358.3 counts, as Kinematics_c).
+# define PATH_MM_PER_COUNT (100.5309649/358.3)
+
+// EEPROM layout: after the motor feedforward map, before the run recorder. Magic, segment count, then the segments.
+# define PATH_EEPROM_ADDR 96
+# define PATH_EEPROM_MAGIC 0xA7
+
+
+// A straight (curvature 0) or an arc. Fixed width, it's the EEPROM format: 4 bytes, up to 32 fit before the recorder.
+struct PathSegment_s {
+  uint16_t length_mm;
+  int16_t curvature; // 1/mm x PATH_CURVATURE_SCALE, +ve = turning left.
+};
+
+
+// Class to record the path and replay it as a speed profile.
+class Path_c {
+  public:
+    PathSegment_s segments[PATH_MAX_SEGMENTS];
+    byte segment_count = 0;
+
+    // Profile, worked out from the segments: the speed limit in each segment and the speed it's entered at.
+    byte segment_speed[PATH_MAX_SEGMENTS];
+    byte entry_speed[PATH_MAX_SEGMENTS + 1]; // [segment_count] is the speed at the end.
+
+    bool mapping = false; // recording this run.
+    bool replaying = false; // following a stored path's profile this run.
+    bool started = false; // true once the robot is on the line and distance is being counted.
+    float distance_mm = 0; // travelled since started.
+
+    // recording state
+    long start_counts = 0; // left + right encoder counts when started.
+    float sample_mm = 0; // distance at the last heading sample.
+    float sample_heading = 0; // line heading at the last sample.
+    float sample_x = 0; // point on the line under the sensors at the last sample (odometry frame, mm).
+    float sample_y = 0;
+    bool sample_line = false; // the line was seen at the last sample.
+    float segment_mm = 0; // current segment so far.
+    float segment_turn = 0; // heading change over it (rad).
+    float line_end_mm = 0; // distance when the line was last seen, the path ends here.
+
+    // saving: one byte per service() call, the magic byte goes last so a half written path is never loaded.
+    int save_index = -1; // next byte of the EEPROM image, -1 = not saving.
+
+    // Constructor, must exist.
+    Path_c() {
+
+    }
+
+    // **** Recording ****
+    // Record this run (the first run, or no stored path).
+    void start_mapping(){
+      mapping = true;
+      replaying = false;
+      started = false;
+      segment_count = 0;
+    }
+
+    // The robot is on the line: distance counts from here, on both the mapping and the replay runs.
+    void start(const EncoderSnapshot_s & encoders, float theta){
+      if(started){
+        return;
+      }
+      started = true;
+      start_counts = encoders.left + encoders.right;
+      distance_mm = 0;
+      sample_mm = 0;
+      sample_heading = theta;
+      sample_line = false;
+      segment_mm = 0;
+      segment_turn = 0;
+      line_end_mm = 0;
+    }
+
+    // Every control tick: distance travelled and, when mapping, the next heading sample. Pose from Kinematics_c,
+    // line position from the line sensors (left +ve).
+    void update(const EncoderSnapshot_s & encoders, float x, float y, float theta, float line_position_mm,
+                bool line_seen){
+      if(!started){
+        return;
+      }
+      distance_mm = (encoders.left + encoders.right - start_counts) * (0.5 * PATH_MM_PER_COUNT);
+      if(!mapping){
+        return;
+      }
+      if(line_seen){
+        line_end_mm = distance_mm;
+      }
+
+      float step = distance_mm - sample_mm;
+      if(step < PATH_SAMPLE_MM && distance_mm > 0){
+        return;
+      }
+      // the point on the line under the sensors. Its direction of travel since the last sample is the line's
+      // heading, whatever the robot's own heading did in between. Without the line, the robot's heading will do.
+      float line_x = x + PATH_SENSOR_AHEAD_MM * trig_cos(theta) - line_position_mm * trig_sin(theta);
+      float line_y = y + PATH_SENSOR_AHEAD_MM * trig_sin(theta) + line_position_mm * trig_cos(theta);
+      float line_heading = theta;
+      if(line_seen && sample_line){
+        line_heading = trig_atan2(line_y - sample_y, line_x - sample_x);
+      }
+      if(distance_mm > 0){
+        add_sample(step, angle_wrap(line_heading - sample_heading));
+      }
+      sample_mm = distance_mm;
+      sample_heading = line_heading;
+      sample_x = line_x;
+      sample_y = line_y;
+      sample_line = line_seen;
+    }
+
+    // Where the robot is on a stored path, for the pose estimator's line landmarks. Only the replay run knows: on the
+    // mapping run a straight can't be told from a corner until the segment is closed, or from the middle of an S bend.
+    // on_straight(): inside a run of stored straights (noise can split one straight into several), at least
+    // PATH_STRAIGHT_MARGIN_MM clear of both its ends.
+    bool on_straight(){
+      if(!started || !replaying){
+        return(false);
+      }
+      float start_mm = 0; // of the run of straights we're in.
+      float end_mm = 0;
+      for(byte i = 0; i < segment_count; i++){
+        if(segments[i].curvature != 0){
+          if(distance_mm < end_mm + segments[i].length_mm){
+            return(false);
+          }
+          start_mm = end_mm + segments[i].length_mm;
+        }
+        end_mm = end_mm + segments[i].length_mm;
+        if(distance_mm < end_mm && (i + 1 == segment_count || segments[i + 1].curvature != 0)){
+          return(distance_mm - start_mm > PATH_STRAIGHT_MARGIN_MM && end_mm - distance_mm > PATH_STRAIGHT_MARGIN_MM);
+        }
+      }
+      return(false);
+    }
+
+    // in_corner(): in a stored segment tighter than PATH_CORNER_CURVATURE.
+    bool in_corner(){
+      if(!started || !replaying){
+        return(false);
+      }
+      float end_mm = 0;
+      for(byte i = 0; i < segment_count; i++){
+        end_mm = end_mm + segments[i].length_mm;
+        if(distance_mm < end_mm){
+          return(abs(segments[i].curvature) > PATH_CORNER_CURVATURE * PATH_CURVATURE_SCALE);
+        }
+      }
+      return(false);
+    }
+
+    // Extend the current segment by a sample, or close it and start a new one if the curvature has changed.
+    void add_sample(float step, float turn){
+      if(segment_mm >= PATH_MIN_SEGMENT_MM){
+        float curvature = turn / step;
+        float segment_curvature = segment_turn / segment_mm;
+        if(abs(curvature - segment_curvature) > PATH_CURVATURE_TOLERANCE && segment_count < PATH_MAX_SEGMENTS - 1){
+          close_segment();
+          segment_mm = 0;
+          segment_turn = 0;
+        }
+      }
+      segment_mm = segment_mm + step;
+      segment_turn = segment_turn + turn;
+    }
+
+    // Store the current segment.
+    void close_segment(){
+      if(segment_mm < 1){
+        return;
+      }
+      float curvature = segment_turn / segment_mm;
+      if(abs(curvature) < PATH_STRAIGHT_CURVATURE){
+        curvature = 0;
+      }
+      segments[segment_count].length_mm = segment_mm;
+      segments[segment_count].curvature = constrain(curvature * PATH_CURVATURE_SCALE, -32000, 32000);
+      segment_count = segment_count + 1;
+    }
+
+    // The end of the track: finish the path where the line was last seen, work out its profile and start saving it.
+    void finish(){
+      if(!mapping || !started){
+        return;
+      }
+      mapping = false;
+      close_segment();
+      // the path stops at the end of the line, not where the robot gave up looking for it.
+      float total_mm = 0;
+      for(byte i = 0; i < segment_count; i++){
+        if(total_mm + segments[i].length_mm > line_end_mm){
+          segments[i].length_mm = line_end_mm - total_mm;
+          segment_count = (segments[i].length_mm > 0) ? i + 1 : i;
+          break;
+        }
+        total_mm = total_mm + segments[i].length_mm;
+      }
+      if(segment_count == 0){
+        return;
+      }
+      make_profile();
+      save_index = 0;
+    }
+
+    // Something went wrong with the run (the line was lost and we turned around), don't keep this path.
+    void abandon(){
+      mapping = false;
+      replaying = false;
+      segment_count = 0;
+    }
+    //*********************
+
+    // **** Speed profile ****
+    // Speed limits from the curvature, then a pass forwards (how fast can we have got here) and backwards (how fast
+    // can we be here and still brake for what's next).
+    void make_profile(){
+      for(byte i = 0; i < segment_count; i++){
+        float limit = speed_to_mm_s(PATH_MAX_SPEED);
+        float curvature = abs(segments[i].curvature) / PATH_CURVATURE_SCALE;
+        if(curvature > 0){
+          limit = min(limit, sqrt(PATH_LATERAL_ACCEL / curvature)); // mm/s^2 over 1/mm gives (mm/s)^2
+        }
+        segment_speed[i] = speed_to_byte(limit);
+      }
+
+      float entry[PATH_MAX_SEGMENTS + 1];
+      float end_speed = speed_to_mm_s(PATH_END_SPEED);
+      entry[0] = min(end_speed, byte_to_mm_s(segment_speed[0]));
+      for(byte i = 0; i < segment_count; i++){
+        float next_limit = (i + 1 < segment_count) ? byte_to_mm_s(segment_speed[i + 1]) : end_speed;
+        float reachable = sqrt(entry[i] * entry[i] + 2 * PATH_ACCEL * segments[i].length_mm);
+        entry[i + 1] = min(reachable, min(byte_to_mm_s(segment_speed[i]), next_limit));
+      }
+      for(int i = segment_count - 1; i >= 0; i--){
+        float stoppable = sqrt(entry[i + 1] * entry[i + 1] + 2 * PATH_BRAKE * segments[i].length_mm);
+        entry[i] = min(entry[i], stoppable);
+      }
+      for(byte i = 0; i <= segment_count; i++){
+        entry_speed[i] = speed_to_byte(entry[i]);
+      }
+    }
+
+    // Speed demand (counts per ms) for where we are on the path, looking PATH_LOOKAHEAD_MM ahead for corners.
+    float speed(){
+      float now = speed_at(distance_mm);
+      float ahead = speed_at(distance_mm + PATH_LOOKAHEAD_MM);
+      return(min(now, ahead));
+    }
+
+    // Profile speed (counts per ms) at a distance along the path.
+    float speed_at(float at_mm){
+      float start_mm = 0;
+      for(byte i = 0; i < segment_count; i++){
+        float length = segments[i].length_mm;
+        if(at_mm < start_mm + length){
+          float into = max(at_mm - start_mm, 0);
+          float entry = byte_to_mm_s(entry_speed[i]);
+          float exit = byte_to_mm_s(entry_speed[i + 1]);
+          float v = byte_to_mm_s(segment_speed[i]);
+          v = min(v, sqrt(entry * entry + 2 * PATH_ACCEL * into));
+          v = min(v, sqrt(exit * exit + 2 * PATH_BRAKE * (length - into)));
+          return(mm_s_to_speed(v));
+        }
+        start_mm = start_mm + length;
+      }
+      return(PATH_END_SPEED);
+    }
+
+    // counts per ms <-> mm/s <-> stored bytes.
+    static float speed_to_mm_s(float speed){
+      return(speed * PATH_MM_PER_COUNT * 1000.0);
+    }
+    static float mm_s_to_speed(float mm_s){
+      return(mm_s / (PATH_MM_PER_COUNT * 1000.0));
+    }
+    static byte speed_to_byte(float mm_s){
+      return(constrain(mm_s_to_speed(mm_s) * PATH_SPEED_SCALE + 0.5, 0, 255));
+    }
+    static float byte_to_mm_s(byte value){
+      return(speed_to_mm_s((float)value / PATH_SPEED_SCALE));
+    }
+    //*********************
+
+    // **** EEPROM ****
+    // Load the stored path for a replay run. Returns false if there isn't one (so this run should map it).
+    bool load(){
+      if(EEPROM.read(PATH_EEPROM_ADDR) != PATH_EEPROM_MAGIC){
+        return(false);
+      }
+      segment_count = EEPROM.read(PATH_EEPROM_ADDR + 1);
+      if(segment_count == 0 || segment_count > PATH_MAX_SEGMENTS){
+        segment_count = 0;
+        return(false);
+      }
+      for(byte i = 0; i < segment_count; i++){
+        EEPROM.get(PATH_EEPROM_ADDR + 2 + i * sizeof(PathSegment_s), segments[i]);
+      }
+      make_profile();
+      mapping = false;
+      replaying = true;
+      started = false;
+      return(true);
+    }
+
+    // Byte i of the stored image: magic, count, segments.
+    byte image_byte(int i){
+      if(i == 0){
+        return(PATH_EEPROM_MAGIC);
+      }
+      if(i == 1){
+        return(segment_count);
+      }
+      return(((const byte *)segments)[i - 2]);
+    }
+
+    // Write the next byte of a path being saved, call every loop(). Never waits on the EEPROM: returns as soon as
+    // a write is in progress. The magic byte is cleared first and written last.
+    void service(){
+      if(save_index < 0 || !eeprom_is_ready()){
+        return;
+      }
+      int size = 2 + segment_count * sizeof(PathSegment_s);
+      if(save_index == 0){
+        EEPROM.update(PATH_EEPROM_ADDR, 0);
+        save_index = 1;
+        return;
+      }
+      while(save_index < size){
+        int i = save_index;
+        save_index = save_index + 1;
+        if(EEPROM.read(PATH_EEPROM_ADDR + i) != image_byte(i)){
+          EEPROM.write(PATH_EEPROM_ADDR + i, image_byte(i));
+          return;
+        }
+      }
+      EEPROM.write(PATH_EEPROM_ADDR, PATH_EEPROM_MAGIC);
+      save_index = -1;
+    }
+    //*********************
+
+    // Print the path and its profile: one line per segment, length, radius (0 = straight), speed limit, entry speed.
+    void report(){
+      Serial.print("path,");
+      Serial.print(segment_count);
+      Serial.println(replaying ? ",replaying" : (mapping ? ",mapping" : ""));
+      for(byte i = 0; i < segment_count; i++){
+        Serial.print(segments[i].length_mm);
+        Serial.print(",");
+        Serial.print(segments[i].curvature ? PATH_CURVATURE_SCALE / segments[i].curvature : 0, 0);
+        Serial.print(",");
+        Serial.print((float)segment_speed[i] / PATH_SPEED_SCALE, 2);
+        Serial.print(",");
+        Serial.println((float)entry_speed[i] / PATH_SPEED_SCALE, 2);
+      }
+    }
+
+    // Wrap an angle difference to +-pi.
+    static float angle_wrap(float angle){
+      while(angle > 3.14159){
+        angle = angle - 2*3.14159;
+      }
+      while(angle < -3.14159){
+        angle = angle + 2*3.14159;
+      }
+      return(angle);
+    }
+};
+
+Path_c path;
+
+#endif
@@ -1,129 +1,246 @@
-#include "Arduino.h"
-// this #ifndef stops this file
-// from being included mored than
-// once by the compiler. 
-#ifndef _PID_H
-#define _PID_H
-
-
-
-
-// Class to contain generic PID algorithm.
-class PID_c {
-  public:
-
-    // we need a set of global class variables here
-
-    // update variables
-    float previous_error;
-    float prop_term; // proportional
-    float int_term; // integral
-    float diff_term; // differential
-    float int_sum; // persistant integration of error
-    float feedback_value; // store the latest feedback value
-
-    // variables to store gain values
-    float prop_gain;
-    float int_gain;
-    float diff_gain; 
-
-    // need a variable to store our previous time stamp
-    unsigned long pid_previous_ts;
-  
-    // Constructor, must exist.
-    PID_c() {
-
-    } 
-
-    void initialise( float kp, float ki, float kd){ // call me in void setup. Reset the pid controller each time you use it.
-      // set our gain values to those provided in setup.
-      prop_gain = kp;
-      int_gain = ki;
-      diff_gain = kd;
-
-      // set everything else to zero intially.
-      previous_error = 0.0;
-      prop_term = 0.0;
-      int_term = 0.0;
-      diff_term = 0.0;
-      int_sum = 0.0;
-      feedback_value = 0.0;
-
-      // begin timing
-      pid_previous_ts = millis();
-    }
-
-
-    void reset(){ // Required to handle any times where there is delay used or motors turned off - prevent integral term building up.
-      // reset all these values
-      previous_error = 0.0;
-      
-      // multiplies our demand to a measurable value
-      prop_term = 0.0;
-      int_term = 0.0;
-      
-      // counteracts any overshoot in speed changes (therefore usually negative)
-      diff_term = 0.0;
-      int_sum = 0.0;
-      feedback_value = 0.0;
-      pid_previous_ts = millis();
-    }
-
-
-    float update(float demand, float measurement){ // This function calculates and returns our feedback value.
-      
-      // declare required time values
-      unsigned long pid_current_ts = millis(); // current time stamp, set at start of each update.
-      unsigned long pid_dt; // differential in time
-
-      // declare our error variables
-      float error;
-      float diff_error;
-
-      // calculate the difference in time
-      pid_dt = pid_current_ts - pid_previous_ts;
-      // then turn this into a float for calcs later.
-      float float_pid_dt = (float)pid_dt;
-
-      // update previous time stamp for next call of update function
-      pid_previous_ts = millis();
-
-      // add a catch for the case where the difference in time is zero
-      // this can happen if you set the update to run too frequently.
-      // in this case, just return the previous value of feedback value:
-      if(pid_previous_ts == 0){// this can happen if you call it in microsecond increments
-        return feedback_value; // returning stops the function here.
-      }
-
-      // calculate our error value; the diff between what we have and what we want.
-      error = demand - measurement; // CHECK, PAUL HAS THIS AS MEASUREMENT - DEMAND
-
-      // using our error value we can calculate each of our p,i,d terms
-
-      // p is just multiplying through by our proportional gain
-      prop_term = prop_gain * error;
-
-      // i term iterates over the sum
-      // find the current sum by adding the integral of the error to all the previous:
-      int_sum = int_sum + (error*float_pid_dt);
-      // find the i term by multiplying this through by our integral gain
-      int_term = int_gain * int_sum;
-
-      // d term is the slope of the line - the difference in error divided by the difference in time
-      // that is: de/dt, so:
-      diff_error = (error - previous_error)/float_pid_dt;
-      // we now reset previous error for next update call
-      previous_error = error;
-      // our d term is then our differential error multiplied by the differential gain:
-      diff_term = diff_gain * diff_error;
-
-      // our feedback value is simply the sum of the three terms!
-      feedback_value = prop_term + int_term + diff_term;
-      // this is what we return!
-      return feedback_value;
-    }
-};
-
-
-
-#endif
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler. 
+#ifndef _PID_H
+#define _PID_H
+
+# include "fixed.h"
+# include "profiler.h"
+
+// In fixed point the integral is clamped well inside the Q15.16 range so it can't wrap around.
+# define PID_FIXED_INT_SUM_LIMIT 20000
+
+// Engine mode (see enable_engine()) times updates with micros(). A gap longer than this (e.g. the first update after
+// the controller sat unused) is treated as this long so one update can't make a huge integral step.
+# define PID_MAX_DT_US 30000
+
+
+
+// Class to contain generic PID algorithm.
+class PID_c {
+  public:
+
+    // we need a set of global class variables here
+
+    // update variables, real_t is fixed point when USE_FIXED_POINT is set (see fixed.h)
+    real_t previous_error;
+    real_t prop_term; // proportional
+    real_t int_term; // integral
+    real_t diff_term; // differential
+    real_t int_sum; // persistant integration of error
+    real_t feedback_value; // store the latest feedback value
+
+    // variables to store gain values
+    real_t prop_gain;
+    real_t int_gain;
+    real_t diff_gain; 
+
+    // need a variable to store our previous time stamp
+    unsigned long pid_previous_ts;
+
+    // **** Engine mode ****
+    // micros() timing, derivative on measurement with a low pass filter, output saturation with clamped and
+    // back-calculation anti-windup. Off by default so initialise() alone keeps the original behaviour.
+    bool engine_mode = false;
+    real_t output_limit = 0; // output saturates at +-output_limit
+    real_t int_limit = 0; // integral term (in output units) is clamped to +-int_limit
+    real_t backcalc_gain = 0; // how fast the integral unwinds by the amount the output was saturated, per ms
+    real_t d_filter_alpha = 1; // derivative low pass filter, 1 = no filtering, smaller = heavier filtering
+    real_t previous_measurement = 0;
+    bool have_measurement = false; // no derivative until there is a previous measurement to compare with.
+    real_t diff_filtered = 0; // filtered rate of change of the measurement (per ms)
+    //**********************
+  
+    // Constructor, must exist.
+    PID_c() {
+
+    } 
+
+    void initialise( float kp, float ki, float kd){ // call me in void setup. Reset the pid controller each time you use it.
+      // set our gain values to those provided in setup.
+      prop_gain = kp;
+      int_gain = ki;
+      diff_gain = kd;
+
+      // set everything else to zero intially.
+      previous_error = 0.0;
+      prop_term = 0.0;
+      int_term = 0.0;
+      diff_term = 0.0;
+      int_sum = 0.0;
+      feedback_value = 0.0;
+
+      // begin timing
+      pid_previous_ts = engine_mode ? micros() : millis();
+    }
+
+
+    // Switch this controller to engine mode. Call after initialise().
+    // output_lim: saturation of the output (e.g. the motors' +-MAX_PWM)
+    // integral_lim: clamp on the integral term, in output units
+    // kt: back-calculation gain, 0 to rely on the clamp alone
+    // alpha: derivative low pass filter coefficient (0 - 1], 1 = unfiltered
+    void enable_engine(float output_lim, float integral_lim, float kt, float alpha){
+      engine_mode = true;
+      output_limit = output_lim;
+      int_limit = integral_lim;
+      backcalc_gain = kt;
+      d_filter_alpha = alpha;
+      reset();
+    }
+
+
+    void reset(){ // Required to handle any times where there is delay used or motors turned off - prevent integral term building up.
+      // reset all these values
+      previous_error = 0.0;
+      
+      // multiplies our demand to a measurable value
+      prop_term = 0.0;
+      int_term = 0.0;
+      
+      // counteracts any overshoot in speed changes (therefore usually negative)
+      diff_term = 0.0;
+      int_sum = 0.0;
+      feedback_value = 0.0;
+      previous_measurement = 0.0;
+      have_measurement = false;
+      diff_filtered = 0.0;
+      pid_previous_ts = engine_mode ? micros() : millis();
+    }
+
+
+    // This function calculates and returns our feedback value.
+    // offset: an open loop output (e.g. the motor feedforward) added to the three terms. In engine mode it goes in
+    // before the saturation, so the clamp and the anti-windup see the whole output.
+    float update(float demand, float measurement, float offset = 0){
+      PROFILE_SCOPE(PROFILE_PID);
+      if(engine_mode){
+        return(update_engine(demand, measurement, offset));
+      }
+      
+      // declare required time values
+      unsigned long pid_current_ts = millis(); // current time stamp, set at start of each update.
+      unsigned long pid_dt; // differential in time
+
+      // declare our error variables
+      real_t error;
+      real_t diff_error;
+
+      // calculate the difference in time
+      pid_dt = pid_current_ts - pid_previous_ts;
+
+      // update previous time stamp for next call of update function
+      pid_previous_ts = pid_current_ts;
+
+      // add a catch for the case where the difference in time is zero
+      // this can happen if you set the update to run too frequently.
+      // in this case, just return the previous value of feedback value:
+      if(pid_dt == 0){// this can happen if you call it in microsecond increments
+        return real_to_float(feedback_value); // returning stops the function here.
+      }
+
+      // calculate our error value; the diff between what we have and what we want.
+      error = real_t(demand) - real_t(measurement); // CHECK, PAUL HAS THIS AS MEASUREMENT - DEMAND
+
+      // using our error value we can calculate each of our p,i,d terms
+
+      // p is just multiplying through by our proportional gain
+      prop_term = prop_gain * error;
+
+      // i term iterates over the sum
+      // find the current sum by adding the integral of the error to all the previous:
+      int_sum = int_sum + (error*real_t(pid_dt));
+      #if USE_FIXED_POINT
+      if(int_sum > real_t(PID_FIXED_INT_SUM_LIMIT)){
+        int_sum = PID_FIXED_INT_SUM_LIMIT;
+      }
+      else if(int_sum < real_t(-PID_FIXED_INT_SUM_LIMIT)){
+        int_sum = -PID_FIXED_INT_SUM_LIMIT;
+      }
+      #endif
+      // find the i term by multiplying this through by our integral gain
+      int_term = int_gain * int_sum;
+
+      // d term is the slope of the line - the difference in error divided by the difference in time
+      // that is: de/dt, so:
+      diff_error = real_div_int(error - previous_error, pid_dt);
+      // we now reset previous error for next update call
+      previous_error = error;
+      // our d term is then our differential error multiplied by the differential gain:
+      diff_term = diff_gain * diff_error;
+
+      // our feedback value is simply the sum of the three terms! (plus any offset)
+      feedback_value = prop_term + int_term + diff_term + real_t(offset);
+      // this is what we return!
+      return real_to_float(feedback_value);
+    }
+
+
+
+    // Engine mode update, see enable_engine().
+    float update_engine(float demand, float measurement, float offset = 0){
+      unsigned long pid_current_ts = micros();
+      unsigned long pid_dt = pid_current_ts - pid_previous_ts;
+      pid_previous_ts = pid_current_ts;
+
+      real_t meas = measurement;
+      if(!have_measurement){
+        previous_measurement = meas;
+        have_measurement = true;
+      }
+      if(pid_dt == 0){
+        return(real_to_float(feedback_value));
+      }
+      if(pid_dt > PID_MAX_DT_US){
+        pid_dt = PID_MAX_DT_US;
+      }
+      // gains stay in per-ms units so the same gains work in both modes. Both ways round from the whole number of
+      // us, so the derivative multiplies rather than doing a full (64 bit in fixed point) divide.
+      real_t dt_ms = real_ratio(pid_dt, 1000);
+      real_t per_ms = real_ratio(1000, pid_dt);
+
+      real_t error = real_t(demand) - meas;
+      prop_term = prop_gain * error;
+
+      // derivative on measurement: d(error)/dt = -d(measurement)/dt while the demand is constant, but a step in
+      // the demand no longer kicks the output. Low pass filtered to keep measurement noise out.
+      real_t diff_measurement = (meas - previous_measurement) * per_ms;
+      previous_measurement = meas;
+      diff_filtered = diff_filtered + d_filter_alpha * (diff_measurement - diff_filtered);
+      diff_term = -(diff_gain * diff_filtered);
+
+      // integral kept in output units so it can be clamped and unwound directly.
+      int_term = int_term + int_gain * error * dt_ms;
+      real_t unsaturated = prop_term + int_term + diff_term + real_t(offset);
+      feedback_value = unsaturated;
+      if(feedback_value > output_limit){
+        feedback_value = output_limit;
+      }
+      else if(feedback_value < -output_limit){
+        feedback_value = -output_limit;
+      }
+
+      // back-calculation: bleed the integral by how far the output was saturated. Never by more than that in one
+      // update, or a long tick (or a big offset) throws the integral past zero to the other side.
+      real_t unwind = backcalc_gain * dt_ms;
+      if(unwind > real_t(1)){
+        unwind = 1;
+      }
+      int_term = int_term + unwind * (feedback_value - unsaturated);
+      if(int_term > int_limit){
+        int_term = int_limit;
+      }
+      else if(int_term < -int_limit){
+        int_term = -int_limit;
+      }
+      int_sum = real_t(0); // unused in engine mode.
+      previous_error = error;
+
+      return(real_to_float(feedback_value));
+    }
+};
+
+
+
+#endif
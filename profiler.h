@@ -0,0 +1,151 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+// Set to 0 (or build with -DPROFILER_ENABLED=0) to compile the profiler out completely: PROFILE_SCOPE() becomes
+// nothing and no RAM is used.
+#ifndef PROFILER_ENABLED
+# define PROFILER_ENABLED 1
+#endif
+
+// The timers we keep. Add an id here and a name in profiler_names to time something new.
+# define PROFILE_LOOP 0 // the whole of loop()
+# define PROFILE_LINE_SENSOR 1 // reading and processing a line sensor frame
+# define PROFILE_PID 2 // one PID_c::update()
+# define PROFILE_KINEMATICS 3 // one Kinematics_c::update()
+# define PROFILE_MOTORS 4 // one Motors_c::setMotorPower()
+# define PROFILER_TIMERS 5
+
+// Histogram: bucket 0 counts times under PROFILER_FIRST_BUCKET_US, each bucket after doubles the limit, and the
+// last bucket counts everything longer. 16us - 4ms covers a PID update up to a whole loop.
+// micros() ticks in 4us steps on the 32U4, so times under that read 0 or 4.
+# define PROFILER_BUCKETS 10
+# define PROFILER_FIRST_BUCKET_US 16
+
+
+#if PROFILER_ENABLED
+
+const char * const profiler_names[PROFILER_TIMERS] = {"loop", "line_sensor", "pid", "kinematics", "motors"};
+
+// Statistics for one named timer. Fixed size: 36 bytes each.
+struct ProfileTimer_s {
+  unsigned long count;
+  unsigned long min_us;
+  unsigned long max_us;
+  unsigned long total_us; // for the mean. Wraps after ~70 minutes of total timed time, dump and reset before then.
+  uint16_t buckets[PROFILER_BUCKETS]; // saturate rather than wrap.
+};
+
+
+// Class to collect the timers and print them.
+class Profiler_c {
+  public:
+    ProfileTimer_s timers[PROFILER_TIMERS];
+
+    // Time source, micros() on the robot. Point it at the simulator's clock to profile off the robot.
+    unsigned long (*clock)() = micros;
+
+    // Constructor, must exist.
+    Profiler_c() {
+      reset();
+    }
+
+    void reset(){
+      for(byte i = 0; i < PROFILER_TIMERS; i++){
+        timers[i].count = 0;
+        timers[i].min_us = 0xFFFFFFFF;
+        timers[i].max_us = 0;
+        timers[i].total_us = 0;
+        for(byte b = 0; b < PROFILER_BUCKETS; b++){
+          timers[i].buckets[b] = 0;
+        }
+      }
+    }
+
+    // Add one measurement to a timer.
+    void record(byte id, unsigned long elapsed_us){
+      ProfileTimer_s & timer = timers[id];
+      timer.count = timer.count + 1;
+      timer.total_us = timer.total_us + elapsed_us;
+      if(elapsed_us < timer.min_us){
+        timer.min_us = elapsed_us;
+      }
+      if(elapsed_us > timer.max_us){
+        timer.max_us = elapsed_us;
+      }
+
+      // find the bucket by doubling the limit rather than dividing.
+      byte bucket = 0;
+      unsigned long limit = PROFILER_FIRST_BUCKET_US;
+      while(bucket < PROFILER_BUCKETS - 1 && elapsed_us >= limit){
+        bucket = bucket + 1;
+        limit = limit << 1;
+      }
+      if(timer.buckets[bucket] < 0xFFFF){
+        timer.buckets[bucket] = timer.buckets[bucket] + 1;
+      }
+    }
+
+    // Print one line per timer that has run: name,count,min,max,mean (us) then the histogram counts split by ';'.
+    void report(){
+      Serial.println("timer,n,min,max,mean,hist");
+      for(byte i = 0; i < PROFILER_TIMERS; i++){
+        ProfileTimer_s & timer = timers[i];
+        if(timer.count == 0){
+          continue;
+        }
+        Serial.print(profiler_names[i]);
+        Serial.print(",");
+        Serial.print(timer.count);
+        Serial.print(",");
+        Serial.print(timer.min_us);
+        Serial.print(",");
+        Serial.print(timer.max_us);
+        Serial.print(",");
+        Serial.print(timer.total_us / timer.count);
+        Serial.print(",");
+        for(byte b = 0; b < PROFILER_BUCKETS; b++){
+          if(b > 0){
+            Serial.print(";");
+          }
+          Serial.print(timer.buckets[b]);
+        }
+        Serial.println();
+      }
+    }
+};
+
+Profiler_c profiler;
+
+
+// Times from construction to the end of the enclosing scope, and records it under the timer id.
+class ProfileScope_c {
+  public:
+    byte id;
+    unsigned long start_us;
+
+    ProfileScope_c(byte timer_id) {
+      id = timer_id;
+      start_us = profiler.clock();
+    }
+
+    ~ProfileScope_c() {
+      profiler.record(id, profiler.clock() - start_us);
+    }
+};
+
+// PROFILE_SCOPE(PROFILE_PID); at the top of a block times the rest of the block.
+# define PROFILE_SCOPE_NAME(line) profile_scope_ ## line
+# define PROFILE_SCOPE_LINE(id, line) ProfileScope_c PROFILE_SCOPE_NAME(line)(id)
+# define PROFILE_SCOPE(id) PROFILE_SCOPE_LINE(id, __LINE__)
+
+#else
+
+# define PROFILE_SCOPE(id)
+
+#endif
+
+#endif
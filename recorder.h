@@ -0,0 +1,315 @@
+#include "Arduino.h"
+#include <EEPROM.h>
+#include <avr/eeprom.h>
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+// Run recorder: pose, e_line and state are delta encoded into EEPROM during a run so they can be downloaded
+// afterwards with no cable attached on the track. Send 'd' over serial to print the last run as CSV.
+# define RECORDER_ENABLED 1
+# define RECORDER_PERIOD_MS 200 // one sample every 200ms: ~25 bytes/s on a lap, so the ring holds the last ~30s.
+
+// EEPROM layout: the line sensor calibration sits at 0, the motor feedforward map at 32, the stored path at 96, the
+// recorder has everything from here to the end.
+// One run id byte, then a ring of fixed size blocks.
+# define RECORDER_EEPROM_START 232
+# define RECORDER_EEPROM_END 1024
+# define RECORDER_BLOCK_SIZE 64
+# define RECORDER_BLOCKS ((RECORDER_EEPROM_END - RECORDER_EEPROM_START - 1) / RECORDER_BLOCK_SIZE) // 12, 768 bytes.
+
+// Bytes waiting to be written. An EEPROM byte takes 3.4ms to write, service() only starts one when the last is done.
+# define RECORDER_QUEUE_SIZE 32 // must be a power of 2
+
+// Quantisation. Deltas are stored in these units.
+# define RECORDER_POSITION_MM 2 // x/y in 2mm steps
+# define RECORDER_THETA_STEPS 64 // theta steps per radian
+# define RECORDER_E_LINE_STEPS 16 // e_line steps per unit
+
+// Record formats. Every block starts with [run id][block sequence] and a key record, then:
+//   key record, 9 bytes: RECORDER_KEY, state, x, y, theta (int16 little endian), e_line (int8). Absolute values,
+//     written at the start of a block, on a state change, or when a delta won't fit.
+//   delta record, 3 bytes: dx, dy (int8, but never RECORDER_KEY/RECORDER_END), then dtheta (5 bits) and
+//     de_line (3 bits). e_line deltas are clamped, it catches up over the next samples instead of costing a key.
+//   RECORDER_END: no more records in this block.
+# define RECORDER_KEY 0x80
+# define RECORDER_END 0x81
+# define RECORDER_KEY_SIZE 9
+# define RECORDER_DELTA_SIZE 3
+# define RECORDER_DELTA_MIN -126 // dx/dy, -128 and -127 are the markers above
+# define RECORDER_DELTA_MAX 127
+# define RECORDER_THETA_DELTA_LIMIT 15 // 5 bit signed
+# define RECORDER_E_LINE_DELTA_LIMIT 3 // 3 bit signed
+
+
+#if RECORDER_ENABLED
+
+// Round to the nearest whole step.
+inline long recorder_quantise(float value, float steps){
+  float scaled = value * steps;
+  return((long)(scaled + (scaled >= 0 ? 0.5 : -0.5)));
+}
+
+
+// Class to record a run into EEPROM and read it back.
+class Recorder_c {
+  public:
+    bool recording = false;
+    byte run_id = 0;
+    byte block = 0; // block being filled
+    byte block_sequence = 0; // counts up every block, so the ring can be put back in order after it wraps.
+    byte block_fill = 0; // bytes used in the current block, 0 = start a new block on the next sample.
+    unsigned long samples = 0;
+    unsigned long dropped = 0; // samples skipped because the write queue was full.
+
+    // the values the decoder will have reconstructed so far, deltas are taken from these so errors don't add up.
+    long last_x = 0;
+    long last_y = 0;
+    long last_theta = 0;
+    long last_e_line = 0;
+    byte last_state = 0;
+
+    // write queue: EEPROM address and value per byte.
+    unsigned int queue_address[RECORDER_QUEUE_SIZE];
+    byte queue_value[RECORDER_QUEUE_SIZE];
+    byte queue_head = 0;
+    byte queue_tail = 0;
+
+    // Constructor, must exist.
+    Recorder_c() {
+
+    }
+
+    // Start a new run. The previous run stays readable until its blocks are overwritten.
+    void start(){
+      run_id = EEPROM.read(RECORDER_EEPROM_START) + 1;
+      if(run_id == 0xFF){ // erased EEPROM reads 0xFF, never use it as a run id.
+        run_id = 0;
+      }
+      queue_head = 0;
+      queue_tail = 0;
+      queue_byte(RECORDER_EEPROM_START, run_id);
+      block = 0;
+      block_sequence = 0;
+      block_fill = 0;
+      samples = 0;
+      dropped = 0;
+      recording = true;
+    }
+
+    void stop(){
+      recording = false; // whatever is queued still gets written by service().
+    }
+
+    // Record one sample. Cheap: it only queues the bytes, service() writes them.
+    void sample(float x_mm, float y_mm, float theta, float e_line, byte state){
+      if(!recording){
+        return;
+      }
+      long x = recorder_quantise(x_mm, 1.0 / RECORDER_POSITION_MM);
+      long y = recorder_quantise(y_mm, 1.0 / RECORDER_POSITION_MM);
+      long t = recorder_quantise(theta, RECORDER_THETA_STEPS);
+      long e = recorder_quantise(e_line, RECORDER_E_LINE_STEPS);
+      long dx = x - last_x;
+      long dy = y - last_y;
+      long dt = t - last_theta;
+      long de = constrain(e - last_e_line, -RECORDER_E_LINE_DELTA_LIMIT, RECORDER_E_LINE_DELTA_LIMIT);
+
+      bool delta_fits = block_fill > 0 && state == last_state
+                        && dx >= RECORDER_DELTA_MIN && dx <= RECORDER_DELTA_MAX
+                        && dy >= RECORDER_DELTA_MIN && dy <= RECORDER_DELTA_MAX
+                        && dt >= -RECORDER_THETA_DELTA_LIMIT && dt <= RECORDER_THETA_DELTA_LIMIT;
+      byte record_size = delta_fits ? RECORDER_DELTA_SIZE : RECORDER_KEY_SIZE;
+      bool new_block = block_fill == 0 || block_fill + record_size > RECORDER_BLOCK_SIZE;
+      if(new_block){
+        record_size = RECORDER_KEY_SIZE;
+        delta_fits = false;
+      }
+
+      // all or nothing: header + record + end marker must fit in the queue.
+      if(queue_space() < record_size + 2 + 1){
+        dropped = dropped + 1;
+        return;
+      }
+
+      if(new_block){
+        if(block_fill > 0){
+          block = (block + 1) % RECORDER_BLOCKS;
+          block_sequence = block_sequence + 1;
+        }
+        block_fill = 0;
+        put(run_id);
+        put(block_sequence);
+      }
+
+      if(delta_fits){
+        put(dx);
+        put(dy);
+        put(((dt & 0x1F) << 3) | (de & 0x07));
+        last_x = x;
+        last_y = y;
+        last_theta = t;
+        last_e_line = last_e_line + de;
+      }
+      else{
+        e = constrain(e, -128, 127);
+        put(RECORDER_KEY);
+        put(state);
+        put(x & 0xFF);
+        put((x >> 8) & 0xFF);
+        put(y & 0xFF);
+        put((y >> 8) & 0xFF);
+        put(t & 0xFF);
+        put((t >> 8) & 0xFF);
+        put(e);
+        last_x = x;
+        last_y = y;
+        last_theta = t;
+        last_e_line = e;
+        last_state = state;
+      }
+
+      // mark the end of the data, the next record overwrites it.
+      if(block_fill < RECORDER_BLOCK_SIZE){
+        queue_byte(block_start(block) + block_fill, RECORDER_END);
+      }
+      samples = samples + 1;
+    }
+
+    // Write queued bytes, call every loop(). Never waits: returns as soon as a write is in progress.
+    void service(){
+      while(queue_tail != queue_head){
+        if(!eeprom_is_ready()){
+          return;
+        }
+        unsigned int address = queue_address[queue_tail];
+        byte value = queue_value[queue_tail];
+        queue_tail = (queue_tail + 1) & (RECORDER_QUEUE_SIZE - 1);
+        if(EEPROM.read(address) != value){ // skip bytes that are already right, saves time and wear.
+          EEPROM.write(address, value); // starts the write and returns.
+          return;
+        }
+      }
+    }
+
+    // Print the last recorded run as CSV: t_ms,x_mm,y_mm,theta,e_line,state, then a summary line.
+    // Blocking (it prints the whole run), use it after the run.
+    void dump(){
+      byte id = EEPROM.read(RECORDER_EEPROM_START);
+
+      // find the oldest block of the run: one whose predecessor in the ring isn't the previous block of the run.
+      int first = -1;
+      for(byte i = 0; i < RECORDER_BLOCKS; i++){
+        byte previous = (i + RECORDER_BLOCKS - 1) % RECORDER_BLOCKS;
+        if(EEPROM.read(block_start(i)) != id){
+          continue;
+        }
+        if(EEPROM.read(block_start(previous)) != id
+           || (byte)(EEPROM.read(block_start(previous) + 1) + 1) != EEPROM.read(block_start(i) + 1)){
+          first = i;
+          break;
+        }
+      }
+
+      Serial.println("t_ms,x_mm,y_mm,theta,e_line,state");
+      unsigned long n = 0;
+      unsigned int bytes = 1;
+      if(first >= 0){
+        long x = 0;
+        long y = 0;
+        long t = 0;
+        long e = 0;
+        byte state = 0;
+        byte i = first;
+        byte sequence = EEPROM.read(block_start(i) + 1);
+        for(byte visited = 0; visited < RECORDER_BLOCKS; visited++){
+          if(EEPROM.read(block_start(i)) != id || EEPROM.read(block_start(i) + 1) != sequence){
+            break;
+          }
+          unsigned int address = block_start(i) + 2;
+          unsigned int end = block_start(i) + RECORDER_BLOCK_SIZE;
+          while(address < end){
+            byte code = EEPROM.read(address);
+            if(code == RECORDER_END){
+              break;
+            }
+            if(code == RECORDER_KEY){
+              if(address + RECORDER_KEY_SIZE > end){
+                break;
+              }
+              state = EEPROM.read(address + 1);
+              x = (int16_t)(EEPROM.read(address + 2) | (EEPROM.read(address + 3) << 8));
+              y = (int16_t)(EEPROM.read(address + 4) | (EEPROM.read(address + 5) << 8));
+              t = (int16_t)(EEPROM.read(address + 6) | (EEPROM.read(address + 7) << 8));
+              e = (int8_t)EEPROM.read(address + 8);
+              address = address + RECORDER_KEY_SIZE;
+            }
+            else{
+              if(address + RECORDER_DELTA_SIZE > end){
+                break;
+              }
+              byte packed = EEPROM.read(address + 2);
+              x = x + (int8_t)code;
+              y = y + (int8_t)EEPROM.read(address + 1);
+              t = t + ((int8_t)packed >> 3); // arithmetic shift keeps the sign of the top 5 bits.
+              e = e + ((int8_t)(packed << 5) >> 5);
+              address = address + RECORDER_DELTA_SIZE;
+            }
+            Serial.print(n * RECORDER_PERIOD_MS);
+            Serial.print(",");
+            Serial.print(x * RECORDER_POSITION_MM);
+            Serial.print(",");
+            Serial.print(y * RECORDER_POSITION_MM);
+            Serial.print(",");
+            Serial.print((float)t / RECORDER_THETA_STEPS, 3);
+            Serial.print(",");
+            Serial.print((float)e / RECORDER_E_LINE_STEPS, 3);
+            Serial.print(",");
+            Serial.println(state);
+            n = n + 1;
+          }
+          bytes = bytes + (address - block_start(i));
+          i = (i + 1) % RECORDER_BLOCKS;
+          sequence = sequence + 1;
+        }
+      }
+
+      // summary: samples, EEPROM bytes they took, and bytes per second of run.
+      Serial.print("samples: ");
+      Serial.print(n);
+      Serial.print(", bytes: ");
+      Serial.print(bytes);
+      Serial.print(", bytes/s: ");
+      Serial.println(n ? (float)bytes * 1000 / (n * RECORDER_PERIOD_MS) : 0.0, 1);
+    }
+
+  private:
+    // EEPROM address of a block's header (run id, sequence), its records follow.
+    unsigned int block_start(byte b){
+      return(RECORDER_EEPROM_START + 1 + (unsigned int)b * RECORDER_BLOCK_SIZE);
+    }
+
+    byte queue_space(){
+      return((queue_tail - queue_head - 1) & (RECORDER_QUEUE_SIZE - 1));
+    }
+
+    void queue_byte(unsigned int address, byte value){
+      queue_address[queue_head] = address;
+      queue_value[queue_head] = value;
+      queue_head = (queue_head + 1) & (RECORDER_QUEUE_SIZE - 1);
+    }
+
+    // next byte of the current block.
+    void put(byte value){
+      queue_byte(block_start(block) + block_fill, value);
+      block_fill = block_fill + 1;
+    }
+};
+
+Recorder_c recorder;
+
+#endif
+
+#endif
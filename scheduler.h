@@ -0,0 +1,155 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+# define SCHEDULER_MAX_TASKS 8
+
+
+// A registered periodic task and its timing statistics.
+// Tasks are plain functions with a context pointer (usually the object whose method they call).
+typedef void (*task_function_t)(void * context);
+
+struct Task_s {
+  const char * name;
+  task_function_t function;
+  void * context;
+  unsigned long period_us;
+  unsigned long next_due_us; // fixed phase: always advanced by whole periods, never reset to "now".
+  byte priority; // higher runs first when several tasks are due together.
+
+  // statistics
+  unsigned long runs;
+  unsigned long overruns; // number of times whole periods were missed (and skipped).
+  unsigned long wcet_us; // worst case execution time.
+  unsigned long max_jitter_us; // worst lateness of a start relative to its due time.
+};
+
+
+// Class for a small cooperative fixed rate scheduler. Call run() as often as possible from loop().
+// Each task becomes due every period_us from the time start() was called, no matter how long it or anything else
+// took, so there is no drift. A task that falls more than a whole period behind counts an overrun and skips the
+// periods it missed (it doesn't try to catch up with a burst of runs).
+class Scheduler_c {
+  public:
+    Task_s tasks[SCHEDULER_MAX_TASKS];
+    byte task_count = 0;
+    bool running = false; // guards against run() being called from inside a task.
+
+    // Time source, micros() on the robot. Point it at a fake clock to test the scheduler off the robot.
+    unsigned long (*clock)() = micros;
+
+    // Constructor, must exist.
+    Scheduler_c() {
+
+    }
+
+    // Register a task. phase_us offsets its first due time so tasks with the same period don't all land together.
+    // Returns the task index, or -1 if the table is full.
+    int add_task(const char * name, task_function_t function, void * context, unsigned long period_us, byte priority, unsigned long phase_us = 0){
+      if(task_count >= SCHEDULER_MAX_TASKS){
+        return(-1);
+      }
+      Task_s & task = tasks[task_count];
+      task.name = name;
+      task.function = function;
+      task.context = context;
+      task.period_us = period_us;
+      task.next_due_us = phase_us; // made absolute in start()
+      task.priority = priority;
+      reset_stats(task);
+      task_count = task_count + 1;
+      return(task_count - 1);
+    }
+
+    // Start the clock: every task becomes due one phase after now.
+    void start(){
+      unsigned long now = clock();
+      for(byte i = 0; i < task_count; i++){
+        tasks[i].next_due_us = now + tasks[i].next_due_us;
+      }
+    }
+
+    // Run every task that is due, highest priority first, each at most once per call.
+    // Returns the number of tasks run.
+    byte run(){
+      if(running){
+        return(0);
+      }
+      running = true;
+      byte ran = 0;
+      unsigned long done_mask = 0;
+
+      while(true){
+        // pick the highest priority due task we haven't run this call.
+        int next = -1;
+        unsigned long now = clock();
+        for(byte i = 0; i < task_count; i++){
+          if(!(done_mask & (1UL << i)) && (long)(now - tasks[i].next_due_us) >= 0){
+            if(next < 0 || tasks[i].priority > tasks[next].priority){
+              next = i;
+            }
+          }
+        }
+        if(next < 0){
+          break;
+        }
+
+        Task_s & task = tasks[next];
+        done_mask = done_mask | (1UL << next);
+        unsigned long lateness = now - task.next_due_us;
+        if(lateness > task.max_jitter_us){
+          task.max_jitter_us = lateness;
+        }
+
+        task.function(task.context);
+
+        unsigned long execution = clock() - now;
+        if(execution > task.wcet_us){
+          task.wcet_us = execution;
+        }
+        task.runs = task.runs + 1;
+
+        // next slot on the fixed grid. If we're already a whole period or more behind, skip the missed slots.
+        task.next_due_us = task.next_due_us + task.period_us;
+        if(task.period_us > 0 && lateness >= task.period_us){
+          unsigned long missed = lateness / task.period_us;
+          task.overruns = task.overruns + missed;
+          task.next_due_us = task.next_due_us + missed * task.period_us;
+        }
+        ran = ran + 1;
+      }
+
+      running = false;
+      return(ran);
+    }
+
+    void reset_stats(Task_s & task){
+      task.runs = 0;
+      task.overruns = 0;
+      task.wcet_us = 0;
+      task.max_jitter_us = 0;
+    }
+
+    // Print one line per task: name, period, runs, worst case execution time, worst jitter, overruns (all us).
+    void report(){
+      Serial.println("task,period,runs,wcet,jitter,overruns");
+      for(byte i = 0; i < task_count; i++){
+        Serial.print(tasks[i].name);
+        Serial.print(",");
+        Serial.print(tasks[i].period_us);
+        Serial.print(",");
+        Serial.print(tasks[i].runs);
+        Serial.print(",");
+        Serial.print(tasks[i].wcet_us);
+        Serial.print(",");
+        Serial.print(tasks[i].max_jitter_us);
+        Serial.print(",");
+        Serial.println(tasks[i].overruns);
+      }
+    }
+};
+
+#endif
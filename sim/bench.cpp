@@ -0,0 +1,433 @@
+// Lap benchmark: many simulated laps of the robot code over the built in tracks, run in parallel, results as JSON.
+//   sim_bench [--tracks default,sharp,...] [--laps n] [--jobs n] [--seed n] [--motor-spread f] [--right-wheel scale]
+//             [--time-limit s] [--output file.json] [--summary-only] [--replay] [--retrace 0|1] [--fusion 0|1]
+// The robot code is all globals, so every lap runs in its own forked process, started from the untouched parent.
+// With --replay each lap is two runs: one from a blank EEPROM that maps the track (path.h), then one from the EEPROM it
+// left behind, which follows the stored path's speed profile. The mapping run goes in a grandchild process.
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "hal/hal_sim.h"
+#include "hal/avr/eeprom.h"
+#include "sim_lap.h"
+#include "track.h"
+#include "world.h"
+
+
+# define BENCH_REPLAY_SEED 1000 // the replay run's sensor noise seed is the mapping run's plus this.
+
+
+// One lap to run: which track, and the seed for its sensor noise and motor mismatch.
+struct BenchLap_s {
+  int track;
+  uint32_t seed;
+  float right_motor;
+  float right_wheel;
+  bool done = false;
+  bool crashed = false;
+  LapResult_s result; // with --replay, the replay run.
+  LapResult_s mapping; // with --replay, the mapping run before it.
+};
+
+// What a lap's process sends back.
+struct BenchResult_s {
+  LapResult_s result;
+  LapResult_s mapping;
+};
+
+struct BenchJob_s {
+  pid_t pid;
+  int fd; // read end of the child's result pipe
+  size_t lap;
+};
+
+
+static void usage(){
+  fprintf(stderr,
+          "usage: sim_bench [options]\n"
+          "  --tracks a,b,...     built in tracks to run (default: all but dead_end)\n"
+          "  --laps n             laps per track (default 20)\n"
+          "  --jobs n             laps run at once (default: number of cores)\n"
+          "  --seed n             first seed, lap i of a track uses seed + i (default 1)\n"
+          "  --motor-spread f     right motor strength varies by up to +-f per lap (default 0.05)\n"
+          "  --right-wheel scale  right wheel size relative to what the robot code assumes (default 1)\n"
+          "  --time-limit s       simulated seconds before a lap counts as not home (default 120)\n"
+          "  --output file.json   write the results here (default: stdout)\n"
+          "  --summary-only       leave the per lap results out\n"
+          "  --replay             map each track on a first run, then time a second run replaying the stored path\n"
+          "  --retrace 0|1        return home straight to the start (0) or back along the outbound path (1)\n"
+          "  --fusion 0|1         pose estimate from odometry alone (0) or corrected by the line (1)\n");
+}
+
+// Run one lap in this process, from whatever is in the simulated EEPROM.
+static LapResult_s run_one(const Track_c & prototype, const BenchLap_s & lap, uint32_t seed, const LapOptions_s & options){
+  Track_c track = prototype;
+  World_c world(&track, seed);
+  world.right_motor_scale = lap.right_motor;
+  world.right_wheel_scale = lap.right_wheel;
+  hal_serial_output(0);
+  return(run_lap(world, options));
+}
+
+// Grandchild side of a replay lap: the mapping run, sending back its result and the EEPROM it leaves.
+static void run_mapping(const Track_c & prototype, const BenchLap_s & lap, const LapOptions_s & options, int fd){
+  LapResult_s result = run_one(prototype, lap, lap.seed, options);
+  bool sent = write(fd, &result, sizeof(result)) == (ssize_t)sizeof(result)
+              && write(fd, hal_eeprom_data(), HAL_EEPROM_SIZE) == HAL_EEPROM_SIZE;
+  _exit(sent ? 0 : 1);
+}
+
+// Read exactly size bytes from a pipe.
+static bool read_all(int fd, void * data, size_t size){
+  uint8_t * p = (uint8_t *)data;
+  while(size > 0){
+    ssize_t n = read(fd, p, size);
+    if(n <= 0){
+      return(false);
+    }
+    p = p + n;
+    size = size - n;
+  }
+  return(true);
+}
+
+// Child side: run the lap (after its mapping run, with --replay) and send the result back.
+static void run_child(const Track_c & prototype, BenchLap_s & lap, const LapOptions_s & options, bool replay, int fd){
+  BenchResult_s out;
+  if(replay){
+    int fds[2];
+    if(pipe(fds) != 0){
+      _exit(1);
+    }
+    fflush(0);
+    pid_t pid = fork();
+    if(pid < 0){
+      _exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      run_mapping(prototype, lap, options, fds[1]);
+    }
+    close(fds[1]);
+    bool got = read_all(fds[0], &out.mapping, sizeof(out.mapping)) && read_all(fds[0], hal_eeprom_data(), HAL_EEPROM_SIZE);
+    int status;
+    waitpid(pid, &status, 0);
+    if(!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+      _exit(1);
+    }
+    out.result = run_one(prototype, lap, lap.seed + BENCH_REPLAY_SEED, options);
+  }
+  else{
+    out.result = run_one(prototype, lap, lap.seed, options);
+  }
+  ssize_t n = write(fd, &out, sizeof(out)); // well under PIPE_BUF, so it's one atomic write.
+  _exit(n == (ssize_t)sizeof(out) ? 0 : 1);
+}
+
+// Summary statistics of one measurement over a set of laps.
+struct BenchStat_s {
+  double mean = 0, min = 0, p50 = 0, p95 = 0, max = 0;
+  size_t n = 0;
+};
+
+static BenchStat_s stat_of(std::vector<double> values){
+  BenchStat_s s;
+  s.n = values.size();
+  if(values.empty()){
+    return(s);
+  }
+  std::sort(values.begin(), values.end());
+  double sum = 0;
+  for(size_t i = 0; i < values.size(); i++){
+    sum = sum + values[i];
+  }
+  s.mean = sum / values.size();
+  s.min = values.front();
+  s.max = values.back();
+  s.p50 = values[(values.size() - 1) / 2];
+  s.p95 = values[(size_t)ceil(0.95 * (values.size() - 1))];
+  return(s);
+}
+
+static void print_stat(FILE * out, const char * name, const BenchStat_s & s, bool last){
+  fprintf(out, "      \"%s\": {\"n\": %zu, \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"max\": %.4f}%s\n",
+          name, s.n, s.mean, s.min, s.p50, s.p95, s.max, last ? "" : ",");
+}
+
+int main(int argc, char ** argv){
+  std::vector<int> tracks;
+  int laps_per_track = 20;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t seed = 1;
+  float motor_spread = 0.05;
+  float right_wheel = 1.0;
+  bool summary_only = false;
+  bool replay = false;
+  const char * output_file = 0;
+  LapOptions_s options;
+
+  for(int i = 1; i < argc; i++){
+    const char * arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if(!strcmp(arg, "--tracks") && has_value){
+      std::string list = argv[++i];
+      size_t start = 0;
+      while(start <= list.size()){
+        size_t end = list.find(',', start);
+        if(end == std::string::npos){
+          end = list.size();
+        }
+        std::string name = list.substr(start, end - start);
+        int found = -1;
+        for(int t = 0; t < TRACK_BUILT_IN; t++){
+          if(name == track_names[t]){
+            found = t;
+          }
+        }
+        if(found < 0){
+          fprintf(stderr, "unknown track %s\n", name.c_str());
+          return(2);
+        }
+        tracks.push_back(found);
+        start = end + 1;
+      }
+    }
+    else if(!strcmp(arg, "--laps") && has_value){
+      laps_per_track = atoi(argv[++i]);
+    }
+    else if(!strcmp(arg, "--jobs") && has_value){
+      jobs = atol(argv[++i]);
+    }
+    else if(!strcmp(arg, "--seed") && has_value){
+      seed = strtoul(argv[++i], 0, 10);
+    }
+    else if(!strcmp(arg, "--motor-spread") && has_value){
+      motor_spread = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--right-wheel") && has_value){
+      right_wheel = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--time-limit") && has_value){
+      options.time_limit_s = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--output") && has_value){
+      output_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--summary-only")){
+      summary_only = true;
+    }
+    else if(!strcmp(arg, "--retrace") && has_value){
+      options.retrace = atoi(argv[++i]);
+    }
+    else if(!strcmp(arg, "--fusion") && has_value){
+      options.fusion = atoi(argv[++i]);
+    }
+    else if(!strcmp(arg, "--replay")){
+      replay = true;
+    }
+    else{
+      usage();
+      return(2);
+    }
+  }
+  if(tracks.empty()){
+    for(int t = 0; t < TRACK_LAPS; t++){
+      tracks.push_back(t);
+    }
+  }
+  if(jobs < 1){
+    jobs = 1;
+  }
+
+  // tracks are drawn once here, the children get copies for free.
+  std::vector<Track_c> track_images(TRACK_BUILT_IN);
+  for(size_t i = 0; i < tracks.size(); i++){
+    track_images[tracks[i]].build(track_names[tracks[i]]);
+  }
+
+  std::vector<BenchLap_s> laps;
+  for(size_t i = 0; i < tracks.size(); i++){
+    for(int n = 0; n < laps_per_track; n++){
+      BenchLap_s lap;
+      lap.track = tracks[i];
+      lap.seed = seed + n;
+      std::mt19937 motor_random(lap.seed);
+      lap.right_motor = 1 + motor_spread * std::uniform_real_distribution<float>(-1, 1)(motor_random);
+      lap.right_wheel = right_wheel;
+      laps.push_back(lap);
+    }
+  }
+
+  uint64_t host_start = hal_host_ns();
+  std::vector<BenchJob_s> running;
+  size_t next = 0;
+  size_t finished = 0;
+  while(finished < laps.size()){
+    // keep every job slot busy.
+    while(next < laps.size() && (long)running.size() < jobs){
+      int fds[2];
+      if(pipe(fds) != 0){
+        perror("pipe");
+        return(1);
+      }
+      fflush(0);
+      pid_t pid = fork();
+      if(pid < 0){
+        perror("fork");
+        return(1);
+      }
+      if(pid == 0){
+        close(fds[0]);
+        run_child(track_images[laps[next].track], laps[next], options, replay, fds[1]);
+      }
+      close(fds[1]);
+      BenchJob_s job = {pid, fds[0], next};
+      running.push_back(job);
+      next = next + 1;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if(pid < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("wait");
+      return(1);
+    }
+    for(size_t j = 0; j < running.size(); j++){
+      if(running[j].pid != pid){
+        continue;
+      }
+      BenchLap_s & lap = laps[running[j].lap];
+      BenchResult_s got;
+      ssize_t n = read(running[j].fd, &got, sizeof(got));
+      lap.crashed = !(WIFEXITED(status) && WEXITSTATUS(status) == 0 && n == (ssize_t)sizeof(got));
+      lap.result = got.result;
+      lap.mapping = got.mapping;
+      lap.done = true;
+      close(running[j].fd);
+      running.erase(running.begin() + j);
+      finished = finished + 1;
+      break;
+    }
+  }
+  double host_seconds = (hal_host_ns() - host_start) / 1e9;
+
+  FILE * out = output_file ? fopen(output_file, "w") : stdout;
+  if(!out){
+    fprintf(stderr, "can't write %s\n", output_file);
+    return(1);
+  }
+  double simulated_seconds = 0;
+  for(size_t i = 0; i < laps.size(); i++){
+    simulated_seconds = simulated_seconds + (laps[i].crashed ? 0 : laps[i].result.time_s);
+  }
+  fprintf(out, "{\n");
+  fprintf(out, "  \"laps\": %zu,\n  \"jobs\": %ld,\n  \"seed\": %u,\n  \"motor_spread\": %.3f,\n  \"right_wheel\": %.4f,\n",
+          laps.size(), jobs, seed, motor_spread, right_wheel);
+  fprintf(out, "  \"replay\": %s,\n  \"retrace\": %d,\n  \"fusion\": %d,\n", replay ? "true" : "false", options.retrace,
+          options.fusion);
+  fprintf(out, "  \"host_seconds\": %.3f,\n  \"simulated_seconds\": %.1f,\n", host_seconds, simulated_seconds);
+
+  // per track summary. Lap time and home error are over the laps that got home.
+  fprintf(out, "  \"tracks\": {\n");
+  for(size_t t = 0; t < tracks.size(); t++){
+    std::vector<double> lap_time, track_time, mapping_track_time, track_speedup, return_time, line_error, line_losses,
+                        home_error, odom_error, max_odom_error, est_error, max_est_error, wheel_scale, cpu;
+    size_t home = 0;
+    size_t crashed = 0;
+    for(size_t i = 0; i < laps.size(); i++){
+      const BenchLap_s & lap = laps[i];
+      if(lap.track != tracks[t]){
+        continue;
+      }
+      if(lap.crashed){
+        crashed = crashed + 1;
+        continue;
+      }
+      const LapResult_s & r = lap.result;
+      if(r.track_time_s > 0){
+        track_time.push_back(r.track_time_s);
+        if(replay && lap.mapping.track_time_s > 0){
+          mapping_track_time.push_back(lap.mapping.track_time_s);
+          track_speedup.push_back(lap.mapping.track_time_s / r.track_time_s);
+        }
+      }
+      line_error.push_back(r.max_line_error_mm);
+      line_losses.push_back(r.line_losses);
+      odom_error.push_back(r.odom_error_mm);
+      max_odom_error.push_back(r.max_odom_error_mm);
+      est_error.push_back(r.est_error_mm);
+      max_est_error.push_back(r.max_est_error_mm);
+      wheel_scale.push_back(r.wheel_scale);
+      cpu.push_back(r.cpu_ns_per_tick);
+      if(r.home){
+        home = home + 1;
+        lap_time.push_back(r.lap_time_s);
+        return_time.push_back(r.return_time_s);
+        home_error.push_back(r.home_error_mm);
+      }
+    }
+    fprintf(out, "    \"%s\": {\n", track_names[tracks[t]]);
+    fprintf(out, "      \"laps\": %d, \"home\": %zu, \"crashed\": %zu, \"home_rate\": %.4f,\n", laps_per_track, home,
+            crashed, laps_per_track ? (double)home / laps_per_track : 0.0);
+    print_stat(out, "lap_time_s", stat_of(lap_time), false);
+    print_stat(out, "track_time_s", stat_of(track_time), false);
+    if(replay){
+      print_stat(out, "mapping_track_time_s", stat_of(mapping_track_time), false);
+      print_stat(out, "track_speedup", stat_of(track_speedup), false);
+    }
+    print_stat(out, "max_line_error_mm", stat_of(line_error), false);
+    print_stat(out, "line_losses", stat_of(line_losses), false);
+    print_stat(out, "return_time_s", stat_of(return_time), false);
+    print_stat(out, "return_error_mm", stat_of(home_error), false);
+    print_stat(out, "odometry_error_mm", stat_of(odom_error), false);
+    print_stat(out, "max_odometry_error_mm", stat_of(max_odom_error), false);
+    print_stat(out, "estimate_error_mm", stat_of(est_error), false);
+    print_stat(out, "max_estimate_error_mm", stat_of(max_est_error), false);
+    print_stat(out, "wheel_scale", stat_of(wheel_scale), false);
+    print_stat(out, "cpu_ns_per_tick", stat_of(cpu), true);
+    fprintf(out, "    }%s\n", t + 1 < tracks.size() ? "," : "");
+  }
+  fprintf(out, "  }%s\n", summary_only ? "" : ",");
+
+  if(!summary_only){
+    fprintf(out, "  \"results\": [\n");
+    for(size_t i = 0; i < laps.size(); i++){
+      const BenchLap_s & lap = laps[i];
+      const LapResult_s & r = lap.result;
+      fprintf(out, "    {\"track\": \"%s\", \"seed\": %u, \"right_motor\": %.4f, \"crashed\": %s", track_names[lap.track],
+              lap.seed, lap.right_motor, lap.crashed ? "true" : "false");
+      if(!lap.crashed){
+        fprintf(out, ", \"home\": %s, \"replay\": %s, \"time_s\": %.3f, \"lap_time_s\": %.3f, \"track_time_s\": %.3f, "
+                "\"return_time_s\": %.3f, \"max_line_error_mm\": %.2f, "
+                "\"mean_line_error_mm\": %.2f, \"line_losses\": %lu, \"return_error_mm\": %.1f, \"odometry_error_mm\": %.2f, "
+                "\"estimate_error_mm\": %.2f, \"wheel_scale\": %.4f, \"landmarks\": %u, \"end_x_mm\": %.1f, \"end_y_mm\": %.1f, \"late_loops\": %lu, \"control_ticks\": %lu, \"cpu_ns_per_tick\": %.0f",
+                r.home ? "true" : "false", r.replay ? "true" : "false", r.time_s, r.lap_time_s, r.track_time_s, r.return_time_s, r.max_line_error_mm, r.mean_line_error_mm, r.line_losses,
+                r.home_error_mm, r.odom_error_mm, r.est_error_mm, r.wheel_scale, r.landmarks, r.true_x, r.true_y, r.late_loops, r.control_ticks, r.cpu_ns_per_tick);
+        if(replay){
+          fprintf(out, ", \"mapping_home\": %s, \"mapping_track_time_s\": %.3f", lap.mapping.home ? "true" : "false",
+                  lap.mapping.track_time_s);
+        }
+      }
+      fprintf(out, "}%s\n", i + 1 < laps.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+  }
+  fprintf(out, "}\n");
+  if(out != stdout){
+    fclose(out);
+  }
+  return(0);
+}
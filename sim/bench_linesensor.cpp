@@ -0,0 +1,143 @@
+// Line sensor I/O backend benchmark (linesensor.h, LS_IO_PORT): built once per backend, it reads frames of random
+// discharge times and reports, in simulated time, how long a frame takes, how long loop() is held up by it, how long
+// the charge takes, and how far the measured times are from the true ones. Blocking and asynchronous reads both.
+//   bench_linesensor_port / bench_linesensor_pins [frames]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+
+#include "hal/hal_sim.h"
+#include "../linesensor.h"
+
+# define BENCH_FRAMES 2000
+# define BENCH_TIMEOUT_FRACTION 0.05 // sensors that see nothing and time out.
+
+// Answers every sensor with the discharge time it was given, nothing else moves.
+class FakeSensors_c : public HalDevice_c {
+  public:
+    int pins[NUMBER_OF_LS_PINS] = {LS_LEFTEST_PIN, LS_LEFT_PIN, LS_CENTRE_PIN, LS_RIGHT_PIN, LS_RIGHTEST_PIN};
+    uint32_t discharge_us[NUMBER_OF_LS_PINS];
+
+    uint64_t next_event_ns(){
+      return(UINT64_MAX);
+    }
+    void step_to(uint64_t){
+    }
+    uint32_t sensor_discharge_us(uint8_t pin){
+      for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+        if(pins[i] == pin){
+          return(discharge_us[i]);
+        }
+      }
+      return(0);
+    }
+};
+
+// Timing and error of one way of reading.
+struct BenchStats_s {
+  double frame_us = 0; // start of the charge to the frame being available.
+  double loop_us = 0; // of that, time the calling code spends in the sensor functions.
+  double error_sum_us = 0;
+  double error_min_us = 1e9;
+  double error_max_us = -1e9;
+  unsigned long timeouts_missed = 0; // timed out sensors that didn't read 0.
+  unsigned long sensors = 0;
+
+  void add_frame(const FakeSensors_c & fake, const unsigned int read[]){
+    for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+      if(fake.discharge_us[i] >= LS_TIMEOUT_US){
+        if(read[i] != 0){
+          timeouts_missed = timeouts_missed + 1;
+        }
+        continue;
+      }
+      double error = (double)read[i] - fake.discharge_us[i];
+      error_sum_us = error_sum_us + fabs(error);
+      error_min_us = error < error_min_us ? error : error_min_us;
+      error_max_us = error > error_max_us ? error : error_max_us;
+      sensors = sensors + 1;
+    }
+  }
+
+  void print(const char * mode, int frames){
+    printf("%s,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%lu\n", LS_IO_PORT ? "port" : "pins", mode, frame_us / frames,
+           loop_us / frames, error_sum_us / sensors, error_min_us, error_max_us, timeouts_missed);
+  }
+};
+
+FakeSensors_c fake;
+LineSensor_c sensors;
+std::mt19937 random_source(1);
+
+static void random_frame(){
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    if(uniform(random_source) < BENCH_TIMEOUT_FRACTION){
+      fake.discharge_us[i] = LS_TIMEOUT_US * 2;
+    }
+    else{
+      fake.discharge_us[i] = 450 + (uint32_t)(uniform(random_source) * 2450);
+    }
+  }
+}
+
+static double elapsed_us(uint64_t start_ns){
+  return((hal_now_ns() - start_ns) / 1000.0);
+}
+
+int main(int argc, char ** argv){
+  int frames = argc > 1 ? atoi(argv[1]) : BENCH_FRAMES;
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    hal_mark_sensor_pin(fake.pins[i]);
+  }
+  hal_attach(&fake);
+  sensors.initialise();
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+
+  // charging on its own: one batched write and a 10us wait, or 10us per pin plus the pin calls.
+  double charge_us = 0;
+  for(int f = 0; f < frames; f++){
+    uint64_t start_ns = hal_now_ns();
+    sensors.charge_all();
+    charge_us = charge_us + elapsed_us(start_ns);
+    hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  }
+
+  // blocking: loop() waits for the whole frame.
+  BenchStats_s blocking;
+  unsigned int read[NUMBER_OF_LS_PINS];
+  for(int f = 0; f < frames; f++){
+    random_frame();
+    uint64_t start_ns = hal_now_ns();
+    sensors.capture_frame(read);
+    blocking.frame_us = blocking.frame_us + elapsed_us(start_ns);
+    blocking.loop_us = blocking.loop_us + elapsed_us(start_ns);
+    blocking.add_frame(fake, read);
+    hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  }
+
+  // asynchronous: loop() only charges, Timer3 times the discharge. Poll for the end like the sensor task does.
+  BenchStats_s async;
+  sensors.next_frame(read); // discard the frame started under the old times.
+  for(int f = 0; f < frames; f++){
+    random_frame();
+    uint64_t start_ns = hal_now_ns();
+    sensors.start_reading();
+    async.loop_us = async.loop_us + elapsed_us(start_ns);
+    while(!sensors.reading_ready){
+      hal_advance_ns(1000);
+    }
+    async.frame_us = async.frame_us + elapsed_us(start_ns);
+    for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+      read[i] = sensors.frame_times[i];
+    }
+    async.add_frame(fake, read);
+  }
+
+  printf("backend,mode,frame_us,loop_us,error_mean_us,error_min_us,error_max_us,timeouts_missed\n");
+  blocking.print("blocking", frames);
+  async.print("async", frames);
+  printf("%s charge_us: %.1f\n", LS_IO_PORT ? "port" : "pins", charge_us / frames);
+  return(0);
+}
@@ -0,0 +1,182 @@
+// Wheel speed estimate benchmark (velocity.h): one wheel is driven through a speed profile, its encoder edges go
+// through the real ISR on the simulated HAL, and two estimators watch it. The original one took the count difference
+// over a 20ms millis() window and smoothed it with a 0.7/0.3 IIR. VelocityEstimator_c blends the edge period and count
+// difference every 10ms, as pid_task() runs it. For each step in the profile it reports the lag of each estimate
+// behind the true speed, and the RMS error once the speed has settled. The edges carry a fixed position error per
+// count (magnet spacing) and are timestamped by micros(), 4us steps.
+//   bench_velocity [edge jitter, counts]
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <random>
+
+#include "Arduino.h"
+#include "hal/hal_sim.h"
+#include "../encoders.h"
+#include "../velocity.h"
+
+# define BENCH_JITTER_COUNTS 0.1 // edge position error, +- counts, a fixed pattern round the wheel.
+# define BENCH_COUNTS_PER_REV 358
+# define BENCH_MOTOR_TAU_MS 40.0 // the wheel follows the demanded speed with this time constant.
+# define BENCH_OLD_WINDOW_MS 20 // PID_UPDATE before velocity.h.
+# define BENCH_NEW_PERIOD_MS 10 // PID_UPDATE now.
+# define BENCH_SETTLED_MS 500 // the RMS error is taken over the last 500ms of each step.
+
+// The profile: wheel speed demands in counts per ms, each held for its time.
+struct BenchStep_s {
+  const char * name;
+  float speed;
+  unsigned long hold_ms;
+};
+
+const BenchStep_s bench_steps[] = {
+  {"stopped", 0.0, 500},
+  {"start 0.6", 0.6, 1000},
+  {"down to 0.3", 0.3, 1000},
+  {"crawl 0.05", 0.05, 1500},
+  {"reverse -0.4", -0.4, 1000},
+  {"stop", 0.0, 1000},
+};
+# define BENCH_STEPS (sizeof(bench_steps) / sizeof(bench_steps[0]))
+
+// One estimate, held between its updates, and how it did on each step.
+struct BenchEstimate_s {
+  float speed = 0;
+  bool crossed = false; // reached 90% of this step's change yet.
+  double lag_ms[BENCH_STEPS];
+  double error_sum[BENCH_STEPS];
+  long error_n[BENCH_STEPS];
+
+  BenchEstimate_s(){
+    for(unsigned i = 0; i < BENCH_STEPS; i++){
+      lag_ms[i] = -1;
+      error_sum[i] = 0;
+      error_n[i] = 0;
+    }
+  }
+
+  // Called every ms of the step: the time it first gets 90% of the way from the old speed to the new one.
+  void watch(unsigned step, unsigned long ms_in_step, float from, float to, float truth, bool settled){
+    if(!crossed && to != from && (speed - from) / (to - from) >= 0.9){
+      crossed = true;
+      lag_ms[step] = ms_in_step;
+    }
+    if(settled){
+      error_sum[step] = error_sum[step] + (speed - truth) * (speed - truth);
+      error_n[step] = error_n[step] + 1;
+    }
+  }
+};
+
+// The right wheel's encoder pins, moved one quadrature step at a time: backwards round the cycle counts up.
+struct BenchWheel_s {
+  int phase = 0;
+
+  void step(int dir){
+    const byte gray[4] = {0, 1, 3, 2};
+    phase = (phase - dir + 4) % 4;
+    byte a = gray[phase] >> 1;
+    byte b = gray[phase] & 1;
+    hal_drive_pin(ENCODER_0_B_PIN, b);
+    hal_drive_pin(ENCODER_0_A_PIN, a ^ b);
+  }
+};
+
+int main(int argc, char ** argv){
+  double jitter = (argc > 1) ? atof(argv[1]) : BENCH_JITTER_COUNTS;
+  std::mt19937 random_source(10);
+  std::uniform_real_distribution<double> uniform(-jitter, jitter);
+  double edge_offset[BENCH_COUNTS_PER_REV];
+  for(int i = 0; i < BENCH_COUNTS_PER_REV; i++){
+    edge_offset[i] = uniform(random_source);
+  }
+
+  BenchWheel_s wheel;
+  hal_drive_pin(ENCODER_0_B_PIN, 0);
+  hal_drive_pin(ENCODER_0_A_PIN, 0);
+  setupEncoder0();
+
+  // the original estimate: the count difference since the last update every time more than 20ms has passed.
+  BenchEstimate_s old_estimate;
+  long old_count_last = 0;
+  unsigned long old_ts = millis();
+  // the new one, on the 10ms PID tick.
+  BenchEstimate_s new_estimate;
+  VelocityEstimator_c velocity;
+  EncoderSnapshot_s snapshot = encoder_snapshot();
+  velocity.count_last = snapshot.right;
+  velocity.ts_last = snapshot.ts_us;
+  unsigned long new_ts = millis();
+
+  // the wheel: position in counts, integrated in 1us steps, an edge wherever it crosses the next (offset) count.
+  double speed = 0;
+  double position = 0;
+  long counts = 0; // edges driven so far.
+  uint64_t t_us = hal_now_ns() / 1000 + 1;
+  float from = 0;
+  for(unsigned step = 0; step < BENCH_STEPS; step++){
+    float to = bench_steps[step].speed;
+    old_estimate.crossed = false;
+    new_estimate.crossed = false;
+    for(unsigned long ms = 0; ms < bench_steps[step].hold_ms; ms++){
+      for(int us = 0; us < 1000; us++){
+        speed = speed + (to - speed) * 0.001 / BENCH_MOTOR_TAU_MS;
+        position = position + speed * 0.001;
+        t_us = t_us + 1;
+        long index = counts + (speed >= 0 ? 1 : -1);
+        long slot = ((index % BENCH_COUNTS_PER_REV) + BENCH_COUNTS_PER_REV) % BENCH_COUNTS_PER_REV;
+        double edge_at = index + edge_offset[slot];
+        if((speed >= 0 && position >= edge_at) || (speed < 0 && position <= edge_at)){
+          if(hal_now_ns() < t_us * 1000){
+            hal_advance_ns(t_us * 1000 - hal_now_ns());
+          }
+          wheel.step(index > counts ? 1 : -1);
+          counts = index;
+        }
+      }
+      if(hal_now_ns() < t_us * 1000){
+        hal_advance_ns(t_us * 1000 - hal_now_ns());
+      }
+
+      // the loop, once a ms: whichever estimator is due updates.
+      unsigned long now_ms = millis();
+      if(now_ms - old_ts > BENCH_OLD_WINDOW_MS){
+        long count = count_wheel_right;
+        float window_speed = (float)(count - old_count_last) / (float)(now_ms - old_ts);
+        old_count_last = count;
+        old_estimate.speed = (0.7 * old_estimate.speed) + (0.3 * window_speed);
+        old_ts = millis();
+      }
+      if(now_ms - new_ts >= BENCH_NEW_PERIOD_MS){
+        snapshot = encoder_snapshot();
+        new_estimate.speed = velocity.update(snapshot.right, snapshot.right_edge, snapshot.ts_us);
+        new_ts = now_ms;
+      }
+
+      bool settled = ms >= bench_steps[step].hold_ms - BENCH_SETTLED_MS;
+      old_estimate.watch(step, ms, from, to, speed, settled);
+      new_estimate.watch(step, ms, from, to, speed, settled);
+    }
+    from = to;
+  }
+
+  // the true speed's own 90% time, for reference: first order, 2.3 time constants.
+  printf("edge jitter +-%.2f counts, wheel time constant %.0fms (true speed 90%% after %.0fms)\n", jitter,
+         BENCH_MOTOR_TAU_MS, 2.303 * BENCH_MOTOR_TAU_MS);
+  printf("%-14s %10s %10s %14s %14s\n", "step", "old 90% ms", "new 90% ms", "old rms c/ms", "new rms c/ms");
+  for(unsigned step = 0; step < BENCH_STEPS; step++){
+    double old_rms = old_estimate.error_n[step] ? sqrt(old_estimate.error_sum[step] / old_estimate.error_n[step]) : 0;
+    double new_rms = new_estimate.error_n[step] ? sqrt(new_estimate.error_sum[step] / new_estimate.error_n[step]) : 0;
+    char old_lag[16] = "-"; // no change of speed, or never got there.
+    char new_lag[16] = "-";
+    if(old_estimate.lag_ms[step] >= 0){
+      snprintf(old_lag, sizeof(old_lag), "%.0f", old_estimate.lag_ms[step]);
+    }
+    if(new_estimate.lag_ms[step] >= 0){
+      snprintf(new_lag, sizeof(new_lag), "%.0f", new_estimate.lag_ms[step]);
+    }
+    printf("%-14s %10s %10s %14.4f %14.4f\n", bench_steps[step].name, old_lag, new_lag, old_rms, new_rms);
+  }
+  return(0);
+}
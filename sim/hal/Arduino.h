@@ -0,0 +1,222 @@
+// Host side hardware abstraction layer: the parts of the Arduino core and avr-libc the robot code uses, backed by
+// the simulated robot in sim/world.h instead of the 32U4. The robot's own headers compile against this unchanged.
+//
+// Time only moves when the code spends it: delay(), delayMicroseconds(), each micros()/millis() call, and whatever
+// the simulator charges per loop(). Nothing depends on the host's clock, so a run is deterministic and goes as fast
+// as the host can compute it.
+#ifndef _SIM_ARDUINO_H
+#define _SIM_ARDUINO_H
+
+// every standard header the simulator needs goes in before the Arduino macros (abs, min, max) below.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+# define HIGH 1
+# define LOW 0
+# define INPUT 0
+# define OUTPUT 1
+# define INPUT_PULLUP 2
+# define DEC 10
+# define HEX 16
+# define PI 3.1415926535897932384626433832795
+# define F_CPU 16000000UL
+
+// Leonardo / 32U4 analogue pin numbers.
+# define A0 18
+# define A1 19
+# define A2 20
+# define A3 21
+# define A4 22
+# define A5 23
+# define A6 24
+# define A7 25
+# define A8 26
+# define A9 27
+# define A10 28
+# define A11 29
+
+// the Arduino core's macros.
+# define abs(x) ((x) > 0 ? (x) : -(x))
+# define min(a, b) ((a) < (b) ? (a) : (b))
+# define max(a, b) ((a) > (b) ? (a) : (b))
+# define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+# define _BV(bit) (1 << (bit))
+
+
+// **** Time ****
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+
+// **** Pins ****
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+
+// **** Interrupts ****
+void cli();
+void sei();
+# define interrupts() sei()
+# define noInterrupts() cli()
+
+// ISR(vector) defines a plain function the simulator calls when the interrupt fires.
+# define ISR(vector) extern "C" void vector(void)
+extern "C" void INT6_vect(void);
+extern "C" void PCINT0_vect(void);
+extern "C" void TIMER3_COMPA_vect(void);
+
+
+// **** Registers ****
+// An 8 or 16 bit I/O register. Reads give the stored value, writes store it and tell the simulator (so e.g. a DDR
+// write can charge a line sensor, or a TIMSK3 write can start the timer).
+template<typename T>
+class HalRegister_c {
+  public:
+    T value;
+    void (*on_write)(T old_value, T new_value);
+
+    HalRegister_c(void (*hook)(T, T) = 0) : value(0), on_write(hook) {}
+
+    operator T() const { return(value); }
+    HalRegister_c & operator=(T v) { write(v); return(*this); }
+    HalRegister_c & operator=(const HalRegister_c & o) { write(o.value); return(*this); }
+    HalRegister_c & operator|=(T v) { write(value | v); return(*this); }
+    HalRegister_c & operator&=(T v) { write(value & v); return(*this); }
+    HalRegister_c & operator^=(T v) { write(value ^ v); return(*this); }
+
+    void write(T v){
+      T old_value = value;
+      value = v;
+      if(on_write){
+        on_write(old_value, v);
+      }
+    }
+};
+typedef HalRegister_c<uint8_t> HalRegister8_c;
+typedef HalRegister_c<uint16_t> HalRegister16_c;
+
+// Port indexes, and the input (PIN) registers, which the simulator works out on every read.
+# define HAL_PORT_B 0
+# define HAL_PORT_C 1
+# define HAL_PORT_D 2
+# define HAL_PORT_E 3
+# define HAL_PORT_F 4
+# define HAL_PORTS 5
+uint8_t hal_read_pins(byte port);
+# define PINB (hal_read_pins(HAL_PORT_B))
+# define PINC (hal_read_pins(HAL_PORT_C))
+# define PIND (hal_read_pins(HAL_PORT_D))
+# define PINE (hal_read_pins(HAL_PORT_E))
+# define PINF (hal_read_pins(HAL_PORT_F))
+
+extern HalRegister8_c PORTB, PORTC, PORTD, PORTE, PORTF;
+extern HalRegister8_c DDRB, DDRC, DDRD, DDRE, DDRF;
+extern HalRegister8_c SREG, EIMSK, EICRA, EICRB, EIFR, PCICR, PCMSK0, PCIFR;
+extern HalRegister8_c TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+extern HalRegister8_c TCCR3A, TCCR3B, TCCR3C, TIMSK3, TIFR3;
+extern HalRegister16_c OCR1A, OCR1B, OCR1C, ICR1, TCNT1;
+extern HalRegister16_c OCR3A, OCR3B, TCNT3;
+
+// bit names used by the robot code.
+# define INT6 6
+# define ISC60 4
+# define ISC61 5
+# define INTF6 6
+# define PCIE0 0
+# define PCIF0 0
+# define PCINT4 4
+# define DDE6 6
+# define PORTE2 2
+# define PORTE6 6
+# define PINE2 2
+# define PINE6 6
+# define WGM10 0
+# define WGM11 1
+# define WGM12 3
+# define WGM13 4
+# define WGM30 0
+# define WGM31 1
+# define WGM32 3
+# define WGM33 4
+# define CS10 0
+# define CS11 1
+# define CS12 2
+# define CS30 0
+# define CS31 1
+# define CS32 2
+# define COM1A0 6
+# define COM1A1 7
+# define COM1B0 4
+# define COM1B1 5
+# define OCIE3A 1
+# define OCF3A 1
+# define PB0 0
+# define PB1 1
+# define PB2 2
+# define PB3 3
+# define PB4 4
+# define PB5 5
+# define PB6 6
+# define PB7 7
+# define PC6 6
+# define PC7 7
+# define PD0 0
+# define PD1 1
+# define PD2 2
+# define PD3 3
+# define PD4 4
+# define PD5 5
+# define PD6 6
+# define PD7 7
+# define PE2 2
+# define PE6 6
+# define PF0 0
+# define PF1 1
+# define PF4 4
+# define PF5 5
+# define PF6 6
+# define PF7 7
+
+
+// **** Serial ****
+// Output goes to the simulator's sink (stdout, or nowhere), input comes from whatever the simulator queued.
+class HalSerial_c {
+  public:
+    void begin(unsigned long){}
+    void flush(){}
+    operator bool() const { return(true); }
+
+    int available();
+    int read();
+    int peek();
+    int availableForWrite(){ return(64); }
+    size_t write(uint8_t b);
+    size_t write(const uint8_t * buffer, size_t length);
+
+    size_t print(const char * s);
+    size_t print(char c);
+    size_t print(unsigned char n, int base = DEC){ return(print((unsigned long)n, base)); }
+    size_t print(int n, int base = DEC){ return(print((long)n, base)); }
+    size_t print(unsigned int n, int base = DEC){ return(print((unsigned long)n, base)); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println(){ return(print("\r\n")); }
+    template<typename T> size_t println(T v){ size_t n = print(v); return(n + println()); }
+    template<typename T> size_t println(T v, int format){ size_t n = print(v, format); return(n + println()); }
+};
+extern HalSerial_c Serial;
+
+#endif
@@ -0,0 +1,33 @@
+// Host EEPROM: 1KB like the 32U4, erased to 0xFF. Writes take 3.4ms of simulated time, like the real thing.
+#ifndef _SIM_EEPROM_H
+#define _SIM_EEPROM_H
+
+#include "Arduino.h"
+#include "avr/eeprom.h"
+
+class HalEEPROM_c {
+  public:
+    uint8_t read(int address){ return(eeprom_read_byte((const uint8_t *)(intptr_t)address)); }
+    void write(int address, uint8_t value){ eeprom_write_byte((uint8_t *)(intptr_t)address, value); }
+    void update(int address, uint8_t value){ eeprom_update_byte((uint8_t *)(intptr_t)address, value); }
+    uint16_t length(){ return(HAL_EEPROM_SIZE); }
+
+    template<typename T> T & get(int address, T & t){
+      uint8_t * bytes = (uint8_t *)&t;
+      for(size_t i = 0; i < sizeof(T); i++){
+        bytes[i] = read(address + i);
+      }
+      return(t);
+    }
+
+    template<typename T> const T & put(int address, const T & t){
+      const uint8_t * bytes = (const uint8_t *)&t;
+      for(size_t i = 0; i < sizeof(T); i++){
+        update(address + i, bytes[i]);
+      }
+      return(t);
+    }
+};
+extern HalEEPROM_c EEPROM;
+
+#endif
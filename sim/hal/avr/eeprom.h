@@ -0,0 +1,14 @@
+// Host avr-libc EEPROM functions, see sim/hal/hal.cpp.
+#ifndef _SIM_AVR_EEPROM_H
+#define _SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+
+# define HAL_EEPROM_SIZE 1024
+
+uint8_t eeprom_read_byte(const uint8_t * address);
+void eeprom_write_byte(uint8_t * address, uint8_t value); // waits for the previous write, like avr-libc.
+void eeprom_update_byte(uint8_t * address, uint8_t value);
+int eeprom_is_ready();
+
+#endif
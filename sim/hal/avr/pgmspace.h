@@ -0,0 +1,12 @@
+// Host avr-libc program memory access: flash is just memory on the host.
+#ifndef _SIM_AVR_PGMSPACE_H
+#define _SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+# define PROGMEM
+# define pgm_read_byte(address) (*(const uint8_t *)(address))
+# define pgm_read_word(address) (*(const uint16_t *)(address))
+# define pgm_read_dword(address) (*(const uint32_t *)(address))
+
+#endif
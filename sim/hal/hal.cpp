@@ -0,0 +1,540 @@
+// Host HAL implementation, see Arduino.h and hal_sim.h.
+#include <string>
+#include <time.h>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "util/atomic.h"
+#include "hal_sim.h"
+
+
+// **** State ****
+static uint64_t now_ns = 0;
+static bool interrupts_on = true;
+static HalDevice_c * device = 0;
+static uint64_t device_host_ns = 0;
+
+// Per physical pin (port * 8 + bit).
+# define HAL_PHYSICAL_PINS (HAL_PORTS * 8)
+static bool sensor_pin[HAL_PHYSICAL_PINS];
+static uint8_t sensor_pin_number[HAL_PHYSICAL_PINS]; // the Arduino pin number it was marked by, several can share a bit.
+static uint64_t discharge_end_ns[HAL_PHYSICAL_PINS]; // when a released sensor pin goes LOW.
+static bool driven[HAL_PHYSICAL_PINS]; // level set by the device.
+static bool driven_level[HAL_PHYSICAL_PINS];
+
+// Timer3 compare interrupt.
+static bool timer3_running = false;
+static uint64_t timer3_next_ns = 0;
+
+static FILE * serial_sink = 0;
+static std::string serial_input;
+
+static uint8_t eeprom[HAL_EEPROM_SIZE];
+static uint64_t eeprom_busy_until_ns = 0;
+
+
+// Leonardo digital pin -> port and bit, as in the Arduino core's pins_arduino.h.
+struct HalPin_s {
+  byte port;
+  byte bit;
+};
+static const HalPin_s pin_map[] = {
+  {HAL_PORT_D, 2}, {HAL_PORT_D, 3}, {HAL_PORT_D, 1}, {HAL_PORT_D, 0}, {HAL_PORT_D, 4}, {HAL_PORT_C, 6}, // 0 - 5
+  {HAL_PORT_D, 7}, {HAL_PORT_E, 6}, {HAL_PORT_B, 4}, {HAL_PORT_B, 5}, {HAL_PORT_B, 6}, {HAL_PORT_B, 7}, // 6 - 11
+  {HAL_PORT_D, 6}, {HAL_PORT_C, 7}, {HAL_PORT_B, 3}, {HAL_PORT_B, 1}, {HAL_PORT_B, 2}, {HAL_PORT_B, 0}, // 12 - 17
+  {HAL_PORT_F, 7}, {HAL_PORT_F, 6}, {HAL_PORT_F, 5}, {HAL_PORT_F, 4}, {HAL_PORT_F, 1}, {HAL_PORT_F, 0}, // 18 - 23
+  {HAL_PORT_D, 4}, {HAL_PORT_D, 7}, {HAL_PORT_B, 4}, {HAL_PORT_B, 5}, {HAL_PORT_B, 6}, {HAL_PORT_D, 6}, // 24 - 29
+  {HAL_PORT_D, 5} // 30
+};
+# define HAL_DIGITAL_PINS (sizeof(pin_map) / sizeof(pin_map[0]))
+
+static int physical(uint8_t pin){
+  if(pin == HAL_PIN_PE2){
+    return(HAL_PORT_E * 8 + 2);
+  }
+  if(pin >= HAL_DIGITAL_PINS){
+    return(-1);
+  }
+  return(pin_map[pin].port * 8 + pin_map[pin].bit);
+}
+
+
+// **** Interrupts ****
+extern "C" __attribute__((weak)) void INT6_vect(void) {}
+extern "C" __attribute__((weak)) void PCINT0_vect(void) {}
+extern "C" __attribute__((weak)) void TIMER3_COMPA_vect(void) {}
+
+static bool in_isr = false;
+
+// Run an ISR the way the hardware does: interrupts off until it returns (which also stops simulated time).
+static void fire(void (*vector)(void)){
+  bool was_on = interrupts_on;
+  in_isr = true;
+  interrupts_on = false;
+  vector();
+  interrupts_on = was_on;
+  in_isr = false;
+}
+
+void cli(){ interrupts_on = false; }
+void sei(){ interrupts_on = true; }
+bool hal_interrupts_enabled(){ return(interrupts_on); }
+void hal_set_interrupts(bool enabled){ interrupts_on = enabled; }
+
+
+// **** Registers ****
+static void port_written(byte port, uint8_t old_value, uint8_t new_value);
+static void ddr_written(byte port, uint8_t old_value, uint8_t new_value);
+static void timer3_written(uint8_t, uint8_t);
+static void timer3_counter_written(uint16_t, uint16_t);
+static void timer3_top_written(uint16_t, uint16_t);
+
+static void portb_written(uint8_t o, uint8_t n){ port_written(HAL_PORT_B, o, n); }
+static void portc_written(uint8_t o, uint8_t n){ port_written(HAL_PORT_C, o, n); }
+static void portd_written(uint8_t o, uint8_t n){ port_written(HAL_PORT_D, o, n); }
+static void porte_written(uint8_t o, uint8_t n){ port_written(HAL_PORT_E, o, n); }
+static void portf_written(uint8_t o, uint8_t n){ port_written(HAL_PORT_F, o, n); }
+static void ddrb_written(uint8_t o, uint8_t n){ ddr_written(HAL_PORT_B, o, n); }
+static void ddrc_written(uint8_t o, uint8_t n){ ddr_written(HAL_PORT_C, o, n); }
+static void ddrd_written(uint8_t o, uint8_t n){ ddr_written(HAL_PORT_D, o, n); }
+static void ddre_written(uint8_t o, uint8_t n){ ddr_written(HAL_PORT_E, o, n); }
+static void ddrf_written(uint8_t o, uint8_t n){ ddr_written(HAL_PORT_F, o, n); }
+
+HalRegister8_c PORTB(portb_written), PORTC(portc_written), PORTD(portd_written), PORTE(porte_written), PORTF(portf_written);
+HalRegister8_c DDRB(ddrb_written), DDRC(ddrc_written), DDRD(ddrd_written), DDRE(ddre_written), DDRF(ddrf_written);
+HalRegister8_c SREG, EIMSK, EICRA, EICRB, EIFR, PCICR, PCMSK0, PCIFR;
+HalRegister8_c TCCR1A, TCCR1B, TCCR1C, TIMSK1, TIFR1;
+HalRegister8_c TCCR3A, TCCR3B(timer3_written), TCCR3C, TIMSK3(timer3_written), TIFR3;
+HalRegister16_c OCR1A, OCR1B, OCR1C, ICR1, TCNT1;
+HalRegister16_c OCR3A(timer3_top_written), OCR3B, TCNT3(timer3_counter_written);
+
+static HalRegister8_c * const port_registers[HAL_PORTS] = {&PORTB, &PORTC, &PORTD, &PORTE, &PORTF};
+static HalRegister8_c * const ddr_registers[HAL_PORTS] = {&DDRB, &DDRC, &DDRD, &DDRE, &DDRF};
+
+// Arduino's init() leaves Timer1 in 8 bit phase correct PWM at clk/64, the motors' analogWrite() relies on it.
+struct HalInit_s {
+  HalInit_s(){
+    TCCR1A.value = (1 << WGM10);
+    TCCR1B.value = (1 << CS11) | (1 << CS10);
+    memset(eeprom, 0xFF, sizeof(eeprom));
+  }
+} hal_init;
+
+
+static void port_written(byte, uint8_t, uint8_t){
+  // outputs follow PORT directly, nothing to simulate.
+}
+
+// A sensor pin going from a HIGH output to an input starts its capacitor discharging.
+static void ddr_written(byte port, uint8_t old_value, uint8_t new_value){
+  uint8_t released = old_value & ~new_value;
+  for(byte bit = 0; bit < 8; bit++){
+    int p = port * 8 + bit;
+    if((released & (1 << bit)) && sensor_pin[p] && (port_registers[port]->value & (1 << bit))){
+      uint32_t discharge_us = device ? device->sensor_discharge_us(sensor_pin_number[p]) : 0;
+      discharge_end_ns[p] = now_ns + (uint64_t)discharge_us * 1000;
+    }
+  }
+}
+
+uint8_t hal_read_pins(byte port){
+  uint8_t value = 0;
+  uint8_t ddr = ddr_registers[port]->value;
+  uint8_t out = port_registers[port]->value;
+  for(byte bit = 0; bit < 8; bit++){
+    int p = port * 8 + bit;
+    bool level;
+    if(ddr & (1 << bit)){
+      level = out & (1 << bit);
+    }
+    else if(sensor_pin[p]){
+      level = now_ns < discharge_end_ns[p];
+    }
+    else if(driven[p]){
+      level = driven_level[p];
+    }
+    else{
+      level = out & (1 << bit); // pull-up, or floating low.
+    }
+    if(level){
+      value = value | (1 << bit);
+    }
+  }
+  return(value);
+}
+
+
+// Timer3 in CTC mode on OCR3A: prescaler from the CS3x bits, 16MHz clock.
+static uint64_t timer3_tick_ps(){
+  static const uint16_t prescalers[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+  return((uint64_t)prescalers[TCCR3B.value & 0x07] * 62500);
+}
+
+static void timer3_schedule(uint16_t count){
+  uint64_t tick_ps = timer3_tick_ps();
+  timer3_running = (TIMSK3.value & (1 << OCIE3A)) && tick_ps > 0;
+  uint16_t top = OCR3A.value;
+  uint16_t remaining = (count <= top) ? top + 1 - count : 1;
+  timer3_next_ns = now_ns + (remaining * tick_ps + 999) / 1000;
+}
+
+static void timer3_written(uint8_t, uint8_t){
+  bool was_running = timer3_running;
+  uint64_t next = timer3_next_ns;
+  timer3_schedule(TCNT3.value);
+  if(was_running && timer3_running){
+    timer3_next_ns = next; // already counting, keep its phase.
+  }
+}
+
+static void timer3_counter_written(uint16_t, uint16_t value){
+  timer3_schedule(value);
+}
+
+static void timer3_top_written(uint16_t, uint16_t){
+  timer3_schedule(0);
+}
+
+static uint64_t timer3_period_ns(){
+  return(((OCR3A.value + 1) * timer3_tick_ps() + 999) / 1000);
+}
+
+
+// **** Time ****
+void hal_attach(HalDevice_c * d){
+  device = d;
+}
+
+uint64_t hal_now_ns(){
+  return(now_ns);
+}
+
+void hal_advance_ns(uint64_t ns){
+  if(!interrupts_on || in_isr){
+    return; // time stands still with interrupts off, so nothing can be missed.
+  }
+  uint64_t target = now_ns + ns;
+  while(true){
+    uint64_t next = target;
+    if(device && device->next_event_ns() < next){
+      next = device->next_event_ns();
+    }
+    if(timer3_running && timer3_next_ns < next){
+      next = timer3_next_ns;
+    }
+    if(next > now_ns){
+      now_ns = next;
+    }
+    if(device && device->next_event_ns() <= now_ns){
+      uint64_t host_start = hal_host_ns();
+      device->step_to(now_ns);
+      device_host_ns = device_host_ns + (hal_host_ns() - host_start);
+    }
+    if(timer3_running && timer3_next_ns <= now_ns){
+      timer3_next_ns = timer3_next_ns + timer3_period_ns();
+      fire(TIMER3_COMPA_vect);
+    }
+    if(now_ns >= target){
+      break;
+    }
+  }
+}
+
+// Wait for a moment in simulated time, jumping straight there if interrupts are off.
+static void wait_until(uint64_t ns){
+  if(ns <= now_ns){
+    return;
+  }
+  if(interrupts_on && !in_isr){
+    hal_advance_ns(ns - now_ns);
+  }
+  else{
+    now_ns = ns;
+  }
+}
+
+unsigned long micros(){
+  hal_advance_ns(HAL_MICROS_COST_NS);
+  return((unsigned long)(now_ns / 1000) & ~3UL); // 4us resolution, like the 16MHz core.
+}
+
+unsigned long millis(){
+  hal_advance_ns(HAL_MILLIS_COST_NS);
+  return((unsigned long)(now_ns / 1000000));
+}
+
+void delay(unsigned long ms){
+  wait_until(now_ns + (uint64_t)ms * 1000000);
+}
+
+void delayMicroseconds(unsigned int us){
+  wait_until(now_ns + (uint64_t)us * 1000);
+}
+
+uint64_t hal_host_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+unsigned long hal_host_micros(){
+  return((unsigned long)(hal_host_ns() / 1000));
+}
+
+uint64_t hal_device_host_ns(){
+  return(device_host_ns);
+}
+
+
+// **** Pins ****
+// Timer1 compare outputs: pin 9 = OC1A, pin 10 = OC1B.
+static HalRegister16_c * pwm_register(uint8_t pin, uint8_t * com_bit){
+  if(pin == 9){
+    *com_bit = COM1A1;
+    return(&OCR1A);
+  }
+  if(pin == 10){
+    *com_bit = COM1B1;
+    return(&OCR1B);
+  }
+  return(0);
+}
+
+void pinMode(uint8_t pin, uint8_t mode){
+  hal_advance_ns(HAL_DIGITAL_IO_COST_NS);
+  int p = physical(pin);
+  if(p < 0){
+    return;
+  }
+  byte port = p / 8;
+  uint8_t mask = 1 << (p % 8);
+  if(mode == OUTPUT){
+    *ddr_registers[port] = ddr_registers[port]->value | mask;
+  }
+  else{
+    *ddr_registers[port] = ddr_registers[port]->value & ~mask;
+    if(mode == INPUT_PULLUP){
+      *port_registers[port] = port_registers[port]->value | mask;
+    }
+    else{
+      *port_registers[port] = port_registers[port]->value & ~mask;
+    }
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value){
+  hal_advance_ns(HAL_DIGITAL_IO_COST_NS);
+  int p = physical(pin);
+  if(p < 0){
+    return;
+  }
+  uint8_t com_bit;
+  if(pwm_register(pin, &com_bit)){
+    TCCR1A = TCCR1A.value & ~(1 << com_bit); // a digital write turns the PWM off, as in the core.
+  }
+  byte port = p / 8;
+  uint8_t mask = 1 << (p % 8);
+  if(value){
+    *port_registers[port] = port_registers[port]->value | mask;
+  }
+  else{
+    *port_registers[port] = port_registers[port]->value & ~mask;
+  }
+}
+
+int digitalRead(uint8_t pin){
+  hal_advance_ns(HAL_DIGITAL_IO_COST_NS);
+  int p = physical(pin);
+  if(p < 0){
+    return(LOW);
+  }
+  return((hal_read_pins(p / 8) >> (p % 8)) & 1);
+}
+
+void analogWrite(uint8_t pin, int value){
+  pinMode(pin, OUTPUT);
+  uint8_t com_bit;
+  HalRegister16_c * ocr = pwm_register(pin, &com_bit);
+  if(!ocr || value <= 0 || value >= 255){
+    digitalWrite(pin, value >= 128 ? HIGH : LOW);
+    return;
+  }
+  *ocr = value;
+  TCCR1A = TCCR1A.value | (1 << com_bit);
+}
+
+void hal_mark_sensor_pin(uint8_t pin){
+  int p = physical(pin);
+  if(p >= 0){
+    sensor_pin[p] = true;
+    sensor_pin_number[p] = pin;
+  }
+}
+
+void hal_drive_pin(uint8_t pin, bool level){
+  int p = physical(pin);
+  if(p < 0){
+    return;
+  }
+  bool changed = !driven[p] || driven_level[p] != level;
+  driven[p] = true;
+  driven_level[p] = level;
+  if(!changed || !interrupts_on){
+    return;
+  }
+  // INT6 on PE6 (any edge), PCINT4 on PB4.
+  if(p == HAL_PORT_E * 8 + 6 && (EIMSK.value & (1 << INT6))){
+    fire(INT6_vect);
+  }
+  if(p == HAL_PORT_B * 8 + 4 && (PCICR.value & (1 << PCIE0)) && (PCMSK0.value & (1 << PCINT4))){
+    fire(PCINT0_vect);
+  }
+}
+
+bool hal_pin_output(uint8_t pin){
+  int p = physical(pin);
+  if(p < 0){
+    return(false);
+  }
+  return(port_registers[p / 8]->value & (1 << (p % 8)));
+}
+
+float hal_pwm_duty(uint8_t pin){
+  uint8_t com_bit;
+  HalRegister16_c * ocr = pwm_register(pin, &com_bit);
+  if(ocr && (TCCR1A.value & (1 << com_bit))){
+    // TOP from the waveform generation mode.
+    byte mode = (TCCR1A.value & 0x03) | ((TCCR1B.value >> 1) & 0x0C);
+    uint16_t top = 255;
+    if(mode == 2 || mode == 6){
+      top = 511;
+    }
+    else if(mode == 3 || mode == 7){
+      top = 1023;
+    }
+    else if(mode == 8 || mode == 10 || mode == 12 || mode == 14){
+      top = ICR1.value;
+    }
+    if(top == 0){
+      return(0);
+    }
+    float duty = (float)ocr->value / top;
+    return(duty > 1 ? 1 : duty);
+  }
+  return(hal_pin_output(pin) ? 1 : 0);
+}
+
+
+// **** Serial ****
+HalSerial_c Serial;
+
+void hal_serial_output(FILE * sink){
+  serial_sink = sink;
+}
+
+void hal_serial_send(const char * text){
+  serial_input = serial_input + text;
+}
+
+int HalSerial_c::available(){
+  return(serial_input.size());
+}
+
+int HalSerial_c::read(){
+  if(serial_input.empty()){
+    return(-1);
+  }
+  int c = (unsigned char)serial_input[0];
+  serial_input.erase(0, 1);
+  return(c);
+}
+
+int HalSerial_c::peek(){
+  return(serial_input.empty() ? -1 : (unsigned char)serial_input[0]);
+}
+
+size_t HalSerial_c::write(uint8_t b){
+  if(serial_sink){
+    fputc(b, serial_sink);
+  }
+  return(1);
+}
+
+size_t HalSerial_c::write(const uint8_t * buffer, size_t length){
+  if(serial_sink){
+    fwrite(buffer, 1, length, serial_sink);
+  }
+  return(length);
+}
+
+size_t HalSerial_c::print(const char * s){
+  return(write((const uint8_t *)s, strlen(s)));
+}
+
+size_t HalSerial_c::print(char c){
+  return(write((uint8_t)c));
+}
+
+size_t HalSerial_c::print(long n, int base){
+  if(base == DEC){
+    char text[24];
+    snprintf(text, sizeof(text), "%ld", n);
+    return(print(text));
+  }
+  return(print((unsigned long)n, base));
+}
+
+size_t HalSerial_c::print(unsigned long n, int base){
+  char text[40];
+  if(base == HEX){
+    snprintf(text, sizeof(text), "%lX", n);
+  }
+  else if(base == 2){
+    int i = sizeof(text) - 1;
+    text[i] = 0;
+    do{
+      text[--i] = '0' + (n & 1);
+      n = n >> 1;
+    } while(n && i > 0);
+    return(print(&text[i]));
+  }
+  else{
+    snprintf(text, sizeof(text), "%lu", n);
+  }
+  return(print(text));
+}
+
+size_t HalSerial_c::print(double n, int digits){
+  char text[48];
+  snprintf(text, sizeof(text), "%.*f", digits, n);
+  return(print(text));
+}
+
+
+// **** EEPROM ****
+HalEEPROM_c EEPROM;
+
+uint8_t * hal_eeprom_data(){
+  return(eeprom);
+}
+
+uint8_t eeprom_read_byte(const uint8_t * address){
+  wait_until(eeprom_busy_until_ns);
+  return(eeprom[(uintptr_t)address % HAL_EEPROM_SIZE]);
+}
+
+void eeprom_write_byte(uint8_t * address, uint8_t value){
+  wait_until(eeprom_busy_until_ns);
+  eeprom[(uintptr_t)address % HAL_EEPROM_SIZE] = value;
+  eeprom_busy_until_ns = now_ns + HAL_EEPROM_WRITE_NS;
+}
+
+void eeprom_update_byte(uint8_t * address, uint8_t value){
+  if(eeprom_read_byte(address) != value){
+    eeprom_write_byte(address, value);
+  }
+}
+
+int eeprom_is_ready(){
+  return(now_ns >= eeprom_busy_until_ns);
+}
@@ -0,0 +1,56 @@
+// The simulator's side of the host HAL: the clock, and the hooks a simulated robot (sim/world.h) uses to drive the
+// pins the robot code reads and to see the pins it writes.
+#ifndef _SIM_HAL_SIM_H
+#define _SIM_HAL_SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// What it costs (simulated time) to call micros()/millis(). Busy-wait loops need time to move when they poll.
+# define HAL_MICROS_COST_NS 2000
+# define HAL_MILLIS_COST_NS 1000
+// pinMode()/digitalWrite()/digitalRead() look the pin up in the core's tables on every call, ~50 cycles on the 16MHz
+// core. Direct port register access costs nothing here.
+# define HAL_DIGITAL_IO_COST_NS 3000
+# define HAL_EEPROM_WRITE_NS 3400000 // 3.4ms per EEPROM byte
+
+
+// A simulated device attached to the pins. The HAL steps it whenever simulated time moves past next_event_ns().
+class HalDevice_c {
+  public:
+    virtual ~HalDevice_c() {}
+    // next time (ns) the device wants to step.
+    virtual uint64_t next_event_ns() = 0;
+    // step the device to now_ns, driving any pins that change on the way (hal_drive_pin()).
+    virtual void step_to(uint64_t now_ns) = 0;
+    // a line sensor pin has just been released after charging: how long (us) until it reads LOW.
+    virtual uint32_t sensor_discharge_us(uint8_t pin) = 0;
+};
+
+void hal_attach(HalDevice_c * device);
+
+// Simulated time.
+uint64_t hal_now_ns();
+void hal_advance_ns(uint64_t ns); // only moves while interrupts are enabled, like the real timers and ISRs.
+
+// Pins, for the device. The left encoder's B input (PE2) has no Arduino pin number, it goes by this one.
+# define HAL_PIN_PE2 31
+void hal_mark_sensor_pin(uint8_t pin); // reads HIGH after a charge, until its discharge time is up.
+void hal_drive_pin(uint8_t pin, bool level); // an input the device drives (e.g. an encoder), fires its interrupt on change.
+bool hal_pin_output(uint8_t pin); // the level the code is driving on an output pin.
+float hal_pwm_duty(uint8_t pin); // 0 - 1, from the timer compare register if PWM is on, else the pin level.
+
+// Serial: where the robot's prints go (0 = nowhere), and characters for it to read.
+void hal_serial_output(FILE * sink);
+void hal_serial_send(const char * text);
+
+// EEPROM contents, so a run can start from (and save) a file.
+uint8_t * hal_eeprom_data();
+
+// Wall clock of the host (us), for profiling the code itself rather than the simulated robot.
+unsigned long hal_host_micros();
+uint64_t hal_host_ns();
+// Host time spent stepping the device so far (ns), to take the simulation itself out of a measurement.
+uint64_t hal_device_host_ns();
+
+#endif
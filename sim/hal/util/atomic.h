@@ -0,0 +1,22 @@
+// Host avr-libc ATOMIC_BLOCK: interrupts are held off for the block, which in the simulator also stops time.
+#ifndef _SIM_UTIL_ATOMIC_H
+#define _SIM_UTIL_ATOMIC_H
+
+bool hal_interrupts_enabled();
+void hal_set_interrupts(bool enabled);
+
+// Disables interrupts for its lifetime and puts them back as they were (ATOMIC_RESTORESTATE) or on (ATOMIC_FORCEON).
+class HalAtomicGuard_c {
+  public:
+    bool restore;
+    bool done;
+    HalAtomicGuard_c(bool force_on) : restore(force_on || hal_interrupts_enabled()), done(false) { hal_set_interrupts(false); }
+    ~HalAtomicGuard_c() { hal_set_interrupts(restore); }
+    bool once(){ bool first = !done; done = true; return(first); }
+};
+
+# define ATOMIC_RESTORESTATE false
+# define ATOMIC_FORCEON true
+# define ATOMIC_BLOCK(type) for(HalAtomicGuard_c hal_atomic_guard(type); hal_atomic_guard.once(); )
+
+#endif
@@ -0,0 +1,197 @@
+// Simulator command line: one lap of the robot code on a track, then a summary.
+//   sim_lap [--track name|file.pgm] [--save-track file.pgm] [--seed n] [--time-limit s] [--loop-cost us]
+//           [--right-motor scale] [--right-wheel scale] [--noise us] [--serial] [--report] [--profile] [--dump]
+//           [--send chars] [--retrace 0|1] [--fusion 0|1] [--eeprom file] [--save-eeprom file] [--trace file.csv]
+//           [--max-loop-us us]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "hal/avr/eeprom.h"
+#include "hal/hal_sim.h"
+#include "sim_lap.h"
+#include "track.h"
+#include "world.h"
+
+static void usage(){
+  fprintf(stderr,
+          "usage: sim_lap [options]\n"
+          "  --track name|file.pgm  built in course (default, straight, sharp, gap, s_bend, dead_end) or a track image\n"
+          "  --save-track file.pgm  write the track image out and carry on\n"
+          "  --seed n               sensor noise seed (default 1)\n"
+          "  --time-limit s         give up after s simulated seconds (default 120)\n"
+          "  --loop-cost us         simulated cost of one loop() (default 100)\n"
+          "  --right-motor scale    right motor strength relative to the left (default 1)\n"
+          "  --right-wheel scale    right wheel size relative to what the robot code assumes (default 1)\n"
+          "  --noise us             sensor noise standard deviation (default 20)\n"
+          "  --serial               show the robot's serial output\n"
+          "  --report               send 's' when home: scheduler, state machine and loop reports\n"
+          "  --profile              send 'p' when home, profiler timed with the host clock\n"
+          "  --dump                 send 'd' when home: the run recording as CSV\n"
+          "  --send chars           send these serial commands when home, e.g. m to time the motor driver\n"
+          "  --retrace 0|1          return home straight to the start (0) or back along the outbound path (1)\n"
+          "  --fusion 0|1           pose estimate from odometry alone (0) or corrected by the line (1)\n"
+          "  --eeprom file          start from this EEPROM image (e.g. a stored calibration)\n"
+          "  --save-eeprom file     write the EEPROM out at the end\n"
+          "  --trace file.csv       true and odometry pose, e_line and state every 50ms\n"
+          "  --max-loop-us us       fail (exit status 1) if any loop() took longer than this, or was counted late\n");
+}
+
+static bool read_file(const char * filename, uint8_t * data, size_t size){
+  FILE * f = fopen(filename, "rb");
+  if(!f){
+    return(false);
+  }
+  size_t n = fread(data, 1, size, f);
+  fclose(f);
+  return(n == size);
+}
+
+static bool write_file(const char * filename, const uint8_t * data, size_t size){
+  FILE * f = fopen(filename, "wb");
+  if(!f){
+    return(false);
+  }
+  size_t n = fwrite(data, 1, size, f);
+  fclose(f);
+  return(n == size);
+}
+
+int main(int argc, char ** argv){
+  const char * track_file = 0;
+  const char * save_track_file = 0;
+  const char * eeprom_file = 0;
+  const char * save_eeprom_file = 0;
+  const char * trace_file = 0;
+  unsigned long max_loop_us = 0; // 0 = don't check.
+  uint32_t seed = 1;
+  float right_motor = 1.0;
+  float right_wheel = 1.0;
+  float noise = -1;
+  bool serial = false;
+  std::string commands;
+  LapOptions_s options;
+
+  for(int i = 1; i < argc; i++){
+    const char * arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if(!strcmp(arg, "--track") && has_value){
+      track_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--save-track") && has_value){
+      save_track_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--seed") && has_value){
+      seed = strtoul(argv[++i], 0, 10);
+    }
+    else if(!strcmp(arg, "--time-limit") && has_value){
+      options.time_limit_s = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--loop-cost") && has_value){
+      options.loop_cost_ns = (uint64_t)(atof(argv[++i]) * 1000);
+    }
+    else if(!strcmp(arg, "--right-motor") && has_value){
+      right_motor = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--right-wheel") && has_value){
+      right_wheel = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--noise") && has_value){
+      noise = atof(argv[++i]);
+    }
+    else if(!strcmp(arg, "--retrace") && has_value){
+      options.retrace = atoi(argv[++i]);
+    }
+    else if(!strcmp(arg, "--fusion") && has_value){
+      options.fusion = atoi(argv[++i]);
+    }
+    else if(!strcmp(arg, "--eeprom") && has_value){
+      eeprom_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--save-eeprom") && has_value){
+      save_eeprom_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--trace") && has_value){
+      trace_file = argv[++i];
+    }
+    else if(!strcmp(arg, "--max-loop-us") && has_value){
+      max_loop_us = strtoul(argv[++i], 0, 10);
+    }
+    else if(!strcmp(arg, "--serial")){
+      serial = true;
+    }
+    else if(!strcmp(arg, "--report")){
+      commands = commands + "s";
+    }
+    else if(!strcmp(arg, "--profile")){
+      commands = commands + "p";
+      options.host_profile = true;
+    }
+    else if(!strcmp(arg, "--send") && has_value){
+      commands = commands + argv[++i];
+    }
+    else if(!strcmp(arg, "--dump")){
+      commands = commands + "d";
+    }
+    else{
+      usage();
+      return(2);
+    }
+  }
+
+  Track_c track;
+  if(!track.build(track_file ? track_file : "default") && !track.load_pgm(track_file)){
+    fprintf(stderr, "can't read track %s\n", track_file);
+    return(1);
+  }
+  if(save_track_file && !track.save_pgm(save_track_file)){
+    fprintf(stderr, "can't write track %s\n", save_track_file);
+    return(1);
+  }
+
+  if(eeprom_file && !read_file(eeprom_file, hal_eeprom_data(), HAL_EEPROM_SIZE)){
+    fprintf(stderr, "can't read EEPROM image %s\n", eeprom_file);
+    return(1);
+  }
+
+  World_c world(&track, seed);
+  world.right_motor_scale = right_motor;
+  world.right_wheel_scale = right_wheel;
+  if(noise >= 0){
+    world.noise_us = noise;
+  }
+
+  // the robot's own prints go to stdout if asked for, or if a command was sent to get them.
+  hal_serial_output((serial || !commands.empty()) ? stdout : 0);
+  if(!commands.empty()){
+    options.serial_commands = commands.c_str();
+  }
+
+  if(trace_file){
+    options.trace = fopen(trace_file, "w");
+    if(!options.trace){
+      fprintf(stderr, "can't write trace %s\n", trace_file);
+      return(1);
+    }
+  }
+
+  LapResult_s result = run_lap(world, options);
+  if(options.trace){
+    fclose(options.trace);
+  }
+  fflush(stdout);
+  print_lap_result(serial || !commands.empty() ? stderr : stdout, result);
+
+  if(save_eeprom_file && !write_file(save_eeprom_file, hal_eeprom_data(), HAL_EEPROM_SIZE)){
+    fprintf(stderr, "can't write EEPROM image %s\n", save_eeprom_file);
+    return(1);
+  }
+  // the state handlers must never block: a long loop() is a failure, not just a statistic.
+  if(max_loop_us && (result.loop_max_us > max_loop_us || result.late_loops > 0)){
+    fprintf(stderr, "loop latency: max %lu us (limit %lu us), %lu late loops\n", result.loop_max_us, max_loop_us,
+            result.late_loops);
+    return(1);
+  }
+  return(result.home ? 0 : 1);
+}
@@ -0,0 +1,187 @@
+// The only translation unit that sees the robot code: it's built exactly as the Arduino IDE would build it, with
+// sim/hal standing in for the Arduino core and avr-libc.
+#include <math.h>
+
+#include "sim_lap.h"
+#include "hal/hal_sim.h"
+
+#include "../Final Code.ino"
+
+
+LapResult_s run_lap(World_c & world, const LapOptions_s & options){
+  LapResult_s result;
+  uint64_t host_start = hal_host_ns();
+
+  world.attach();
+  #if PROFILER_ENABLED
+  if(options.host_profile){
+    profiler.clock = hal_host_micros;
+  }
+  #endif
+
+  setup();
+  if(options.retrace >= 0){
+    homing.retrace = options.retrace;
+  }
+  result.retraced = homing.retrace;
+  #if ESTIMATOR_ENABLED
+  if(options.fusion >= 0){
+    estimator.fusion = options.fusion;
+  }
+  result.fusion = estimator.fusion;
+  #endif
+  #if PATH_ENABLED
+  result.replay = path.replaying;
+  #endif
+
+  uint64_t limit_ns = (uint64_t)(options.time_limit_s * 1e9);
+  uint64_t start_ns = 0; // when the robot left the initial state.
+  byte previous_state = fsm.machine.current;
+  bool after_turn = false; // turned around, and not back on the line or gone elsewhere yet.
+  double turn_x = 0, turn_y = 0; // where the current turn around started.
+  double line_error_sum = 0;
+  unsigned long line_error_samples = 0;
+  uint64_t trace_ns = hal_now_ns();
+  uint64_t loop_host_ns = 0; // host time inside loop(), less the world's share of it.
+  if(options.trace){
+    fprintf(options.trace, "t_s,x_mm,y_mm,theta,odom_x_mm,odom_y_mm,odom_theta,e_line,state\n");
+  }
+
+  while(hal_now_ns() < limit_ns){
+    uint64_t device_before = hal_device_host_ns();
+    uint64_t loop_start = hal_host_ns();
+    loop();
+    loop_host_ns = loop_host_ns + (hal_host_ns() - loop_start) - (hal_device_host_ns() - device_before);
+    hal_advance_ns(options.loop_cost_ns);
+    result.loops = result.loops + 1;
+
+    float odom_error = hypot(world.x - kinematics.X_pos, world.y - kinematics.Y_pos);
+    if(odom_error > result.max_odom_error_mm){
+      result.max_odom_error_mm = odom_error;
+    }
+    #if ESTIMATOR_ENABLED
+    float est_error = hypot(world.x - estimator.X_pos, world.y - estimator.Y_pos);
+    if(est_error > result.max_est_error_mm){
+      result.max_est_error_mm = est_error;
+    }
+    #endif
+
+    byte state = fsm.machine.current;
+    if(options.trace && hal_now_ns() >= trace_ns){
+      fprintf(options.trace, "%.3f,%.1f,%.1f,%.4f,%.1f,%.1f,%.4f,%.3f,%d\n", hal_now_ns() / 1e9, world.x, world.y,
+              world.theta, kinematics.X_pos, kinematics.Y_pos, kinematics.Theta, fsm.e_line, state);
+      trace_ns = trace_ns + SIM_TRACE_PERIOD_NS;
+    }
+    if(state != previous_state){
+      if(previous_state == STATE_INITIAL && start_ns == 0){
+        start_ns = hal_now_ns();
+      }
+      if(state == STATE_RETURN_TO_START && start_ns && result.track_time_s == 0){
+        result.track_time_s = (hal_now_ns() - start_ns) / 1e9;
+      }
+      if(previous_state == STATE_ON_LINE && state == STATE_LOST_LINE){
+        result.line_losses = result.line_losses + 1;
+      }
+      if(state == STATE_TURN_AROUND){
+        result.turn_arounds = result.turn_arounds + 1;
+        turn_x = world.x;
+        turn_y = world.y;
+      }
+      if(previous_state == STATE_TURN_AROUND){
+        float drift = hypot(world.x - turn_x, world.y - turn_y);
+        if(drift > result.max_turn_drift_mm){
+          result.max_turn_drift_mm = drift;
+        }
+        after_turn = true;
+      }
+      else if(after_turn && state == STATE_ON_LINE){
+        result.turn_arounds_found = result.turn_arounds_found + 1;
+        after_turn = false;
+      }
+      else if(state != STATE_LOST_LINE){
+        after_turn = false;
+      }
+      previous_state = state;
+    }
+    if(state == STATE_ON_LINE){
+      double sx, sy;
+      world.sensor_position(0, &sx, &sy);
+      float error = world.track->distance_to_line(sx, sy);
+      if(error >= 0){
+        line_error_sum = line_error_sum + error;
+        line_error_samples = line_error_samples + 1;
+        if(error > result.max_line_error_mm){
+          result.max_line_error_mm = error;
+        }
+      }
+    }
+    if(state == STATE_HOME){
+      result.home = true;
+      break;
+    }
+  }
+
+  result.time_s = hal_now_ns() / 1e9;
+  result.return_time_s = homing.time_ms / 1000.0;
+  result.lap_time_s = start_ns ? (hal_now_ns() - start_ns) / 1e9 : 0;
+
+  // once home, let the robot answer any serial commands (reports, the run recording).
+  if(options.serial_commands){
+    hal_serial_send(options.serial_commands);
+    for(size_t i = 0; options.serial_commands[i]; i++){
+      loop();
+      hal_advance_ns(options.loop_cost_ns);
+    }
+  }
+
+  result.true_x = world.x;
+  result.true_y = world.y;
+  result.true_theta = world.theta;
+  result.odom_x = kinematics.X_pos;
+  result.odom_y = kinematics.Y_pos;
+  result.odom_theta = kinematics.Theta;
+  result.home_error_mm = sqrt(world.x * world.x + world.y * world.y);
+  result.odom_error_mm = sqrt((world.x - kinematics.X_pos) * (world.x - kinematics.X_pos)
+                              + (world.y - kinematics.Y_pos) * (world.y - kinematics.Y_pos));
+  #if ESTIMATOR_ENABLED
+  result.est_x = estimator.X_pos;
+  result.est_y = estimator.Y_pos;
+  result.est_theta = estimator.Theta;
+  result.est_error_mm = hypot(world.x - estimator.X_pos, world.y - estimator.Y_pos);
+  result.est_sd_mm = estimator.position_sd();
+  result.wheel_scale = estimator.state[EST_SCALE];
+  result.landmarks = estimator.landmarks;
+  #endif
+  result.mean_line_error_mm = line_error_samples ? line_error_sum / line_error_samples : 0;
+  result.late_loops = loop_late_count;
+  result.loop_max_us = loop_max_us;
+  for(byte i = 0; i < fsm.scheduler.task_count; i++){
+    if(!strcmp(fsm.scheduler.tasks[i].name, "pid")){
+      result.control_ticks = fsm.scheduler.tasks[i].runs;
+    }
+  }
+  result.cpu_ns_per_tick = result.control_ticks ? (float)loop_host_ns / result.control_ticks : 0;
+  result.host_seconds = (hal_host_ns() - host_start) / 1e9;
+  return(result);
+}
+
+void print_lap_result(FILE * out, const LapResult_s & result){
+  fprintf(out, "home: %s\n", result.home ? "yes" : "no");
+  fprintf(out, "time: %.3f s (lap %.3f s), simulated in %.3f s\n", result.time_s, result.lap_time_s, result.host_seconds);
+  fprintf(out, "track: %.3f s, %s\n", result.track_time_s, result.replay ? "replaying the stored path" : "mapping");
+  fprintf(out, "true pose: %.1f, %.1f mm, %.3f rad\n", result.true_x, result.true_y, result.true_theta);
+  fprintf(out, "odometry pose: %.1f, %.1f mm, %.3f rad\n", result.odom_x, result.odom_y, result.odom_theta);
+  fprintf(out, "distance from start: %.1f mm, odometry error: %.1f mm (max %.1f mm)\n", result.home_error_mm,
+          result.odom_error_mm, result.max_odom_error_mm);
+  fprintf(out, "estimated pose: %.1f, %.1f mm, %.3f rad, %s\n", result.est_x, result.est_y, result.est_theta,
+          result.fusion ? "fused with the line" : "odometry only");
+  fprintf(out, "estimate error: %.1f mm (max %.1f mm), sd %.1f mm, wheel scale %+.4f, %u landmarks\n",
+          result.est_error_mm, result.max_est_error_mm, result.est_sd_mm, result.wheel_scale, result.landmarks);
+  fprintf(out, "return: %.3f s, %s\n", result.return_time_s, result.retraced ? "retracing the outbound path" : "straight home");
+  fprintf(out, "line losses: %lu, line error mean %.1f mm, max %.1f mm\n", result.line_losses,
+          result.mean_line_error_mm, result.max_line_error_mm);
+  fprintf(out, "turn arounds: %lu, line found after %lu, drift max %.1f mm\n", result.turn_arounds,
+          result.turn_arounds_found, result.max_turn_drift_mm);
+  fprintf(out, "loops: %lu, late loops: %lu, loop max: %lu us\n", result.loops, result.late_loops, result.loop_max_us);
+  fprintf(out, "control ticks: %lu, host cpu per tick: %.0f ns\n", result.control_ticks, result.cpu_ns_per_tick);
+}
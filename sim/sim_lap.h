@@ -0,0 +1,64 @@
+// One simulated lap of the unmodified robot code (Final Code.ino) on a World_c.
+// The robot code is made of globals, so a process runs one lap: start a new process for the next.
+#ifndef _SIM_LAP_H
+#define _SIM_LAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "world.h"
+
+# define SIM_LOOP_COST_NS 100000ULL // simulated time one loop() costs on top of the micros()/millis() calls it makes.
+# define SIM_TRACE_PERIOD_NS 50000000ULL // 50ms
+
+
+struct LapOptions_s {
+  float time_limit_s = 120; // give up if the robot isn't home by then (setup() included).
+  uint64_t loop_cost_ns = SIM_LOOP_COST_NS;
+  const char * serial_commands = 0; // sent to the robot once it gets home, e.g. "sp".
+  bool host_profile = false; // time the profiler's scopes with the host clock instead of simulated micros().
+  FILE * trace = 0; // CSV of the true and odometry pose every SIM_TRACE_PERIOD_NS, if set.
+  int retrace = -1; // 1/0: return home along the outbound path or straight to the start (homing.h), -1 = as built.
+  int fusion = -1; // 1/0: correct the pose estimate with the line or not (estimator.h), -1 = as built.
+};
+
+struct LapResult_s {
+  bool home = false; // reached STATE_HOME within the time limit.
+  float time_s = 0; // simulated time from power on to home (or the limit).
+  float lap_time_s = 0; // from leaving the initial state to home.
+  float track_time_s = 0; // from leaving the initial state to the end of the track (return_to_start), 0 if never.
+  bool replay = false; // the robot followed a stored path's speed profile (path.h) rather than mapping it.
+  float return_time_s = 0; // the drive home, from setting off after the track end pause to stopping at the start.
+  bool retraced = false; // went home along the outbound path.
+  double true_x = 0, true_y = 0, true_theta = 0; // where the robot really ended up.
+  float odom_x = 0, odom_y = 0, odom_theta = 0; // where it thinks it is.
+  float home_error_mm = 0; // true distance from the start at the end.
+  float odom_error_mm = 0; // odometry position error at the end.
+  float max_odom_error_mm = 0; // largest odometry position error over the run.
+  bool fusion = false; // the pose estimate was corrected by the line.
+  float est_x = 0, est_y = 0, est_theta = 0; // the pose estimate (estimator.h), what the path and the way home use.
+  float est_error_mm = 0; // pose estimate position error at the end.
+  float max_est_error_mm = 0; // largest over the run.
+  float est_sd_mm = 0; // the estimator's own position standard deviation at the end.
+  float wheel_scale = 0; // the right wheel scale error it learnt.
+  unsigned int landmarks = 0; // straights it used.
+  unsigned long line_losses = 0; // times on_line -> lost_line.
+  unsigned long turn_arounds = 0; // 180 degree turns after losing the line before the track end.
+  unsigned long turn_arounds_found = 0; // of those, how many found the line again straight after.
+  float max_turn_drift_mm = 0; // furthest the robot's centre moved during one turn around (on the spot = 0).
+  float max_line_error_mm = 0; // furthest the sensor bar centre got from the line while on_line.
+  float mean_line_error_mm = 0;
+  unsigned long loops = 0;
+  unsigned long late_loops = 0; // loop_late_count from the robot.
+  unsigned long loop_max_us = 0;
+  unsigned long control_ticks = 0; // runs of the 10ms PID task.
+  float cpu_ns_per_tick = 0; // host time in loop() per control tick, not counting the simulated world.
+  double host_seconds = 0; // how long the lap took to simulate.
+};
+
+// Run setup() then loop() until the robot is home or the time limit is up.
+LapResult_s run_lap(World_c & world, const LapOptions_s & options);
+
+void print_lap_result(FILE * out, const LapResult_s & result);
+
+#endif
@@ -0,0 +1,39 @@
+// Host tests of the robot code: each test_*.cpp is one program that includes the headers it tests, runs them against
+// the simulated HAL, prints a line per failed check and exits non zero if anything failed. make test runs them all.
+#ifndef _SIM_TEST_H
+#define _SIM_TEST_H
+
+#include <math.h>
+#include <stdio.h>
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+static inline void test_result(bool passed, const char * file, int line, const char * what){
+  test_checks = test_checks + 1;
+  if(!passed){
+    test_failures = test_failures + 1;
+    printf("%s:%d: FAILED: %s\n", file, line, what);
+  }
+}
+
+// CHECK(condition), or CHECK_NEAR(value, expected, tolerance) which prints both numbers when it fails.
+# define CHECK(condition) test_result((condition), __FILE__, __LINE__, #condition)
+# define CHECK_NEAR(value, expected, tolerance) test_near((value), (expected), (tolerance), __FILE__, __LINE__, #value)
+
+static inline void test_near(double value, double expected, double tolerance, const char * file, int line,
+                             const char * what){
+  bool passed = fabs(value - expected) <= tolerance;
+  test_result(passed, file, line, what);
+  if(!passed){
+    printf("    %s = %g, expected %g +- %g\n", what, value, expected, tolerance);
+  }
+}
+
+// Last line of main(): the summary and the exit status.
+static inline int test_summary(const char * name){
+  printf("%s: %d checks, %d failed\n", name, test_checks, test_failures);
+  return(test_failures ? 1 : 0);
+}
+
+#endif
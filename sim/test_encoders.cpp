@@ -0,0 +1,195 @@
+// Table driven quadrature decoder (encoders.h) against the original if/else decoder: every state, every pin sequence
+// up to eight transitions long from every starting state, and long random walks through the real ISRs with the pins
+// driven by the simulated HAL.
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+
+#include "Arduino.h"
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../encoders.h"
+
+# define TEST_SEQUENCE_LENGTH 8 // 4^8 pin sequences from each of the 4 starting states.
+# define TEST_WALK_STEPS 200000
+
+// The decoder as it was before the table: same state layout (new B, new A, old B, old A), a branch per transition.
+static void original_decode(byte & state, long & count, bool a_xor, bool b){
+  bool a = a_xor ^ b;
+  state = state | (b << 3);
+  state = state | (a << 2);
+  if(state == 1){
+    count = count - 1;
+  } else if(state == 2){
+    count = count + 1;
+  } else if(state == 4){
+    count = count + 1;
+  } else if(state == 7){
+    count = count - 1;
+  } else if(state == 8){
+    count = count - 1;
+  } else if(state == 11){
+    count = count + 1;
+  } else if(state == 13){
+    count = count + 1;
+  } else if(state == 14){
+    count = count - 1;
+  }
+  state = state >> 2;
+}
+
+// Both decoders fed the same raw pin values (XOR of A and B, then B), compared after every step.
+struct DecoderPair_s {
+  volatile byte state = 0;
+  volatile long count = 0;
+  volatile EncoderEdge_s edge;
+  byte original_state = 0;
+  long original_count = 0;
+
+  void start(byte initial){
+    state = initial;
+    count = 0;
+    original_state = initial;
+    original_count = 0;
+    edge.ts_us = 0;
+    edge.period_us = 0;
+    edge.dir = 0;
+  }
+
+  bool step(byte pins){
+    encoder_decode(state, count, edge, (pins >> 1) & 1, pins & 1);
+    original_decode(original_state, original_count, (pins >> 1) & 1, pins & 1);
+    return(state == original_state && count == original_count);
+  }
+};
+
+static void check_table(){
+  // every prior state with every new reading: the whole table.
+  for(byte prior = 0; prior < 4; prior++){
+    for(byte pins = 0; pins < 4; pins++){
+      DecoderPair_s pair;
+      pair.start(prior);
+      CHECK(pair.step(pins));
+    }
+  }
+}
+
+static void check_sequences(){
+  unsigned long sequences = 0;
+  unsigned long mismatches = 0;
+  for(byte initial = 0; initial < 4; initial++){
+    for(uint32_t sequence = 0; sequence < (1UL << (2 * TEST_SEQUENCE_LENGTH)); sequence++){
+      DecoderPair_s pair;
+      pair.start(initial);
+      bool same = true;
+      for(int i = 0; i < TEST_SEQUENCE_LENGTH; i++){
+        same = pair.step((sequence >> (2 * i)) & 3) && same;
+      }
+      sequences = sequences + 1;
+      if(!same){
+        mismatches = mismatches + 1;
+      }
+    }
+  }
+  printf("%lu pin sequences of %d steps, %lu differ\n", sequences, TEST_SEQUENCE_LENGTH, mismatches);
+  CHECK(mismatches == 0);
+}
+
+// One wheel's pins as the simulated robot drives them: B first, then the XOR pin, whose change fires the ISR.
+struct WheelPins_s {
+  uint8_t xor_pin;
+  uint8_t b_pin;
+  volatile long * count;
+  volatile EncoderEdge_s * edge;
+  byte a = 0;
+  byte b = 0;
+  byte original_state = 0;
+  long original_count = 0;
+
+  WheelPins_s(uint8_t x, uint8_t p, volatile long * c, volatile EncoderEdge_s * e)
+    : xor_pin(x), b_pin(p), count(c), edge(e) {}
+
+  void drive(byte new_a, byte new_b){
+    bool fires = (new_a ^ new_b) != (a ^ b); // the ISR only sees changes of the XOR pin.
+    a = new_a;
+    b = new_b;
+    hal_drive_pin(b_pin, b);
+    hal_drive_pin(xor_pin, a ^ b);
+    if(fires){
+      original_decode(original_state, original_count, a ^ b, b);
+    }
+  }
+};
+
+static void check_isrs(){
+  WheelPins_s right(ENCODER_0_A_PIN, ENCODER_0_B_PIN, &count_wheel_right, &edge_wheel_right);
+  WheelPins_s left(ENCODER_1_A_PIN, HAL_PIN_PE2, &count_wheel_left, &edge_wheel_left);
+  WheelPins_s * wheels[2] = {&right, &left};
+  for(int w = 0; w < 2; w++){
+    hal_drive_pin(wheels[w]->b_pin, 0);
+    hal_drive_pin(wheels[w]->xor_pin, 0);
+  }
+  setupEncoder0();
+  setupEncoder1();
+
+  // a random walk of the quadrature: mostly single steps either way in runs, some double steps (a missed edge),
+  // some glitches back and forth, on both wheels at once.
+  const byte gray[4] = {0, 1, 3, 2}; // A, B in order round the cycle, as bits (A << 1) | B.
+  std::mt19937 random_source(8);
+  std::uniform_int_distribution<int> choice(0, 99);
+  int phase[2] = {0, 0};
+  int direction[2] = {1, -1};
+  bool edges_match = true;
+  for(int i = 0; i < TEST_WALK_STEPS; i++){
+    int w = choice(random_source) & 1;
+    int roll = choice(random_source);
+    int move = direction[w];
+    if(roll < 3){
+      direction[w] = -direction[w];
+    }
+    else if(roll < 5){
+      move = 2 * direction[w];
+    }
+    else if(roll < 8){
+      move = -direction[w];
+    }
+    phase[w] = (phase[w] + move + 4) % 4;
+    long before = *wheels[w]->count;
+    wheels[w]->drive(gray[phase[w]] >> 1, gray[phase[w]] & 1);
+    long step = *wheels[w]->count - before;
+    if(step != 0 && wheels[w]->edge->dir != step){
+      edges_match = false;
+    }
+    hal_advance_ns(20000);
+  }
+  for(int w = 0; w < 2; w++){
+    CHECK(*wheels[w]->count == wheels[w]->original_count);
+  }
+  CHECK(edges_match);
+
+  // then clean runs: forward round the cycle counts down, as it always has, one count per edge. The first step
+  // resynchronises the decoder's previous state after any double step.
+  for(int w = 0; w < 2; w++){
+    for(int run = 0; run < 2; run++){
+      int move = run ? -1 : 1;
+      phase[w] = (phase[w] + move + 4) % 4;
+      wheels[w]->drive(gray[phase[w]] >> 1, gray[phase[w]] & 1);
+      long start = *wheels[w]->count;
+      for(int i = 0; i < 400; i++){
+        phase[w] = (phase[w] + move + 4) % 4;
+        wheels[w]->drive(gray[phase[w]] >> 1, gray[phase[w]] & 1);
+        hal_advance_ns(20000);
+      }
+      CHECK(*wheels[w]->count - start == -400 * move);
+    }
+  }
+  printf("random walk: right %ld counts (original decoder %ld), left %ld counts (%ld)\n", count_wheel_right,
+         right.original_count, count_wheel_left, left.original_count);
+}
+
+int main(){
+  check_table();
+  check_sequences();
+  check_isrs();
+  return(test_summary("test_encoders"));
+}
@@ -0,0 +1,108 @@
+// The line correction (estimator.h) against odometry alone, on the track library with a 2% big right wheel: each
+// track's mapping run, then the replay from the path it stored, once with the line fused and once without. Summed
+// over the library, the fused estimate has to bring the robot home closer than odometry alone does, and no track
+// may come home much further off. Every run is a child process, as in sim_bench: the robot code's state is globals.
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "hal/hal_sim.h"
+#include "hal/avr/eeprom.h"
+#include "test.h"
+#include "sim_lap.h"
+#include "track.h"
+#include "world.h"
+
+# define TEST_RIGHT_WHEEL 1.02 // the wheel size error the line correction is there to learn.
+# define TEST_LAPS 2 // per track, seeds 1, 2, ...
+# define TEST_REPLAY_SEED 1000 // as sim_bench: the replay's sensor noise isn't the mapping run's.
+# define TEST_TRACK_SLACK_MM 10 // a track may come home this much further off fused, ~its lap to lap spread.
+
+static const char * const test_tracks[] = {"default", "straight", "sharp", "gap", "s_bend"};
+# define TEST_TRACKS (sizeof(test_tracks) / sizeof(test_tracks[0]))
+
+// Read exactly size bytes from a pipe.
+static bool read_all(int fd, void * data, size_t size){
+  uint8_t * p = (uint8_t *)data;
+  while(size > 0){
+    ssize_t n = read(fd, p, size);
+    if(n <= 0){
+      return(false);
+    }
+    p = p + n;
+    size = size - n;
+  }
+  return(true);
+}
+
+// One run from power on, in a child, starting from the EEPROM as it is here. Its result and the EEPROM it leaves
+// come back through a pipe.
+static bool run_child(const char * name, uint32_t seed, int fusion, LapResult_s * result){
+  int fds[2];
+  if(pipe(fds) != 0){
+    return(false);
+  }
+  fflush(0);
+  pid_t pid = fork();
+  if(pid < 0){
+    return(false);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    Track_c track;
+    track.build(name);
+    World_c world(&track, seed);
+    world.right_wheel_scale = TEST_RIGHT_WHEEL;
+    hal_serial_output(0);
+    LapOptions_s options;
+    options.fusion = fusion;
+    LapResult_s lap = run_lap(world, options);
+    bool sent = write(fds[1], &lap, sizeof(lap)) == (ssize_t)sizeof(lap)
+                && write(fds[1], hal_eeprom_data(), HAL_EEPROM_SIZE) == HAL_EEPROM_SIZE;
+    _exit(sent ? 0 : 1);
+  }
+  close(fds[1]);
+  bool got = read_all(fds[0], result, sizeof(*result)) && read_all(fds[0], hal_eeprom_data(), HAL_EEPROM_SIZE);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return(got && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Mean distance from the start after the replay, over the laps, or -1 if a run fails.
+static float return_error_mm(const char * name, int fusion, const uint8_t * blank_eeprom){
+  float sum = 0;
+  for(uint32_t seed = 1; seed <= TEST_LAPS; seed++){
+    LapResult_s mapping, replay;
+    memcpy(hal_eeprom_data(), blank_eeprom, HAL_EEPROM_SIZE);
+    if(!run_child(name, seed, fusion, &mapping) || !mapping.home){
+      return(-1);
+    }
+    if(!run_child(name, seed + TEST_REPLAY_SEED, fusion, &replay) || !replay.home || !replay.replay){
+      return(-1);
+    }
+    sum = sum + replay.home_error_mm;
+  }
+  return(sum / TEST_LAPS);
+}
+
+int main(){
+  uint8_t blank_eeprom[HAL_EEPROM_SIZE];
+  memcpy(blank_eeprom, hal_eeprom_data(), HAL_EEPROM_SIZE);
+
+  float odometry_sum = 0;
+  float fused_sum = 0;
+  for(size_t i = 0; i < TEST_TRACKS; i++){
+    float odometry = return_error_mm(test_tracks[i], 0, blank_eeprom);
+    float fused = return_error_mm(test_tracks[i], 1, blank_eeprom);
+    printf("%-9s return error: odometry %6.1f mm, fused %6.1f mm\n", test_tracks[i], odometry, fused);
+    CHECK(odometry >= 0 && fused >= 0);
+    CHECK(fused < odometry + TEST_TRACK_SLACK_MM);
+    odometry_sum = odometry_sum + odometry;
+    fused_sum = fused_sum + fused;
+  }
+  printf("library   return error: odometry %6.1f mm, fused %6.1f mm\n", odometry_sum, fused_sum);
+  CHECK(fused_sum < odometry_sum);
+  return(test_summary("test_estimator"));
+}
@@ -0,0 +1,253 @@
+// Fixed point (fixed.h): the Fixed_c operations against double, and the three hot paths that use real_t (the line
+// position, the speed PID and the odometry) against the same code built with float.
+// Built twice. test_fixed_float (USE_FIXED_POINT 0) prints what the hot paths output for a fixed script of inputs.
+// test_fixed (fixed point, as on the robot) checks the arithmetic, runs the same script and compares its outputs with
+// those. Both print the host time per call, the cycle counts on the robot come from its 'c' serial command.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <random>
+#include <string>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../linesensor.h"
+#include "../pid.h"
+#include "../kinematics.h"
+
+# define TEST_TIMING_CALLS 100000
+
+// Every output of the hot path script by name, in script order.
+typedef std::map<std::string, double> Outputs_t;
+
+static void output(Outputs_t & outputs, const char * path, int i, double value){
+  char name[32];
+  snprintf(name, sizeof(name), "%s.%d", path, i);
+  outputs[name] = value;
+}
+
+// Host time per call of fn, ns.
+template<typename F>
+static double host_ns_per_call(F fn){
+  uint64_t start_ns = hal_host_ns();
+  for(int i = 0; i < TEST_TIMING_CALLS; i++){
+    fn(i);
+  }
+  return((double)(hal_host_ns() - start_ns) / TEST_TIMING_CALLS);
+}
+
+
+// **** Hot paths ****
+// A line of 12mm blur swept across the bar, raw discharge times like the simulated robot's.
+static void line_frame(float line_mm, unsigned int raw[]){
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    float d = (2 - i) * LS_PITCH_MM - line_mm;
+    raw[i] = 500 + (unsigned int)(2300 * exp(-(d * d) / 72.0));
+  }
+}
+
+static double line_path(Outputs_t & outputs, bool calibrated){
+  LineSensor_c sensors;
+  unsigned int raw[NUMBER_OF_LS_PINS];
+  if(calibrated){
+    sensors.reset_calibration();
+    for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+      raw[i] = 480 + 10 * i;
+    }
+    sensors.update_calibration(raw);
+    for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+      raw[i] = 2850 - 20 * i;
+    }
+    sensors.update_calibration(raw);
+    sensors.finish_calibration();
+  }
+  int n = 0;
+  for(float line_mm = -30; line_mm <= 30; line_mm = line_mm + 0.25){
+    line_frame(line_mm, raw);
+    output(outputs, calibrated ? "line_calibrated" : "line", n++, sensors.process_LS(raw));
+  }
+  line_frame(5, raw);
+  return(host_ns_per_call([&](int){ sensors.process_LS(raw); }));
+}
+
+// The speed PID as fsm.h runs it, closing the loop round a first order motor: demand steps every second.
+static double pid_path(Outputs_t & outputs){
+  PID_c pid;
+  pid.initialise(100, 0.5, -100);
+  pid.enable_engine(MAX_PWM, 50, 0.5, 0.3);
+  double speed = 0;
+  const float demands[4] = {0.6, -0.3, 0.45, 0};
+  for(int i = 0; i < 400; i++){
+    float pwm = pid.update(demands[i / 100], speed);
+    speed = speed + (0.02 * pwm - speed) * 10 / 40.0;
+    output(outputs, "pid", i, pwm);
+    hal_advance_ns(10000000ULL - (hal_now_ns() % 10000000ULL));
+  }
+  return(host_ns_per_call([&](int i){ pid.update(0.5, 0.4 + (i & 7) * 0.01); }));
+}
+
+// Odometry at the high rate over a corner heavy run: a straight, arcs both ways, spins and a reverse.
+static double odometry_path(Outputs_t & outputs){
+  Kinematics_c kinematics;
+  EncoderSnapshot_s encoders;
+  memset(&encoders, 0, sizeof(encoders));
+  const int8_t steps[6][2] = {{3, 3}, {1, 4}, {4, 2}, {-2, 2}, {3, -3}, {-3, -2}};
+  int n = 0;
+  for(int segment = 0; segment < 24; segment++){
+    for(int tick = 0; tick < 250; tick++){
+      encoders.left = encoders.left + steps[segment % 6][0];
+      encoders.right = encoders.right + steps[segment % 6][1];
+      kinematics.update(encoders);
+    }
+    output(outputs, "odometry_x", n, kinematics.X_pos);
+    output(outputs, "odometry_y", n, kinematics.Y_pos);
+    output(outputs, "odometry_theta", n, kinematics.Theta);
+    n = n + 1;
+  }
+  return(host_ns_per_call([&](int i){
+    encoders.left = encoders.left + 3;
+    encoders.right = encoders.right + 2 + (i & 1);
+    kinematics.update(encoders);
+  }));
+}
+
+static void run_hot_paths(Outputs_t & outputs){
+  double line_ns = line_path(outputs, false);
+  line_path(outputs, true);
+  double pid_ns = pid_path(outputs);
+  double odometry_ns = odometry_path(outputs);
+  fprintf(stderr, "%s host ns per call: line sensor %.0f, pid %.0f, kinematics %.0f\n",
+          USE_FIXED_POINT ? "fixed" : "float", line_ns, pid_ns, odometry_ns);
+}
+
+
+#if USE_FIXED_POINT
+
+// **** Arithmetic ****
+// Every operation is within one least significant bit of the exact result of its (exactly representable) inputs.
+template<uint8_t FRAC_BITS>
+static void check_arithmetic(double range){
+  typedef Fixed_c<FRAC_BITS> F;
+  const double lsb = 1.0 / (1L << FRAC_BITS);
+  std::mt19937 random_source(FRAC_BITS);
+  std::uniform_real_distribution<double> uniform(-range, range);
+  double worst_mul = 0;
+  double worst_div = 0;
+  for(int i = 0; i < 100000; i++){
+    F a = uniform(random_source);
+    F b = uniform(random_source);
+    double exact_a = (double)a.raw * lsb;
+    double exact_b = (double)b.raw * lsb;
+    CHECK_NEAR((a + b).raw * lsb, exact_a + exact_b, 0);
+    CHECK_NEAR((a - b).raw * lsb, exact_a - exact_b, 0);
+    if(fabs(exact_a * exact_b) < 32767.0 * 32768 * lsb){
+      double error = fabs((a * b).raw * lsb - exact_a * exact_b);
+      worst_mul = error > worst_mul ? error : worst_mul;
+    }
+    if(fabs(exact_b) > 0.5 && fabs(exact_a / exact_b) < 32767.0 * 32768 * lsb){
+      double error = fabs((a / b).raw * lsb - exact_a / exact_b);
+      worst_div = error > worst_div ? error : worst_div;
+    }
+    CHECK_NEAR(a.to_float(), exact_a, fabs(exact_a) * 1e-7);
+    CHECK(a.to_long() == (long)floor(exact_a));
+  }
+  CHECK(worst_mul <= lsb);
+  CHECK(worst_div <= lsb);
+  printf("Q%d.%d worst multiply error %.3g lsb, divide %.3g lsb\n", 31 - FRAC_BITS, FRAC_BITS, worst_mul / lsb,
+         worst_div / lsb);
+}
+
+static void check_conversions(){
+  // constants round to nearest, both signs.
+  CHECK(fixed_t(0.5f / 65536).raw == 1);
+  CHECK(fixed_t(-0.4 / 65536).raw == 0);
+  CHECK(fixed_t(-1.6 / 65536).raw == -2);
+  CHECK(fixed_t(3).raw == 3L << 16);
+  CHECK(fixed_t(-7L).raw == -(7L << 16));
+  // whole number division and ratios, as the PID and line sensor use them.
+  const double lsb = 1.0 / 65536;
+  CHECK_NEAR(real_div_int(fixed_t(10.0), 3).raw * lsb, 10.0 / 3, lsb);
+  CHECK_NEAR(real_div_int(fixed_t(-10.0), 7).raw * lsb, -10.0 / 7, lsb);
+  CHECK_NEAR(real_ratio(12345, 1000).raw * lsb, 12.345, lsb);
+  CHECK_NEAR(real_ratio(-32767, 3).raw * lsb, -32767.0 / 3, lsb);
+  CHECK_NEAR(real_ratio(4, 10000).raw * lsb, 0.0004, lsb);
+}
+
+// The float build's outputs, read from its stdout: "name value" per line.
+static bool read_reference(Outputs_t & reference){
+  FILE * f = popen("./test_fixed_float", "r");
+  if(!f){
+    return(false);
+  }
+  char name[32];
+  double value;
+  while(fscanf(f, "%31s %lf", name, &value) == 2){
+    reference[name] = value;
+  }
+  return(pclose(f) == 0 && !reference.empty());
+}
+
+// Largest difference between the two builds over every output of one path.
+static double worst_difference(const Outputs_t & outputs, const Outputs_t & reference, const char * path){
+  double worst = 0;
+  size_t length = strlen(path);
+  for(Outputs_t::const_iterator it = outputs.begin(); it != outputs.end(); ++it){
+    if(it->first.compare(0, length, path) != 0 || it->first[length] != '.'){
+      continue;
+    }
+    Outputs_t::const_iterator match = reference.find(it->first);
+    if(match == reference.end()){
+      return(1e9);
+    }
+    double difference = fabs(it->second - match->second);
+    worst = difference > worst ? difference : worst;
+  }
+  return(worst);
+}
+
+int main(){
+  check_arithmetic<16>(180);
+  check_arithmetic<12>(1000);
+  check_arithmetic<8>(8000);
+  check_conversions();
+
+  Outputs_t outputs;
+  Outputs_t reference;
+  run_hot_paths(outputs);
+  CHECK(read_reference(reference));
+  CHECK(reference.size() == outputs.size());
+
+  // e_line is +-0.5 across +-24mm, so 0.001 is 0.05mm of line position.
+  double line = worst_difference(outputs, reference, "line");
+  double line_calibrated = worst_difference(outputs, reference, "line_calibrated");
+  double pid = worst_difference(outputs, reference, "pid");
+  double odometry_xy = fmax(worst_difference(outputs, reference, "odometry_x"),
+                            worst_difference(outputs, reference, "odometry_y"));
+  double odometry_theta = worst_difference(outputs, reference, "odometry_theta");
+  printf("fixed - float worst difference: e_line %.2g (calibrated %.2g), pid %.2g pwm, odometry %.2g mm %.2g rad\n",
+         line, line_calibrated, pid, odometry_xy, odometry_theta);
+  CHECK(line < 0.001);
+  CHECK(line_calibrated < 0.001);
+  CHECK(pid < 0.05);
+  // the radians per count constant rounds to Q16 with a 0.05% error, the same drift as wheels 0.05% different in size.
+  // Over the ~3m of the script that is a few mrad and a few mm, far inside the wheels' real mismatch.
+  CHECK(odometry_xy < 3.0);
+  CHECK(odometry_theta < 0.005);
+
+  return(test_summary("test_fixed"));
+}
+
+#else
+
+int main(){
+  Outputs_t outputs;
+  run_hot_paths(outputs);
+  for(Outputs_t::iterator it = outputs.begin(); it != outputs.end(); ++it){
+    printf("%s %.9g\n", it->first.c_str(), it->second);
+  }
+  return(0);
+}
+
+#endif
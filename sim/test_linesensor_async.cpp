@@ -0,0 +1,123 @@
+// Asynchronous line sensor acquisition (linesensor.h): starting a frame doesn't wait on the capacitors, the Timer3
+// ISR completes it in the background, each time is stamped to within one sample tick, timeouts read 0, and the
+// frames match the blocking read.
+#include <stdint.h>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../linesensor.h"
+
+// Answers every sensor with a fixed discharge time, nothing else moves.
+class FakeSensors_c : public HalDevice_c {
+  public:
+    int pins[NUMBER_OF_LS_PINS] = {LS_LEFTEST_PIN, LS_LEFT_PIN, LS_CENTRE_PIN, LS_RIGHT_PIN, LS_RIGHTEST_PIN};
+    uint32_t discharge_us[NUMBER_OF_LS_PINS];
+
+    uint64_t next_event_ns(){
+      return(UINT64_MAX);
+    }
+    void step_to(uint64_t){
+    }
+    uint32_t sensor_discharge_us(uint8_t pin){
+      for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+        if(pins[i] == pin){
+          return(discharge_us[i]);
+        }
+      }
+      return(0);
+    }
+};
+
+FakeSensors_c fake;
+LineSensor_c sensors;
+
+static void set_times(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e){
+  uint32_t times[NUMBER_OF_LS_PINS] = {a, b, c, d, e};
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    fake.discharge_us[i] = times[i];
+  }
+}
+
+// Every time is stamped at the first sample tick at or after the sensor went LOW, and a timeout reads 0.
+static void check_frame(const unsigned int frame[], unsigned int resolution_us){
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    if(fake.discharge_us[i] >= LS_TIMEOUT_US){
+      CHECK(frame[i] == 0);
+    }
+    else{
+      CHECK(frame[i] >= fake.discharge_us[i]);
+      CHECK(frame[i] <= fake.discharge_us[i] + resolution_us);
+    }
+  }
+}
+
+int main(){
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    hal_mark_sensor_pin(fake.pins[i]);
+  }
+  hal_attach(&fake);
+  set_times(600, 1210, 2790, 905, 517);
+
+  // initialise() kicks off the first frame, and returns in about the 10us charge time.
+  uint64_t start_ns = hal_now_ns();
+  sensors.initialise();
+  CHECK(hal_now_ns() - start_ns < 50000);
+  CHECK(sensors.acquiring);
+  CHECK(!sensors.reading_ready);
+
+  // nothing is ready until the slowest sensor has discharged, and then it is within a sample tick.
+  unsigned int sensor_read[NUMBER_OF_LS_PINS];
+  hal_advance_ns(2790000 - 2 * LS_ASYNC_SAMPLE_US * 1000);
+  CHECK(!sensors.reading_ready);
+  CHECK(!sensors.next_frame(sensor_read));
+  hal_advance_ns(3 * LS_ASYNC_SAMPLE_US * 1000);
+  CHECK(sensors.reading_ready);
+  CHECK(!sensors.acquiring);
+
+  // consuming the frame starts the next one straight away.
+  start_ns = hal_now_ns();
+  CHECK(sensors.next_frame(sensor_read));
+  CHECK(hal_now_ns() - start_ns < 50000);
+  check_frame(sensor_read, LS_ASYNC_SAMPLE_US);
+  CHECK(sensors.acquiring);
+  CHECK(!sensors.reading_ready);
+
+  // a frame that isn't consumed stays as it was.
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  CHECK(sensors.reading_ready);
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    CHECK(sensors.frame_times[i] == sensor_read[i]);
+  }
+
+  // a sensor over nothing never discharges: it reads 0, and the frame ends at the timeout.
+  set_times(700, 3500, 1400, 10000, 650);
+  sensors.next_frame(sensor_read);
+  hal_advance_ns((LS_TIMEOUT_US - 2 * LS_ASYNC_SAMPLE_US) * 1000ULL);
+  CHECK(!sensors.reading_ready);
+  hal_advance_ns(3 * LS_ASYNC_SAMPLE_US * 1000);
+  CHECK(sensors.reading_ready);
+  sensors.next_frame(sensor_read);
+  check_frame(sensor_read, LS_ASYNC_SAMPLE_US);
+
+  // the background frames agree with the blocking read, whose resolution is the micros() polling loop.
+  set_times(880, 1530, 2450, 1120, 640);
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  sensors.next_frame(sensor_read); // the frame started under the old times.
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  CHECK(sensors.next_frame(sensor_read));
+  check_frame(sensor_read, LS_ASYNC_SAMPLE_US);
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  unsigned int blocking_read[NUMBER_OF_LS_PINS];
+  sensors.capture_frame(blocking_read);
+  for(int i = 0; i < NUMBER_OF_LS_PINS; i++){
+    CHECK_NEAR(sensor_read[i], blocking_read[i], LS_ASYNC_SAMPLE_US + 8);
+  }
+
+  // and give the same line position: darkest under the centre sensor, a little to the left.
+  hal_advance_ns(LS_TIMEOUT_US * 2000ULL);
+  float e_line = sensors.read_async();
+  CHECK(e_line > 0 && e_line < 0.2);
+  CHECK_NEAR(e_line, sensors.process_LS(blocking_read), 0.01);
+
+  return(test_summary("test_linesensor_async"));
+}
@@ -0,0 +1,195 @@
+// Direct motor driver (motors.h MOTORS_DIRECT) against the simulated Timer1 compare registers and port B: over-range
+// commands are clamped keeping the left/right ratio, changes are slew limited and reversals ramp through zero, and
+// the registers are only written when what's in them changes.
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../motors.h"
+
+// Register writes, counted by hooks on the registers. Port B already has the simulator's hook, which still runs.
+static unsigned long ocr_left_writes = 0; // OCR1B
+static unsigned long ocr_right_writes = 0; // OCR1A
+static unsigned long portb_writes = 0;
+static void (*portb_hook)(uint8_t, uint8_t) = 0;
+
+static void ocr1a_written(uint16_t, uint16_t){ ocr_right_writes = ocr_right_writes + 1; }
+static void ocr1b_written(uint16_t, uint16_t){ ocr_left_writes = ocr_left_writes + 1; }
+static void portb_written(uint8_t old_value, uint8_t new_value){
+  portb_writes = portb_writes + 1;
+  if(portb_hook){
+    portb_hook(old_value, new_value);
+  }
+}
+
+static void reset_writes(){
+  ocr_left_writes = 0;
+  ocr_right_writes = 0;
+  portb_writes = 0;
+}
+
+static bool left_reversed(){
+  return(PORTB.value & (1 << MOTORS_L_DIR_BIT));
+}
+
+static bool right_reversed(){
+  return(PORTB.value & (1 << MOTORS_R_DIR_BIT));
+}
+
+Motors_c motors;
+
+// Clamping, with the slew limit off so every command is applied at once.
+static void check_clamp(){
+  motors.slew_pwm_per_ms = 0;
+
+  // in range: as commanded, truncated to whole steps in the registers.
+  motors.setMotorPower(40.6, -20.2);
+  CHECK_NEAR(motors.applied_left, 40.6, 1e-4);
+  CHECK_NEAR(motors.applied_right, -20.2, 1e-4);
+  CHECK(OCR1B.value == 40 && OCR1A.value == 20);
+  CHECK(!left_reversed() && right_reversed());
+
+  // over range: the bigger one sits on the limit, the other keeps the ratio, so the robot still turns the same way.
+  motors.setMotorPower(150, 75);
+  CHECK_NEAR(motors.applied_left, MAX_PWM, 1e-4);
+  CHECK_NEAR(motors.applied_right, MAX_PWM / 2.0, 1e-4);
+  CHECK(OCR1B.value == MAX_PWM && OCR1A.value == 37);
+  CHECK(!left_reversed() && !right_reversed());
+  motors.setMotorPower(-100, 200);
+  CHECK_NEAR(motors.applied_left, -MAX_PWM / 2.0, 1e-4);
+  CHECK_NEAR(motors.applied_right, MAX_PWM, 1e-4);
+  CHECK(left_reversed() && !right_reversed());
+  motors.setMotorPower(-90, -90);
+  CHECK_NEAR(motors.applied_left, -MAX_PWM, 1e-4);
+  CHECK_NEAR(motors.applied_right, -MAX_PWM, 1e-4);
+  CHECK(OCR1B.value == MAX_PWM && OCR1A.value == MAX_PWM);
+  for(int i = 0; i < 50; i++){
+    float left = (i * 37 % 400) - 200;
+    float right = (i * 91 % 400) - 200;
+    motors.setMotorPower(left, right);
+    CHECK(abs(motors.applied_left) <= MAX_PWM + 1e-4 && abs(motors.applied_right) <= MAX_PWM + 1e-4);
+    if(right != 0 && motors.applied_right != 0){
+      CHECK_NEAR(motors.applied_left / motors.applied_right, left / right, 1e-4);
+    }
+  }
+  motors.stop();
+  motors.slew_pwm_per_ms = MOTORS_SLEW_PWM_PER_MS;
+}
+
+// Drive the same command every ms for ms milliseconds, as the motor task would.
+static void drive(float left, float right, int ms){
+  for(int i = 0; i < ms; i++){
+    hal_advance_ns(1000000);
+    motors.setMotorPower(left, right);
+  }
+}
+
+static void check_slew(){
+  const float step = MOTORS_SLEW_PWM_PER_MS; // per ms
+  motors.stop();
+  drive(0, 0, 5);
+
+  // 0 -> full power takes MAX_PWM / step ms, moving step per ms on the way. Each call spends a few us of its own,
+  // which the ramp counts too.
+  drive(MAX_PWM, 30, 10);
+  CHECK_NEAR(motors.applied_left, 10 * step, 0.02 * 10 * step);
+  CHECK_NEAR(motors.applied_right, 10 * step, 0.02 * 10 * step);
+  drive(MAX_PWM, 30, 10);
+  CHECK_NEAR(motors.applied_left, 20 * step, 0.02 * 20 * step);
+  CHECK_NEAR(motors.applied_right, 30, 1e-4); // got there, and stays there.
+  drive(MAX_PWM, 30, 40);
+  CHECK_NEAR(motors.applied_left, MAX_PWM, 1e-4);
+
+  // a reversal ramps down through zero, the direction bit only flips once the pwm has crossed it.
+  bool crossed_early = false;
+  float previous = motors.applied_left;
+  for(int i = 0; i < 120; i++){
+    drive(-MAX_PWM, 30, 1);
+    if(motors.applied_left > 0 && left_reversed()){
+      crossed_early = true;
+    }
+    CHECK(previous - motors.applied_left <= step * 1.01 + 1e-3);
+    previous = motors.applied_left;
+  }
+  CHECK(!crossed_early);
+  CHECK_NEAR(motors.applied_left, -MAX_PWM, 1e-4);
+  CHECK(left_reversed());
+
+  // one long gap between calls allows the whole step at once.
+  motors.setMotorPower(-MAX_PWM, 30);
+  hal_advance_ns(200000000ULL);
+  motors.setMotorPower(MAX_PWM, -30);
+  CHECK_NEAR(motors.applied_left, MAX_PWM, 1e-4);
+  CHECK_NEAR(motors.applied_right, -30, 1e-4);
+
+  // stop() is immediate.
+  motors.stop();
+  CHECK(motors.applied_left == 0 && motors.applied_right == 0);
+  CHECK(OCR1A.value == 0 && OCR1B.value == 0);
+}
+
+static void check_register_writes(){
+  motors.slew_pwm_per_ms = 0;
+  motors.setMotorPower(30, 30);
+  reset_writes();
+
+  // the same command again, or one that truncates to the same step: nothing written.
+  for(int i = 0; i < 100; i++){
+    motors.setMotorPower(30 + (i % 10) * 0.09, 30);
+  }
+  CHECK(ocr_left_writes == 0 && ocr_right_writes == 0 && portb_writes == 0);
+
+  // one wheel changes: only its compare register.
+  motors.setMotorPower(31, 30);
+  CHECK(ocr_left_writes == 1 && ocr_right_writes == 0 && portb_writes == 0);
+  motors.setMotorPower(31, 29);
+  CHECK(ocr_left_writes == 1 && ocr_right_writes == 1 && portb_writes == 0);
+
+  // a direction change at the same magnitude: only port B, once for both wheels.
+  motors.setMotorPower(-31, -29);
+  CHECK(ocr_left_writes == 1 && ocr_right_writes == 1 && portb_writes == 1);
+  CHECK(left_reversed() && right_reversed());
+  motors.setMotorPower(-31, -29);
+  CHECK(portb_writes == 1);
+
+  // the other port B bits are left alone.
+  PORTB.write(PORTB.value | 0x81);
+  reset_writes();
+  motors.setMotorPower(31, 29);
+  CHECK(portb_writes == 1);
+  CHECK((PORTB.value & 0x81) == 0x81);
+  CHECK(!left_reversed() && !right_reversed());
+
+  // the slew limited ramp: each of the 50 calls up to full power moves the whole pwm step and writes OCR1B, the 50
+  // calls at full power write nothing.
+  motors.stop();
+  motors.slew_pwm_per_ms = MOTORS_SLEW_PWM_PER_MS;
+  reset_writes();
+  drive(MAX_PWM, 0, 100);
+  printf("ramp 0 -> %d over 100 calls: %lu OCR1B writes, %lu OCR1A, %lu PORTB\n", MAX_PWM, ocr_left_writes,
+         ocr_right_writes, portb_writes);
+  CHECK(ocr_left_writes <= 51 && ocr_left_writes >= 45);
+  CHECK(ocr_right_writes == 0 && portb_writes == 0);
+  motors.stop();
+}
+
+int main(){
+  OCR1A.on_write = ocr1a_written;
+  OCR1B.on_write = ocr1b_written;
+  portb_hook = PORTB.on_write;
+  PORTB.on_write = portb_written;
+
+  motors.initialise();
+  CHECK(TCCR1A.value & (1 << COM1A1));
+  CHECK(TCCR1A.value & (1 << COM1B1));
+  CHECK(OCR1A.value == 0 && OCR1B.value == 0);
+
+  check_clamp();
+  check_slew();
+  check_register_writes();
+
+  PORTB.on_write = portb_hook;
+  return(test_summary("test_motors"));
+}
@@ -0,0 +1,272 @@
+// Speed PID engine mode (pid.h): step responses closing the loop round a first order motor, with the speed PID's real
+// gains and limits. Rise time, overshoot, settling time and steady state error at the 10ms PID tick and at 2ms, no
+// derivative kick on a demand step, the output saturating at the motor limit, and recovery from a stalled wheel
+// with and without the anti-windup. Then the motor feedforward going in as the PID's offset, inside the saturation.
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../pid.h"
+#include "../motors.h"
+#include "../fsm.h"
+#include "../feedforward.h"
+
+# define TEST_MOTOR_GAIN 0.02 // counts per ms per unit of pwm, at steady state.
+# define TEST_MOTOR_TAU_MS 40.0
+# define TEST_SETTLE_BAND 0.05 // settled once within 5% of the step for good.
+
+// The wheel: its speed follows gain * pwm with a time constant, integrated every simulated ms. The pwm is clamped to
+// the motor limit as Motors_c does, and a stalled wheel doesn't move whatever the pwm.
+struct Motor_s {
+  double speed = 0;
+  bool stalled = false;
+
+  void run_ms(float pwm){
+    if(stalled){
+      speed = 0;
+      return;
+    }
+    pwm = constrain(pwm, -MAX_PWM, MAX_PWM);
+    speed = speed + (TEST_MOTOR_GAIN * pwm - speed) / TEST_MOTOR_TAU_MS;
+  }
+};
+
+// A speed PID as pid_task() sets it up.
+static void speed_pid(PID_c & pid, bool engine){
+  pid.initialise(100, 0.5, -100);
+  if(engine){
+    pid.enable_engine(MAX_PWM, SPEED_PID_INT_LIMIT, SPEED_PID_BACKCALC, SPEED_PID_D_ALPHA);
+  }
+}
+
+// What a step response did, times in ms from the step.
+struct StepResponse_s {
+  double rise_ms = -1; // 10% to 90% of the step.
+  double overshoot = 0; // fraction of the step beyond the final value.
+  double settle_ms = -1; // last time it was outside the settling band.
+  double final_error = 0; // demand - speed at the end.
+  float max_pwm = 0;
+};
+
+// Run the loop for run_ms with the PID updated every period_ms, from the motor's current speed to demand. offset is
+// passed to every update, as pid_task() passes the feedforward.
+static StepResponse_s step_response(PID_c & pid, Motor_s & motor, float demand, int period_ms, int run_ms,
+                                    float offset = 0){
+  StepResponse_s response;
+  double start = motor.speed;
+  double step = demand - start;
+  double t10 = -1;
+  double t90 = -1;
+  float pwm = 0;
+  for(int ms = 0; ms < run_ms; ms++){
+    if(ms % period_ms == 0){
+      pwm = pid.update(demand, motor.speed, offset);
+      response.max_pwm = fmax(response.max_pwm, fabs(pwm));
+    }
+    motor.run_ms(pwm);
+    hal_advance_ns(1000000);
+    double progress = (motor.speed - start) / step;
+    if(t10 < 0 && progress >= 0.1){
+      t10 = ms;
+    }
+    if(t90 < 0 && progress >= 0.9){
+      t90 = ms;
+    }
+    response.overshoot = fmax(response.overshoot, progress - 1);
+    if(fabs(progress - 1) > TEST_SETTLE_BAND){
+      response.settle_ms = ms + 1;
+    }
+  }
+  if(t10 >= 0 && t90 >= 0){
+    response.rise_ms = t90 - t10;
+  }
+  response.final_error = demand - motor.speed;
+  return(response);
+}
+
+static void print_response(const char * name, const StepResponse_s & r){
+  printf("%-28s rise %4.0fms, overshoot %4.1f%%, settle %4.0fms, error %+.4f, max pwm %.1f\n", name, r.rise_ms,
+         100 * r.overshoot, r.settle_ms, r.final_error, r.max_pwm);
+}
+
+// Steps up, down and through zero, at the 10ms tick the FSM runs and at five times the rate with the same gains.
+static void check_step_responses(){
+  const int periods[2] = {PID_UPDATE, 2};
+  StepResponse_s up[2];
+  for(int p = 0; p < 2; p++){
+    PID_c pid;
+    Motor_s motor;
+    speed_pid(pid, true);
+    char name[40];
+    snprintf(name, sizeof(name), "0 -> 0.6 every %dms", periods[p]);
+    up[p] = step_response(pid, motor, 0.6, periods[p], 1500);
+    print_response(name, up[p]);
+    // the integral does most of the work: kp alone only gets the wheel 2/3 of the way.
+    CHECK(up[p].rise_ms > 0 && up[p].rise_ms < 400);
+    CHECK(up[p].overshoot < 0.2);
+    CHECK(up[p].settle_ms < 600);
+    CHECK_NEAR(up[p].final_error, 0, 0.005);
+    CHECK(up[p].max_pwm <= MAX_PWM);
+
+    snprintf(name, sizeof(name), "0.6 -> 0.3 every %dms", periods[p]);
+    StepResponse_s down = step_response(pid, motor, 0.3, periods[p], 1500);
+    print_response(name, down);
+    CHECK(down.overshoot < 0.2);
+    CHECK(down.settle_ms < 600);
+    CHECK_NEAR(down.final_error, 0, 0.005);
+
+    snprintf(name, sizeof(name), "0.3 -> -0.4 every %dms", periods[p]);
+    StepResponse_s reverse = step_response(pid, motor, -0.4, periods[p], 1500);
+    print_response(name, reverse);
+    CHECK(reverse.overshoot < 0.2);
+    CHECK(reverse.settle_ms < 600);
+    CHECK_NEAR(reverse.final_error, 0, 0.005);
+  }
+  // micros() timing keeps the gains per ms, so running faster gives much the same response.
+  CHECK_NEAR(up[1].rise_ms, up[0].rise_ms, 0.25 * up[0].rise_ms);
+}
+
+// A step in the demand with the wheel holding still: the derivative works on the measurement, so the output moves
+// by the proportional step (and one tick of integral), no kick. The original error derivative kicks.
+static void check_derivative_kick(){
+  PID_c engine;
+  speed_pid(engine, true);
+  PID_c original;
+  speed_pid(original, false);
+  for(int i = 0; i < 20; i++){
+    hal_advance_ns(PID_UPDATE * 1000000ULL);
+    engine.update(0.3, 0.3);
+    original.update(0.3, 0.3);
+  }
+  float engine_before = engine.update(0.3, 0.3);
+  hal_advance_ns(PID_UPDATE * 1000000ULL);
+  float engine_after = engine.update(0.4, 0.3);
+  hal_advance_ns(PID_UPDATE * 1000000ULL);
+  original.update(0.3, 0.3);
+  hal_advance_ns(PID_UPDATE * 1000000ULL);
+  original.update(0.4, 0.3);
+  printf("demand step 0.1: engine output %+.2f pwm, derivative %.3f; original derivative %.2f\n",
+         engine_after - engine_before, real_to_float(engine.diff_term), real_to_float(original.diff_term));
+  CHECK_NEAR(real_to_float(engine.diff_term), 0, 1e-3);
+  CHECK_NEAR(engine_after - engine_before, 100 * 0.1, 0.1 * PID_UPDATE * 0.5 + 0.01);
+  CHECK(fabs(real_to_float(original.diff_term)) > 0.5);
+}
+
+// The output never goes past the motor limit, however big the error.
+static void check_saturation(){
+  PID_c pid;
+  speed_pid(pid, true);
+  for(int i = 0; i < 50; i++){
+    hal_advance_ns(PID_UPDATE * 1000000ULL);
+    float pwm = pid.update(i & 1 ? 5.0 : -5.0, 0);
+    CHECK(fabs(pwm) <= MAX_PWM);
+  }
+  CHECK_NEAR(pid.update(5.0, 0), MAX_PWM, 1e-3);
+}
+
+// The wheel held still for two seconds at a demand it can't reach, then let go. With the anti-windup the integral
+// stays inside its clamp and the speed barely overshoots. The original integrator winds up and overshoots by far,
+// which is why it used to be reset on every state change.
+static StepResponse_s stall_and_release(bool engine){
+  PID_c pid;
+  Motor_s motor;
+  speed_pid(pid, engine);
+  motor.stalled = true;
+  step_response(pid, motor, 0.6, PID_UPDATE, 2000);
+  if(engine){
+    CHECK(fabs(real_to_float(pid.int_term)) <= SPEED_PID_INT_LIMIT + 1e-3);
+  }
+  motor.stalled = false;
+  return(step_response(pid, motor, 0.6, PID_UPDATE, 3000));
+}
+
+static void check_anti_windup(){
+  StepResponse_s engine = stall_and_release(true);
+  StepResponse_s original = stall_and_release(false);
+  print_response("released after a stall", engine);
+  print_response("released, original integral", original);
+  CHECK(engine.overshoot < 0.2);
+  CHECK(engine.settle_ms < 800);
+  CHECK_NEAR(engine.final_error, 0, 0.005);
+  CHECK(original.overshoot > 0.5);
+}
+
+// The feedforward map: the nominal map's inverse undoes its forward map above the deadband, and a learnt map comes
+// back from the EEPROM as it was saved.
+static void check_feedforward_map(){
+  Feedforward_c map;
+  for(float pwm = FF_DEFAULT_DEADBAND + 1; pwm <= MAX_PWM; pwm = pwm + 3.5){
+    CHECK_NEAR(map.pwm_for_speed(FF_LEFT, map.speed_for_pwm(FF_LEFT, pwm)), pwm, 0.1);
+    CHECK_NEAR(map.pwm_for_speed(FF_RIGHT, map.speed_for_pwm(FF_RIGHT, -pwm)), -pwm, 0.1);
+  }
+  CHECK(map.pwm_for_speed(FF_LEFT, 0) == 0);
+  for(byte i = 0; i < FF_POINTS; i++){
+    map.record(FF_LEFT, false, i, 0.03 * (i + 1));
+    map.record(FF_LEFT, true, i, -0.025 * (i + 1));
+    map.record(FF_RIGHT, false, i, 0.04 * i); // still at the first point: a deadband past it.
+    map.record(FF_RIGHT, true, i, -0.028 * (i + 1));
+  }
+  CHECK(map.finish());
+  map.save();
+  Feedforward_c loaded;
+  CHECK(!loaded.learnt);
+  CHECK(loaded.load());
+  CHECK(loaded.learnt);
+  CHECK(!memcmp(loaded.curves, map.curves, sizeof(map.curves)));
+  CHECK_NEAR(loaded.pwm_for_speed(FF_RIGHT, -0.1), map.pwm_for_speed(FF_RIGHT, -0.1), 1e-6);
+}
+
+// The feedforward as the offset: it goes into the output before the clamp, so the output stays within the motor limit
+// and the anti-windup unwinds by what the whole output was saturated, not just the PID's part of it.
+static void check_feedforward_offset(){
+  Feedforward_c map;
+  PID_c pid;
+  Motor_s motor;
+  speed_pid(pid, true);
+  StepResponse_s up = step_response(pid, motor, 0.6, PID_UPDATE, 1500, map.pwm_for_speed(FF_LEFT, 0.6));
+  print_response("0 -> 0.6 with feedforward", up);
+  CHECK(up.max_pwm <= MAX_PWM);
+  CHECK(up.overshoot < 0.2);
+  CHECK_NEAR(up.final_error, 0, 0.005);
+
+  // saturated by the offset alone: the output sits on the limit.
+  hal_advance_ns(PID_UPDATE * 1000000ULL);
+  CHECK_NEAR(pid.update(0.6, 0.6, 2 * MAX_PWM), MAX_PWM, 1e-3);
+
+  // stalled with the feedforward on: the integral has less to do, and stays inside its clamp.
+  motor.stalled = true;
+  float offset = map.pwm_for_speed(FF_LEFT, 0.6);
+  step_response(pid, motor, 0.6, PID_UPDATE, 2000, offset);
+  CHECK(fabs(real_to_float(pid.int_term)) <= SPEED_PID_INT_LIMIT + 1e-3);
+  motor.stalled = false;
+  StepResponse_s released = step_response(pid, motor, 0.6, PID_UPDATE, 3000, offset);
+  print_response("released, with feedforward", released);
+  CHECK(released.overshoot < 0.2);
+  CHECK_NEAR(released.final_error, 0, 0.005);
+
+  // a reversal, the wheel running forwards at 0.3 when the demand becomes -0.3 as it does at the start of the turn
+  // around: the output saturates backwards. Unwinding brings the integral back only as far as puts the output on the
+  // limit, it mustn't run on to the other clamp, which would hold the wheel back once it's turned.
+  speed_pid(pid, true);
+  offset = map.pwm_for_speed(FF_LEFT, -0.3);
+  for(int i = 0; i < 10; i++){
+    hal_advance_ns(PID_UPDATE * 1000000ULL);
+    CHECK_NEAR(pid.update(-0.3, 0.3, offset), -MAX_PWM, 1e-3);
+    float unsaturated = real_to_float(pid.prop_term + pid.int_term + pid.diff_term) + offset;
+    CHECK_NEAR(unsaturated, -MAX_PWM, 0.5);
+    CHECK(real_to_float(pid.int_term) < 0.25 * SPEED_PID_INT_LIMIT);
+  }
+}
+
+int main(){
+  check_step_responses();
+  check_derivative_kick();
+  check_saturation();
+  check_anti_windup();
+  check_feedforward_map();
+  check_feedforward_offset();
+  return(test_summary("test_pid"));
+}
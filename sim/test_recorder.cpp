@@ -0,0 +1,132 @@
+// Run recorder (recorder.h): a run is recorded into the simulated EEPROM through the write queue, then the 'd' dump
+// is read back from the serial output and compared with what went in, to within the quantisation. A short run comes
+// back whole. A long run wraps round the ring and comes back as its most recent samples. Both report the EEPROM
+// bytes per second of run, which sets how long a run the ring holds.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../recorder.h"
+
+// One sample as it went in or came out.
+struct Sample_s {
+  float x, y, theta, e_line;
+  int state;
+};
+
+// A run that looks like a lap: driving at 150mm/s while weaving, the line swinging under the sensors, and a change
+// of state every 40 samples (8 seconds).
+static Sample_s run_sample(int i){
+  Sample_s s;
+  float t = i * RECORDER_PERIOD_MS / 1000.0;
+  s.theta = 0.8 * sin(t * 0.4);
+  s.x = 150 * t * cos(0.3 * sin(t * 0.4)) - 200;
+  s.y = 300 * sin(t * 0.2);
+  s.e_line = 0.3 * sin(t * 0.9);
+  s.state = 2 + (i / 40) % 3;
+  return(s);
+}
+
+// Record n samples 200ms apart, servicing the write queue once a ms in between as loop() does.
+static void record_run(int n){
+  recorder.start();
+  for(int i = 0; i < n; i++){
+    Sample_s s = run_sample(i);
+    recorder.sample(s.x, s.y, s.theta, s.e_line, s.state);
+    for(int ms = 0; ms < RECORDER_PERIOD_MS; ms++){
+      recorder.service();
+      hal_advance_ns(1000000);
+    }
+  }
+  recorder.stop();
+}
+
+// The dump, parsed from the serial output. Returns the bytes/s from its summary line.
+static float read_dump(std::vector<Sample_s> & samples, unsigned long & bytes){
+  FILE * f = tmpfile();
+  hal_serial_output(f);
+  recorder.dump();
+  hal_serial_output(0);
+  rewind(f);
+  char line[128];
+  float bytes_per_s = -1;
+  unsigned long n = 0;
+  while(fgets(line, sizeof(line), f)){
+    unsigned long t_ms;
+    Sample_s s;
+    if(sscanf(line, "%lu,%f,%f,%f,%f,%d", &t_ms, &s.x, &s.y, &s.theta, &s.e_line, &s.state) == 6){
+      CHECK(t_ms == samples.size() * RECORDER_PERIOD_MS);
+      samples.push_back(s);
+    }
+    else if(sscanf(line, "samples: %lu, bytes: %lu, bytes/s: %f", &n, &bytes, &bytes_per_s) == 3){
+      CHECK(n == samples.size());
+    }
+  }
+  fclose(f);
+  return(bytes_per_s);
+}
+
+// The dump's samples are the last ones recorded, to within half a step of each quantity.
+static void check_samples(const std::vector<Sample_s> & samples, int recorded){
+  int first = recorded - samples.size();
+  int bad = 0;
+  for(size_t i = 0; i < samples.size(); i++){
+    Sample_s expected = run_sample(first + i);
+    const Sample_s & s = samples[i];
+    if(fabs(s.x - expected.x) > RECORDER_POSITION_MM / 2.0 + 1e-3
+       || fabs(s.y - expected.y) > RECORDER_POSITION_MM / 2.0 + 1e-3
+       || fabs(s.theta - expected.theta) > 0.5 / RECORDER_THETA_STEPS + 1e-3
+       || fabs(s.e_line - expected.e_line) > 0.5 / RECORDER_E_LINE_STEPS + 1e-3
+       || s.state != expected.state){
+      bad = bad + 1;
+    }
+  }
+  CHECK(bad == 0);
+}
+
+int main(){
+  // a run that fits: every sample comes back.
+  const int short_run = 100;
+  record_run(short_run);
+  CHECK(recorder.dropped == 0);
+  CHECK(recorder.samples == short_run);
+  std::vector<Sample_s> samples;
+  unsigned long bytes = 0;
+  float bytes_per_s = read_dump(samples, bytes);
+  CHECK(samples.size() == short_run);
+  check_samples(samples, short_run);
+  printf("%d samples (%.0fs) in %lu bytes: %.1f bytes/s\n", short_run, short_run * RECORDER_PERIOD_MS / 1000.0,
+         bytes, bytes_per_s);
+
+  // the ring holds RECORDER_BLOCKS blocks after the run id byte, the oldest is overwritten as the run goes on.
+  float ring_bytes = RECORDER_BLOCKS * RECORDER_BLOCK_SIZE;
+  printf("ring %.0f bytes: %.0f seconds of run at this rate\n", ring_bytes, ring_bytes / bytes_per_s);
+  CHECK(RECORDER_BLOCKS == 12);
+  CHECK(bytes_per_s > 10 && bytes_per_s < 40);
+
+  // a run three times too long: the dump is the most recent part of it, in order, ending at the last sample.
+  const int long_run = 3 * ring_bytes / bytes_per_s * 1000 / RECORDER_PERIOD_MS;
+  record_run(long_run);
+  CHECK(recorder.dropped == 0);
+  samples.clear();
+  read_dump(samples, bytes);
+  printf("%d samples recorded, the last %zu (%.0fs) read back from %lu bytes\n", long_run, samples.size(),
+         samples.size() * RECORDER_PERIOD_MS / 1000.0, bytes);
+  CHECK(samples.size() > 0.8 * (RECORDER_BLOCKS - 1) * RECORDER_BLOCK_SIZE / bytes_per_s * 1000 / RECORDER_PERIOD_MS);
+  CHECK(samples.size() < (size_t)long_run);
+  CHECK(bytes <= ring_bytes + 1);
+  check_samples(samples, long_run);
+
+  // a new run replaces the old one in the dump, even where the old blocks are still in the EEPROM.
+  record_run(10);
+  samples.clear();
+  read_dump(samples, bytes);
+  CHECK(samples.size() == 10);
+  check_samples(samples, 10);
+
+  return(test_summary("test_recorder"));
+}
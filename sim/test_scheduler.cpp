@@ -0,0 +1,187 @@
+// Fixed rate scheduler (scheduler.h) on a fake clock: due times stay on the fixed grid however late each run is,
+// tasks due together run highest priority first, a task that falls whole periods behind counts the overrun and
+// skips them rather than catching up in a burst, the wcet and jitter figures are the fake clock's, and run() can't
+// be re-entered from inside a task.
+#include <stdio.h>
+#include <string>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../scheduler.h"
+
+static unsigned long fake_us = 0;
+static unsigned long fake_clock(){
+  return(fake_us);
+}
+
+// A task's context: the order tasks ran in goes in the log, and the task takes cost_us of the fake clock.
+struct Context_s {
+  std::string * log;
+  const char * name;
+  unsigned long cost_us;
+};
+
+static void logged_task(void * context){
+  Context_s * c = (Context_s *)context;
+  if(c->log){
+    *c->log = *c->log + c->name + " ";
+  }
+  fake_us = fake_us + c->cost_us;
+}
+
+// Polled every 37us (not a divisor of the period) for ten thousand periods: every start is within one poll of its
+// slot, and the next slot is still exactly on the grid from start().
+static void check_no_drift(){
+  Scheduler_c scheduler;
+  scheduler.clock = fake_clock;
+  Context_s context = {0, "tick", 5};
+  fake_us = 12345;
+  CHECK(scheduler.add_task("tick", logged_task, &context, 1000, 1, 250) == 0);
+  scheduler.start();
+  const unsigned long start_us = fake_us;
+  CHECK(scheduler.tasks[0].next_due_us == start_us + 250);
+  while(scheduler.tasks[0].runs < 10000){
+    scheduler.run();
+    fake_us = fake_us + 37;
+  }
+  Task_s & task = scheduler.tasks[0];
+  CHECK(task.next_due_us == start_us + 250 + 10000 * 1000UL);
+  CHECK(task.overruns == 0);
+  CHECK(task.max_jitter_us < 37);
+  CHECK(task.wcet_us == 5);
+}
+
+// Three tasks due at once run highest priority first, each once per run() call, whatever order they were added in.
+static void check_priority(){
+  Scheduler_c scheduler;
+  scheduler.clock = fake_clock;
+  std::string log;
+  Context_s low = {&log, "low", 10};
+  Context_s high = {&log, "high", 10};
+  Context_s mid = {&log, "mid", 10};
+  fake_us = 0;
+  scheduler.add_task("low", logged_task, &low, 1000, 1);
+  scheduler.add_task("high", logged_task, &high, 1000, 3);
+  scheduler.add_task("mid", logged_task, &mid, 1000, 2);
+  scheduler.start();
+  CHECK(scheduler.run() == 3);
+  CHECK(log == "high mid low ");
+
+  // not due yet: nothing runs.
+  log.clear();
+  fake_us = 999;
+  CHECK(scheduler.run() == 0);
+  CHECK(log.empty());
+
+  // only the due ones, and a task that becomes due while a higher priority one runs still gets its turn.
+  fake_us = 1000;
+  scheduler.tasks[0].next_due_us = 1005; // low falls due during high's 10us.
+  CHECK(scheduler.run() == 3);
+  CHECK(log == "high mid low ");
+
+  // the table fills up.
+  Scheduler_c full;
+  for(int i = 0; i < SCHEDULER_MAX_TASKS; i++){
+    CHECK(full.add_task("t", logged_task, &low, 1000, 0) == i);
+  }
+  CHECK(full.add_task("t", logged_task, &low, 1000, 0) == -1);
+}
+
+// Late by three and a half periods: one run, three overruns, and the next slot is the next one on the grid after
+// now. The missed runs aren't replayed.
+static void check_overrun(){
+  Scheduler_c scheduler;
+  scheduler.clock = fake_clock;
+  Context_s context = {0, "task", 0};
+  fake_us = 0;
+  scheduler.add_task("task", logged_task, &context, 1000, 1);
+  scheduler.start();
+  scheduler.run();
+  Task_s & task = scheduler.tasks[0];
+  CHECK(task.runs == 1 && task.next_due_us == 1000);
+
+  fake_us = 1000 + 3500;
+  CHECK(scheduler.run() == 1);
+  CHECK(task.overruns == 3);
+  CHECK(task.next_due_us == 5000);
+  CHECK(task.max_jitter_us == 3500);
+  for(int i = 0; i < 10; i++){
+    CHECK(scheduler.run() == 0);
+  }
+  CHECK(task.runs == 2);
+  fake_us = 5000;
+  CHECK(scheduler.run() == 1);
+  CHECK(task.runs == 3 && task.overruns == 3 && task.next_due_us == 6000);
+
+  // a run that takes longer than its period overruns the next slot too.
+  context.cost_us = 2200;
+  fake_us = 6000;
+  scheduler.run();
+  CHECK(task.wcet_us == 2200);
+  CHECK(scheduler.run() == 1); // at 8200, due at 7000: one slot missed.
+  CHECK(task.overruns == 4);
+  CHECK(task.next_due_us == 9000);
+}
+
+// The statistics are the fake clock's: wcet from the task's own time, jitter from how late it started.
+static void check_statistics(){
+  Scheduler_c scheduler;
+  scheduler.clock = fake_clock;
+  Context_s context = {0, "task", 123};
+  fake_us = 0;
+  scheduler.add_task("task", logged_task, &context, 1000, 1);
+  scheduler.start();
+  fake_us = 45;
+  scheduler.run();
+  Task_s & task = scheduler.tasks[0];
+  CHECK(task.wcet_us == 123);
+  CHECK(task.max_jitter_us == 45);
+
+  // a quicker, earlier run doesn't lower the worst cases, a slower later one raises them.
+  context.cost_us = 50;
+  fake_us = 1010;
+  scheduler.run();
+  CHECK(task.wcet_us == 123 && task.max_jitter_us == 45);
+  context.cost_us = 300;
+  fake_us = 2060;
+  scheduler.run();
+  CHECK(task.wcet_us == 300 && task.max_jitter_us == 60);
+  CHECK(task.runs == 3 && task.overruns == 0);
+
+  scheduler.reset_stats(task);
+  CHECK(task.runs == 0 && task.wcet_us == 0 && task.max_jitter_us == 0 && task.overruns == 0);
+}
+
+// A task that calls run() itself: the inner call runs nothing, and the scheduler still works afterwards.
+static Scheduler_c * reentrant_scheduler = 0;
+static int inner_ran = -1;
+static void reentrant_task(void *){
+  inner_ran = reentrant_scheduler->run();
+}
+
+static void check_reentrancy(){
+  Scheduler_c scheduler;
+  scheduler.clock = fake_clock;
+  reentrant_scheduler = &scheduler;
+  Context_s context = {0, "other", 0};
+  fake_us = 0;
+  scheduler.add_task("reentrant", reentrant_task, 0, 1000, 2);
+  scheduler.add_task("other", logged_task, &context, 1000, 1);
+  scheduler.start();
+  CHECK(scheduler.run() == 2);
+  CHECK(inner_ran == 0);
+  CHECK(!scheduler.running);
+  CHECK(scheduler.tasks[0].runs == 1 && scheduler.tasks[1].runs == 1);
+  fake_us = 1000;
+  CHECK(scheduler.run() == 2);
+  CHECK(scheduler.tasks[0].runs == 2);
+}
+
+int main(){
+  check_no_drift();
+  check_priority();
+  check_overrun();
+  check_statistics();
+  check_reentrancy();
+  return(test_summary("test_scheduler"));
+}
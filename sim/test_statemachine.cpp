@@ -0,0 +1,206 @@
+// Table driven state machine (statemachine.h) on a fake clock: the tables are checked when the machine is
+// initialised, the first passing guard of the current state wins, only the current state's guards are asked, the
+// exit, entry and step actions run in order, and the time, entry and transition statistics add up. Then the
+// robot's own tables (fsm.h).
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../statemachine.h"
+#include "../fsm.h"
+
+static unsigned long fake_ms = 0;
+static unsigned long fake_clock(){
+  return(fake_ms);
+}
+
+// The owner of the test machine: every action and guard call is appended to the log, and the guards return
+// whatever the test sets.
+struct Owner_s {
+  std::string log;
+  bool go[4] = {false, false, false, false};
+};
+
+static void note(void * owner, const char * what){
+  Owner_s * o = (Owner_s *)owner;
+  o->log = o->log + what + " ";
+}
+
+static void entry_a(void * o){ note(o, "entry_a"); }
+static void step_a(void * o){ note(o, "step_a"); }
+static void exit_a(void * o){ note(o, "exit_a"); }
+static void entry_b(void * o){ note(o, "entry_b"); }
+static void step_b(void * o){ note(o, "step_b"); }
+static void exit_b(void * o){ note(o, "exit_b"); }
+static void entry_c(void * o){ note(o, "entry_c"); }
+
+static bool guard_0(void * o){ note(o, "guard_0"); return(((Owner_s *)o)->go[0]); }
+static bool guard_1(void * o){ note(o, "guard_1"); return(((Owner_s *)o)->go[1]); }
+static bool guard_2(void * o){ note(o, "guard_2"); return(((Owner_s *)o)->go[2]); }
+static bool guard_3(void * o){ note(o, "guard_3"); return(((Owner_s *)o)->go[3]); }
+
+# define STATE_A 0
+# define STATE_B 1
+# define STATE_C 2
+
+const State_s test_states[3] = {
+  {"a", entry_a, step_a, exit_a},
+  {"b", entry_b, step_b, exit_b},
+  {"c", entry_c, 0, 0}, // no step or exit action.
+};
+
+// a has three ways out in priority order, b one guarded and one unconditional, c none.
+const Transition_s test_transitions[5] = {
+  {STATE_A, STATE_B, guard_0},
+  {STATE_A, STATE_C, guard_1},
+  {STATE_A, STATE_B, guard_2},
+  {STATE_B, STATE_C, guard_3},
+  {STATE_B, STATE_A, 0},
+};
+
+static void check_initialise(){
+  StateMachine_c machine;
+  machine.clock = fake_clock;
+  Owner_s owner;
+
+  // the transitions leaving a state must be next to each other.
+  const Transition_s split[3] = {{STATE_A, STATE_B, guard_0}, {STATE_B, STATE_A, 0}, {STATE_A, STATE_C, guard_1}};
+  CHECK(!machine.initialise(test_states, 3, split, 3, &owner, STATE_A));
+  // states must exist, and the tables must fit.
+  const Transition_s unknown[1] = {{STATE_A, 3, 0}};
+  CHECK(!machine.initialise(test_states, 3, unknown, 1, &owner, STATE_A));
+  CHECK(!machine.initialise(test_states, 3, test_transitions, 5, &owner, 3));
+  CHECK(!machine.initialise(test_states, STATE_MACHINE_MAX_STATES + 1, test_transitions, 5, &owner, STATE_A));
+  CHECK(!machine.initialise(test_states, 3, test_transitions, STATE_MACHINE_MAX_TRANSITIONS + 1, &owner, STATE_A));
+  CHECK(owner.log.empty()); // nothing entered.
+
+  // a good table enters the initial state, running only its entry action.
+  fake_ms = 1000;
+  CHECK(machine.initialise(test_states, 3, test_transitions, 5, &owner, STATE_A));
+  CHECK(machine.current == STATE_A);
+  CHECK(owner.log == "entry_a ");
+  CHECK(machine.state_entries[STATE_A] == 1);
+  CHECK(machine.first_transition[STATE_A] == 0 && machine.transitions_from[STATE_A] == 3);
+  CHECK(machine.first_transition[STATE_B] == 3 && machine.transitions_from[STATE_B] == 2);
+  CHECK(machine.transitions_from[STATE_C] == 0);
+}
+
+static void check_guards_and_order(){
+  StateMachine_c machine;
+  machine.clock = fake_clock;
+  Owner_s owner;
+  fake_ms = 0;
+  machine.initialise(test_states, 3, test_transitions, 5, &owner, STATE_A);
+
+  // no guard passes: every guard of a is asked once in table order, nothing else runs.
+  owner.log.clear();
+  CHECK(!machine.evaluate());
+  CHECK(machine.current == STATE_A);
+  CHECK(owner.log == "guard_0 guard_1 guard_2 ");
+
+  // the step action is only the current state's.
+  owner.log.clear();
+  machine.step();
+  CHECK(owner.log == "step_a ");
+
+  // two guards pass: the first in the table wins, and the rest aren't asked. Exit before entry.
+  owner.go[1] = true;
+  owner.go[2] = true;
+  owner.log.clear();
+  fake_ms = 250;
+  CHECK(machine.evaluate());
+  CHECK(machine.current == STATE_C);
+  CHECK(owner.log == "guard_0 guard_1 exit_a entry_c ");
+  CHECK(machine.transition_counts[1] == 1);
+  CHECK(machine.transition_counts[2] == 0);
+
+  // c has no way out, no step and no exit: evaluate and step do nothing.
+  owner.log.clear();
+  CHECK(!machine.evaluate());
+  machine.step();
+  CHECK(owner.log.empty());
+
+  // forced from outside the table: c has no exit action, b is entered.
+  fake_ms = 400;
+  machine.change_state(STATE_B);
+  CHECK(owner.log == "entry_b ");
+
+  // b's guard comes before its unconditional transition, and a's guards are never asked from b.
+  owner.go[3] = false;
+  owner.log.clear();
+  fake_ms = 450;
+  CHECK(machine.evaluate());
+  CHECK(machine.current == STATE_A);
+  CHECK(owner.log == "guard_3 exit_b entry_a ");
+  owner.go[3] = true;
+  owner.go[1] = false;
+  owner.go[2] = false;
+  owner.go[0] = true;
+  owner.log.clear();
+  fake_ms = 700;
+  CHECK(machine.evaluate());
+  CHECK(owner.log == "guard_0 exit_a entry_b ");
+  owner.log.clear();
+  fake_ms = 1000;
+  CHECK(machine.evaluate());
+  CHECK(machine.current == STATE_C);
+  CHECK(owner.log == "guard_3 exit_b entry_c ");
+
+  // statistics: a 0-250 and 450-700, b 400-450 and 700-1000, c from 250-400 and now from 1000.
+  fake_ms = 1100;
+  CHECK(machine.state_time_ms[STATE_A] == 500);
+  CHECK(machine.state_time_ms[STATE_B] == 350);
+  CHECK(machine.state_time_ms[STATE_C] == 150);
+  CHECK(machine.time_in_state() == 100);
+  CHECK(machine.state_entries[STATE_A] == 2);
+  CHECK(machine.state_entries[STATE_B] == 2);
+  CHECK(machine.state_entries[STATE_C] == 2);
+  const unsigned long counts[5] = {1, 1, 0, 1, 1};
+  for(int i = 0; i < 5; i++){
+    CHECK(machine.transition_counts[i] == counts[i]);
+  }
+
+  // reset_stats() starts the counts again from the current state.
+  machine.reset_stats();
+  fake_ms = 1200;
+  CHECK(machine.state_entries[STATE_C] == 0);
+  CHECK(machine.state_time_ms[STATE_A] == 0);
+  CHECK(machine.time_in_state() == 100);
+}
+
+// The robot's tables: they load, every state is where its STATE_ number says, and the lost line checks come in the
+// order the FSM relies on.
+static void check_fsm_tables(){
+  StateMachine_c machine;
+  machine.clock = fake_clock;
+  CHECK(machine.initialise(FSM_c::state_table, NUMBER_OF_STATES, FSM_c::transition_table,
+                           FSM_c::NUMBER_OF_TRANSITIONS, 0, STATE_INITIAL));
+  CHECK(!strcmp(FSM_c::state_table[STATE_INITIAL].name, "initial"));
+  CHECK(!strcmp(FSM_c::state_table[STATE_ON_LINE].name, "on_line"));
+  CHECK(!strcmp(FSM_c::state_table[STATE_LOST_LINE].name, "lost_line"));
+  CHECK(!strcmp(FSM_c::state_table[STATE_HOME].name, "home"));
+  CHECK(!strcmp(FSM_c::state_table[STATE_TURN_AROUND].name, "turn_around"));
+  for(byte s = 0; s < NUMBER_OF_STATES; s++){
+    CHECK(FSM_c::state_table[s].step != 0);
+  }
+  // every state but home has a way out, home has none.
+  for(byte s = 0; s < NUMBER_OF_STATES; s++){
+    CHECK((machine.transitions_from[s] > 0) == (s != STATE_HOME));
+  }
+  // lost the line: turning around (too early for the track end) is checked before the track end, and both before
+  // finding the line again.
+  const Transition_s * lost = &FSM_c::transition_table[machine.first_transition[STATE_LOST_LINE]];
+  CHECK(machine.transitions_from[STATE_LOST_LINE] == 3);
+  CHECK(lost[0].to == STATE_TURN_AROUND);
+  CHECK(lost[1].to == STATE_RETURN_TO_START);
+  CHECK(lost[2].to == STATE_ON_LINE);
+}
+
+int main(){
+  check_initialise();
+  check_guards_and_order();
+  check_fsm_tables();
+  return(test_summary("test_statemachine"));
+}
@@ -0,0 +1,119 @@
+// Lookup table trigonometry (trig.h): error bounds of sin, cos and atan2 against libm over several turns of angle,
+// every quadrant and a wide range of scales, and the homing controller's bearing to the start from every quadrant.
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hal/hal_sim.h"
+#include "test.h"
+#include "../trig.h"
+#include "../homing.h"
+
+# define TRIG_SIN_BOUND 1.2e-4 // worst case of the 64 step table with linear interpolation, plus the Q16 angle.
+# define TRIG_ATAN2_BOUND 2.5e-4 // 32 step table over one octant.
+
+static double wrap(double angle){
+  while(angle > M_PI){
+    angle = angle - 2 * M_PI;
+  }
+  while(angle < -M_PI){
+    angle = angle + 2 * M_PI;
+  }
+  return(angle);
+}
+
+static void check_sin_cos(){
+  double worst_sin = 0;
+  double worst_cos = 0;
+  for(double angle = -4 * M_PI; angle <= 4 * M_PI; angle = angle + 0.0001){
+    // the table sees the angle after rounding to Q16, so compare with libm at that angle.
+    fixed_t a = angle;
+    double exact = a.raw / 65536.0;
+    worst_sin = fmax(worst_sin, fabs(trig_sin(a).to_float() - sin(exact)));
+    worst_cos = fmax(worst_cos, fabs(trig_cos(a).to_float() - cos(exact)));
+  }
+  printf("sin worst error %.3g, cos %.3g\n", worst_sin, worst_cos);
+  CHECK(worst_sin < TRIG_SIN_BOUND);
+  CHECK(worst_cos < TRIG_SIN_BOUND);
+
+  // exact at zero, so a straight line along the start heading stays straight, and close at the quadrant points.
+  CHECK(trig_sin(fixed_t(0)).raw == 0);
+  CHECK_NEAR(trig_cos(fixed_t(0)).to_float(), 1, 1e-4);
+  CHECK_NEAR(trig_sin(fixed_t(M_PI / 2)).to_float(), 1, 1e-4);
+  CHECK_NEAR(trig_sin(fixed_t(-M_PI / 2)).to_float(), -1, 1e-4);
+  CHECK_NEAR(trig_cos(fixed_t(M_PI)).to_float(), -1, 1e-4);
+}
+
+static void check_atan2(){
+  // every direction, from tiny vectors up to the edge of the Q15.16 range.
+  const double scales[5] = {0.01, 1, 50, 1000, 30000};
+  double worst = 0;
+  for(int s = 0; s < 5; s++){
+    for(double angle = -M_PI; angle < M_PI; angle = angle + 0.0005){
+      fixed_t x = scales[s] * cos(angle);
+      fixed_t y = scales[s] * sin(angle);
+      double exact = atan2(y.raw, x.raw);
+      double error = fabs(wrap(trig_atan2(y, x).to_float() - exact));
+      if(scales[s] < 0.1){
+        error = error - 1.0 / 655; // the vector itself is only good to 1 part in 655 at this size.
+      }
+      worst = fmax(worst, error);
+    }
+  }
+  printf("atan2 worst error %.3g rad\n", worst);
+  CHECK(worst < TRIG_ATAN2_BOUND);
+
+  // the axes and the origin.
+  CHECK_NEAR(trig_atan2(fixed_t(0), fixed_t(0)).to_float(), 0, 0);
+  CHECK_NEAR(trig_atan2(fixed_t(0), fixed_t(5)).to_float(), 0, 1e-4);
+  CHECK_NEAR(trig_atan2(fixed_t(5), fixed_t(0)).to_float(), M_PI / 2, 1e-4);
+  CHECK_NEAR(trig_atan2(fixed_t(-5), fixed_t(0)).to_float(), -M_PI / 2, 1e-4);
+  CHECK_NEAR(trig_atan2(fixed_t(0), fixed_t(-5)).to_float(), M_PI, 1e-4);
+
+  // one point per quadrant, where atan(y/x) would be off by pi in the second and third.
+  const float points[4][2] = {{300, 200}, {-300, 200}, {-300, -200}, {300, -200}};
+  for(int q = 0; q < 4; q++){
+    float x = points[q][0];
+    float y = points[q][1];
+    CHECK_NEAR(trig_atan2(y, x), atan2(y, x), TRIG_ATAN2_BOUND);
+  }
+  CHECK_NEAR(fabs(wrap(trig_atan2(200.0f, -300.0f) - atan(200.0 / -300.0))), M_PI, 1e-3);
+}
+
+// From each quadrant around the start, the way home must turn towards the start the short way round, and drive
+// only once it's facing it.
+static void check_homing_bearing(){
+  const float points[8][2] = {{400, 300}, {-400, 300}, {-400, -300}, {400, -300},
+                              {-500, 1}, {-500, -1}, {0, 600}, {0, -600}};
+  for(int i = 0; i < 8; i++){
+    float x = points[i][0];
+    float y = points[i][1];
+    float bearing = atan2(-y, -x); // from the robot to the start.
+    Homing_c homing;
+    homing.reset();
+    homing.start();
+
+    // facing the start: no turn, full speed.
+    homing.update(x, y, bearing);
+    CHECK_NEAR(homing.turn_demand, 0, 1e-3);
+    CHECK(homing.forward_demand > 0.5 * HOMING_SPEED);
+
+    // a little left of it (either side of +-pi too): turn right, still driving.
+    homing.update(x, y, wrap(bearing + 0.3));
+    CHECK_NEAR(homing.turn_demand, -0.3 * HOMING_TURN_GAIN, 1e-3);
+    CHECK(homing.forward_demand > 0);
+    homing.update(x, y, wrap(bearing - 0.3));
+    CHECK_NEAR(homing.turn_demand, 0.3 * HOMING_TURN_GAIN, 1e-3);
+
+    // facing away: turn on the spot.
+    homing.update(x, y, wrap(bearing + M_PI - 0.1));
+    CHECK(homing.forward_demand == 0);
+    CHECK(fabs(homing.turn_demand) == HOMING_TURN_LIMIT);
+  }
+}
+
+int main(){
+  check_sin_cos();
+  check_atan2();
+  check_homing_bearing();
+  return(test_summary("test_trig"));
+}
@@ -0,0 +1,32 @@
+// The 180 degree turn after losing the line before the track end (fsm.h STATE_TURN_AROUND), on the dead_end track:
+// the line stops short of TRACK_END_DISTANCE at both ends, so the robot shuttles up and down it turning around at
+// each end. Every turn has to be on the spot, and has to bring the robot back onto the line.
+#include <stdio.h>
+
+#include "test.h"
+#include "sim_lap.h"
+#include "track.h"
+#include "world.h"
+
+# define TEST_TIME_LIMIT_S 40 // time for a few turns at each end.
+# define TEST_TURN_DRIFT_MM 10 // the sensor bar is 48mm wide: drift much more than this and it misses the line.
+
+int main(){
+  Track_c track;
+  CHECK(track.build("dead_end"));
+  World_c world(&track, 1);
+  LapOptions_s options;
+  options.time_limit_s = TEST_TIME_LIMIT_S;
+  LapResult_s result = run_lap(world, options);
+  print_lap_result(stdout, result);
+
+  // there is no track end, so it never gets home.
+  CHECK(!result.home);
+  CHECK(result.track_time_s == 0);
+  CHECK(result.turn_arounds >= 3);
+  // the last turn may still be looking for the line when time is up.
+  CHECK(result.turn_arounds_found + 1 >= result.turn_arounds);
+  CHECK(result.max_turn_drift_mm < TEST_TURN_DRIFT_MM);
+  CHECK(result.late_loops == 0);
+  return(test_summary("test_turn_around"));
+}
@@ -0,0 +1,273 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "track.h"
+
+const char * const track_names[TRACK_BUILT_IN] = {"default", "straight", "sharp", "gap", "s_bend", "dead_end"};
+
+# define TRACK_STEP_MM 0.5 // pen step when drawing
+
+
+void Track_c::create(float x_min, float y_min, float x_max, float y_max, float resolution_mm){
+  mm_per_px = resolution_mm;
+  origin_x = x_min;
+  origin_y = y_max;
+  width = (int)ceil((x_max - x_min) / resolution_mm);
+  height = (int)ceil((y_max - y_min) / resolution_mm);
+  pixels.assign((size_t)width * height, 255);
+  centre_x.clear();
+  centre_y.clear();
+}
+
+void Track_c::pen(float x, float y, float heading){
+  pen_x = x;
+  pen_y = y;
+  pen_heading = heading;
+}
+
+void Track_c::ink(float x, float y){
+  float r = TRACK_LINE_WIDTH_MM / 2;
+  int c0 = (int)floor((x - r - origin_x) / mm_per_px);
+  int c1 = (int)ceil((x + r - origin_x) / mm_per_px);
+  int r0 = (int)floor((origin_y - (y + r)) / mm_per_px);
+  int r1 = (int)ceil((origin_y - (y - r)) / mm_per_px);
+  for(int row = r0; row <= r1; row++){
+    for(int col = c0; col <= c1; col++){
+      if(row < 0 || col < 0 || row >= height || col >= width){
+        continue;
+      }
+      // pixel centre
+      float px = origin_x + (col + 0.5) * mm_per_px;
+      float py = origin_y - (row + 0.5) * mm_per_px;
+      if((px - x) * (px - x) + (py - y) * (py - y) <= r * r){
+        pixels[(size_t)row * width + col] = 0;
+      }
+    }
+  }
+  // keep roughly one centre point per mm.
+  if(centre_x.empty() || fabs(centre_x.back() - x) + fabs(centre_y.back() - y) >= 1.0){
+    centre_x.push_back(x);
+    centre_y.push_back(y);
+  }
+}
+
+void Track_c::straight(float length){
+  int steps = (int)ceil(length / TRACK_STEP_MM);
+  for(int i = 0; i <= steps; i++){
+    float d = length * i / steps;
+    ink(pen_x + d * cos(pen_heading), pen_y + d * sin(pen_heading));
+  }
+  pen_x = pen_x + length * cos(pen_heading);
+  pen_y = pen_y + length * sin(pen_heading);
+}
+
+void Track_c::arc(float radius, float angle){
+  // centre of the turn is off to the left for a left turn, right for a right turn.
+  float side = angle >= 0 ? 1 : -1;
+  float cx = pen_x - side * radius * sin(pen_heading);
+  float cy = pen_y + side * radius * cos(pen_heading);
+  int steps = (int)ceil(fabs(angle) * radius / TRACK_STEP_MM);
+  for(int i = 0; i <= steps; i++){
+    float heading = pen_heading + angle * i / steps;
+    ink(cx + side * radius * sin(heading), cy - side * radius * cos(heading));
+  }
+  pen_heading = pen_heading + angle;
+  pen_x = cx + side * radius * sin(pen_heading);
+  pen_y = cy - side * radius * cos(pen_heading);
+}
+
+void Track_c::gap(float length){
+  pen_x = pen_x + length * cos(pen_heading);
+  pen_y = pen_y + length * sin(pen_heading);
+}
+
+float Track_c::darkness(float x, float y){
+  int col = (int)floor((x - origin_x) / mm_per_px);
+  int row = (int)floor((origin_y - y) / mm_per_px);
+  if(row < 0 || col < 0 || row >= height || col >= width){
+    return(0);
+  }
+  return(1.0 - pixels[(size_t)row * width + col] / 255.0);
+}
+
+float Track_c::darkness_around(float x, float y, float r){
+  // 13 point disc: centre, an inner ring of 4 and an outer ring of 8.
+  float sum = darkness(x, y);
+  for(int i = 0; i < 4; i++){
+    float a = i * M_PI / 2 + M_PI / 4;
+    sum = sum + darkness(x + 0.5 * r * cos(a), y + 0.5 * r * sin(a));
+  }
+  for(int i = 0; i < 8; i++){
+    float a = i * M_PI / 4;
+    sum = sum + darkness(x + r * cos(a), y + r * sin(a));
+  }
+  return(sum / 13);
+}
+
+float Track_c::distance_to_line(float x, float y){
+  if(centre_x.empty()){
+    return(-1);
+  }
+  float best = 1e30;
+  for(size_t i = 0; i < centre_x.size(); i++){
+    float d = (centre_x[i] - x) * (centre_x[i] - x) + (centre_y[i] - y) * (centre_y[i] - y);
+    if(d < best){
+      best = d;
+    }
+  }
+  return(sqrt(best));
+}
+
+bool Track_c::load_pgm(const char * filename){
+  FILE * f = fopen(filename, "rb");
+  if(!f){
+    return(false);
+  }
+  char magic[3] = {0};
+  if(fscanf(f, "%2s", magic) != 1 || (strcmp(magic, "P5") && strcmp(magic, "P2"))){
+    fclose(f);
+    return(false);
+  }
+  mm_per_px = 1.0;
+  origin_x = 0;
+  origin_y = 0;
+  bool origin_given = false;
+
+  // header: width, height, maxval, with comments anywhere between them.
+  int header[3];
+  int got = 0;
+  while(got < 3){
+    int c = fgetc(f);
+    if(c == EOF){
+      fclose(f);
+      return(false);
+    }
+    if(c == '#'){
+      char line[256];
+      if(!fgets(line, sizeof(line), f)){
+        line[0] = 0;
+      }
+      float scale, ox, oy;
+      if(sscanf(line, " track %f %f %f", &scale, &ox, &oy) == 3){
+        mm_per_px = scale;
+        origin_x = ox;
+        origin_y = oy;
+        origin_given = true;
+      }
+      continue;
+    }
+    if(c >= '0' && c <= '9'){
+      ungetc(c, f);
+      if(fscanf(f, "%d", &header[got]) != 1){
+        fclose(f);
+        return(false);
+      }
+      got = got + 1;
+    }
+  }
+  fgetc(f); // the single whitespace before binary data.
+  width = header[0];
+  height = header[1];
+  int maxval = header[2];
+  pixels.assign((size_t)width * height, 255);
+  for(size_t i = 0; i < pixels.size(); i++){
+    int v;
+    if(magic[1] == '5'){
+      v = fgetc(f);
+    }
+    else if(fscanf(f, "%d", &v) != 1){
+      v = EOF;
+    }
+    if(v == EOF){
+      fclose(f);
+      return(false);
+    }
+    pixels[i] = (uint8_t)(v * 255 / (maxval > 0 ? maxval : 255));
+  }
+  fclose(f);
+
+  // without a placement, put the start (0, 0) in the middle of the left edge.
+  if(!origin_given){
+    origin_x = -50;
+    origin_y = height * mm_per_px / 2;
+  }
+  centre_x.clear();
+  centre_y.clear();
+  return(true);
+}
+
+bool Track_c::save_pgm(const char * filename){
+  FILE * f = fopen(filename, "wb");
+  if(!f){
+    return(false);
+  }
+  fprintf(f, "P5\n# track %g %g %g\n%d %d\n255\n", mm_per_px, origin_x, origin_y, width, height);
+  fwrite(&pixels[0], 1, pixels.size(), f);
+  fclose(f);
+  return(true);
+}
+
+void Track_c::build_entry(){
+  create(-100, -400, 1100, 200, 1.0);
+  pen(150, 60, -M_PI / 2);
+  straight(120);
+  arc(80, M_PI / 2);
+}
+
+bool Track_c::build(const char * name){
+  if(!strcmp(name, "default")){
+    build_entry();
+    straight(150);
+    arc(100, M_PI / 3);
+    straight(80);
+    arc(100, -M_PI / 3);
+    straight(250);
+  }
+  else if(!strcmp(name, "straight")){
+    build_entry();
+    straight(650);
+  }
+  else if(!strcmp(name, "sharp")){
+    build_entry();
+    straight(100);
+    arc(30, -M_PI / 2);
+    straight(100);
+    arc(30, M_PI / 2);
+    straight(100);
+    arc(30, M_PI / 2);
+    straight(150);
+    arc(30, -M_PI / 2);
+    straight(300);
+  }
+  else if(!strcmp(name, "gap")){
+    build_entry();
+    straight(150);
+    gap(40);
+    straight(150);
+    gap(40);
+    straight(250);
+  }
+  else if(!strcmp(name, "s_bend")){
+    build_entry();
+    straight(50);
+    arc(120, M_PI / 3);
+    arc(120, -2 * M_PI / 3);
+    arc(120, M_PI / 3);
+    arc(120, -M_PI / 3);
+    arc(120, 2 * M_PI / 3);
+    arc(120, -M_PI / 3);
+    straight(200);
+  }
+  else if(!strcmp(name, "dead_end")){
+    // the crossing line carries straight on down and stops, at x = 150: short of TRACK_END_DISTANCE whichever
+    // way the robot drifts once it has lost it.
+    create(-100, -400, 1100, 200, 1.0);
+    pen(150, 60, -M_PI / 2);
+    straight(220);
+  }
+  else{
+    return(false);
+  }
+  return(true);
+}
@@ -0,0 +1,71 @@
+// The track the simulated robot drives on: a greyscale image (255 = white surface, 0 = black line) placed in the
+// world in mm. Tracks are drawn from straights and arcs, or loaded from a PGM image.
+#ifndef _SIM_TRACK_H
+#define _SIM_TRACK_H
+
+#include <stdint.h>
+#include <vector>
+
+# define TRACK_LINE_WIDTH_MM 15.0 // the 3pi+ course line is electrical tape.
+
+
+// The built in courses:
+//   default: a bend, an S and a long straight.
+//   straight: one long straight after the entry bend.
+//   sharp: tight 30mm radius corners, right and left.
+//   gap: breaks in a straight line, the kind the lost line state (LOST_LIMIT) has to bridge.
+//   s_bend: back to back S bends.
+//   dead_end: the line stops short of TRACK_END_DISTANCE, so the robot turns around (STATE_TURN_AROUND) to find it
+//   again. There's no track end to find, so it never gets home, and it's left out of the benchmarks by default.
+# define TRACK_BUILT_IN 6
+# define TRACK_LAPS 5 // the first five are the lap courses, the ones the benchmarks run by default.
+extern const char * const track_names[TRACK_BUILT_IN];
+
+
+// Class for the track image and the centre line it was drawn from.
+class Track_c {
+  public:
+    int width = 0; // pixels
+    int height = 0;
+    float mm_per_px = 1.0;
+    float origin_x = 0; // world position (mm) of the top left pixel, y is up in the world and down the image.
+    float origin_y = 0;
+    std::vector<uint8_t> pixels;
+
+    // Centre line points (mm), for measuring how far the robot strays. Empty for a loaded image.
+    std::vector<float> centre_x;
+    std::vector<float> centre_y;
+
+    // Blank white track covering x_min..x_max, y_min..y_max (mm).
+    void create(float x_min, float y_min, float x_max, float y_max, float resolution_mm);
+
+    // Path drawing: a pen at (x, y) heading (radians, 0 = +x, anticlockwise +ve). Gaps move the pen without drawing.
+    void pen(float x, float y, float heading);
+    void straight(float length);
+    void arc(float radius, float angle); // angle +ve turns left.
+    void gap(float length);
+
+    // 0 (white) - 1 (black) at a point, off the image counts as white.
+    float darkness(float x, float y);
+    // Mean darkness over a disc of radius r (mm), the patch of floor one sensor sees.
+    float darkness_around(float x, float y, float r);
+    // Distance (mm) from a point to the nearest centre line point, -1 if there is no centre line.
+    float distance_to_line(float x, float y);
+
+    // PGM (P5 binary or P2 text). The scale and origin go in a "# track mm_per_px origin_x origin_y" comment.
+    bool load_pgm(const char * filename);
+    bool save_pgm(const char * filename);
+
+    // Built in courses, see track_names. Each starts with a line crossing ahead of the robot, which starts at (0, 0)
+    // facing +x, and the lap courses end well past TRACK_END_DISTANCE. Returns false for an unknown name.
+    bool build(const char * name);
+
+  private:
+    void build_entry(); // the crossing line and the bend onto the course proper, common to every built in course.
+    float pen_x = 0;
+    float pen_y = 0;
+    float pen_heading = 0;
+    void ink(float x, float y); // stamp the line width at a point.
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include <math.h>
+
+#include "world.h"
+
+// The robot's pins, as wired on the 3pi+ (motors.h, encoders.h, linesensor.h).
+# define WORLD_L_PWM_PIN 10
+# define WORLD_L_DIR_PIN 16
+# define WORLD_R_PWM_PIN 9
+# define WORLD_R_DIR_PIN 15
+# define WORLD_RIGHT_XOR_PIN 7
+# define WORLD_RIGHT_B_PIN 23
+# define WORLD_LEFT_XOR_PIN 26
+# define WORLD_LEFT_B_PIN HAL_PIN_PE2
+
+// Line sensor pins leftest to rightest (A11, A0, A2, A3, A4) and where they sit across the bar.
+static const uint8_t sensor_pins[5] = {29, 18, 20, 21, 22};
+static const float sensor_lateral_mm[5] = {24, 12, 0, -12, -24};
+
+
+World_c::World_c(Track_c * t, uint32_t seed) : track(t), random(seed), gaussian(0.0, 1.0) {
+}
+
+void World_c::attach(){
+  for(int i = 0; i < 5; i++){
+    hal_mark_sensor_pin(sensor_pins[i]);
+  }
+  drive_encoder(0, WORLD_RIGHT_XOR_PIN, WORLD_RIGHT_B_PIN);
+  drive_encoder(0, WORLD_LEFT_XOR_PIN, WORLD_LEFT_B_PIN);
+  step_ns = hal_now_ns();
+  hal_attach(this);
+}
+
+uint64_t World_c::next_event_ns(){
+  return(step_ns + WORLD_STEP_NS);
+}
+
+// Steady speed the motor is heading for, counts per ms, from its PWM duty and direction pin (REV = HIGH).
+double World_c::motor_target(uint8_t pwm_pin, uint8_t dir_pin, double scale){
+  double pwm = hal_pwm_duty(pwm_pin) * 255;
+  if(pwm <= WORLD_MOTOR_DEADBAND){
+    return(0);
+  }
+  double speed = WORLD_MOTOR_GAIN * (pwm - WORLD_MOTOR_DEADBAND) * scale;
+  return(hal_pin_output(dir_pin) ? -speed : speed);
+}
+
+// Quadrature phase of a count, forward (count up) runs (A,B) = 00, 10, 11, 01. The board gives A XOR B and B.
+void World_c::drive_encoder(long count, uint8_t xor_pin, uint8_t b_pin){
+  static const bool phase_a[4] = {0, 1, 1, 0};
+  static const bool phase_b[4] = {0, 0, 1, 1};
+  int phase = ((count % 4) + 4) % 4;
+  hal_drive_pin(b_pin, phase_b[phase]); // B first, the interrupt is on the XOR pin and reads B.
+  hal_drive_pin(xor_pin, phase_a[phase] ^ phase_b[phase]);
+}
+
+void World_c::step_to(uint64_t now_ns){
+  const double dt_ms = WORLD_STEP_NS / 1e6;
+  const double lag = dt_ms / (WORLD_MOTOR_TAU_MS + dt_ms);
+  while(step_ns + WORLD_STEP_NS <= now_ns){
+    step_ns = step_ns + WORLD_STEP_NS;
+
+    speed_left = speed_left + (motor_target(WORLD_L_PWM_PIN, WORLD_L_DIR_PIN, 1.0) - speed_left) * lag;
+    speed_right = speed_right + (motor_target(WORLD_R_PWM_PIN, WORLD_R_DIR_PIN, right_motor_scale) - speed_right) * lag;
+    double d_left = speed_left * dt_ms;
+    double d_right = speed_right * dt_ms;
+    wheel_left = wheel_left + d_left;
+    wheel_right = wheel_right + d_right;
+
+    // move along the midpoint heading. The encoders count turns, the wheel size sets how far a turn goes.
+    double ds = 0.5 * (d_left + d_right * right_wheel_scale) * WORLD_MM_PER_COUNT;
+    double dtheta = (d_right * right_wheel_scale - d_left) * WORLD_MM_PER_COUNT / (2 * WORLD_HALF_TRACK_MM);
+    x = x + ds * cos(theta + 0.5 * dtheta);
+    y = y + ds * sin(theta + 0.5 * dtheta);
+    theta = theta + dtheta;
+    if(theta > M_PI){
+      theta = theta - 2 * M_PI;
+    }
+    else if(theta <= -M_PI){
+      theta = theta + 2 * M_PI;
+    }
+
+    // one encoder edge at a time, each fires its interrupt.
+    while(count_left != (long)floor(wheel_left)){
+      count_left = count_left + (wheel_left > count_left ? 1 : -1);
+      drive_encoder(count_left, WORLD_LEFT_XOR_PIN, WORLD_LEFT_B_PIN);
+    }
+    while(count_right != (long)floor(wheel_right)){
+      count_right = count_right + (wheel_right > count_right ? 1 : -1);
+      drive_encoder(count_right, WORLD_RIGHT_XOR_PIN, WORLD_RIGHT_B_PIN);
+    }
+  }
+}
+
+void World_c::sensor_position(float lateral_mm, double * sx, double * sy){
+  *sx = x + WORLD_SENSOR_AHEAD_MM * cos(theta) - lateral_mm * sin(theta);
+  *sy = y + WORLD_SENSOR_AHEAD_MM * sin(theta) + lateral_mm * cos(theta);
+}
+
+uint32_t World_c::sensor_discharge_us(uint8_t pin){
+  for(int i = 0; i < 5; i++){
+    if(sensor_pins[i] != pin){
+      continue;
+    }
+    double sx, sy;
+    sensor_position(sensor_lateral_mm[i], &sx, &sy);
+    double us = WORLD_SENSOR_WHITE_US + WORLD_SENSOR_SPAN_US * track->darkness_around(sx, sy, WORLD_SENSOR_FOOTPRINT_MM);
+    us = us + noise_us * gaussian(random);
+    return(us > 0 ? (uint32_t)us : 0);
+  }
+  return(0);
+}
@@ -0,0 +1,77 @@
+// The simulated 3pi+: a differential drive robot on a Track_c. It reads the motor pins the robot code drives,
+// integrates the wheels, drives the encoder pins and answers the line sensors' discharge times.
+#ifndef _SIM_WORLD_H
+#define _SIM_WORLD_H
+
+#include <stdint.h>
+#include <random>
+
+#include "hal/hal_sim.h"
+#include "track.h"
+
+# define WORLD_STEP_NS 50000ULL // physics step, 50us: well under one encoder count at full speed.
+
+// Robot geometry, the same numbers kinematics.h uses.
+# define WORLD_COUNTS_PER_REV 358.3
+# define WORLD_MM_PER_COUNT (100.5309649 / WORLD_COUNTS_PER_REV)
+# define WORLD_HALF_TRACK_MM 44.6 // centre of robot to centre of wheel.
+
+// Sensor bar: how far ahead of the axle, and where across it (left +ve), leftest first.
+# define WORLD_SENSOR_AHEAD_MM 40.0
+# define WORLD_SENSOR_FOOTPRINT_MM 3.0 // radius of floor each sensor sees.
+
+// Reflectance model: discharge time (us) = white + span * darkness, plus noise.
+# define WORLD_SENSOR_WHITE_US 500
+# define WORLD_SENSOR_SPAN_US 2300
+# define WORLD_SENSOR_NOISE_US 20
+
+// Motor model: first order lag to a steady speed of gain * (|pwm| - deadband) counts per ms.
+# define WORLD_MOTOR_GAIN 0.02
+# define WORLD_MOTOR_DEADBAND 8
+# define WORLD_MOTOR_TAU_MS 40.0
+
+
+// Class for the simulated robot, attached to the HAL as its device.
+class World_c : public HalDevice_c {
+  public:
+    Track_c * track;
+
+    // true pose: mm, radians (0 = +x, anticlockwise +ve), same frame as the robot's odometry.
+    double x = 0;
+    double y = 0;
+    double theta = 0;
+
+    // wheel state: speed (counts per ms) and position (counts, fractional).
+    double speed_left = 0;
+    double speed_right = 0;
+    double wheel_left = 0;
+    double wheel_right = 0;
+    long count_left = 0; // whole counts already sent out on the encoder pins.
+    long count_right = 0;
+
+    float right_motor_scale = 1.0; // < 1 makes the right motor weaker than the left.
+    float right_wheel_scale = 1.0; // > 1 makes the right wheel bigger than the robot code thinks, so odometry drifts.
+    float noise_us = WORLD_SENSOR_NOISE_US;
+
+    World_c(Track_c * t, uint32_t seed);
+
+    // Put the encoder pins in their starting state and attach to the HAL. Call before the robot's setup().
+    void attach();
+
+    uint64_t next_event_ns() override;
+    void step_to(uint64_t now_ns) override;
+    uint32_t sensor_discharge_us(uint8_t pin) override;
+
+    // Where a sensor's footprint is, from its lateral offset (mm, left +ve).
+    void sensor_position(float lateral_mm, double * sx, double * sy);
+
+  private:
+    uint64_t step_ns = 0; // time of the last physics step
+    std::mt19937 random;
+    std::normal_distribution<double> gaussian;
+
+    double motor_target(uint8_t pwm_pin, uint8_t dir_pin, double scale);
+    void drive_encoder(long count, uint8_t xor_pin, uint8_t b_pin);
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _STATEMACHINE_H
+#define _STATEMACHINE_H
+
+# define STATE_MACHINE_MAX_STATES 8
+# define STATE_MACHINE_MAX_TRANSITIONS 16
+# define STATE_NONE 0xFF // no state / no transition
+
+
+// Callbacks take a context pointer (usually the object whose method they call), same as scheduler tasks.
+typedef void (*state_action_t)(void * context);
+typedef bool (*transition_guard_t)(void * context);
+
+// One state: what to do on the way in, every step while in it, and on the way out. Any of them can be null.
+struct State_s {
+  const char * name;
+  state_action_t entry;
+  state_action_t step;
+  state_action_t exit;
+};
+
+// A guarded transition. The transitions leaving a state must sit next to each other in the table, and are
+// checked in table order: the first whose guard is true is taken. A null guard is always true.
+struct Transition_s {
+  byte from;
+  byte to;
+  transition_guard_t guard;
+};
+
+
+// Class for a table driven state machine. The states and transitions are constant tables (constexpr in the
+// owner so they live in flash with the code). Stepping is an index into the state table and evaluating only looks
+// at the current state's own transitions, so neither grows with the number of states.
+// Time spent in each state, entries to each state and uses of each transition are counted.
+class StateMachine_c {
+  public:
+    const State_s * states = 0;
+    byte state_count = 0;
+    const Transition_s * transitions = 0;
+    byte transition_count = 0;
+    void * context = 0;
+
+    byte current = STATE_NONE;
+    unsigned long entered_ts = 0; // clock() when the current state was entered
+
+    // per state: where its transitions start in the table and how many there are.
+    byte first_transition[STATE_MACHINE_MAX_STATES];
+    byte transitions_from[STATE_MACHINE_MAX_STATES];
+
+    // statistics
+    unsigned long state_time_ms[STATE_MACHINE_MAX_STATES]; // total time spent in each state, not counting the current visit.
+    unsigned long state_entries[STATE_MACHINE_MAX_STATES];
+    unsigned long transition_counts[STATE_MACHINE_MAX_TRANSITIONS];
+
+    // Time source, millis() on the robot. Point it at a fake clock to test the tables off the robot.
+    unsigned long (*clock)() = millis;
+
+    // Constructor, must exist.
+    StateMachine_c() {
+
+    }
+
+    // Point the machine at its tables and enter the initial state (running its entry action).
+    // Returns false if the tables are too big or a state's transitions aren't grouped together.
+    bool initialise(const State_s * state_table, byte n_states, const Transition_s * transition_table, byte n_transitions, void * owner, byte initial){
+      if(n_states > STATE_MACHINE_MAX_STATES || n_transitions > STATE_MACHINE_MAX_TRANSITIONS || initial >= n_states){
+        return(false);
+      }
+      states = state_table;
+      state_count = n_states;
+      transitions = transition_table;
+      transition_count = n_transitions;
+      context = owner;
+
+      for(byte s = 0; s < state_count; s++){
+        first_transition[s] = 0;
+        transitions_from[s] = 0;
+      }
+      for(byte i = 0; i < transition_count; i++){
+        byte from = transitions[i].from;
+        if(from >= state_count || transitions[i].to >= state_count){
+          return(false);
+        }
+        if(transitions_from[from] == 0){
+          first_transition[from] = i;
+        }
+        else if(first_transition[from] + transitions_from[from] != i){
+          return(false); // not contiguous
+        }
+        transitions_from[from] = transitions_from[from] + 1;
+      }
+
+      reset_stats();
+      current = STATE_NONE;
+      enter(initial);
+      return(true);
+    }
+
+    // Check the current state's transitions and take the first one whose guard passes.
+    // Returns true if the state changed.
+    bool evaluate(){
+      if(current == STATE_NONE){
+        return(false);
+      }
+      byte first = first_transition[current];
+      byte last = first + transitions_from[current];
+      for(byte i = first; i < last; i++){
+        if(transitions[i].guard == 0 || transitions[i].guard(context)){
+          transition_counts[i] = transition_counts[i] + 1;
+          change_state(transitions[i].to);
+          return(true);
+        }
+      }
+      return(false);
+    }
+
+    // Run the current state's step action.
+    void step(){
+      if(current != STATE_NONE && states[current].step){
+        states[current].step(context);
+      }
+    }
+
+    // Leave the current state and enter another, running their exit and entry actions.
+    // Also the way to force a state from outside the table.
+    void change_state(byte to){
+      if(current != STATE_NONE){
+        if(states[current].exit){
+          states[current].exit(context);
+        }
+        state_time_ms[current] = state_time_ms[current] + (clock() - entered_ts);
+      }
+      enter(to);
+    }
+
+    // How long we've been in the current state (ms).
+    unsigned long time_in_state(){
+      return(clock() - entered_ts);
+    }
+
+    void reset_stats(){
+      for(byte s = 0; s < STATE_MACHINE_MAX_STATES; s++){
+        state_time_ms[s] = 0;
+        state_entries[s] = 0;
+      }
+      for(byte i = 0; i < STATE_MACHINE_MAX_TRANSITIONS; i++){
+        transition_counts[i] = 0;
+      }
+      entered_ts = clock();
+    }
+
+    // Print one line per state: name, total ms in it (including the current visit), entries.
+    // Then one line per transition: from, to, times taken.
+    void report(){
+      Serial.println("state,ms,entries");
+      for(byte s = 0; s < state_count; s++){
+        unsigned long total = state_time_ms[s];
+        if(s == current){
+          total = total + time_in_state();
+        }
+        Serial.print(states[s].name);
+        Serial.print(",");
+        Serial.print(total);
+        Serial.print(",");
+        Serial.println(state_entries[s]);
+      }
+      Serial.println("from,to,count");
+      for(byte i = 0; i < transition_count; i++){
+        Serial.print(states[transitions[i].from].name);
+        Serial.print(",");
+        Serial.print(states[transitions[i].to].name);
+        Serial.print(",");
+        Serial.println(transition_counts[i]);
+      }
+    }
+
+  private:
+    void enter(byte to){
+      current = to;
+      entered_ts = clock();
+      state_entries[to] = state_entries[to] + 1;
+      if(states[to].entry){
+        states[to].entry(context);
+      }
+    }
+};
+
+#endif
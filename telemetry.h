@@ -0,0 +1,169 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+// Binary telemetry: fixed size samples go into a ring buffer and are streamed out in the background as COBS framed
+// packets, only ever writing as many bytes as the serial port can take without waiting. Printing one ASCII line used
+// to cost more than the whole 10ms sensor budget, a sample costs a struct copy.
+// Decode the stream with tools/telemetry_decode.py.
+# define TELEMETRY_ENABLED 1
+# define TELEMETRY_PERIOD_US 10000UL // one sample per control tick.
+# define TELEMETRY_BUFFER_SAMPLES 8 // must be a power of 2. 8 x 35 bytes of RAM.
+# define TELEMETRY_VERSION 1 // first byte of every sample, bump when TelemetrySample_s changes.
+
+// The 32U4's Serial is native USB, it runs at USB speed whatever rate is asked for. This is for boards with a
+// real UART, and for the host decoder's default.
+# define SERIAL_BAUD 115200
+
+// Sample scaling, so everything fits in small integers.
+# define TELEMETRY_E_LINE_SCALE 10000 // e_line x 10000
+# define TELEMETRY_POSITION_SCALE 4 // X/Y in quarter mm, +-8 m
+# define TELEMETRY_THETA_SCALE 10000 // theta in 1e-4 rad
+
+
+#if TELEMETRY_ENABLED
+
+// One sample, sent as is (little endian, no padding on the AVR). Keep tools/telemetry_decode.py in step.
+struct TelemetrySample_s {
+  uint8_t version;
+  uint8_t sequence; // increments every sample taken, so the decoder can spot drops.
+  uint32_t ts_us;
+  uint16_t sensor_us[5]; // raw discharge times, left to right
+  int16_t e_line;
+  int32_t count_left;
+  int32_t count_right;
+  int16_t x;
+  int16_t y;
+  int16_t theta;
+  int8_t pwm_left;
+  int8_t pwm_right;
+  uint8_t state;
+} __attribute__((packed));
+
+// COBS adds at most one byte per 254, plus the checksum and the 0 delimiter.
+# define TELEMETRY_FRAME_MAX (sizeof(TelemetrySample_s) + 1 + 1 + 1)
+
+
+// Class for the telemetry ring buffer and its serial drain.
+// Single producer (claim()/commit(), from the telemetry task) and single consumer (drain(), from loop()): each side only
+// writes its own index and both are single bytes, so no interrupts need disabling even if the producer moves into an ISR.
+class Telemetry_c {
+  public:
+    bool streaming = false; // toggled by the 't' serial command.
+    TelemetrySample_s buffer[TELEMETRY_BUFFER_SAMPLES];
+    volatile byte head = 0; // next slot to write, producer only
+    volatile byte tail = 0; // next slot to read, consumer only
+    uint8_t sequence = 0;
+    unsigned long dropped = 0; // samples lost to a full buffer.
+
+    // frame currently being sent.
+    uint8_t frame[TELEMETRY_FRAME_MAX];
+    byte frame_length = 0;
+    byte frame_sent = 0;
+
+    // Constructor, must exist.
+    Telemetry_c() {
+
+    }
+
+    // Start or stop streaming. Anything still buffered is thrown away so a new stream starts clean.
+    void set_streaming(bool on){
+      streaming = on;
+      tail = head;
+      frame_length = 0;
+      frame_sent = 0;
+      dropped = 0;
+    }
+
+    // Producer: claim the next slot to fill, or 0 if the buffer is full (the sample is dropped and counted).
+    TelemetrySample_s * claim(){
+      byte next = (head + 1) & (TELEMETRY_BUFFER_SAMPLES - 1);
+      sequence = sequence + 1;
+      if(next == tail){
+        dropped = dropped + 1;
+        return(0);
+      }
+      TelemetrySample_s * sample = &buffer[head];
+      sample->version = TELEMETRY_VERSION;
+      sample->sequence = sequence;
+      return(sample);
+    }
+
+    // Producer: publish the slot claim() gave out.
+    void commit(){
+      head = (head + 1) & (TELEMETRY_BUFFER_SAMPLES - 1);
+    }
+
+    // Consumer: send as much as the serial port will take right now, never waiting on it.
+    void drain(){
+      while(true){
+        if(frame_sent == frame_length){
+          if(tail == head){
+            return; // nothing left to send.
+          }
+          frame_length = encode_frame((const uint8_t *)&buffer[tail], sizeof(TelemetrySample_s), frame);
+          frame_sent = 0;
+          tail = (tail + 1) & (TELEMETRY_BUFFER_SAMPLES - 1); // copied into frame, slot can be reused.
+        }
+
+        int space = Serial.availableForWrite();
+        if(space <= 0){
+          return;
+        }
+        byte chunk = frame_length - frame_sent;
+        if(chunk > space){
+          chunk = space;
+        }
+        Serial.write(&frame[frame_sent], chunk);
+        frame_sent = frame_sent + chunk;
+      }
+    }
+
+    // COBS encode data plus a one byte checksum (sum of the data bytes) into out, with the 0 delimiter on the end.
+    // Returns the frame length. COBS removes every 0 from the packet so the decoder can always resync on a 0.
+    byte encode_frame(const uint8_t * data, byte length, uint8_t * out){
+      uint8_t checksum = 0;
+      byte code_index = 0; // where the current block's length code goes
+      byte out_index = 1;
+      byte code = 1;
+      for(byte i = 0; i <= length; i++){
+        uint8_t value;
+        if(i < length){
+          value = data[i];
+          checksum = checksum + value;
+        }
+        else{
+          value = checksum;
+        }
+        if(value == 0){
+          out[code_index] = code;
+          code_index = out_index;
+          out_index = out_index + 1;
+          code = 1;
+        }
+        else{
+          out[out_index] = value;
+          out_index = out_index + 1;
+          code = code + 1;
+          if(code == 0xFF){ // a full block of 254 non zero bytes.
+            out[code_index] = code;
+            code_index = out_index;
+            out_index = out_index + 1;
+            code = 1;
+          }
+        }
+      }
+      out[code_index] = code;
+      out[out_index] = 0;
+      return(out_index + 1);
+    }
+};
+
+Telemetry_c telemetry;
+
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Decode the robot's binary telemetry stream (see telemetry.h) to CSV.
+
+Send 't' to the robot to start streaming, then either read the serial port directly:
+
+    python3 tools/telemetry_decode.py /dev/ttyACM0 > run.csv
+
+or decode a capture saved earlier (e.g. with `cat /dev/ttyACM0 > run.bin`):
+
+    python3 tools/telemetry_decode.py run.bin > run.csv
+
+Frames are COBS encoded with a trailing checksum byte and a 0 delimiter. Anything that doesn't decode to a whole,
+correctly checksummed sample (e.g. ASCII reports printed in between) is skipped and counted on stderr.
+"""
+
+import argparse
+import csv
+import os
+import struct
+import sys
+
+# Must match TelemetrySample_s and the scaling defines in telemetry.h.
+TELEMETRY_VERSION = 1
+SAMPLE_FORMAT = "<BBI5HhiihhhbbB"
+SAMPLE_SIZE = struct.calcsize(SAMPLE_FORMAT)
+E_LINE_SCALE = 10000.0
+POSITION_SCALE = 4.0
+THETA_SCALE = 10000.0
+STATE_NAMES = ["initial", "join_line", "on_line", "lost_line", "return_to_start", "home", "turn_around"]
+
+COLUMNS = ["sequence", "dropped", "ts_us", "s0_us", "s1_us", "s2_us", "s3_us", "s4_us", "e_line",
+           "count_left", "count_right", "x_mm", "y_mm", "theta_rad", "pwm_left", "pwm_right", "state"]
+
+
+def cobs_decode(frame):
+    """Decode one COBS frame (without its 0 delimiter). Returns None if it's malformed."""
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame):
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def decode_sample(frame):
+    """COBS frame -> tuple of sample fields, or None if it isn't a valid sample."""
+    packet = cobs_decode(frame)
+    if packet is None or len(packet) != SAMPLE_SIZE + 1:
+        return None
+    data, checksum = packet[:-1], packet[-1]
+    if sum(data) & 0xFF != checksum:
+        return None
+    fields = struct.unpack(SAMPLE_FORMAT, data)
+    if fields[0] != TELEMETRY_VERSION:
+        return None
+    return fields
+
+
+def frames(stream):
+    """Split a byte stream on 0 delimiters."""
+    pending = bytearray()
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            break
+        for byte in chunk:
+            if byte == 0:
+                yield bytes(pending)
+                pending.clear()
+            else:
+                pending.append(byte)
+
+
+def open_input(path, baud):
+    if path == "-":
+        return sys.stdin.buffer
+    if os.path.exists(path) and not os.path.isfile(path):
+        try:
+            import serial  # pyserial, only needed to read a port directly.
+        except ImportError:
+            sys.exit("reading a serial port needs pyserial (pip install pyserial), or capture to a file first")
+        port = serial.Serial(path, baud, timeout=1)
+        port.write(b"t")  # start streaming
+        return port
+    return open(path, "rb")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="serial port, capture file, or - for stdin")
+    parser.add_argument("--baud", type=int, default=115200, help="serial rate (SERIAL_BAUD)")
+    args = parser.parse_args()
+
+    writer = csv.writer(sys.stdout)
+    writer.writerow(COLUMNS)
+    previous_sequence = None
+    good = bad = dropped_total = 0
+    try:
+        for frame in frames(open_input(args.input, args.baud)):
+            if not frame:
+                continue
+            fields = decode_sample(frame)
+            if fields is None:
+                bad += 1
+                continue
+            good += 1
+            sequence = fields[1]
+            dropped = 0 if previous_sequence is None else (sequence - previous_sequence - 1) & 0xFF
+            dropped_total += dropped
+            previous_sequence = sequence
+            (_, _, ts_us, s0, s1, s2, s3, s4, e_line, count_left, count_right,
+             x, y, theta, pwm_left, pwm_right, state) = fields
+            writer.writerow([sequence, dropped, ts_us, s0, s1, s2, s3, s4,
+                             "%.4f" % (e_line / E_LINE_SCALE), count_left, count_right,
+                             "%.2f" % (x / POSITION_SCALE), "%.2f" % (y / POSITION_SCALE),
+                             "%.4f" % (theta / THETA_SCALE), pwm_left, pwm_right,
+                             STATE_NAMES[state] if state < len(STATE_NAMES) else state])
+    except KeyboardInterrupt:
+        pass
+    sys.stderr.write("%d samples, %d dropped on the robot, %d bad frames skipped\n" % (good, dropped_total, bad))
+
+
+if __name__ == "__main__":
+    main()
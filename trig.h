@@ -0,0 +1,122 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _TRIG_H
+#define _TRIG_H
+
+#include <avr/pgmspace.h>
+#include "fixed.h"
+
+// Lookup table trigonometry. libm's sin/cos/atan are software float on the 32U4 and take 1000s of cycles each,
+// these take a table read, a multiply and a few adds. Angles are radians.
+// Worst case error is about 1e-4 for sin/cos and 2e-4 rad for atan2 (linear interpolation between table points).
+
+// sin over one quadrant, 64 steps of pi/128, Q15 (32768 = 1.0).
+// Generated with round(32768*sin(i*pi/128)), i = 0..64. avr-gcc builds as gnu++11 so the table can't be
+// generated by a constexpr loop at compile time, regenerate it with the formula if the step count changes.
+# define TRIG_SIN_STEPS 64
+const uint16_t trig_sin_table[TRIG_SIN_STEPS + 1] PROGMEM = {
+  0, 804, 1608, 2411, 3212, 4011, 4808, 5602, 6393, 7180, 7962, 8740, 9512, 10279, 11039, 11793,
+  12540, 13279, 14010, 14733, 15447, 16151, 16846, 17531, 18205, 18868, 19520, 20160, 20788, 21403, 22006, 22595,
+  23170, 23732, 24279, 24812, 25330, 25833, 26320, 26791, 27246, 27684, 28106, 28511, 28899, 29269, 29622, 29957,
+  30274, 30572, 30853, 31114, 31357, 31581, 31786, 31972, 32138, 32286, 32413, 32522, 32610, 32679, 32729, 32758,
+  32768
+};
+
+// atan over [0, 1], 32 steps of 1/32, Q16 radians.
+// Generated with round(65536*atan(i/32)), i = 0..32.
+# define TRIG_ATAN_STEPS 32
+const uint16_t trig_atan_table[TRIG_ATAN_STEPS + 1] PROGMEM = {
+  0, 2047, 4091, 6126, 8150, 10158, 12147, 14114, 16055, 17968, 19850, 21699, 23512, 25289, 27028, 28727,
+  30386, 32003, 33580, 35115, 36608, 38060, 39472, 40842, 42172, 43464, 44716, 45931, 47109, 48251, 49359, 50432,
+  51472
+};
+
+
+// Linear interpolation in a PROGMEM table. pos is the table index in Q16 (whole steps in the top half).
+// Result is in the table's own units.
+inline int32_t trig_table_lookup(const uint16_t * table, uint32_t pos){
+  uint16_t i = pos >> 16;
+  uint16_t f = pos & 0xFFFF;
+  int32_t a = pgm_read_word(&table[i]);
+  if(f == 0){
+    return(a); // also avoids reading past the end at the last entry.
+  }
+  int32_t b = pgm_read_word(&table[i + 1]);
+  return(a + (((b - a) * (int32_t)f) >> 16));
+}
+
+
+// sin of an angle in Q16 radians, returned as Q16.
+inline fixed_t trig_sin(fixed_t angle){
+  // convert radians to table steps (Q16): 4*64 steps per full turn, so multiply by 256/(2pi).
+  constexpr fixed_t steps_per_radian = (4.0 * TRIG_SIN_STEPS) / (2 * 3.14159265358979);
+  // wrapping to one full turn is just masking the step count, two's complement handles negative angles.
+  uint32_t phase = (uint32_t)fixed_t::mul_raw(angle.raw, steps_per_radian.raw) & (((uint32_t)4 * TRIG_SIN_STEPS << 16) - 1);
+  byte quadrant = phase >> 16 >> 6;
+  uint32_t pos = phase & (((uint32_t)TRIG_SIN_STEPS << 16) - 1);
+  if(quadrant & 1){
+    pos = ((uint32_t)TRIG_SIN_STEPS << 16) - pos; // second and fourth quadrants run the table backwards.
+  }
+  int32_t value = trig_table_lookup(trig_sin_table, pos) << 1; // Q15 -> Q16
+  return(fixed_t::from_raw((quadrant & 2) ? -value : value)); // third and fourth quadrants are negative.
+}
+
+
+// cos(x) = sin(x + pi/2)
+inline fixed_t trig_cos(fixed_t angle){
+  constexpr fixed_t half_pi = 3.14159265358979 / 2;
+  return(trig_sin(angle + half_pi));
+}
+
+
+// atan2(y, x) in Q16 radians, -pi to pi. Works on any scale of x and y (only their ratio matters).
+inline fixed_t trig_atan2(fixed_t y, fixed_t x){
+  constexpr fixed_t half_pi = 3.14159265358979 / 2;
+  constexpr fixed_t pi = 3.14159265358979;
+  uint32_t ax = (x.raw < 0) ? -(uint32_t)x.raw : (uint32_t)x.raw;
+  uint32_t ay = (y.raw < 0) ? -(uint32_t)y.raw : (uint32_t)y.raw;
+  if(ax == 0 && ay == 0){
+    return(fixed_t(0));
+  }
+
+  // reduce to the first octant so the ratio is between 0 and 1, scaling both down so the division stays 32 bit.
+  bool swapped = ay > ax;
+  uint32_t big = swapped ? ay : ax;
+  uint32_t small = swapped ? ax : ay;
+  while(big > 0x7FFF){
+    big = big >> 1;
+    small = small >> 1;
+  }
+  uint32_t ratio = (small << 16) / big; // Q16, 0 - 1
+  fixed_t angle = fixed_t::from_raw(trig_table_lookup(trig_atan_table, ratio * TRIG_ATAN_STEPS));
+
+  // unfold the octant, then the quadrant.
+  if(swapped){
+    angle = half_pi - angle;
+  }
+  if(x.raw < 0){
+    angle = pi - angle;
+  }
+  if(y.raw < 0){
+    angle = -angle;
+  }
+  return(angle);
+}
+
+
+// float versions, for code that isn't in fixed point. The conversions cost a little but still far less than libm.
+inline float trig_sin(float angle){
+  return(trig_sin(fixed_t(angle)).to_float());
+}
+
+inline float trig_cos(float angle){
+  return(trig_cos(fixed_t(angle)).to_float());
+}
+
+inline float trig_atan2(float y, float x){
+  return(trig_atan2(fixed_t(y), fixed_t(x)).to_float());
+}
+
+#endif
@@ -0,0 +1,70 @@
+#include "Arduino.h"
+// this #ifndef stops this file
+// from being included mored than
+// once by the compiler.
+#ifndef _VELOCITY_H
+#define _VELOCITY_H
+
+# include "encoders.h"
+
+// The count difference method (counts moved / time) is accurate at speed but at low speed only a few counts land in
+// each window, so it's very coarse. The edge period method (time between the last two edges) is fresh and fine grained
+// at low speed but noisy at high speed, where edges are close together and micros() only has 4us resolution.
+// So we use periods when only a few counts arrived this window, count difference when plenty did, and blend between.
+# define VELOCITY_BLEND_LOW_COUNTS 2 // at or below this many counts in the window: edge period only.
+# define VELOCITY_BLEND_HIGH_COUNTS 8 // at or above: count difference only.
+# define VELOCITY_STOP_TIMEOUT_US 50000 // no edge for this long and the wheel is regarded as stopped.
+
+
+// Class to estimate the speed of one wheel from its encoder.
+class VelocityEstimator_c {
+  public:
+    long count_last = 0; // count at the previous update
+    unsigned long ts_last = 0; // micros() at the previous update
+    float speed = 0.0; // latest estimate, encoder counts per ms (same sign as the counts)
+
+    // Constructor, must exist.
+    VelocityEstimator_c() {
+
+    }
+
+    // Work out a fresh speed from an encoder snapshot (count, the wheel's edge timing and the snapshot time).
+    // Can be called at any rate, returns counts per ms.
+    float update(long count, const EncoderEdge_s & edge, unsigned long now_us){
+      long diff_count = count - count_last;
+      unsigned long dt_us = now_us - ts_last;
+      count_last = count;
+      ts_last = now_us;
+      if(dt_us == 0){
+        return(speed);
+      }
+
+      // count difference method.
+      float count_speed = diff_count * 1000.0 / dt_us;
+
+      // edge period method.
+      float period_speed = 0.0;
+      unsigned long since_edge = now_us - edge.ts_us;
+      if(edge.dir != 0 && edge.period_us != 0 && since_edge < VELOCITY_STOP_TIMEOUT_US){
+        // if the wheel is slowing down, the time since the last edge is already longer than the last period,
+        // so that is the better (lower) bound on the speed.
+        unsigned long period = (since_edge > edge.period_us) ? since_edge : edge.period_us;
+        period_speed = edge.dir * 1000.0 / period;
+      }
+
+      long counts = abs(diff_count);
+      if(counts <= VELOCITY_BLEND_LOW_COUNTS){
+        speed = period_speed;
+      }
+      else if(counts >= VELOCITY_BLEND_HIGH_COUNTS){
+        speed = count_speed;
+      }
+      else{
+        float w = (float)(counts - VELOCITY_BLEND_LOW_COUNTS) / (VELOCITY_BLEND_HIGH_COUNTS - VELOCITY_BLEND_LOW_COUNTS);
+        speed = (w * count_speed) + ((1 - w) * period_speed);
+      }
+      return(speed);
+    }
+};
+
+#endif